@@ -0,0 +1,20 @@
+static int clamp(int x, int low, int high)
+{
+  if (x < low)
+    return low;
+  if (x > high)
+    return high;
+  return x;
+}
+
+static int mix(int a, int b) { return a * 31 + (b ^ a >> 3); }
+
+static int step(int state, int i) { return mix(state, clamp(i - (i >> 10 << 10), 100, 900)); }
+
+int main()
+{
+  int state = 1;
+  for (int i = 0; i < 50000000; i++)
+    state = step(state, i) + (mix(i, state) >> 4);
+  return state % 256;
+}
@@ -0,0 +1,17 @@
+int main()
+{
+  int n = 4000;
+  int a = 7;
+  int b = 13;
+  int total = 0;
+
+  for (int i = 0; i < n; i++) {
+    int j = 0;
+    while (j < n) {
+      total += a*b*n + a*i - b;
+      j++;
+    }
+  }
+
+  return total % 256;
+}
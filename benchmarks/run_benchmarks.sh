@@ -0,0 +1,83 @@
+#!/bin/sh
+
+# compiles each benchmark at -O0 and -O1, turns the IR into an executable with
+# llc -O0 so LLVM's own optimizations don't hide ours, and checks both builds
+# agree on the exit code. Each level is also built with the native backend,
+# -c, which has to agree too
+#
+# with perf around, the dynamic instruction count of each run is reported,
+# otherwise just the wall clock time
+#
+# last comes compile time, of getting from C to an object file through llc
+# versus with -c, over $COMPILES compiles since one is over in a few milliseconds
+
+MINICLANG=build/miniclang
+# miniclang names its output after everything before the first ., so no ./ here
+OUT=build/benchmarks
+COMPILES=50
+mkdir -p "$OUT"
+
+# runs an executable, printing how long it took and leaving its exit code in $result
+run() {
+    if command -v perf > /dev/null; then
+        count=$(perf stat -x, -e instructions:u "$1" 2>&1 > /dev/null | grep instructions | cut -d, -f1)
+        "$1"
+        result=$?
+        echo "    $2: $count instructions"
+    else
+        start=$(date +%s%N)
+        "$1"
+        result=$?
+        end=$(date +%s%N)
+        echo "    $2: $(( (end - start) / 1000000 )) ms"
+    fi
+}
+
+check() {
+    if test -n "$expected" && test "$expected" != "$result";then
+        echo "    $1 returned $result, expected $expected"
+        exit 1
+    fi
+    expected=$result
+}
+
+if test -n "$1";then
+    benchmarks=benchmarks/"$1".c
+else
+    benchmarks=benchmarks/*.c
+fi
+
+for source in $benchmarks; do
+    name=$(basename "$source" .c)
+    echo "$name"
+
+    expected=""
+    for level in 0 1; do
+        cp "$source" "$OUT/$name.c"
+        $MINICLANG -O$level "$OUT/$name.c" || exit 1
+        llc -O0 -opaque-pointers -filetype=obj "$OUT/$name.ll" -o "$OUT/$name-O$level.o" || exit 1
+        cc "$OUT/$name-O$level.o" -o "$OUT/$name-O$level" || exit 1
+
+        run "$OUT/$name-O$level" "-O$level"
+        check "-O$level"
+
+        $MINICLANG -O$level -c "$OUT/$name.c" || exit 1
+        cc "$OUT/$name.o" -o "$OUT/$name-O$level-native" || exit 1
+        run "$OUT/$name-O$level-native" "-O$level -c"
+        check "-O$level -c"
+    done
+
+    start=$(date +%s%N)
+    for i in $(seq $COMPILES); do
+        $MINICLANG -O1 "$OUT/$name.c" && llc -O0 -opaque-pointers -filetype=obj "$OUT/$name.ll" -o "$OUT/$name.o"
+    done
+    end=$(date +%s%N)
+    echo "    compiling -O1 through llc -O0: $(( (end - start) / COMPILES / 1000 )) us"
+
+    start=$(date +%s%N)
+    for i in $(seq $COMPILES); do
+        $MINICLANG -O1 -c "$OUT/$name.c"
+    done
+    end=$(date +%s%N)
+    echo "    compiling -O1 with -c: $(( (end - start) / COMPILES / 1000 )) us"
+done
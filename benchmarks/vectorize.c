@@ -0,0 +1,28 @@
+int *calloc(long long count, long long size);
+
+void mix(int *a, int *b, int *c, int n)
+{
+  for (int i = 0; i < n; i++)
+    a[i] = a[i] * 5 + b[i] ^ c[i];
+}
+
+int main()
+{
+  int n = 1000;
+  int *a = calloc(n, 4);
+  int *b = calloc(n, 4);
+  int *c = calloc(n, 4);
+
+  for (int i = 0; i < n; i++) {
+    b[i] = i * 7;
+    c[i] = i ^ 91;
+  }
+
+  for (int round = 0; round < 100000; round++)
+    mix(a, b, c, n);
+
+  int total = 0;
+  for (int i = 0; i < n; i++)
+    total = total * 31 + a[i];
+  return total % 251;
+}
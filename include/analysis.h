@@ -0,0 +1,79 @@
+#pragma once
+
+#include "ir.h"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// analyses over the control flow graph of an IRFunction
+//
+// these are computed on demand and are invalidated by any pass that adds,
+// removes or retargets blocks, so passes recompute them rather than keeping
+// them around
+
+struct ControlFlowGraph {
+  std::unordered_map<IRBasicBlock const*, std::vector<IRBasicBlock*>> predecessors;
+  std::unordered_map<IRBasicBlock const*, std::vector<IRBasicBlock*>> successors;
+
+  // only blocks reachable from the entry block appear here
+  std::vector<IRBasicBlock*> reverse_postorder;
+};
+
+struct DominatorTree {
+  IRBasicBlock* root;
+  std::unordered_map<IRBasicBlock const*, IRBasicBlock*> immediate_dominator;
+  std::unordered_map<IRBasicBlock const*, std::vector<IRBasicBlock*>> children;
+};
+
+// a natural loop (Dragon book 9.6.6). An edge latch -> header where the
+// header dominates the latch is a back edge, and the loop is the header plus
+// every block that can reach the latch without going through the header.
+// Back edges to the same header make a single loop
+struct Loop {
+  IRBasicBlock* header;
+  std::vector<IRBasicBlock*> latches;
+  std::unordered_set<IRBasicBlock const*> blocks;
+
+  // the innermost loop containing this one, null for outermost loops
+  Loop* parent;
+  unsigned depth;
+};
+
+struct LoopInfo {
+  // innermost loops first, so a loop always comes before the loops containing it
+  std::vector<Loop*> loops;
+
+  // blocks outside any loop aren't in here
+  std::unordered_map<IRBasicBlock const*, Loop*> innermost_loop;
+};
+
+// the call graph of a module's defined functions, split into strongly
+// connected components, i.e. sets of mutually recursive functions. A function
+// that calls itself is a component of its own, as is one that calls nothing
+struct CallGraph {
+  std::unordered_map<IRFunction const*, std::vector<IRFunction*>> callees;
+
+  // callees before their callers, the order Tarjan's algorithm finds them in
+  std::vector<std::vector<IRFunction*>> bottom_up_components;
+  std::unordered_map<IRFunction const*, unsigned> component;
+};
+
+ControlFlowGraph compute_control_flow_graph(IRFunction*);
+DominatorTree compute_dominator_tree(IRFunction*, ControlFlowGraph const*);
+
+LoopInfo compute_loop_info(ControlFlowGraph const*, DominatorTree const*);
+CallGraph compute_call_graph(IRModule*);
+
+bool block_dominates(DominatorTree const*, IRBasicBlock const* dominator, IRBasicBlock const* block);
+
+// the single block outside the loop that branches to the header, if that is
+// the only place it branches to. Code placed at its end runs exactly once
+// before the loop is entered. Null if the loop doesn't have one
+IRBasicBlock* loop_preheader(Loop const*, ControlFlowGraph const*);
+bool block_is_reachable(ControlFlowGraph const*, IRBasicBlock const*);
+
+// allocas whose address is only ever the pointer operand of a non volatile load or store.
+// Nothing else can see their memory, so passes can reason about every read
+// and write of them
+std::unordered_set<IRValue const*> find_non_escaping_allocas(IRFunction const*);
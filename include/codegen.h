@@ -1,5 +1,43 @@
 #pragma once
 
+#include "ir.h"
+#include "optimize.h"
+#include "options.h"
 #include "parser.h"
 
-void emit_llvm_from_translation_unit(ExternalDeclaration const*, FILE*);
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+IRModule* lower_translation_unit(ExternalDeclaration const*);
+void emit_llvm_from_translation_unit(ExternalDeclaration const*, FILE*, CompilerOptions const*, OptimizationStatistics*);
+void emit_object_from_translation_unit(ExternalDeclaration const*, FILE*, CompilerOptions const*, OptimizationStatistics*);
+
+// the same, for a module that's already been lowered
+void emit_llvm_from_module(IRModule*, FILE*, CompilerOptions const*, OptimizationStatistics*);
+void emit_object_from_module(IRModule*, FILE*, CompilerOptions const*, OptimizationStatistics*);
+
+// lowers a translation unit one external declaration at a time, in order,
+// while the parser is still working on the ones after it. See
+// src/pipeline.cpp
+struct ModuleLowering {
+  IRModule* module;
+  std::unordered_map<std::string, IRFunction*> functions;
+
+  // what the declarations lowered so far declared, by name. The parser is
+  // adding to its global scope at the same time, so names that aren't
+  // local are looked up here instead
+  std::unordered_map<std::string, Object*> globals;
+
+  // definitions calling a function declared after them, lowered at the end
+  std::vector<Object*> waiting_definitions;
+
+  // deletes each function body once it's been lowered
+  bool releases_function_bodies;
+};
+
+ModuleLowering* new_module_lowering();
+// doesn't follow the declaration's next
+void lower_external_declaration(ModuleLowering*, ExternalDeclaration const*);
+// deletes the lowering
+IRModule* finish_module_lowering(ModuleLowering*);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "options.h"
+#include "preprocessor.h"
+
+#include <cstdio>
+#include <string>
+
+// a directory of compiled outputs, --cache-dir, so compiling a file that
+// hasn't changed copies what compiling it last time wrote instead. See
+// src/compilation_cache.cpp
+
+// for the whole run
+struct CompilationCacheStatistics {
+  unsigned hits;
+  unsigned misses;
+  unsigned entries_evicted;
+};
+
+// names the entry for compiling source, the text of the file at path, with
+// flags, the command line options that change the output
+std::string compilation_cache_key(char const* source, char const* path, std::string const& flags);
+
+// false if there's no entry, or a file it depends on has changed since
+bool lookup_compilation_cache(CompilerOptions const*, std::string const& key, std::string* output);
+
+// the entry depends on the files the preprocessor included, and the
+// precompiled header and profile the options name
+void store_compilation_cache(CompilerOptions const*, std::string const& key, Preprocessor const*, std::string const& output);
+
+// the entries other parts of the compiler keep in the same directory, e.g.
+// src/incremental.cpp's. A key names an entry by a hash of text, which
+// should be everything the entry's contents depend on besides the compiler
+std::string cache_entry_key(std::string const& text);
+// false if there's no entry
+bool read_cache_entry(CompilerOptions const*, std::string const& key, std::string* contents);
+void write_cache_entry(CompilerOptions const*, std::string const& key, std::string const& contents);
+
+CompilationCacheStatistics compilation_cache_statistics();
+void reset_compilation_cache_statistics();
+void print_compilation_cache_statistics(FILE*);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "optimize.h"
+#include "options.h"
+#include "parser.h"
+
+#include <cstdio>
+#include <string>
+
+// --incremental, compiling a file again only recompiles the functions that
+// changed, and splices in what compiling it last time printed for the rest.
+// Kept in the --cache-dir directory. See src/incremental.cpp
+
+// for the whole run
+struct IncrementalStatistics {
+  // definitions spliced in from the cache, and ones compiled again, some only
+  // because a function that changed depends on them
+  unsigned functions_reused;
+  unsigned functions_compiled;
+};
+
+// LLVM IR output, without a profile or a precompiled header
+bool can_compile_incrementally(CompilerOptions const*);
+
+// flags are the command line options that change the output, as for the
+// compilation cache
+void emit_llvm_incrementally(TranslationUnit const*, std::string const& flags, FILE*, CompilerOptions const*, OptimizationStatistics*);
+
+IncrementalStatistics incremental_statistics();
+void reset_incremental_statistics();
+void print_incremental_statistics(FILE*);
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// the in-memory form of the LLVM IR that codegen produces
+//
+// codegen used to print LLVM text straight to the output file, which leaves
+// no room for a middle end. Now the AST is lowered into these structs first,
+// optimization passes rewrite them, and only then is text printed
+//
+// the structs mirror LLVM's own: a module is a list of functions, a function
+// is a list of basic blocks, a basic block is a list of instructions. Types
+// are kept as the LLVM type strings, e.g. "i32", since that is all the
+// printer needs. Vector types are strings too, e.g. "<4 x i32>", made by
+// ir_vector_type so that equal types are the same pointer
+
+struct Object;
+struct IRGlobal;
+struct IRTBAAType;
+struct IRInstruction;
+struct IRBasicBlock;
+struct IRFunction;
+
+enum class IROpcode {
+  // memory
+  Alloca,
+  Load,
+  Store,
+
+  // the address of element index of an array starting at the pointer
+  // operand. The element type lives in IRInstruction::allocated_type, and the
+  // index is an i64
+  GetElementPtr,
+
+  // binary operators
+  Add,
+  Sub,
+  Mul,
+  SDiv,
+  UDiv,
+  SRem,
+  URem,
+  Shl,
+  LShr,
+  AShr,
+  And,
+  Or,
+  Xor,
+
+  // comparisons, the predicate lives in IRInstruction::comparison
+  ICmp,
+
+  // conversions
+  ZExt,
+  SExt,
+  Trunc,
+
+  // a vector with every lane set to the scalar operand
+  Splat,
+
+  // the second operand if the i1 first one is true, otherwise the third
+  Select,
+
+  // the callee lives in IRInstruction::callee, the operands are the arguments
+  Call,
+
+  // terminators
+  Br,
+  CondBr,
+
+  // the operand is compared against IRInstruction::case_values, and the
+  // first target is the default
+  Switch,
+
+  Ret,
+  Unreachable
+};
+
+// https://llvm.org/docs/LangRef.html#icmp-instruction
+enum class IRComparison {
+  None,
+  Eq,
+  Ne,
+  Ugt,
+  Uge,
+  Ult,
+  Ule,
+  Sgt,
+  Sge,
+  Slt,
+  Sle
+};
+
+// https://llvm.org/docs/LangRef.html#call-instruction. Both mark a call
+// right before a ret of its result, whose callee doesn't touch the caller's
+// allocas, so the callee can reuse the caller's frame
+enum class IRTailCallKind {
+  None,
+  Tail,
+
+  // the prototypes match too, and then LLVM has to reuse the frame, even at -O0
+  MustTail
+};
+
+enum class IRValueKind {
+  Constant,
+  Argument,
+  Instruction,
+
+  // the address of a global, see IRGlobal
+  Global
+};
+
+struct IRValue {
+  IRValueKind kind;
+  char const* type;
+
+  long long constant;
+  unsigned argument_index;
+  IRInstruction* instruction;
+  IRGlobal* global;
+
+  // an argument that is a restrict qualified pointer, which nothing else the
+  // function accesses aliases. Printed as noalias
+  bool is_noalias;
+};
+
+struct IRInstruction {
+  IROpcode opcode;
+  IRComparison comparison;
+
+  // null for instructions that produce no value, e.g. store, br, ret
+  IRValue* result;
+
+  // alloca'd type, the type of the value a load produces, or the element type
+  // of a getelementptr
+  char const* allocated_type;
+
+  // the function a call calls
+  IRFunction* callee;
+  IRTailCallKind tail_call_kind;
+
+  // a load or store of a volatile object, which has to happen exactly as
+  // written (6.7.3)
+  bool is_volatile;
+
+  // the type a load or store accesses memory as, printed as !tbaa. Null
+  // means unknown, which aliases everything
+  IRTBAAType const* tbaa_type;
+
+  IRValue** operands;
+  unsigned operand_count;
+
+  // branch targets, for CondBr the true target comes first
+  IRBasicBlock** targets;
+  unsigned target_count;
+
+  // for a switch, the value that goes to each target after the default, so
+  // case_values[i] goes to targets[i + 1]
+  long long* case_values;
+
+  // how often each target is taken relative to the others, printed as !prof
+  // branch_weights. Null if nothing is known
+  unsigned long long* branch_weights;
+
+  IRBasicBlock* parent;
+  IRInstruction* previous;
+  IRInstruction* next;
+};
+
+// a node in the type tree that LLVM's type based alias analysis works on,
+// https://llvm.org/docs/LangRef.html#tbaa-metadata. Accesses as two types can
+// only alias if one type is an ancestor of the other, so everything below the
+// root is a child of char, which may alias anything. Made by ir_tbaa_type,
+// which gives equal names the same node
+struct IRTBAAType {
+  char const* name;
+
+  // null for the root
+  IRTBAAType const* parent;
+};
+
+struct IRBasicBlock {
+  // blocks are printed as <name><id>, except for the entry block
+  char const* name;
+  unsigned id;
+
+  IRInstruction* first_instruction;
+  IRInstruction* last_instruction;
+
+  IRFunction* parent;
+  IRBasicBlock* previous;
+  IRBasicBlock* next;
+};
+
+// a function with no blocks is only declared, it's defined in another
+// translation unit
+struct IRFunction {
+  Object const* object;
+  char const* name;
+  char const* return_type;
+  bool is_internal;
+
+  // _Noreturn and inline, printed as the noreturn and inlinehint attributes
+  bool is_noreturn;
+  bool is_inline_hint;
+
+  // printed as the hot and cold attributes, and placed in .text.hot and
+  // .text.unlikely so that the code that runs sits together. See
+  // src/hot_cold_splitting.cpp
+  bool is_hot;
+  bool is_cold;
+
+  // how many times the function was called in a profiled run, printed as
+  // !prof function_entry_count
+  bool has_entry_count;
+  unsigned long long entry_count;
+
+  IRValue** arguments;
+  unsigned argument_count;
+
+  IRBasicBlock* first_block;
+  IRBasicBlock* last_block;
+  unsigned next_block_id;
+
+  IRFunction* next;
+};
+
+// a global variable. C globals aren't supported yet, these are made by the
+// profile instrumentation, see src/profile.cpp
+struct IRGlobal {
+  char const* name;
+  char const* type;
+
+  // LLVM's text for the initial value, e.g. zeroinitializer. Null for a
+  // global defined in another translation unit
+  char const* initializer;
+
+  // null for the default section
+  char const* section;
+  bool is_private;
+  bool is_constant;
+
+  // kept even though nothing refers to it, by listing it in @llvm.used
+  bool is_used;
+
+  IRGlobal* next;
+};
+
+struct IRModule {
+  IRFunction* first_function;
+  IRFunction* last_function;
+
+  IRGlobal* first_global;
+  IRGlobal* last_global;
+};
+
+// the builder keeps track of where new instructions go
+struct IRBuilder {
+  IRFunction* function;
+  IRBasicBlock* insertion_block;
+};
+
+IRModule* new_ir_module();
+IRFunction* new_ir_function(IRModule*, Object const*, char const* name, char const* return_type, unsigned argument_count);
+IRBasicBlock* new_ir_basic_block(IRFunction*, char const* name);
+IRBasicBlock* insert_ir_basic_block_after(IRBasicBlock* after, char const* name);
+
+IRValue* ir_constant(char const* type, long long value);
+IRValue* ir_argument(char const* type, unsigned index);
+IRGlobal* new_ir_global(IRModule*, char const* name, char const* type, char const* initializer);
+IRValue* ir_global_address(IRGlobal*);
+bool ir_value_is_constant(IRValue const*, long long value);
+
+char const* ir_vector_type(char const* element_type, unsigned lanes);
+bool ir_type_is_vector(char const*);
+unsigned ir_vector_lanes(char const*);
+char const* ir_vector_element_type(char const*);
+
+IRTBAAType const* ir_tbaa_type(char const* name, IRTBAAType const* parent);
+// char, which aliases every type. For the loads and stores the passes make,
+// which don't know the C type
+IRTBAAType const* ir_tbaa_omnipotent_char();
+
+// the size of an integer, pointer or vector type
+unsigned ir_type_size(char const*);
+
+bool ir_opcode_is_terminator(IROpcode);
+// !(a < b) is a >= b
+IRComparison ir_inverse_comparison(IRComparison);
+bool ir_opcode_is_binary_operator(IROpcode);
+bool ir_opcode_is_commutative(IROpcode);
+bool ir_instruction_has_side_effects(IRInstruction const*);
+IRInstruction* ir_block_terminator(IRBasicBlock const*);
+bool ir_function_is_declaration(IRFunction const*);
+
+void ir_remove_instruction(IRInstruction*);
+void ir_insert_instruction_before(IRInstruction* before, IRInstruction*);
+void ir_append_instruction(IRBasicBlock*, IRInstruction*);
+void ir_replace_all_uses(IRFunction*, IRValue* old_value, IRValue* new_value);
+
+// a copy with the same operands and targets and a fresh result, in no block
+IRInstruction* ir_clone_instruction(IRInstruction const*);
+unsigned ir_count_instructions(IRFunction const*);
+
+// building instructions at the end of the builder's current block
+IRValue* ir_build_alloca(IRBuilder*, char const* type);
+IRValue* ir_build_load(IRBuilder*, char const* type, IRValue* pointer);
+void ir_build_store(IRBuilder*, IRValue* value, IRValue* pointer);
+IRValue* ir_build_getelementptr(IRBuilder*, char const* element_type, IRValue* pointer, IRValue* index);
+IRValue* ir_build_binary(IRBuilder*, IROpcode, IRValue* lhs, IRValue* rhs);
+IRValue* ir_build_icmp(IRBuilder*, IRComparison, IRValue* lhs, IRValue* rhs);
+IRValue* ir_build_cast(IRBuilder*, IROpcode, IRValue*, char const* type);
+IRValue* ir_build_splat(IRBuilder*, IRValue*, unsigned lanes);
+IRValue* ir_build_select(IRBuilder*, IRValue* condition, IRValue* true_value, IRValue* false_value);
+void ir_build_br(IRBuilder*, IRBasicBlock* target);
+void ir_build_cond_br(IRBuilder*, IRValue* condition, IRBasicBlock* true_target, IRBasicBlock* false_target);
+void ir_build_switch(IRBuilder*, IRValue* condition, IRBasicBlock* default_target, long long const* case_values, IRBasicBlock* const* case_targets,
+    unsigned case_count);
+IRValue* ir_build_call(IRBuilder*, IRFunction* callee, IRValue** arguments, unsigned argument_count);
+void ir_build_ret(IRBuilder*, IRValue*);
+void ir_build_unreachable(IRBuilder*);
+
+void print_ir_module(IRModule const*, FILE*);
+
+// a function printed as if it were alone in a module with no globals, for
+// --incremental to keep and splice into a later compile's output. Metadata
+// is numbered from 0, tbaa nodes first, and metadata[N] is what's between
+// the braces of !N
+struct PrintedIRFunction {
+  std::string text;
+  unsigned tbaa_node_count;
+  std::vector<std::string> metadata;
+};
+
+PrintedIRFunction print_ir_function_alone(IRFunction const*);
+
+// prints functions printed alone the way print_ir_module prints a module of
+// them, numbering their metadata across all of them again
+void print_spliced_ir_functions(std::vector<PrintedIRFunction const*> const&, FILE*);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 enum class TokenType {
   // compiler internals
@@ -67,6 +68,13 @@ enum class TokenType {
 
   ArrowOperator,
 
+  // preprocessing
+  Hash,
+  HashHash,
+  // "file.h" or <file.h> after #include, delimiters and all. Only in
+  // files lexed ahead of time, see src/preprocessor.cpp
+  HeaderName,
+
   // control
   For,
   Do,
@@ -140,11 +148,55 @@ enum class TokenType {
   IntegerSuffixLLU
 };
 
+struct FileEntry;
+struct HideSet;
+struct Preprocessor;
+
 struct Token {
   TokenType type;
   std::string string;
   unsigned line;
   unsigned column;
+
+  // first on its line, where a # starts a directive
+  bool starts_line;
+  // the macros this token came out of, which it can't expand again
+  HideSet const* hide_set;
+};
+
+// an #if, #ifdef or #ifndef the lexer is inside
+struct Conditional {
+  // one of its groups was kept, so the ones after it are skipped
+  bool taken;
+  bool seen_else;
+};
+
+// whether a file's contents are all inside one #ifndef, see
+// src/preprocessor.cpp
+enum class IncludeGuardState {
+  NothingYet,
+  InsideGuard,
+  AfterGuard,
+  NotGuarded,
+};
+
+// a file being lexed because of an #include
+struct IncludedFile {
+  FileEntry* file;
+
+  // where lexing the file that included it picks up again
+  char const* return_filepath;
+  char const* return_location;
+  unsigned return_line;
+  unsigned return_column;
+  std::vector<Token> const* return_file_tokens;
+  unsigned return_next_file_token;
+
+  // conditionals opened before the #include, which the file can't close
+  unsigned conditional_depth;
+
+  IncludeGuardState guard_state;
+  std::string guard_macro;
 };
 
 struct Lexer {
@@ -157,17 +209,60 @@ struct Lexer {
 
   unsigned current_line;
   unsigned current_column;
+  bool at_start_of_line;
+
+  // a header lexed ahead of time is read from its tokens instead of its
+  // text, starting at file_tokens[next_file_token]. Null for text
+  std::vector<Token> const* file_tokens;
+  unsigned next_file_token;
+
+  // errors give Error tokens instead of ending the compile
+  bool is_lexing_ahead;
+
+  // tokens handed out as they are, already preprocessed, starting at
+  // replayed_tokens[next_replayed_token]. Null for none, see
+  // DeferredFunctionBody
+  std::vector<Token> const* replayed_tokens;
+  unsigned next_replayed_token;
+
+  // every token handed out is hashed into this, see hash_token. Null for
+  // none
+  unsigned long long* token_hash;
 
   Token current_token;
+
+  // tokens macros expanded to that haven't been handed out yet, the next one
+  // last. Peeking copies the lexer, which copies these along with it, and
+  // the conditionals and includes too
+  std::vector<Token> pending_tokens;
+  std::vector<Conditional> conditionals;
+  std::vector<IncludedFile> included_files;
+
+  // the macros and files of the translation unit, shared between copies of
+  // the lexer
+  Preprocessor* preprocessor;
 };
 
-Lexer new_lexer(char const*);
+// macros defined while lexing go in preprocessor, a new one if it's null
+Lexer new_lexer(char const*, Preprocessor* preprocessor = nullptr);
 void tokenize_char_ptr(char const*);
 Token make_token(TokenType, unsigned, unsigned, std::string = "");
 bool token_equals(Token const*, Token const*);
+// mixes a token's type and spelling, but not where it is, into hash. Starts
+// from fnv_offset_basis
+unsigned long long hash_token(unsigned long long hash, Token const*);
+constexpr unsigned long long fnv_offset_basis = 14695981039346656037ull;
 
 Token* get_current_token(Lexer*);
+Token lex_next_token(Lexer*);
 Token const* get_next_token(Lexer*);
+char const* skip_braced_text(Lexer*);
+char const* token_spelling(Token const*);
+
+// for directives, which go by lines rather than tokens
+bool lexer_at_end_of_line(Lexer*);
+void skip_to_next_directive(Lexer*);
+bool lex_header_name(Lexer*, std::string*, bool*);
 Token error_token(Lexer*, char const*);
 void lexer_print_error_message(Lexer*, char const*);
 Token const* expect_next_token_and_skip(Lexer* lexer, TokenType type, char const*);
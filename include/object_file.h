@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// a relocatable object with a single .text section, which is all the native
+// backend produces. write_elf_object lays it out as an ELF64 file for x86-64
+// System V, the kind of file cc -c writes
+
+struct ObjectSymbol {
+  std::string name;
+
+  // offset and size within .text, meaningless for undefined symbols
+  unsigned long long offset;
+  unsigned long long size;
+
+  bool is_global;
+  bool is_defined;
+};
+
+// https://refspecs.linuxbase.org/elf/x86_64-abi-0.99.pdf, table 4.10
+enum class RelocationType : unsigned {
+  PC32 = 2,
+  PLT32 = 4
+};
+
+struct ObjectRelocation {
+  // where in .text the 32 bit field to patch is
+  unsigned long long offset;
+
+  // index into ObjectFile::symbols
+  unsigned symbol;
+
+  RelocationType type;
+  long long addend;
+};
+
+struct ObjectFile {
+  std::vector<unsigned char> text;
+  std::vector<ObjectSymbol> symbols;
+  std::vector<ObjectRelocation> relocations;
+};
+
+// the index of the symbol with this name, adding it as an undefined global if
+// there isn't one yet. Calls can come before the callee is encoded, or be to
+// functions that are never defined here at all
+unsigned find_or_add_object_symbol(ObjectFile*, std::string const& name);
+
+void write_elf_object(ObjectFile const*, FILE*);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "analysis.h"
+#include "ir.h"
+
+#include <cstdio>
+
+// counters bumped by the passes, printed with --stats
+struct OptimizationStatistics {
+  unsigned value_numbering_eliminated;
+  unsigned dead_code_eliminated;
+  unsigned dead_stores_eliminated;
+  unsigned licm_hoisted;
+  unsigned loop_vectorization_loops_vectorized;
+  unsigned loop_vectorization_alias_checks;
+  unsigned inliner_call_sites_inlined;
+  unsigned inliner_functions_deleted;
+  unsigned tail_calls_eliminated;
+  unsigned peephole_rewrites;
+  unsigned hot_cold_regions_outlined;
+  unsigned hot_cold_hot_functions;
+  unsigned hot_cold_cold_functions;
+
+  // the x86-64 backend's register allocator
+  unsigned intervals_split;
+  unsigned intervals_spilled;
+};
+
+OptimizationStatistics new_optimization_statistics();
+void print_optimization_statistics(OptimizationStatistics const*, FILE*);
+
+// runs the pass pipeline for the given -O level over every function
+void optimize_ir_module(IRModule*, unsigned optimization_level, OptimizationStatistics*);
+// the part of it that runs on each function, callees first, before unused
+// internal functions are deleted and cold code is split out. For
+// src/incremental.cpp, which deletes them itself
+void optimize_ir_functions(IRModule*, OptimizationStatistics*);
+
+// passes
+void run_inliner(IRModule*, IRFunction*, CallGraph const*, OptimizationStatistics*);
+void remove_unused_internal_functions(IRModule*, OptimizationStatistics*);
+void run_tail_recursion_elimination(IRFunction*, OptimizationStatistics*);
+void run_value_numbering(IRFunction*, OptimizationStatistics*);
+void run_loop_invariant_code_motion(IRFunction*, OptimizationStatistics*);
+void run_loop_vectorization(IRFunction*, OptimizationStatistics*);
+void run_peephole(IRFunction*, OptimizationStatistics*);
+void run_dead_code_elimination(IRFunction*, OptimizationStatistics*);
+void run_hot_cold_splitting(IRModule*, OptimizationStatistics*);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+
+// flags collected from the command line in main, passed down to whoever needs them
+struct CompilerOptions {
+  // -O0, -O1, ...
+  unsigned optimization_level;
+
+  // --stats, print pass counters to stderr after compiling
+  bool print_statistics;
+
+  // -c, write an object file with the native x86-64 backend instead of LLVM IR
+  bool emit_object;
+
+  // -fprofile-generate, count how often branches go each way and write the
+  // counts out at exit, see include/profile.h
+  bool profile_generate;
+
+  // -fprofile-use=<path>, the counts from a -fprofile-generate build. Null
+  // without one
+  char const* profile_use_path;
+
+  // --emit-pch, write a precompiled header instead of code, see
+  // include/precompiled_header.h
+  bool emit_pch;
+
+  // --include-pch=<path>, start every file from a precompiled header. Null
+  // without one
+  char const* include_pch_path;
+
+  // --index, write a symbol index of the declarations instead of code, see
+  // include/symbol_index.h
+  bool emit_index;
+
+  // --cache-dir=<dir>, look compiled files up in a cache, see
+  // include/compilation_cache.h. Null without one
+  char const* cache_directory;
+
+  // --cache-max-size=<megabytes>, in bytes
+  unsigned long long cache_max_size;
+
+  // --incremental, only recompile the functions that changed, keeping the
+  // rest in the cache directory. See include/incremental.h
+  bool incremental;
+
+  // --pipeline, lower each declaration on a second thread while the rest
+  // of the file is parsed, see include/pipeline.h
+  bool pipelined;
+};
+
+inline CompilerOptions default_compiler_options()
+{
+  CompilerOptions options;
+  options.optimization_level = 0;
+  options.print_statistics = false;
+  options.emit_object = false;
+  options.profile_generate = false;
+  options.profile_use_path = nullptr;
+  options.emit_pch = false;
+  options.include_pch_path = nullptr;
+  options.emit_index = false;
+  options.cache_directory = nullptr;
+  options.cache_max_size = 512ull << 20;
+  options.incremental = false;
+  options.pipelined = false;
+  return options;
+}
+
+// where compiling path writes to, the file name up to its first . with the
+// output's extension. Dots in directory names are kept
+inline std::string output_path(char const* path, CompilerOptions const* options)
+{
+  std::string output = path;
+  size_t name = output.rfind('/');
+  size_t extension = output.find('.', name == std::string::npos ? 0 : name + 1);
+  if (extension != std::string::npos)
+    output.erase(extension);
+  return output + (options->emit_pch ? ".pch" : options->emit_index ? ".idx" : options->emit_object ? ".o" : ".ll");
+}
@@ -4,10 +4,15 @@
 #include "type.h"
 
 #include <cstdlib>
+#include <functional>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 struct ASTNode;
+struct Preprocessor;
+struct PrecompiledHeader;
+struct DeferredFunctionBody;
 
 enum class ASTNodeType {
   Void,
@@ -38,10 +43,27 @@ enum class ASTNodeType {
   ConditionalExpression,
   Assignment,
 
+  // unary expressions
+  PreIncrement,
+  PreDecrement,
+  PostIncrement,
+  PostDecrement,
+  LogicalNot,
+
+  // postfix expressions
+  FunctionCall,
+  ArraySubscript,
+
   // control flow
   If,
   Switch,
+  Case,
+  Default,
   For,
+  While,
+  DoWhile,
+  Break,
+  Continue,
   Return,
 
   // declarations
@@ -52,7 +74,22 @@ enum class ASTNodeType {
 struct Object {
   std::string identifier;
   Type const* type;
+  // read it with function_body(), which parses a deferred body first
   ASTNode* function_body;
+  DeferredFunctionBody* deferred_body;
+
+  // the storage class and function specifiers it was declared with, e.g. static
+  DeclarationSpecifierFlags declaration_specifier_flags;
+
+  // how many names had been declared in its scope before its name was
+  // first, see Scope::visible_declarations
+  unsigned declaration_number;
+
+  // where its name is, as error messages count lines and columns. Null path
+  // for one read from a precompiled header
+  char const* path;
+  unsigned line;
+  unsigned column;
 };
 
 struct Scope {
@@ -60,6 +97,19 @@ struct Scope {
   Type const* return_type;
   std::unordered_map<std::string, Object*> variables;
   std::unordered_map<std::string, Object*> typedef_names;
+
+  // with --include-pch, the global scope also has everything the header
+  // declared, read in as it's looked up
+  PrecompiledHeader* precompiled_header = nullptr;
+
+  // names declared in it so far, see declare_in_scope
+  unsigned declaration_count;
+
+  // the scopes around it only show the names declared in them before this
+  // many were, ~0u for all of them. For a deferred function body, which
+  // sees the global scope as it was when the body was skipped. A name
+  // declared again since is the latest declaration, as codegen sees it
+  unsigned visible_declarations;
 };
 
 struct ASTNode {
@@ -92,6 +142,15 @@ struct ASTNode {
   // for ternary conditional, while, for and if
   ASTNode* conditional;
 
+  // a function call's callee is its lhs, and its arguments are this list,
+  // chained through next
+  ASTNode* arguments;
+
+  // the statement a for, while or do while repeats. A for's first clause is
+  // lhs and its third is rhs. Also a switch's body, and the statement after
+  // a case or default label, a case's value being its lhs
+  ASTNode* body;
+
   // declarations/definitions
   Object* object;
 
@@ -105,19 +164,38 @@ struct ExternalDeclaration {
   ExternalDeclaration* next;
   ExternalDeclarationType type;
   ASTNode const* root_ast_node;
+
+  // of its tokens after macro expansion, for --incremental. 0 for one read
+  // from a precompiled header
+  unsigned long long token_hash;
+};
+
+// everything parsing a translation unit leaves behind, which --emit-pch
+// writes out
+struct TranslationUnit {
+  ExternalDeclaration* external_declarations;
+  Scope* global_scope;
+  // its macros, and the files it included
+  Preprocessor* preprocessor;
 };
 
 ASTNode* new_ast_node(Scope*, ASTNodeType);
+Scope* new_scope(Scope*, Type const* return_type = nullptr);
 bool expect_token_type(Token*, TokenType);
 
 Type const* declaration_to_fundamental_type(DeclarationSpecifierFlags*);
 
 Object* variable_in_scope(std::string const&, Scope*);
+// adds the object to the scope's variables, replacing an earlier
+// declaration of the same name but keeping its declaration_number
+void declare_in_scope(Scope*, Object*);
 
 // expressions
 
 ASTNode* parse_expression(Lexer*, Scope*);
 ASTNode* parse_primary_expression(Lexer*, Scope*);
+ASTNode* parse_cast_expression(Lexer*, Scope*);
+ASTNode* parse_conditional_expression(Lexer*, Scope*);
 ASTNode* parse_assignment_expression(Lexer*, Scope*);
 
 // declarations
@@ -136,4 +214,43 @@ void parse_rest_of_declaration(Lexer*, Scope*, ASTNode*);
 // statements
 ASTNode* parse_statement(Lexer* lexer, Scope* scope);
 
-ExternalDeclaration* parse_translation_unit(char const*);
+// a function body a parse skipped, parsed the first time something asks
+// for it. Where the body's text has no directives or macros, only its braces
+// were matched, and it's lexed when it's parsed. Otherwise it was
+// preprocessed then, and tokens are what that gave, from the { to the }
+struct DeferredFunctionBody {
+  // where the { is, null for a body kept as tokens
+  char const* text;
+  unsigned line;
+  unsigned column;
+
+  std::vector<Token> tokens;
+  Scope* scope;
+  // how many objects scope had when the body was skipped
+  unsigned visible_declarations;
+  Type const* return_type;
+  char const* path;
+  Preprocessor* preprocessor;
+};
+
+// null for a function that's only declared
+ASTNode* function_body(Object const*);
+
+// frees a definition's body, with the scopes and local objects in it, once
+// nothing will read it again. Its types are kept, they can be shared
+void delete_function_body(Object*);
+
+// called with each external declaration as soon as it's been parsed, before
+// the declaration after it is linked to it as next
+using ExternalDeclarationParsed = std::function<void(ExternalDeclaration*)>;
+
+// path is where the text came from, for error messages and finding files
+// #include names next to it. Null when it isn't from a file
+ExternalDeclaration* parse_translation_unit(char const*, char const* path = nullptr);
+// starting from a precompiled header, if there is one, as if the header it
+// was made from had been included before the first line. Deferring bodies
+// only matches braces in them, for passes that only need the declarations.
+// A deferred body is parsed in the scope as it was where the body is, so
+// it can't use names declared after it any more than a parsed one can
+TranslationUnit parse_whole_translation_unit(char const*, char const* path, PrecompiledHeader*, bool defers_function_bodies = false,
+    ExternalDeclarationParsed const& on_parsed = nullptr);
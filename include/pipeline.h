@@ -0,0 +1,17 @@
+#pragma once
+
+#include "optimize.h"
+#include "options.h"
+#include "parser.h"
+
+#include <cstdio>
+
+// --pipeline, parsing on one thread and lowering each external declaration
+// on another as soon as it's parsed. See src/pipeline.cpp
+
+// LLVM IR or object output, without a precompiled header or --incremental
+bool can_compile_pipelined(CompilerOptions const*);
+
+// parses file, path being where it's from, and writes the code for it. The
+// translation unit is for what's left of it, its function bodies are freed
+TranslationUnit emit_pipelined(char const* file, char const* path, FILE*, CompilerOptions const*, OptimizationStatistics*);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "parser.h"
+#include "preprocessor.h"
+
+#include <cstdio>
+
+// precompiled headers, --emit-pch and --include-pch. See
+// src/precompiled_header.cpp for the file format
+
+// a mapped precompiled header, and the declarations read out of it so far
+// for the translation unit using it. Each translation unit needs its own
+struct PrecompiledHeader;
+
+void write_precompiled_header(TranslationUnit const*, FILE*);
+
+// null if the file isn't a precompiled header
+PrecompiledHeader* read_precompiled_header(char const* path);
+
+// starts a translation unit off with the header's macros, and has its global
+// scope look in the header for names it doesn't have
+void use_precompiled_header(PrecompiledHeader*, Scope* global_scope, MacroTable*);
+
+// null if the header doesn't declare the name. Otherwise reads in the
+// declaration, with its type and function body, the first time
+Object* precompiled_variable(PrecompiledHeader*, std::string const&);
+bool precompiled_typedef_name(PrecompiledHeader*, std::string const&);
+
+// the header's external declarations the translation unit needs, the ones
+// it used and the function definitions that aren't static, ahead of its own
+ExternalDeclaration* prepend_precompiled_declarations(PrecompiledHeader*, ExternalDeclaration*);
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "lexer.h"
+#include "mini_string.h"
+
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_set>
+#include <vector>
+
+// the preprocessor, built into the lexer the way clang's is. get_next_token
+// hands the parser tokens after macro expansion, and lex_next_token underneath
+// only ever sees the file as written. There's no preprocessed text in between
+// to write out and lex again, expansions are pushed back onto the lexer as
+// tokens, and an #include points the lexer at the included file until it
+// runs out, see IncludedFile in lexer.h
+//
+// expansion follows Dave Prosser's algorithm, the one the standard's wording
+// was written from: every token carries the set of macros it came out of, its
+// hide set, and a macro name whose hide set holds that macro isn't expanded.
+// This is what stops #define x x + 1 from recursing, while still expanding
+// f(f(1)) twice
+
+struct Macro {
+  bool is_function_like;
+  // the last parameter is __VA_ARGS__
+  bool is_variadic;
+  unsigned parameter_count;
+
+  std::vector<Token> body;
+  // for each token in the body, which parameter it names, or -1
+  std::vector<int> body_parameters;
+};
+
+// a name, stored once. Interned names are equal when their pointers are, see
+// string_equals
+struct Identifier {
+  String name;
+  unsigned hash;
+  // null if the name isn't a macro
+  Macro* macro;
+};
+
+// every identifier the preprocessor has looked at, hashed with open addressing.
+// Each entry holds the name's macro, so finding a macro is one probe sequence
+// on the name, and hide sets compare Identifier pointers
+struct MacroTable {
+  Identifier** entries;
+  unsigned capacity;
+  unsigned count;
+};
+
+// sorted by address, so union and intersection are a single merge. Sets are
+// never changed once made and are shared between tokens
+struct HideSet {
+  Identifier const* identifier;
+  HideSet const* next;
+};
+
+// a file #include has found, kept for the rest of the run so including it
+// again doesn't have to read it. Files are told apart by inode, so one
+// reached through two different paths is still one file, and by
+// modification time, so one that changed is read again
+//
+// the run can be compiling several translation units, so everything here is
+// shared between them and guarded by a lock, see src/preprocessor.cpp
+struct FileEntry {
+  char const* path;
+  dev_t device;
+  ino_t inode;
+  timespec modification_time;
+  // mapped, not copied
+  char const* contents;
+
+  bool is_pragma_once;
+  // set once the whole file turns out to be inside #ifndef guard_macro. While
+  // that's defined, including the file again would read nothing
+  std::string guard_macro;
+
+  // the file lexed once for every translation unit that includes it. Empty
+  // and not used if it doesn't lex, then it's lexed from contents every time
+  // for the errors
+  std::once_flag lexed_ahead;
+  bool lexes;
+  std::vector<Token> tokens;
+};
+
+// per translation unit, the lexers of all its files point to one of these
+struct Preprocessor {
+  MacroTable* macros;
+  // every file included so far, for #pragma once
+  std::unordered_set<FileEntry const*> included_files;
+  // quoted includes in the main file are looked for next to it. Null when
+  // lexing a string, then they're looked for in the working directory
+  char const* main_file_path;
+};
+
+// for the whole run, across translation units
+struct PreprocessorStatistics {
+  unsigned files_read;
+  unsigned includes_from_token_cache;
+  unsigned includes_skipped_by_guard;
+  unsigned includes_skipped_by_pragma_once;
+};
+
+Preprocessor* new_preprocessor();
+MacroTable* new_macro_table();
+Identifier* intern_identifier(MacroTable*, char const*, unsigned);
+// null if the name was never interned
+Identifier* find_identifier(MacroTable const*, char const*, unsigned);
+
+// the next token after expanding macros and carrying out directives
+Token preprocess_next_token(Lexer*);
+
+// -I, searched in order for <file> and then for "file" that isn't next to the
+// file including it
+void add_include_directory(char const*);
+// for a process that compiles more than one command line, see src/server.cpp
+void clear_include_directories();
+PreprocessorStatistics preprocessor_statistics();
+// a server's counts are for one command line, not everything it compiled
+void reset_preprocessor_statistics();
+void print_preprocessor_statistics(FILE*);
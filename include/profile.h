@@ -0,0 +1,45 @@
+#pragma once
+
+#include "ir.h"
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// profile guided optimization, what clang calls -fprofile-generate and
+// -fprofile-use
+//
+// an instrumented build counts how often each function is entered and how
+// often each edge out of a conditional branch or switch is taken. At exit,
+// runtime/profile.c writes the counts out, adding them to whatever an
+// earlier run left in the file. A later build reads them back and attaches
+// them to the IR as branch weights and function entry counts, which LLVM's
+// block placement, inliner and hot/cold splitting go by
+//
+// both work on the IR exactly as codegen produced it, before any pass has
+// run, so the branches in the instrumented and the optimized build are the
+// same ones in the same order. A hash of the control flow catches functions
+// whose source has changed since the profile was taken
+
+// the counts of one function: how many times it was entered, then each edge
+// of each conditional branch and switch in order
+struct FunctionProfile {
+  unsigned long long hash;
+  std::vector<unsigned long long> counts;
+};
+
+// by function name
+using Profile = std::unordered_map<std::string, FunctionProfile>;
+
+void instrument_ir_module(IRModule*);
+
+// false if the file isn't a profile
+bool read_profile(FILE*, Profile*);
+
+// functions the profile has no counts for are left alone
+void apply_profile(IRModule*, Profile const*);
+
+// weights from static heuristics for every conditional branch and switch that
+// doesn't have any yet, see src/branch_probability.cpp
+void estimate_branch_weights(IRModule*);
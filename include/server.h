@@ -0,0 +1,22 @@
+#pragma once
+
+// a compile server, --server=<socket>, and the client that forwards command
+// lines to it, --connect=<socket>. See src/server.cpp
+
+// compiles a command line, argv[0] being the program, and returns the exit
+// status
+using CompileCommandLine = int (*)(int argc, char** argv);
+
+// a worker holds on to everything each compile allocated, the ASTs and IR
+// along with the caches, so after this many it exits and is replaced
+constexpr unsigned compiles_per_worker = 200;
+
+// listens on a Unix socket at path, and compiles each command line a client
+// sends in one of worker_count processes that stay up between compiles.
+// Only returns on SIGINT or SIGTERM, or if the socket can't be made
+int run_compile_server(char const* socket_path, unsigned worker_count, CompileCommandLine);
+
+// has the server compile the command line, argv[0] being the program, and
+// copies what the compile printed to stderr. False if no server is
+// listening, otherwise status is what the compile returned
+bool compile_on_server(char const* socket_path, int argc, char** argv, int* status);
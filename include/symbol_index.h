@@ -0,0 +1,42 @@
+#pragma once
+
+#include "parser.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// symbol indexes, --index. Every external declaration's name, kind, type and
+// where it is, without parsing function bodies or running codegen. See
+// src/symbol_index.cpp for the file format
+
+enum class SymbolKind {
+  FunctionDefinition,
+  FunctionDeclaration,
+  Variable,
+};
+
+// a symbol as read back out of an index
+struct IndexedSymbol {
+  std::string name;
+  SymbolKind kind;
+  bool is_static;
+  bool is_extern;
+  // the declared type spelled out as C, e.g. int (char*, ...)
+  std::string signature;
+
+  // the file the name is in, empty for one from a precompiled header. line
+  // and column are as error messages count them
+  std::string path;
+  unsigned line;
+  unsigned column;
+};
+
+// meant for a translation unit parsed with its function bodies deferred,
+// which are left unparsed
+void write_symbol_index(TranslationUnit const*, FILE*);
+
+// false if the file isn't a symbol index
+bool read_symbol_index(char const* path, std::vector<IndexedSymbol>*);
+
+std::string type_signature(Type const*);
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "ir.h"
+#include "object_file.h"
+#include "optimize.h"
+
+#include <cstdio>
+#include <vector>
+
+// the native x86-64 backend, an alternative to handing the LLVM text to llc
+//
+// instruction selection turns an IRFunction into a MachineFunction, whose
+// instructions are x86 instructions operating on an unlimited supply of
+// virtual registers. Linear scan then maps those onto physical registers and
+// stack slots, and the encoder turns the result into bytes for the ELF writer
+//
+// only as much of x86 is modelled as instruction selection needs. Operand
+// sizes are in bytes, and memory operands are stack slots addressed off rbp,
+// except for the loads and stores through a pointer in a register that have
+// opcodes of their own
+//
+// vector values live in 16 byte stack slots and are worked on in xmm0 and
+// xmm1, so the register allocator never sees them
+
+// numbered the way the instruction encoding numbers them
+enum class X86Register : unsigned {
+  Rax = 0,
+  Rcx,
+  Rdx,
+  Rbx,
+  Rsp,
+  Rbp,
+  Rsi,
+  Rdi,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15
+};
+
+// registers 0-15 are the physical ones above, anything from here on is virtual
+constexpr unsigned first_virtual_register = 16;
+
+// the condition code field of jcc and setcc
+enum class X86Condition : unsigned {
+  B = 0x2,
+  AE = 0x3,
+  E = 0x4,
+  NE = 0x5,
+  BE = 0x6,
+  A = 0x7,
+  L = 0xc,
+  GE = 0xd,
+  LE = 0xe,
+  G = 0xf
+};
+
+enum class MachineOpcode {
+  Mov,   // mov dst, src
+  MovZX, // movzx dst, src, zero extending from source_size, a 32 bit mov when that's 4
+  MovSX, // movsx dst, src, sign extending from source_size
+  Lea,   // lea dst, [slot]
+  Load,  // mov dst, [src], zero extending loads under 4 bytes
+  Store, // mov [dst], src
+
+  // two address arithmetic, dst = dst op src
+  Add,
+  Sub,
+  IMul,
+  And,
+  Or,
+  Xor,
+  Cmp,
+
+  // shifts by an immediate, or by cl with no source operand
+  Shl,
+  Shr,
+  Sar,
+
+  Neg,
+  Test,
+  SetCC,
+  CMov, // cmov dst, src, dst = src if the condition holds
+
+  // sign extend eax into edx (cdq, or cqo at size 8), then divide edx:eax
+  SignExtendAccumulator,
+  IDiv,
+  Div,
+
+  // SSE on whole xmm registers, size is the size of a lane. Loads and
+  // stores are movdqu to or from a stack slot or the memory a register
+  // points at, Broadcast copies a register into every lane
+  VectorLoad,
+  VectorStore,
+  Broadcast,
+  VectorAdd,
+  VectorSub,
+  VectorMul,
+  VectorAnd,
+  VectorOr,
+  VectorXor,
+
+  Push, // push a 64 bit register or a sign extended 32 bit immediate
+  Call, // call a symbol, everything but the callee saved registers is clobbered
+
+  // the epilogue, then a jmp to a symbol, which returns to our caller
+  TailCall,
+
+  // bt dst, src, setting the carry flag to bit src of dst
+  Bt,
+
+  Jmp,
+  Jcc,
+
+  // an indirect jmp to MachineInstruction::jump_table[index], where index is
+  // the operand, a register known to be in range. It's clobbered, and the
+  // table itself follows the jmp in .text
+  JumpTable,
+
+  Ret, // the epilogue is filled in by the encoder
+  Ud2
+};
+
+enum class MachineOperandKind {
+  None,
+  Register,
+  VectorRegister, // xmm0-15, never allocated
+  Immediate,
+  StackSlot,
+  Block,
+  Symbol
+};
+
+struct MachineBasicBlock;
+
+struct MachineOperand {
+  MachineOperandKind kind;
+  unsigned reg;
+  long long immediate;
+  unsigned stack_slot;
+  MachineBasicBlock* block;
+  char const* symbol;
+};
+
+struct MachineInstruction {
+  MachineOpcode opcode;
+
+  // operand size in bytes, 1, 2, 4 or 8
+  unsigned size;
+
+  // size of the source of MovZX and MovSX
+  unsigned source_size;
+
+  X86Condition condition;
+
+  MachineOperand operands[2];
+  unsigned operand_count;
+
+  std::vector<MachineBasicBlock*>* jump_table;
+};
+
+struct MachineBasicBlock {
+  unsigned id;
+  std::vector<MachineInstruction> instructions;
+};
+
+struct StackSlot {
+  unsigned size;
+
+  // offset from rbp, assigned when the frame is laid out. Arguments passed on
+  // the stack are above rbp and have their offsets from the start
+  int offset;
+};
+
+struct MachineFunction {
+  IRFunction const* ir_function;
+
+  // in layout order, the first block is the entry
+  std::vector<MachineBasicBlock*> blocks;
+
+  // allocas first, spill slots are added by the register allocator
+  std::vector<StackSlot> stack_slots;
+
+  unsigned next_virtual_register;
+
+  // callee saved registers the register allocator handed out, which the
+  // prologue has to save
+  std::vector<X86Register> used_callee_saved_registers;
+
+  // bytes the prologue subtracts from rsp, set once stack slots have offsets
+  unsigned frame_size;
+};
+
+MachineOperand machine_register(unsigned);
+MachineOperand machine_vector_register(unsigned);
+MachineOperand machine_immediate(long long);
+MachineOperand machine_stack_slot(unsigned);
+MachineOperand machine_block(MachineBasicBlock*);
+MachineOperand machine_symbol(char const*);
+
+// which operands of an instruction are read and which are written
+bool machine_operand_is_use(MachineInstruction const*, unsigned operand_index);
+bool machine_operand_is_def(MachineInstruction const*, unsigned operand_index);
+
+// a switch is split into clusters of adjacent case values that are each
+// handled one way, see src/x86_64_switch_lowering.cpp. Instruction selection
+// then finds the right cluster with a balanced tree of comparisons
+enum class SwitchClusterKind {
+  Range,     // every value from low to high goes to targets[0]
+  JumpTable, // value goes to targets[value - low], the default for the holes
+  BitTest,   // value goes to targets[i] if bit value - low of masks[i] is set
+};
+
+struct SwitchCluster {
+  SwitchClusterKind kind;
+
+  // inclusive, sign extended from the condition's type
+  long long low;
+  long long high;
+
+  std::vector<IRBasicBlock*> targets;
+  std::vector<unsigned long long> masks;
+};
+
+// sorted by value, values in no cluster go to the default
+std::vector<SwitchCluster> cluster_switch_cases(IRInstruction const* switch_instruction);
+
+MachineFunction* select_x86_64_instructions(IRFunction const*);
+void allocate_registers(MachineFunction*, OptimizationStatistics*);
+void encode_x86_64_function(MachineFunction const*, ObjectFile*);
+
+// the whole pipeline, for every function in the module
+ObjectFile generate_x86_64_object(IRModule const*, OptimizationStatistics*);
+
+void print_machine_function(MachineFunction const*, FILE*);
@@ -7,3 +7,5 @@ fi
 
 ./build/lexer_test
 ./build/parser_test
+./build/codegen_test
+./build/x86_64_test
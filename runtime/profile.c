@@ -0,0 +1,122 @@
+// the half of -fprofile-generate that runs in the instrumented program, the
+// way compiler-rt's profile library does for clang. Link it in with the
+// objects llc makes from the instrumented IR
+//
+// every instrumented function has a record in the miniclang_profile section,
+// see src/profile.cpp. The linker defines __start_ and __stop_ symbols around
+// a section whose name is a C identifier, so the records can be walked like
+// an array without any of them registering. At exit the counts are added to
+// whatever the profile already holds, so several runs make up one profile.
+// Records for functions whose code has changed since are replaced
+//
+// the profile goes to $MINICLANG_PROFILE, or miniclang.profile by default
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ProfileData {
+  char const* name;
+  unsigned long long* counters;
+  unsigned long long hash;
+  unsigned long long counter_count;
+};
+
+// instrumented code refers to this, so linking with the library brings this file in
+int __miniclang_profile_runtime;
+
+extern struct ProfileData __start_miniclang_profile[] __attribute__((weak));
+extern struct ProfileData __stop_miniclang_profile[] __attribute__((weak));
+
+// a record from the profile file
+struct StoredProfile {
+  char name[1024];
+  unsigned long long hash;
+  unsigned long long counter_count;
+  unsigned long long* counters;
+};
+
+static struct ProfileData* find_function(char const* name)
+{
+  struct ProfileData* data;
+  for (data = __start_miniclang_profile; data < __stop_miniclang_profile; data++)
+    if (strcmp(data->name, name) == 0)
+      return data;
+  return NULL;
+}
+
+// the records for functions this program doesn't have, which are written back
+// as they were. The others are added to this run's counts
+static size_t merge_stored_profile(FILE* file, struct StoredProfile** kept)
+{
+  char header[32];
+  size_t kept_count = 0;
+  struct StoredProfile stored;
+
+  *kept = NULL;
+  if (!fgets(header, sizeof(header), file) || strcmp(header, "miniclang profile\n") != 0)
+    return 0;
+
+  while (fscanf(file, "%1023s %llu %llu", stored.name, &stored.hash, &stored.counter_count) == 3) {
+    struct ProfileData* data = find_function(stored.name);
+    unsigned long long i;
+
+    stored.counters = (unsigned long long*)malloc(stored.counter_count * sizeof(unsigned long long));
+    for (i = 0; i < stored.counter_count; i++)
+      if (fscanf(file, "%llu", &stored.counters[i]) != 1)
+        return kept_count;
+
+    if (!data) {
+      *kept = (struct StoredProfile*)realloc(*kept, (kept_count + 1) * sizeof(struct StoredProfile));
+      (*kept)[kept_count++] = stored;
+      continue;
+    }
+
+    if (data->hash == stored.hash && data->counter_count == stored.counter_count)
+      for (i = 0; i < stored.counter_count; i++)
+        data->counters[i] += stored.counters[i];
+    free(stored.counters);
+  }
+  return kept_count;
+}
+
+static void write_counters(FILE* file, char const* name, unsigned long long hash, unsigned long long count, unsigned long long const* counters)
+{
+  unsigned long long i;
+  fprintf(file, "%s %llu %llu\n", name, hash, count);
+  for (i = 0; i < count; i++)
+    fprintf(file, "%s%llu", i ? " " : "", counters[i]);
+  fprintf(file, "\n");
+}
+
+__attribute__((destructor)) static void write_profile(void)
+{
+  char const* path = getenv("MINICLANG_PROFILE") ? getenv("MINICLANG_PROFILE") : "miniclang.profile";
+  struct StoredProfile* kept = NULL;
+  size_t kept_count = 0;
+  struct ProfileData* data;
+  size_t i;
+  FILE* file;
+
+  if (&__start_miniclang_profile[0] == &__stop_miniclang_profile[0])
+    return;
+
+  file = fopen(path, "r");
+  if (file) {
+    kept_count = merge_stored_profile(file, &kept);
+    fclose(file);
+  }
+
+  file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "miniclang profile: could not write %s\n", path);
+    return;
+  }
+
+  fprintf(file, "miniclang profile\n");
+  for (i = 0; i < kept_count; i++)
+    write_counters(file, kept[i].name, kept[i].hash, kept[i].counter_count, kept[i].counters);
+  for (data = __start_miniclang_profile; data < __stop_miniclang_profile; data++)
+    write_counters(file, data->name, data->hash, data->counter_count, data->counters);
+  fclose(file);
+}
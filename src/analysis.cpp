@@ -0,0 +1,299 @@
+#include "analysis.h"
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_set>
+
+static void postorder_walk(ControlFlowGraph* cfg, IRBasicBlock* block, std::unordered_set<IRBasicBlock const*>* visited, std::vector<IRBasicBlock*>* postorder)
+{
+  visited->insert(block);
+  for (IRBasicBlock* successor : cfg->successors[block])
+    if (!visited->contains(successor))
+      postorder_walk(cfg, successor, visited, postorder);
+  postorder->push_back(block);
+}
+
+ControlFlowGraph compute_control_flow_graph(IRFunction* function)
+{
+  ControlFlowGraph cfg;
+
+  for (IRBasicBlock* block = function->first_block; block; block = block->next) {
+    cfg.predecessors[block];
+    cfg.successors[block];
+  }
+
+  for (IRBasicBlock* block = function->first_block; block; block = block->next) {
+    IRInstruction* terminator = ir_block_terminator(block);
+    if (!terminator)
+      continue;
+
+    for (unsigned i = 0; i < terminator->target_count; i++) {
+      IRBasicBlock* target = terminator->targets[i];
+
+      // a conditional branch with the same target twice is still one edge
+      std::vector<IRBasicBlock*>& successors = cfg.successors[block];
+      bool seen = false;
+      for (IRBasicBlock* successor : successors)
+        seen |= successor == target;
+      if (seen)
+        continue;
+
+      successors.push_back(target);
+      cfg.predecessors[target].push_back(block);
+    }
+  }
+
+  std::unordered_set<IRBasicBlock const*> visited;
+  std::vector<IRBasicBlock*> postorder;
+  postorder_walk(&cfg, function->first_block, &visited, &postorder);
+  cfg.reverse_postorder.assign(postorder.rbegin(), postorder.rend());
+
+  return cfg;
+}
+
+bool block_is_reachable(ControlFlowGraph const* cfg, IRBasicBlock const* block)
+{
+  for (IRBasicBlock const* reachable : cfg->reverse_postorder)
+    if (reachable == block)
+      return true;
+  return false;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+//
+// iterate over the blocks in reverse postorder, setting each block's immediate
+// dominator to the nearest common ancestor of its already processed
+// predecessors, until nothing changes. For reducible graphs, which is all C
+// without goto can produce, this converges in two passes
+DominatorTree compute_dominator_tree(IRFunction* function, ControlFlowGraph const* cfg)
+{
+  DominatorTree tree;
+  tree.root = function->first_block;
+
+  std::unordered_map<IRBasicBlock const*, unsigned> rpo_index;
+  for (unsigned i = 0; i < cfg->reverse_postorder.size(); i++)
+    rpo_index[cfg->reverse_postorder[i]] = i;
+
+  std::unordered_map<IRBasicBlock const*, IRBasicBlock*>& idom = tree.immediate_dominator;
+  idom[tree.root] = tree.root;
+
+  auto intersect = [&](IRBasicBlock* a, IRBasicBlock* b) {
+    while (a != b) {
+      while (rpo_index[a] > rpo_index[b])
+        a = idom[a];
+      while (rpo_index[b] > rpo_index[a])
+        b = idom[b];
+    }
+    return a;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    for (IRBasicBlock* block : cfg->reverse_postorder) {
+      if (block == tree.root)
+        continue;
+
+      IRBasicBlock* new_idom = nullptr;
+      for (IRBasicBlock* predecessor : cfg->predecessors.at(block)) {
+        if (!idom.contains(predecessor))
+          continue;
+        new_idom = new_idom ? intersect(predecessor, new_idom) : predecessor;
+      }
+      assert(new_idom && "reachable block with no processed predecessor");
+
+      if (!idom.contains(block) || idom[block] != new_idom) {
+        idom[block] = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  for (IRBasicBlock* block : cfg->reverse_postorder)
+    if (block != tree.root)
+      tree.children[idom[block]].push_back(block);
+
+  return tree;
+}
+
+bool block_dominates(DominatorTree const* tree, IRBasicBlock const* dominator, IRBasicBlock const* block)
+{
+  if (!tree->immediate_dominator.contains(block))
+    return false;
+
+  for (;;) {
+    if (block == dominator)
+      return true;
+    if (block == tree->root)
+      return false;
+    block = tree->immediate_dominator.at(block);
+  }
+}
+
+LoopInfo compute_loop_info(ControlFlowGraph const* cfg, DominatorTree const* dominator_tree)
+{
+  LoopInfo loop_info;
+  std::unordered_map<IRBasicBlock const*, Loop*> loop_by_header;
+
+  for (IRBasicBlock* latch : cfg->reverse_postorder)
+    for (IRBasicBlock* header : cfg->successors.at(latch)) {
+      if (!block_dominates(dominator_tree, header, latch))
+        continue;
+
+      Loop*& loop = loop_by_header[header];
+      if (!loop) {
+        loop = new Loop;
+        loop->header = header;
+        loop->parent = nullptr;
+        loop->depth = 1;
+        loop->blocks.insert(header);
+        loop_info.loops.push_back(loop);
+      }
+      loop->latches.push_back(latch);
+
+      // walk backwards from the latch, the header is already in the set so the walk stops there
+      std::vector<IRBasicBlock*> worklist = { latch };
+      while (!worklist.empty()) {
+        IRBasicBlock* block = worklist.back();
+        worklist.pop_back();
+
+        if (!loop->blocks.insert(block).second)
+          continue;
+        // only reachable blocks are in the dominator tree
+        for (IRBasicBlock* predecessor : cfg->predecessors.at(block))
+          if (dominator_tree->immediate_dominator.contains(predecessor))
+            worklist.push_back(predecessor);
+      }
+    }
+
+  // two natural loops are either nested or disjoint, so the parent of a loop
+  // is the smallest other loop containing its header
+  std::sort(loop_info.loops.begin(), loop_info.loops.end(), [](Loop const* a, Loop const* b) { return a->blocks.size() < b->blocks.size(); });
+
+  for (size_t i = 0; i < loop_info.loops.size(); i++) {
+    Loop* loop = loop_info.loops[i];
+    for (size_t j = i + 1; j < loop_info.loops.size() && !loop->parent; j++)
+      if (loop_info.loops[j]->blocks.contains(loop->header))
+        loop->parent = loop_info.loops[j];
+  }
+
+  for (Loop* loop : loop_info.loops)
+    for (Loop* ancestor = loop->parent; ancestor; ancestor = ancestor->parent)
+      loop->depth++;
+
+  // smaller loops come first, so the first loop found for a block is the innermost
+  for (Loop* loop : loop_info.loops)
+    for (IRBasicBlock const* block : loop->blocks)
+      loop_info.innermost_loop.try_emplace(block, loop);
+
+  return loop_info;
+}
+
+IRBasicBlock* loop_preheader(Loop const* loop, ControlFlowGraph const* cfg)
+{
+  IRBasicBlock* preheader = nullptr;
+  for (IRBasicBlock* predecessor : cfg->predecessors.at(loop->header)) {
+    if (loop->blocks.contains(predecessor) || !block_is_reachable(cfg, predecessor))
+      continue;
+    if (preheader)
+      return nullptr;
+    preheader = predecessor;
+  }
+
+  if (!preheader || cfg->successors.at(preheader).size() != 1)
+    return nullptr;
+  return preheader;
+}
+
+std::unordered_set<IRValue const*> find_non_escaping_allocas(IRFunction const* function)
+{
+  std::unordered_set<IRValue const*> allocas;
+  std::unordered_set<IRValue const*> escaped;
+
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      if (instruction->opcode == IROpcode::Alloca)
+        allocas.insert(instruction->result);
+
+      // a volatile access has to happen as written, so a local accessed that
+      // way counts as escaping, which keeps every pass away from it
+      for (unsigned i = 0; i < instruction->operand_count; i++) {
+        bool is_address_operand = (instruction->opcode == IROpcode::Load && i == 0) || (instruction->opcode == IROpcode::Store && i == 1);
+        if (!is_address_operand || instruction->is_volatile)
+          escaped.insert(instruction->operands[i]);
+      }
+    }
+
+  for (IRValue const* value : escaped)
+    allocas.erase(value);
+
+  return allocas;
+}
+
+// Tarjan's strongly connected components algorithm. A component is complete
+// once the walk returns to its root, and by then every component it calls
+// into has been completed, so they come out bottom up
+struct TarjanState {
+  CallGraph* call_graph;
+  unsigned next_index;
+  std::unordered_map<IRFunction const*, unsigned> index;
+  std::unordered_map<IRFunction const*, unsigned> lowlink;
+  std::vector<IRFunction*> stack;
+  std::unordered_set<IRFunction const*> on_stack;
+};
+
+static void strong_connect(TarjanState* state, IRFunction* function)
+{
+  state->index[function] = state->lowlink[function] = state->next_index++;
+  state->stack.push_back(function);
+  state->on_stack.insert(function);
+
+  for (IRFunction* callee : state->call_graph->callees[function]) {
+    if (!state->index.contains(callee)) {
+      strong_connect(state, callee);
+      state->lowlink[function] = std::min(state->lowlink[function], state->lowlink[callee]);
+    } else if (state->on_stack.contains(callee)) {
+      state->lowlink[function] = std::min(state->lowlink[function], state->index[callee]);
+    }
+  }
+
+  if (state->lowlink[function] != state->index[function])
+    return;
+
+  unsigned component_index = state->call_graph->bottom_up_components.size();
+  std::vector<IRFunction*> component;
+  IRFunction* member;
+  do {
+    member = state->stack.back();
+    state->stack.pop_back();
+    state->on_stack.erase(member);
+    state->call_graph->component[member] = component_index;
+    component.push_back(member);
+  } while (member != function);
+
+  state->call_graph->bottom_up_components.push_back(component);
+}
+
+CallGraph compute_call_graph(IRModule* module)
+{
+  CallGraph call_graph;
+
+  for (IRFunction* function = module->first_function; function; function = function->next) {
+    std::vector<IRFunction*>* callees = &call_graph.callees[function];
+    for (IRBasicBlock* block = function->first_block; block; block = block->next)
+      for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next)
+        if (instruction->opcode == IROpcode::Call && !ir_function_is_declaration(instruction->callee)
+            && std::find(callees->begin(), callees->end(), instruction->callee) == callees->end())
+          callees->push_back(instruction->callee);
+  }
+
+  TarjanState state;
+  state.call_graph = &call_graph;
+  state.next_index = 0;
+  for (IRFunction* function = module->first_function; function; function = function->next)
+    if (!ir_function_is_declaration(function) && !state.index.contains(function))
+      strong_connect(&state, function);
+
+  return call_graph;
+}
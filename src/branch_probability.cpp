@@ -0,0 +1,272 @@
+#include "analysis.h"
+#include "profile.h"
+
+#include <cstdlib>
+#include <cstring>
+
+// static branch prediction, for the branches a profile says nothing about
+//
+// each conditional branch gets the weights of the first of Ball and Larus'
+// heuristics that applies to it, in the order they found worked best, with
+// the hit rates they measured as weights ("Branch Prediction for Free", PLDI
+// 1993). A branch none of them applies to gets even weights
+//
+//   noreturn: an edge to a block that can only end in unreachable, which is
+//   where calls to _Noreturn functions leave off, is as good as never taken.
+//   These get the weights LLVM gives such edges, not a percentage
+//
+//   loop branch: an edge back to the loop header, or one that stays in the
+//   loop when the other leaves it, is taken
+//
+//   pointer: two pointers are unlikely to be equal, which is how !p and
+//   p == q come out
+//
+//   opcode: an integer is unlikely to be equal to a constant, the == error
+//   check, or to be negative
+//
+//   return: an edge to a block that returns isn't taken, the early return
+//   after a failed check
+//
+//   loop header: an edge into a loop is taken
+//
+// Ball and Larus' call, store and guard heuristics need post dominators and
+// def-use information about variables, which the IR doesn't have
+//
+// a switch's targets get the noreturn, loop branch, return and loop header
+// heuristics, the first one that tells some of them from the others, with
+// its weights for taken and not taken. There's no comparison to go by, so
+// the pointer and opcode heuristics never apply, and a switch none of the
+// others apply to gets even weights for its default and every case
+
+static constexpr unsigned long long unreachable_taken_weight = 1;
+static constexpr unsigned long long unreachable_not_taken_weight = (1 << 20) - 1;
+
+static constexpr unsigned long long loop_branch_percent = 88;
+static constexpr unsigned long long pointer_percent = 60;
+static constexpr unsigned long long opcode_percent = 84;
+static constexpr unsigned long long return_percent = 72;
+static constexpr unsigned long long loop_header_percent = 75;
+
+// the weights of the true and the false edge
+struct Prediction {
+  unsigned long long true_weight;
+  unsigned long long false_weight;
+};
+
+// the edge to taken is taken percent of the time
+static Prediction predict(IRInstruction const* branch, IRBasicBlock const* taken, unsigned long long percent)
+{
+  if (branch->targets[0] == taken)
+    return { percent, 100 - percent };
+  return { 100 - percent, percent };
+}
+
+// following unconditional branches
+static bool only_reaches_unreachable(IRBasicBlock const* block)
+{
+  for (unsigned steps = 0; steps < 8; steps++) {
+    IRInstruction const* terminator = ir_block_terminator(block);
+    if (!terminator)
+      return false;
+    if (terminator->opcode == IROpcode::Unreachable)
+      return true;
+    if (terminator->opcode != IROpcode::Br)
+      return false;
+    block = terminator->targets[0];
+  }
+  return false;
+}
+
+static bool returns(IRBasicBlock const* block)
+{
+  IRInstruction const* terminator = ir_block_terminator(block);
+  return terminator && terminator->opcode == IROpcode::Ret;
+}
+
+// the block one of the targets is, if exactly one of them is
+static IRBasicBlock const* the_one_target(IRInstruction const* branch, bool (*is)(IRBasicBlock const*))
+{
+  bool first = is(branch->targets[0]);
+  bool second = is(branch->targets[1]);
+  if (first == second)
+    return nullptr;
+  return first ? branch->targets[0] : branch->targets[1];
+}
+
+static bool predict_noreturn(IRInstruction const* branch, Prediction* prediction)
+{
+  IRBasicBlock const* cold = the_one_target(branch, only_reaches_unreachable);
+  if (!cold)
+    return false;
+
+  if (branch->targets[0] == cold)
+    *prediction = { unreachable_taken_weight, unreachable_not_taken_weight };
+  else
+    *prediction = { unreachable_not_taken_weight, unreachable_taken_weight };
+  return true;
+}
+
+static bool predict_loop_branch(IRInstruction const* branch, LoopInfo const* loops, Prediction* prediction)
+{
+  if (!loops->innermost_loop.contains(branch->parent))
+    return false;
+  Loop const* loop = loops->innermost_loop.at(branch->parent);
+
+  for (unsigned i = 0; i < 2; i++) {
+    IRBasicBlock const* target = branch->targets[i];
+    IRBasicBlock const* other = branch->targets[1 - i];
+    bool back_edge = target == loop->header && other != loop->header;
+    bool stays = loop->blocks.contains(target) && !loop->blocks.contains(other);
+    if (back_edge || stays) {
+      *prediction = predict(branch, target, loop_branch_percent);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool predict_comparison(IRInstruction const* branch, Prediction* prediction)
+{
+  IRValue const* condition = branch->operands[0];
+  if (condition->kind != IRValueKind::Instruction || condition->instruction->opcode != IROpcode::ICmp)
+    return false;
+
+  IRInstruction const* comparison = condition->instruction;
+  IRValue const* rhs = comparison->operands[1];
+  bool is_pointer = strcmp(comparison->operands[0]->type, "ptr") == 0;
+
+  // how often the likelier way goes
+  unsigned long long percent;
+  bool is_true_likely;
+  if (is_pointer && (comparison->comparison == IRComparison::Eq || comparison->comparison == IRComparison::Ne)) {
+    percent = pointer_percent;
+    is_true_likely = comparison->comparison == IRComparison::Ne;
+  } else if (!is_pointer && rhs->kind == IRValueKind::Constant
+      && (comparison->comparison == IRComparison::Eq || comparison->comparison == IRComparison::Ne)) {
+    percent = opcode_percent;
+    is_true_likely = comparison->comparison == IRComparison::Ne;
+  } else if (!is_pointer && ir_value_is_constant(rhs, 0)) {
+    percent = opcode_percent;
+    switch (comparison->comparison) {
+    case IRComparison::Slt:
+    case IRComparison::Sle:
+      is_true_likely = false;
+      break;
+    case IRComparison::Sgt:
+    case IRComparison::Sge:
+      is_true_likely = true;
+      break;
+    default:
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  *prediction = predict(branch, branch->targets[is_true_likely ? 0 : 1], percent);
+  return true;
+}
+
+static bool predict_return(IRInstruction const* branch, Prediction* prediction)
+{
+  IRBasicBlock const* returning = the_one_target(branch, returns);
+  if (!returning)
+    return false;
+  *prediction = predict(branch, returning, 100 - return_percent);
+  return true;
+}
+
+// an edge from the block to target goes into a loop
+static bool enters_loop(LoopInfo const* loops, IRBasicBlock const* block, IRBasicBlock const* target)
+{
+  for (Loop const* loop : loops->loops)
+    if (loop->header == target && !loop->blocks.contains(block))
+      return true;
+  return false;
+}
+
+static bool predict_loop_header(IRInstruction const* branch, LoopInfo const* loops, Prediction* prediction)
+{
+  bool first = enters_loop(loops, branch->parent, branch->targets[0]);
+  bool second = enters_loop(loops, branch->parent, branch->targets[1]);
+  if (first == second)
+    return false;
+  *prediction = predict(branch, branch->targets[first ? 0 : 1], loop_header_percent);
+  return true;
+}
+
+static Prediction predict_branch(IRInstruction const* branch, LoopInfo const* loops)
+{
+  Prediction prediction;
+  if (predict_noreturn(branch, &prediction) || predict_loop_branch(branch, loops, &prediction) || predict_comparison(branch, &prediction)
+      || predict_return(branch, &prediction) || predict_loop_header(branch, loops, &prediction))
+    return prediction;
+
+  // nothing to go by
+  return { 1, 1 };
+}
+
+// the targets of a switch the test picks out get one weight and the others
+// the other, unless it picks out all of them or none
+template <typename Test>
+static bool weigh_targets(IRInstruction const* terminator, Test is_picked, unsigned long long picked_weight, unsigned long long other_weight,
+    unsigned long long* weights)
+{
+  unsigned picked = 0;
+  for (unsigned i = 0; i < terminator->target_count; i++)
+    picked += is_picked(terminator->targets[i]);
+  if (picked == 0 || picked == terminator->target_count)
+    return false;
+
+  for (unsigned i = 0; i < terminator->target_count; i++)
+    weights[i] = is_picked(terminator->targets[i]) ? picked_weight : other_weight;
+  return true;
+}
+
+static void predict_switch(IRInstruction const* terminator, LoopInfo const* loops, unsigned long long* weights)
+{
+  Loop const* loop = loops->innermost_loop.contains(terminator->parent) ? loops->innermost_loop.at(terminator->parent) : nullptr;
+  auto stays_in_loop = [&](IRBasicBlock const* target) { return loop && loop->blocks.contains(target); };
+  auto enters = [&](IRBasicBlock const* target) { return enters_loop(loops, terminator->parent, target); };
+
+  if (weigh_targets(terminator, only_reaches_unreachable, unreachable_taken_weight, unreachable_not_taken_weight, weights)
+      || weigh_targets(terminator, stays_in_loop, loop_branch_percent, 100 - loop_branch_percent, weights)
+      || weigh_targets(terminator, returns, 100 - return_percent, return_percent, weights)
+      || weigh_targets(terminator, enters, loop_header_percent, 100 - loop_header_percent, weights))
+    return;
+
+  // nothing to go by
+  for (unsigned i = 0; i < terminator->target_count; i++)
+    weights[i] = 1;
+}
+
+void estimate_branch_weights(IRModule* module)
+{
+  for (IRFunction* function = module->first_function; function; function = function->next) {
+    if (ir_function_is_declaration(function))
+      continue;
+
+    ControlFlowGraph cfg = compute_control_flow_graph(function);
+    DominatorTree dominators = compute_dominator_tree(function, &cfg);
+    LoopInfo loops = compute_loop_info(&cfg, &dominators);
+
+    for (IRBasicBlock* block = function->first_block; block; block = block->next) {
+      IRInstruction* terminator = ir_block_terminator(block);
+      if (!terminator || terminator->branch_weights)
+        continue;
+
+      if (terminator->opcode == IROpcode::Switch) {
+        terminator->branch_weights = (unsigned long long*)malloc(terminator->target_count * sizeof(unsigned long long));
+        predict_switch(terminator, &loops, terminator->branch_weights);
+        continue;
+      }
+      if (terminator->opcode != IROpcode::CondBr)
+        continue;
+
+      Prediction prediction = predict_branch(terminator, &loops);
+      terminator->branch_weights = (unsigned long long*)malloc(2 * sizeof(unsigned long long));
+      terminator->branch_weights[0] = prediction.true_weight;
+      terminator->branch_weights[1] = prediction.false_weight;
+    }
+  }
+}
@@ -1,9 +1,25 @@
+#include "codegen.h"
+#include "ir.h"
+#include "optimize.h"
 #include "parser.h"
+#include "profile.h"
 #include "type.h"
+#include "x86_64.h"
 
 #include <cassert>
+#include <climits>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
-using IdentifierMap = std::unordered_map<std::string, unsigned>;
+// codegen lowers the AST into the IR structs from ir.h, one function at a
+// time, and the printer in ir.cpp turns those into LLVM text
+//
+// the lowering is deliberately naive, the way clang's is at -O0. Every local
+// variable, parameters included, lives in an alloca, every read of a variable
+// is a load and every write is a store. Cleaning that up is the middle end's
+// job, see optimize.cpp
 
 static void error_and_stop(char const* message)
 {
@@ -11,17 +27,6 @@ static void error_and_stop(char const* message)
   exit(1);
 }
 
-static char const* print_numeric_literal_as_string(FILE* outfile, ASTNode const* ast_node)
-{
-  assert(ast_node->type == ASTNodeType::NumericConstant);
-  switch (ast_node->data_type) {
-  case FundamentalType::Int:
-    fprintf(outfile, "%d", ast_node->data_as.int_data);
-  default:
-    assert(false);
-  }
-}
-
 static char const* type_to_string(Type const* type)
 {
   switch (type->fundamental_type) {
@@ -57,6 +62,10 @@ static char const* type_to_string(Type const* type)
   case FundamentalType::Bool:
     return "i1";
 
+  // opaque pointers, https://llvm.org/docs/OpaquePointers.html
+  case FundamentalType::Pointer:
+    return "ptr";
+
     // FIXME incomplete
   case FundamentalType::FloatComplex:
   case FundamentalType::DoubleComplex:
@@ -66,7 +75,6 @@ static char const* type_to_string(Type const* type)
   case FundamentalType::Enum:
   case FundamentalType::EnumeratedValue:
   case FundamentalType::TypedefName:
-  case FundamentalType::Pointer:
   case FundamentalType::Function:
   default:
     assert(false && "emitting code for this type not implemented\n");
@@ -74,156 +82,1471 @@ static char const* type_to_string(Type const* type)
   }
 }
 
-static void emit_code_from_node(ASTNode const* ast_node, FILE* outfile, IdentifierMap& identifier_map, unsigned* count)
+static bool is_unsigned_type(Type const* type)
 {
-  switch (ast_node->type) {
+  switch (type->fundamental_type) {
+  case FundamentalType::Bool:
+  case FundamentalType::UnsignedChar:
+  case FundamentalType::UnsignedShort:
+  case FundamentalType::UnsignedInt:
+  case FundamentalType::UnsignedLong:
+  case FundamentalType::UnsignedLongLong:
+    return true;
+  default:
+    return false;
+  }
+}
 
-  case ASTNodeType::Void:
-    return;
+// 6.3.1.1, the rank of the integer types, used in the usual arithmetic conversions
+static int integer_conversion_rank(Type const* type)
+{
+  switch (type->fundamental_type) {
+  case FundamentalType::Bool:
+    return 0;
+  case FundamentalType::Char:
+  case FundamentalType::SignedChar:
+  case FundamentalType::UnsignedChar:
+    return 1;
+  case FundamentalType::Short:
+  case FundamentalType::UnsignedShort:
+    return 2;
+  case FundamentalType::Int:
+  case FundamentalType::UnsignedInt:
+  case FundamentalType::EnumeratedValue:
+    return 3;
+  case FundamentalType::Long:
+  case FundamentalType::UnsignedLong:
+    return 4;
+  case FundamentalType::LongLong:
+  case FundamentalType::UnsignedLongLong:
+    return 5;
+  default:
+    assert(false && "integer conversion rank of a non integer type");
+    return 0;
+  }
+}
 
-  case ASTNodeType::NumericConstant:
-    print_numeric_literal_as_string(outfile, ast_node);
-    return;
+// a value together with the C type it has, the IR type alone doesn't say
+// whether an i32 is signed
+struct TypedValue {
+  IRValue* value;
+  Type const* type;
+};
 
-  case ASTNodeType::VariableReference:
-    if (!identifier_map.contains(ast_node->referenced_variable))
-      error_and_stop("Local variable not found in this identifier map\n");
+struct LoopTargets {
+  IRBasicBlock* break_target;
+  IRBasicBlock* continue_target;
+};
 
-    fprintf(outfile, "%%%d", identifier_map.at(ast_node->referenced_variable));
-    return;
+struct SwitchCases {
+  // the promoted type of the condition, which case values are converted to
+  Type const* condition_type;
 
-  case ASTNodeType::Declaration: {
-    // a declaration is a series of "int x = 3"s or whatever
-    // this requires us to put these new variables on the stack in accord with their type
-    // then potentially initialize them
-    //
-    // variables are put on the LLVM stack using the alloca instruction
-    // https://www.llvm.org/docs/LangRef.html#alloca-instruction
-    //
-    // alloca returns a pointer to the requested type, then the initialization can be done using loads and stores
-    // https://www.llvm.org/docs/LangRef.html#store-instruction
-    // a store's semantics are, in short, "store <type> <value>, ptr <ptr>"
-    Object* current_object = ast_node->object;
-    assert(current_object && "Emitting code for declaration with null object");
+  std::vector<long long> values;
+  std::vector<IRBasicBlock*> targets;
+  std::unordered_set<long long> seen_values;
+  IRBasicBlock* default_target;
 
-    identifier_map[current_object->identifier] = *count;
-    fprintf(outfile, "  %%%u = alloca %s\n", *count++, type_to_string(current_object->type));
+  // the block of the latest label, which labels right after it share
+  IRBasicBlock* label_block;
+};
 
-    // node has an initializer
-    if (ast_node->rhs) { }
+struct FunctionLowering {
+  IRBuilder builder;
+  Object const* function_object;
+  Type const* return_type;
+
+  // locals are looked up through the scope of the referencing node, so they
+  // are keyed by the declaring object. Parameters aren't in any scope, so
+  // they are keyed by name
+  std::unordered_map<Object const*, IRValue*> local_variables;
+  std::unordered_map<std::string, TypedValue> parameters;
+
+  // where break and continue go in the innermost loop or switch being
+  // lowered. A switch only changes where break goes
+  std::vector<LoopTargets> loop_targets;
+
+  // the labels found so far in each switch being lowered, innermost last
+  std::vector<SwitchCases> switches;
+
+  // every function declared or defined in the translation unit, by name
+  std::unordered_map<std::string, IRFunction*> const* functions;
+
+  // see ModuleLowering::globals, null to look in the global scope
+  std::unordered_map<std::string, Object*> const* globals;
+};
+
+static TypedValue lower_expression(FunctionLowering*, ASTNode const*);
+static void lower_statements(FunctionLowering*, ASTNode const*);
+
+static IRValue* constant_from_numeric_node(ASTNode const* ast_node, char const* ir_type)
+{
+  assert(ast_node->type == ASTNodeType::NumericConstant);
+  switch (ast_node->data_type) {
+  case FundamentalType::Int:
+    return ir_constant(ir_type, ast_node->data_as.int_data);
+  case FundamentalType::UnsignedInt:
+    return ir_constant(ir_type, ast_node->data_as.unsigned_int_data);
+  case FundamentalType::Long:
+    return ir_constant(ir_type, ast_node->data_as.long_data);
+  case FundamentalType::LongLong:
+    return ir_constant(ir_type, ast_node->data_as.long_long_data);
+  case FundamentalType::UnsignedLongLong:
+    return ir_constant(ir_type, (long long)ast_node->data_as.unsigned_long_long_data);
+  default:
+    assert(false && "emitting numeric constant of this type not implemented");
+    return nullptr;
   }
-    return;
+}
 
-  case ASTNodeType::Return:
-    // FIXME what register to return?
-    assert(ast_node->scope->return_type && "codegen for return statement with no return type");
-    fprintf(outfile, "  ret %s %%%d\n", type_to_string(ast_node->scope->return_type), 0);
-    return;
+static unsigned integer_bit_width(char const* ir_type)
+{
+  assert(ir_type[0] == 'i');
+  return (unsigned)atoi(ir_type + 1);
+}
+
+// 6.3.1.3 integer conversions
+// constants are converted on the spot rather than with a cast instruction
+static TypedValue convert(FunctionLowering* lowering, TypedValue from, Type const* to)
+{
+  char const* from_ir_type = from.value->type;
+  char const* to_ir_type = type_to_string(to);
+
+  // FIXME: void pointers and qualifiers aren't checked
+  bool from_pointer = from.type->fundamental_type == FundamentalType::Pointer;
+  bool to_pointer = to->fundamental_type == FundamentalType::Pointer;
+  if (from_pointer && to_pointer)
+    return { from.value, to };
+  if (from_pointer || to_pointer)
+    error_and_stop("Conversions between pointers and integers are not supported\n");
+
+  if (!is_integer_type(to->fundamental_type) && to->fundamental_type != FundamentalType::Bool)
+    assert(false && "conversion to non integer types not implemented");
+
+  unsigned from_width = integer_bit_width(from_ir_type);
+  unsigned to_width = integer_bit_width(to_ir_type);
+
+  if (from.value->kind == IRValueKind::Constant) {
+    long long value = from.value->constant;
+    if (to_width < 64) {
+      long long mask = (1ll << to_width) - 1;
+      value &= mask;
+      if (!is_unsigned_type(to) && to_width > 1 && (value >> (to_width - 1)))
+        value |= ~mask;
+    }
+    return { ir_constant(to_ir_type, value), to };
+  }
+
+  if (from_width == to_width)
+    return { from.value, to };
+
+  if (from_width > to_width)
+    return { ir_build_cast(&lowering->builder, IROpcode::Trunc, from.value, to_ir_type), to };
+
+  IROpcode extension = is_unsigned_type(from.type) ? IROpcode::ZExt : IROpcode::SExt;
+  return { ir_build_cast(&lowering->builder, extension, from.value, to_ir_type), to };
+}
+
+// 6.3.1.1 integer promotions, anything smaller than an int becomes an int
+static Type const* promoted_type(Type const* type)
+{
+  if (integer_conversion_rank(type) < integer_conversion_rank(IntType))
+    return IntType;
+  return type;
+}
+
+// 6.3.1.8 usual arithmetic conversions, for integers only so far
+static Type const* common_type(Type const* left, Type const* right)
+{
+  left = promoted_type(left);
+  right = promoted_type(right);
+
+  if (left == right)
+    return left;
+
+  int left_rank = integer_conversion_rank(left);
+  int right_rank = integer_conversion_rank(right);
+
+  if (left_rank == right_rank)
+    return is_unsigned_type(left) ? left : right;
+
+  return left_rank > right_rank ? left : right;
+}
+
+// 6.7.3 an access to a volatile object has to happen exactly as written, which
+// LLVM's volatile loads and stores promise
+static bool is_volatile_type(Type const* type) { return type->declaration_specifier_flags.flags & TypeModifierFlag::Volatile; }
+
+// 6.5p7 an object may only be accessed as its own type, give or take
+// signedness and qualifiers, or as a character type. That's the tree LLVM's
+// type based alias analysis wants: char at the top, aliasing everything, and
+// each type below it, so e.g. storing to an int* can't change a short
+//
+// pointers are told apart by what they point to, counting the levels, so an
+// int** is "p2 int". void* can hold any of them, so it's their parent
+static IRTBAAType const* tbaa_type(Type const* type)
+{
+  IRTBAAType const* omnipotent_char = ir_tbaa_omnipotent_char();
+
+  switch (type->fundamental_type) {
+  case FundamentalType::Char:
+  case FundamentalType::SignedChar:
+  case FundamentalType::UnsignedChar:
+    return omnipotent_char;
+  case FundamentalType::Short:
+  case FundamentalType::UnsignedShort:
+    return ir_tbaa_type("short", omnipotent_char);
+  case FundamentalType::Int:
+  case FundamentalType::UnsignedInt:
+    return ir_tbaa_type("int", omnipotent_char);
+  case FundamentalType::Long:
+  case FundamentalType::UnsignedLong:
+    return ir_tbaa_type("long", omnipotent_char);
+  case FundamentalType::LongLong:
+  case FundamentalType::UnsignedLongLong:
+    return ir_tbaa_type("long long", omnipotent_char);
+  case FundamentalType::Bool:
+    return ir_tbaa_type("_Bool", omnipotent_char);
+  case FundamentalType::Float:
+    return ir_tbaa_type("float", omnipotent_char);
+  case FundamentalType::Double:
+    return ir_tbaa_type("double", omnipotent_char);
+  case FundamentalType::LongDouble:
+    return ir_tbaa_type("long double", omnipotent_char);
+
+  case FundamentalType::Pointer: {
+    IRTBAAType const* any_pointer = ir_tbaa_type("any pointer", omnipotent_char);
+    unsigned depth = 0;
+    while (type->fundamental_type == FundamentalType::Pointer) {
+      type = type->pointed_type;
+      depth++;
+    }
+    if (type->fundamental_type == FundamentalType::Void)
+      return any_pointer;
+    std::string name = "p" + std::to_string(depth) + " " + tbaa_type(type)->name;
+    return ir_tbaa_type(name.c_str(), any_pointer);
+  }
+
+  // FIXME: nothing else can be loaded or stored yet, char is always safe
+  default:
+    return omnipotent_char;
+  }
+}
+
+static IRValue* load_object(FunctionLowering* lowering, Type const* type, IRValue* address)
+{
+  IRValue* value = ir_build_load(&lowering->builder, type_to_string(type), address);
+  value->instruction->is_volatile = is_volatile_type(type);
+  value->instruction->tbaa_type = tbaa_type(type);
+  return value;
+}
+
+static void store_object(FunctionLowering* lowering, IRValue* value, Type const* type, IRValue* address)
+{
+  ir_build_store(&lowering->builder, value, address);
+  lowering->builder.insertion_block->last_instruction->is_volatile = is_volatile_type(type);
+  lowering->builder.insertion_block->last_instruction->tbaa_type = tbaa_type(type);
+}
+
+// the innermost local of the name, or the global. Codegen sees every global
+// declared so far, or in the whole file once the parser is done, even ones
+// a deferred body's scope hides. See lower_external_declaration
+static Object* find_object(FunctionLowering const* lowering, std::string const& name, Scope* scope)
+{
+  for (; scope && scope->parent_scope; scope = scope->parent_scope)
+    if (auto object = scope->variables.find(name); object != scope->variables.end())
+      return object->second;
+  if (!lowering->globals)
+    return variable_in_scope(name, scope);
+
+  auto global = lowering->globals->find(name);
+  return global != lowering->globals->end() ? global->second : nullptr;
+}
+
+static IRValue* variable_address(FunctionLowering* lowering, ASTNode const* ast_node, Type const** type)
+{
+  Object* object = find_object(lowering, ast_node->referenced_variable, ast_node->scope);
+  if (object && lowering->local_variables.contains(object)) {
+    *type = object->type;
+    return lowering->local_variables.at(object);
+  }
+
+  if (lowering->parameters.contains(ast_node->referenced_variable)) {
+    TypedValue const& parameter = lowering->parameters.at(ast_node->referenced_variable);
+    *type = parameter.type;
+    return parameter.value;
+  }
+
+  error_and_stop("Local variable not found in this scope\n");
+  return nullptr;
+}
+
+static IROpcode binary_opcode(ASTNodeType node_type, bool is_unsigned)
+{
+  switch (node_type) {
   case ASTNodeType::Multiplication:
+    return IROpcode::Mul;
   case ASTNodeType::Division:
+    return is_unsigned ? IROpcode::UDiv : IROpcode::SDiv;
   case ASTNodeType::Modulo:
-  case ASTNodeType::Addition:
+    return is_unsigned ? IROpcode::URem : IROpcode::SRem;
   // https://www.llvm.org/docs/LangRef.html#add-instruction
   // FIXME: Worry about wrap around
+  case ASTNodeType::Addition:
+    return IROpcode::Add;
   case ASTNodeType::Subtraction:
+    return IROpcode::Sub;
   case ASTNodeType::BitShiftLeft:
+    return IROpcode::Shl;
   case ASTNodeType::BitShiftRight:
+    return is_unsigned ? IROpcode::LShr : IROpcode::AShr;
+  case ASTNodeType::BitwiseAnd:
+    return IROpcode::And;
+  case ASTNodeType::BitwiseXor:
+    return IROpcode::Xor;
+  case ASTNodeType::BitwiseOr:
+    return IROpcode::Or;
+  default:
+    assert(false && "binary_opcode got a non arithmetic node");
+    return IROpcode::Add;
+  }
+}
+
+static IRComparison comparison_predicate(ASTNodeType node_type, bool is_unsigned)
+{
+  switch (node_type) {
   case ASTNodeType::GreaterThan:
+    return is_unsigned ? IRComparison::Ugt : IRComparison::Sgt;
   case ASTNodeType::GreaterThanOrEqualTo:
+    return is_unsigned ? IRComparison::Uge : IRComparison::Sge;
   case ASTNodeType::LessThan:
+    return is_unsigned ? IRComparison::Ult : IRComparison::Slt;
   case ASTNodeType::LessThanOrEqualTo:
+    return is_unsigned ? IRComparison::Ule : IRComparison::Sle;
   case ASTNodeType::EqualityComparison:
+    return IRComparison::Eq;
   case ASTNodeType::InequalityComparison:
-  case ASTNodeType::BitwiseAnd:
-  case ASTNodeType::BitwiseXor:
-  case ASTNodeType::BitwiseOr:
-  case ASTNodeType::LogicalAnd:
-  case ASTNodeType::LogicalOr:
-  case ASTNodeType::ConditionalExpression:
-  case ASTNodeType::Assignment:
-  case ASTNodeType::If:
-  case ASTNodeType::Switch:
-  case ASTNodeType::For:
-    assert(false && "emitting code not implemented");
+    return IRComparison::Ne;
+  default:
+    assert(false && "comparison_predicate got a non comparison node");
+    return IRComparison::None;
   }
 }
 
-// https://llvm.org/docs/LangRef.html#functions
-// LLVM function definitions begin with the line
-// define [linkage] [other stuff] <ResultType> @<FunctionName>([argument list]) [other stuff] { basic blocks }
-// this function does that first line only
-static void function_definition_signature(Object const* function_object, FILE* outfile)
+static TypedValue lower_binary_expression(FunctionLowering* lowering, ASTNode const* ast_node)
 {
-  FunctionData const* function_data = function_object->type->function_data;
-  fprintf(outfile, "define");
+  TypedValue lhs = lower_expression(lowering, ast_node->lhs);
+  TypedValue rhs = lower_expression(lowering, ast_node->rhs);
 
-  if (function_data->return_type->declaration_specifier_flags.flags & TypeModifierFlag::Static)
-    fprintf(outfile, " internal");
+  // 6.5.7 the type of a shift is the promoted left operand, the right one doesn't matter
+  bool is_shift = ast_node->type == ASTNodeType::BitShiftLeft || ast_node->type == ASTNodeType::BitShiftRight;
+  Type const* operation_type = is_shift ? promoted_type(lhs.type) : common_type(lhs.type, rhs.type);
 
-  // room for other stuff
+  lhs = convert(lowering, lhs, operation_type);
+  rhs = convert(lowering, rhs, operation_type);
 
-  fprintf(outfile, " %s", type_to_string(function_data->return_type));
-  fprintf(outfile, " @%s(", function_object->identifier.c_str());
+  IROpcode opcode = binary_opcode(ast_node->type, is_unsigned_type(operation_type));
+  return { ir_build_binary(&lowering->builder, opcode, lhs.value, rhs.value), operation_type };
+}
 
-  unsigned count = 0;
-  for (FunctionParameter const* current_param = function_data->parameter_list; current_param; current_param = current_param->next_parameter) {
-    if (current_param->identifier == "")
-      error_and_stop("Function definition parameters must have identifiers");
+// 6.5.2.1 a[i] is *(a + i), so i[a] works too. The index is extended to 64
+// bits for the getelementptr, by its own signedness
+static IRValue* subscript_address(FunctionLowering* lowering, ASTNode const* ast_node, Type const** type)
+{
+  TypedValue base = lower_expression(lowering, ast_node->lhs);
+  TypedValue index = lower_expression(lowering, ast_node->rhs);
+  if (index.type->fundamental_type == FundamentalType::Pointer)
+    std::swap(base, index);
 
-    fprintf(outfile, "%s %%%d", type_to_string(current_param->parameter_type), count++);
+  if (base.type->fundamental_type != FundamentalType::Pointer || !is_integer_type(index.type->fundamental_type))
+    error_and_stop("Subscripted value is not a pointer\n");
 
-    if (current_param->next_parameter)
-      fprintf(outfile, ", ");
-  }
-  fprintf(outfile, ")");
+  *type = base.type->pointed_type;
+  index = convert(lowering, index, is_unsigned_type(index.type) ? UnsignedLongLongType : LongLongType);
+  return ir_build_getelementptr(&lowering->builder, type_to_string(*type), base.value, index.value);
+}
+
+// the only lvalues so far are variables and subscripts
+static IRValue* lvalue_address(FunctionLowering* lowering, ASTNode const* ast_node, Type const** type)
+{
+  if (ast_node->type == ASTNodeType::ArraySubscript)
+    return subscript_address(lowering, ast_node, type);
+  if (ast_node->type != ASTNodeType::VariableReference)
+    error_and_stop("Expression is not assignable\n");
+  return variable_address(lowering, ast_node, type);
+}
 
-  // room for other stuff maybe
+// 6.5.16.1 the value of an assignment is the value stored, converted to the type of the lhs
+static TypedValue lower_assignment(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  Type const* type;
+  IRValue* address = lvalue_address(lowering, ast_node->lhs, &type);
 
-  fprintf(outfile, "{\n");
+  TypedValue value = convert(lowering, lower_expression(lowering, ast_node->rhs), type);
+  store_object(lowering, value.value, type, address);
+  return value;
 }
 
-// this gets appended to the function definition, which ends with {\n
-// in C, the function body is a compound statment, so we just need to emit code corresponding to a compound statement
-static void emit_function_body(Object const* function_object, FILE* outfile)
+// 6.5.2.4 and 6.5.3.1, ++x is x += 1 and evaluates to the new value, x++
+// evaluates to the old one
+static TypedValue lower_increment(FunctionLowering* lowering, ASTNode const* ast_node)
 {
-  assert(function_object->function_body);
-  assert(function_object->type->function_data->return_type);
+  Type const* type;
+  IRValue* address = lvalue_address(lowering, ast_node->lhs, &type);
 
-  // begin the function definition with the "entry" basic block
-  fprintf(outfile, "entry:\n");
+  TypedValue old_value = { load_object(lowering, type, address), type };
+  TypedValue promoted = convert(lowering, old_value, promoted_type(type));
 
-  IdentifierMap identifier_map;
-  unsigned count = 0;
-  for (FunctionParameter const* current_param = function_object->type->function_data->parameter_list; current_param != nullptr;
-       current_param = current_param->next_parameter)
-    identifier_map[current_param->identifier] = count++;
-  printf("emittinf body\n");
+  bool is_increment = ast_node->type == ASTNodeType::PreIncrement || ast_node->type == ASTNodeType::PostIncrement;
+  IROpcode opcode = is_increment ? IROpcode::Add : IROpcode::Sub;
+  TypedValue sum = { ir_build_binary(&lowering->builder, opcode, promoted.value, ir_constant(promoted.value->type, 1)), promoted.type };
+
+  TypedValue new_value = convert(lowering, sum, type);
+  store_object(lowering, new_value.value, type, address);
+
+  bool is_prefix = ast_node->type == ASTNodeType::PreIncrement || ast_node->type == ASTNodeType::PreDecrement;
+  return is_prefix ? new_value : old_value;
+}
+
+// 6.5.2.2 arguments are converted to the parameter types as if by
+// assignment. Arguments past the end of a variadic function's parameters just
+// get the integer promotions
+static TypedValue lower_function_call(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  ASTNode const* callee_node = ast_node->lhs;
+  if (callee_node->type != ASTNodeType::VariableReference)
+    error_and_stop("Only calls to named functions are supported\n");
+
+  Object const* callee_object = find_object(lowering, callee_node->referenced_variable, callee_node->scope);
+  if (!callee_object || callee_object->type->fundamental_type != FundamentalType::Function)
+    error_and_stop("Called object is not a function\n");
+
+  IRFunction* callee = lowering->functions->at(callee_object->identifier);
+  FunctionData const* function_data = callee_object->type->function_data;
 
-  for (ASTNode const* current_ast_node = function_object->function_body; current_ast_node; current_ast_node = current_ast_node->next) {
-    emit_code_from_node(current_ast_node, outfile, identifier_map, &count);
+  std::vector<IRValue*> arguments;
+  FunctionParameter const* parameter = function_data->parameter_list;
+  for (ASTNode const* argument_node = ast_node->arguments; argument_node; argument_node = argument_node->next) {
+    TypedValue argument = lower_expression(lowering, argument_node);
+
+    if (parameter) {
+      argument = convert(lowering, argument, parameter->parameter_type);
+      parameter = parameter->next_parameter;
+    } else if (function_data->is_variadic) {
+      argument = convert(lowering, argument, promoted_type(argument.type));
+    } else {
+      error_and_stop("Too many arguments in function call\n");
+    }
+
+    arguments.push_back(argument.value);
+  }
+
+  if (parameter)
+    error_and_stop("Too few arguments in function call\n");
+
+  IRValue* result = ir_build_call(&lowering->builder, callee, arguments.data(), arguments.size());
+
+  // 6.7.4 a _Noreturn function never returns, so nothing after the call
+  // runs. The rest of the expression goes in a block that gets deleted
+  if (callee->is_noreturn) {
+    ir_build_unreachable(&lowering->builder);
+    lowering->builder.insertion_block = insert_ir_basic_block_after(lowering->builder.insertion_block, "dead");
   }
+
+  return { result, function_data->return_type };
 }
 
-static void emit_function_definition(ExternalDeclaration const* function_declaration, FILE* outfile)
+// LLVM requires this of musttail. Variadic functions are left out, since
+// musttail needs the caller variadic exactly when the callee is
+static bool have_same_prototype(IRFunction const* caller, IRFunction const* callee)
 {
-  assert(function_declaration->type == ExternalDeclarationType::FunctionDefinition);
-  ASTNode const* head_node = function_declaration->root_ast_node;
-  Object const* function_object = head_node->object;
+  if (caller->object->type->function_data->is_variadic || callee->object->type->function_data->is_variadic)
+    return false;
+  if (strcmp(caller->return_type, callee->return_type) != 0 || caller->argument_count != callee->argument_count)
+    return false;
+  for (unsigned i = 0; i < caller->argument_count; i++)
+    if (strcmp(caller->arguments[i]->type, callee->arguments[i]->type) != 0)
+      return false;
+  return true;
+}
+
+// 6.8.6.4 return f(...) is a tail call when the value f returns is returned
+// as is, without a conversion in between. Mutually recursive functions that
+// call each other this way then run in constant stack, see
+// remove_tail_calls_if_allocas_escape for the other condition
+static void mark_tail_call(FunctionLowering* lowering, ASTNode const* returned, IRValue* value)
+{
+  if (returned->type != ASTNodeType::FunctionCall || !value || value->kind != IRValueKind::Instruction)
+    return;
 
-  function_definition_signature(function_object, outfile);
-  emit_function_body(function_object, outfile);
+  IRInstruction* call = value->instruction;
+  if (call->opcode != IROpcode::Call || call->callee->is_noreturn)
+    return;
 
-  fprintf(outfile, "}\n");
+  bool is_must_tail = have_same_prototype(lowering->builder.function, call->callee);
+  call->tail_call_kind = is_must_tail ? IRTailCallKind::MustTail : IRTailCallKind::Tail;
 }
 
-void emit_llvm_from_translation_unit(ExternalDeclaration const* external_declaration, FILE* outfile)
+// comparisons produce an i1 in LLVM but an int in C, the i1 is extended to an
+// int where the value is used as one
+static IRValue* lower_comparison(FunctionLowering* lowering, ASTNode const* ast_node)
 {
-  for (ExternalDeclaration const* current_declaration = external_declaration; current_declaration; current_declaration = current_declaration->next) {
-    switch (current_declaration->type) {
-    case ExternalDeclarationType::Declaration:
-      assert(false && "codegen for declarations not implemented\n");
-    case ExternalDeclarationType::FunctionDefinition:
-      emit_function_definition(current_declaration, outfile);
-    }
+  TypedValue lhs = lower_expression(lowering, ast_node->lhs);
+  TypedValue rhs = lower_expression(lowering, ast_node->rhs);
+
+  Type const* operation_type = common_type(lhs.type, rhs.type);
+  lhs = convert(lowering, lhs, operation_type);
+  rhs = convert(lowering, rhs, operation_type);
+
+  IRComparison predicate = comparison_predicate(ast_node->type, is_unsigned_type(operation_type));
+  return ir_build_icmp(&lowering->builder, predicate, lhs.value, rhs.value);
+}
+
+static bool is_comparison(ASTNodeType node_type)
+{
+  switch (node_type) {
+  case ASTNodeType::GreaterThan:
+  case ASTNodeType::GreaterThanOrEqualTo:
+  case ASTNodeType::LessThan:
+  case ASTNodeType::LessThanOrEqualTo:
+  case ASTNodeType::EqualityComparison:
+  case ASTNodeType::InequalityComparison:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// &&, ||, ! and ?:
+//
+// where they decide a branch, && and || are lowered straight to branches,
+// each operand branching to wherever the whole condition would go once it's
+// decided. if (a < b && !c) is
+//
+//     %1 = icmp slt i32 %a, %b
+//     br i1 %1, label %land.rhs, label %if.else
+//   land.rhs:
+//     %2 = icmp eq i32 %c, 0
+//     br i1 %2, label %if.then, label %if.else
+//
+// rather than turning each comparison into an int, combining those and
+// comparing the result against 0. Where the value is needed, e.g. x = a && b,
+// the operand C might not evaluate is evaluated anyway if that's cheap and
+// can't go wrong, and a select picks the result. Otherwise it's branches and
+// a temporary, as there are no phis
+
+// computing an operand that might not have run unconditionally is worth it up
+// to a few instructions, the same budget as SimplifyCFG's when it turns
+// branches into selects. Variables are loads here, so each counts as one
+static constexpr unsigned cannot_speculate = UINT_MAX;
+static constexpr unsigned maximum_speculation_cost = 4;
+
+static unsigned add_speculation_costs(unsigned a, unsigned b) { return a == cannot_speculate || b == cannot_speculate ? cannot_speculate : a + b; }
+
+// roughly how many instructions ast_node is, or cannot_speculate if running it
+// when C wouldn't could change what the program does. Calls, assignments and
+// increments have side effects, division by zero traps, volatile accesses
+// have to happen as written, and a subscript's pointer may be what the
+// condition checks, as in p && p[0]
+static unsigned speculation_cost(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  switch (ast_node->type) {
+  case ASTNodeType::NumericConstant:
+    return 0;
+
+  case ASTNodeType::VariableReference: {
+    Type const* type;
+    variable_address(lowering, ast_node, &type);
+    return is_volatile_type(type) ? cannot_speculate : 1;
+  }
+
+  case ASTNodeType::LogicalNot:
+    return add_speculation_costs(1, speculation_cost(lowering, ast_node->lhs));
+
+  case ASTNodeType::ConditionalExpression:
+    return add_speculation_costs(speculation_cost(lowering, ast_node->conditional),
+        add_speculation_costs(1, add_speculation_costs(speculation_cost(lowering, ast_node->lhs), speculation_cost(lowering, ast_node->rhs))));
+
+  case ASTNodeType::Multiplication:
+  case ASTNodeType::Addition:
+  case ASTNodeType::Subtraction:
+  case ASTNodeType::BitShiftLeft:
+  case ASTNodeType::BitShiftRight:
+  case ASTNodeType::BitwiseAnd:
+  case ASTNodeType::BitwiseXor:
+  case ASTNodeType::BitwiseOr:
+  case ASTNodeType::GreaterThan:
+  case ASTNodeType::GreaterThanOrEqualTo:
+  case ASTNodeType::LessThan:
+  case ASTNodeType::LessThanOrEqualTo:
+  case ASTNodeType::EqualityComparison:
+  case ASTNodeType::InequalityComparison:
+  case ASTNodeType::LogicalAnd:
+  case ASTNodeType::LogicalOr:
+    return add_speculation_costs(1, add_speculation_costs(speculation_cost(lowering, ast_node->lhs), speculation_cost(lowering, ast_node->rhs)));
+
+  default:
+    return cannot_speculate;
   }
 }
+
+static bool is_cheap_to_speculate(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  return speculation_cost(lowering, ast_node) <= maximum_speculation_cost;
+}
+
+static void lower_branch(FunctionLowering*, ASTNode const*, IRBasicBlock* true_target, IRBasicBlock* false_target);
+
+// a && b or a || b as an int, with branches
+//
+//   store 0 or 1 to the result
+//   a, b:                       br logical.true or logical.end
+//   logical.true:  store 1/0,   br logical.end
+//   logical.end:   load the result
+static IRValue* lower_logical_with_branches(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  bool is_and = ast_node->type == ASTNodeType::LogicalAnd;
+  IRValue* result = ir_build_alloca(&lowering->builder, "i32");
+  store_object(lowering, ir_constant("i32", is_and ? 0 : 1), IntType, result);
+
+  IRBasicBlock* current_block = lowering->builder.insertion_block;
+  IRBasicBlock* decided_block = insert_ir_basic_block_after(current_block, is_and ? "land.true" : "lor.false");
+  IRBasicBlock* end_block = insert_ir_basic_block_after(decided_block, is_and ? "land.end" : "lor.end");
+
+  if (is_and)
+    lower_branch(lowering, ast_node, decided_block, end_block);
+  else
+    lower_branch(lowering, ast_node, end_block, decided_block);
+
+  lowering->builder.insertion_block = decided_block;
+  store_object(lowering, ir_constant("i32", is_and ? 1 : 0), IntType, result);
+  ir_build_br(&lowering->builder, end_block);
+
+  lowering->builder.insertion_block = end_block;
+  return load_object(lowering, IntType, result);
+}
+
+// an expression as the i1 of whether it's nonzero, 6.8.4.1
+static IRValue* lower_boolean(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  if (is_comparison(ast_node->type))
+    return lower_comparison(lowering, ast_node);
+
+  switch (ast_node->type) {
+  case ASTNodeType::LogicalNot: {
+    IRValue* operand = lower_boolean(lowering, ast_node->lhs);
+
+    // the comparison was just built and has no other users
+    if (operand->kind == IRValueKind::Instruction && operand->instruction->opcode == IROpcode::ICmp) {
+      operand->instruction->comparison = ir_inverse_comparison(operand->instruction->comparison);
+      return operand;
+    }
+    return ir_build_binary(&lowering->builder, IROpcode::Xor, operand, ir_constant("i1", 1));
+  }
+
+  // a && b is a ? b : false, and a || b is a ? true : b
+  case ASTNodeType::LogicalAnd:
+  case ASTNodeType::LogicalOr:
+    if (is_cheap_to_speculate(lowering, ast_node->rhs)) {
+      IRValue* lhs = lower_boolean(lowering, ast_node->lhs);
+      IRValue* rhs = lower_boolean(lowering, ast_node->rhs);
+      if (ast_node->type == ASTNodeType::LogicalAnd)
+        return ir_build_select(&lowering->builder, lhs, rhs, ir_constant("i1", 0));
+      return ir_build_select(&lowering->builder, lhs, ir_constant("i1", 1), rhs);
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  TypedValue value = lower_expression(lowering, ast_node);
+  return ir_build_icmp(&lowering->builder, IRComparison::Ne, value.value, ir_constant(value.value->type, 0));
+}
+
+// branches to true_target if ast_node is nonzero, otherwise to false_target
+static void lower_branch(FunctionLowering* lowering, ASTNode const* ast_node, IRBasicBlock* true_target, IRBasicBlock* false_target)
+{
+  switch (ast_node->type) {
+  case ASTNodeType::LogicalAnd:
+  case ASTNodeType::LogicalOr: {
+    bool is_and = ast_node->type == ASTNodeType::LogicalAnd;
+    IRBasicBlock* rhs_block = insert_ir_basic_block_after(lowering->builder.insertion_block, is_and ? "land.rhs" : "lor.rhs");
+    if (is_and)
+      lower_branch(lowering, ast_node->lhs, rhs_block, false_target);
+    else
+      lower_branch(lowering, ast_node->lhs, true_target, rhs_block);
+
+    lowering->builder.insertion_block = rhs_block;
+    lower_branch(lowering, ast_node->rhs, true_target, false_target);
+    return;
+  }
+
+  case ASTNodeType::LogicalNot:
+    lower_branch(lowering, ast_node->lhs, false_target, true_target);
+    return;
+
+  // e.g. while (1)
+  case ASTNodeType::NumericConstant:
+    if (is_integer_type(ast_node->data_type)) {
+      ir_build_br(&lowering->builder, constant_from_numeric_node(ast_node, "i64")->constant ? true_target : false_target);
+      return;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  ir_build_cond_br(&lowering->builder, lower_boolean(lowering, ast_node), true_target, false_target);
+}
+
+// 6.5.15 the result has the arithmetic conversions' type if both arms are
+// arithmetic, otherwise they have the same type, e.g. pointers or void
+static Type const* conditional_result_type(TypedValue lhs, TypedValue rhs)
+{
+  bool lhs_is_integer = is_integer_type(lhs.type->fundamental_type) || lhs.type->fundamental_type == FundamentalType::Bool;
+  bool rhs_is_integer = is_integer_type(rhs.type->fundamental_type) || rhs.type->fundamental_type == FundamentalType::Bool;
+  if (lhs_is_integer && rhs_is_integer)
+    return common_type(lhs.type, rhs.type);
+  if (lhs.type->fundamental_type == FundamentalType::Void || rhs.type->fundamental_type == FundamentalType::Void)
+    return VoidType;
+  return lhs.type;
+}
+
+// condition ? lhs : rhs, a select if the arms are cheap enough to compute
+// both. Otherwise
+//
+//   condition,                     br cond.true or cond.false
+//   cond.true:   lhs, store it,    br cond.end
+//   cond.false:  rhs, store it,    br cond.end
+//   cond.end:    load it
+//
+// the type of the result isn't known until both arms are lowered, so the
+// conversions and stores go at the end of each arm afterwards
+static TypedValue lower_conditional_expression(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  if (add_speculation_costs(speculation_cost(lowering, ast_node->lhs), speculation_cost(lowering, ast_node->rhs)) <= maximum_speculation_cost) {
+    IRValue* condition = lower_boolean(lowering, ast_node->conditional);
+    TypedValue lhs = lower_expression(lowering, ast_node->lhs);
+    TypedValue rhs = lower_expression(lowering, ast_node->rhs);
+    Type const* type = conditional_result_type(lhs, rhs);
+    lhs = convert(lowering, lhs, type);
+    rhs = convert(lowering, rhs, type);
+    return { ir_build_select(&lowering->builder, condition, lhs.value, rhs.value), type };
+  }
+
+  IRBasicBlock* current_block = lowering->builder.insertion_block;
+  IRBasicBlock* true_block = insert_ir_basic_block_after(current_block, "cond.true");
+  IRBasicBlock* false_block = insert_ir_basic_block_after(true_block, "cond.false");
+  IRBasicBlock* end_block = insert_ir_basic_block_after(false_block, "cond.end");
+  lower_branch(lowering, ast_node->conditional, true_block, false_block);
+
+  lowering->builder.insertion_block = true_block;
+  TypedValue lhs = lower_expression(lowering, ast_node->lhs);
+  IRBasicBlock* true_end = lowering->builder.insertion_block;
+
+  lowering->builder.insertion_block = false_block;
+  TypedValue rhs = lower_expression(lowering, ast_node->rhs);
+  IRBasicBlock* false_end = lowering->builder.insertion_block;
+
+  Type const* type = conditional_result_type(lhs, rhs);
+  IRValue* result = type == VoidType ? nullptr : ir_build_alloca(&lowering->builder, type_to_string(type));
+  TypedValue arms[] = { lhs, rhs };
+  IRBasicBlock* arm_ends[] = { true_end, false_end };
+  for (unsigned i = 0; i < 2; i++) {
+    lowering->builder.insertion_block = arm_ends[i];
+    if (result)
+      store_object(lowering, convert(lowering, arms[i], type).value, type, result);
+    ir_build_br(&lowering->builder, end_block);
+  }
+
+  lowering->builder.insertion_block = end_block;
+  return { result ? load_object(lowering, type, result) : nullptr, type };
+}
+
+static TypedValue lower_expression(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  switch (ast_node->type) {
+  case ASTNodeType::NumericConstant: {
+    Type const* type = get_fundamental_type_pointer(ast_node->data_type);
+    return { constant_from_numeric_node(ast_node, type_to_string(type)), type };
+  }
+
+  case ASTNodeType::VariableReference: {
+    Type const* type;
+    IRValue* address = variable_address(lowering, ast_node, &type);
+    return { load_object(lowering, type, address), type };
+  }
+
+  case ASTNodeType::Multiplication:
+  case ASTNodeType::Division:
+  case ASTNodeType::Modulo:
+  case ASTNodeType::Addition:
+  case ASTNodeType::Subtraction:
+  case ASTNodeType::BitShiftLeft:
+  case ASTNodeType::BitShiftRight:
+  case ASTNodeType::BitwiseAnd:
+  case ASTNodeType::BitwiseXor:
+  case ASTNodeType::BitwiseOr:
+    return lower_binary_expression(lowering, ast_node);
+
+  case ASTNodeType::GreaterThan:
+  case ASTNodeType::GreaterThanOrEqualTo:
+  case ASTNodeType::LessThan:
+  case ASTNodeType::LessThanOrEqualTo:
+  case ASTNodeType::EqualityComparison:
+  case ASTNodeType::InequalityComparison:
+  case ASTNodeType::LogicalNot:
+    return { ir_build_cast(&lowering->builder, IROpcode::ZExt, lower_boolean(lowering, ast_node), "i32"), IntType };
+
+  case ASTNodeType::LogicalAnd:
+  case ASTNodeType::LogicalOr:
+    if (is_cheap_to_speculate(lowering, ast_node->rhs))
+      return { ir_build_cast(&lowering->builder, IROpcode::ZExt, lower_boolean(lowering, ast_node), "i32"), IntType };
+    return { lower_logical_with_branches(lowering, ast_node), IntType };
+
+  case ASTNodeType::ConditionalExpression:
+    return lower_conditional_expression(lowering, ast_node);
+
+  case ASTNodeType::Assignment:
+    return lower_assignment(lowering, ast_node);
+
+  case ASTNodeType::PreIncrement:
+  case ASTNodeType::PreDecrement:
+  case ASTNodeType::PostIncrement:
+  case ASTNodeType::PostDecrement:
+    return lower_increment(lowering, ast_node);
+
+  case ASTNodeType::FunctionCall:
+    return lower_function_call(lowering, ast_node);
+
+  case ASTNodeType::ArraySubscript: {
+    Type const* type;
+    IRValue* address = subscript_address(lowering, ast_node, &type);
+    return { load_object(lowering, type, address), type };
+  }
+
+  default:
+    assert(false && "emitting code not implemented");
+    return { nullptr, nullptr };
+  }
+}
+
+// once a block has a terminator, anything after it, e.g. code following a
+// return, goes in a fresh block with no predecessors. Those get deleted once
+// the function is done
+static void ensure_insertion_block_open(FunctionLowering* lowering)
+{
+  IRBasicBlock* block = lowering->builder.insertion_block;
+  if (ir_block_terminator(block))
+    lowering->builder.insertion_block = insert_ir_basic_block_after(block, "dead");
+}
+
+static void branch_if_open(FunctionLowering* lowering, IRBasicBlock* target)
+{
+  if (!ir_block_terminator(lowering->builder.insertion_block))
+    ir_build_br(&lowering->builder, target);
+}
+
+// for (init; condition; increment) body, and while (condition) body, which is
+// a for with no init or increment
+//
+//   (init)                  br for.cond
+//   for.cond:  condition,   br for.body or for.end
+//   for.body:  body,        br for.inc
+//   for.inc:   increment,   br for.cond
+//   for.end:
+//
+// the same layout clang uses. The block that branches to for.cond is the
+// loop's preheader, which is where LICM puts what it hoists
+static void lower_loop(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  bool is_for = ast_node->type == ASTNodeType::For;
+  if (is_for && ast_node->lhs)
+    lower_statements(lowering, ast_node->lhs);
+
+  IRBasicBlock* current_block = lowering->builder.insertion_block;
+  IRBasicBlock* condition_block = insert_ir_basic_block_after(current_block, is_for ? "for.cond" : "while.cond");
+  IRBasicBlock* body_block = insert_ir_basic_block_after(condition_block, is_for ? "for.body" : "while.body");
+  IRBasicBlock* increment_block = is_for ? insert_ir_basic_block_after(body_block, "for.inc") : nullptr;
+  IRBasicBlock* end_block = insert_ir_basic_block_after(increment_block ? increment_block : body_block, is_for ? "for.end" : "while.end");
+
+  ir_build_br(&lowering->builder, condition_block);
+
+  // for (;;) has no condition and loops until something breaks out
+  lowering->builder.insertion_block = condition_block;
+  if (ast_node->conditional)
+    lower_branch(lowering, ast_node->conditional, body_block, end_block);
+  else
+    ir_build_br(&lowering->builder, body_block);
+
+  IRBasicBlock* continue_target = increment_block ? increment_block : condition_block;
+  lowering->loop_targets.push_back({ end_block, continue_target });
+
+  lowering->builder.insertion_block = body_block;
+  lower_statements(lowering, ast_node->body);
+  branch_if_open(lowering, continue_target);
+
+  lowering->loop_targets.pop_back();
+
+  if (increment_block) {
+    lowering->builder.insertion_block = increment_block;
+    if (ast_node->rhs)
+      lower_expression(lowering, ast_node->rhs);
+    ir_build_br(&lowering->builder, condition_block);
+  }
+
+  lowering->builder.insertion_block = end_block;
+}
+
+// 6.6 an integer constant expression, which is what a case label has to be.
+// Only constants and the arithmetic on them so far, all done in long long
+static long long evaluate_constant_expression(ASTNode const* ast_node)
+{
+  if (ast_node->type == ASTNodeType::NumericConstant)
+    return constant_from_numeric_node(ast_node, "i64")->constant;
+
+  if (!ast_node->lhs || !ast_node->rhs)
+    error_and_stop("Case label is not an integer constant expression\n");
+
+  long long lhs = evaluate_constant_expression(ast_node->lhs);
+  long long rhs = evaluate_constant_expression(ast_node->rhs);
+  switch (ast_node->type) {
+  case ASTNodeType::Multiplication:
+    return lhs * rhs;
+  case ASTNodeType::Division:
+  case ASTNodeType::Modulo:
+    if (rhs == 0)
+      error_and_stop("Division by zero in a case label\n");
+    return ast_node->type == ASTNodeType::Division ? lhs / rhs : lhs % rhs;
+  case ASTNodeType::Addition:
+    return lhs + rhs;
+  case ASTNodeType::Subtraction:
+    return lhs - rhs;
+  case ASTNodeType::BitShiftLeft:
+    return lhs << rhs;
+  case ASTNodeType::BitShiftRight:
+    return lhs >> rhs;
+  case ASTNodeType::BitwiseAnd:
+    return lhs & rhs;
+  case ASTNodeType::BitwiseXor:
+    return lhs ^ rhs;
+  case ASTNodeType::BitwiseOr:
+    return lhs | rhs;
+  default:
+    error_and_stop("Case label is not an integer constant expression\n");
+    return 0;
+  }
+}
+
+// switch (condition) body
+//
+// the labels are somewhere in the body, so the body is lowered first, each
+// label starting a block that the code before it falls through to. The switch
+// instruction then goes at the end of the block the condition was computed in
+//
+//   condition,     switch to the switch.case blocks, switch.default or switch.end
+//   switch.body:   whatever comes before the first label, which never runs
+//   switch.case:   ...
+//   switch.end:
+//
+// how to dispatch, a jump table, bit tests or a tree of comparisons, is up to
+// llc, or to instruction selection in the native backend
+static void lower_switch(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  // 6.8.4.2 the condition is promoted, and each case value converted to the promoted type
+  TypedValue condition = lower_expression(lowering, ast_node->conditional);
+  if (!is_integer_type(condition.type->fundamental_type) && condition.type->fundamental_type != FundamentalType::Bool)
+    error_and_stop("Switch condition is not an integer\n");
+  condition = convert(lowering, condition, promoted_type(condition.type));
+
+  IRBasicBlock* switch_block = lowering->builder.insertion_block;
+  IRBasicBlock* body_block = insert_ir_basic_block_after(switch_block, "switch.body");
+  IRBasicBlock* end_block = insert_ir_basic_block_after(body_block, "switch.end");
+
+  IRBasicBlock* continue_target = lowering->loop_targets.empty() ? nullptr : lowering->loop_targets.back().continue_target;
+  lowering->loop_targets.push_back({ end_block, continue_target });
+  lowering->switches.push_back({ condition.type, {}, {}, {}, nullptr, nullptr });
+
+  lowering->builder.insertion_block = body_block;
+  lower_statements(lowering, ast_node->body);
+  branch_if_open(lowering, end_block);
+
+  SwitchCases const& cases = lowering->switches.back();
+  lowering->builder.insertion_block = switch_block;
+  ir_build_switch(&lowering->builder, condition.value, cases.default_target ? cases.default_target : end_block, cases.values.data(),
+      cases.targets.data(), cases.values.size());
+
+  lowering->switches.pop_back();
+  lowering->loop_targets.pop_back();
+  lowering->builder.insertion_block = end_block;
+}
+
+// case value: and default:, each starting a block that the code before falls into
+static void lower_switch_label(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  if (lowering->switches.empty())
+    error_and_stop("Case label outside of a switch\n");
+  SwitchCases* cases = &lowering->switches.back();
+
+  // case 1: case 2: ... is one block, so the backend sees both values going
+  // to the same place
+  bool is_case = ast_node->type == ASTNodeType::Case;
+  IRBasicBlock* label_block = cases->label_block;
+  if (label_block != lowering->builder.insertion_block || label_block->first_instruction) {
+    label_block = insert_ir_basic_block_after(lowering->builder.insertion_block, is_case ? "switch.case" : "switch.default");
+    branch_if_open(lowering, label_block);
+    lowering->builder.insertion_block = label_block;
+    cases->label_block = label_block;
+  }
+
+  if (is_case) {
+    TypedValue value = { ir_constant("i64", evaluate_constant_expression(ast_node->lhs)), LongLongType };
+    long long case_value = convert(lowering, value, cases->condition_type).value->constant;
+    if (!cases->seen_values.insert(case_value).second)
+      error_and_stop("Duplicate case value\n");
+    cases->values.push_back(case_value);
+    cases->targets.push_back(label_block);
+  } else {
+    if (cases->default_target)
+      error_and_stop("Multiple default labels in one switch\n");
+    cases->default_target = label_block;
+  }
+
+  lower_statements(lowering, ast_node->body);
+}
+
+// do body while (condition), the body runs before the first check
+//
+//   do.body:   body,        br do.cond
+//   do.cond:   condition,   br do.body or do.end
+//   do.end:
+static void lower_do_while(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  IRBasicBlock* current_block = lowering->builder.insertion_block;
+  IRBasicBlock* body_block = insert_ir_basic_block_after(current_block, "do.body");
+  IRBasicBlock* condition_block = insert_ir_basic_block_after(body_block, "do.cond");
+  IRBasicBlock* end_block = insert_ir_basic_block_after(condition_block, "do.end");
+
+  ir_build_br(&lowering->builder, body_block);
+
+  lowering->loop_targets.push_back({ end_block, condition_block });
+
+  lowering->builder.insertion_block = body_block;
+  lower_statements(lowering, ast_node->body);
+  branch_if_open(lowering, condition_block);
+
+  lowering->loop_targets.pop_back();
+
+  lowering->builder.insertion_block = condition_block;
+  lower_branch(lowering, ast_node->conditional, body_block, end_block);
+
+  lowering->builder.insertion_block = end_block;
+}
+
+static void lower_statement(FunctionLowering* lowering, ASTNode const* ast_node)
+{
+  ensure_insertion_block_open(lowering);
+
+  switch (ast_node->type) {
+
+  case ASTNodeType::Void:
+    return;
+
+  case ASTNodeType::Declaration: {
+    // a declaration is a series of "int x = 3"s or whatever
+    // this requires us to put these new variables on the stack in accord with their type
+    // then potentially initialize them
+    //
+    // variables are put on the LLVM stack using the alloca instruction
+    // https://www.llvm.org/docs/LangRef.html#alloca-instruction
+    //
+    // alloca returns a pointer to the requested type, then the initialization can be done using loads and stores
+    // https://www.llvm.org/docs/LangRef.html#store-instruction
+    // a store's semantics are, in short, "store <type> <value>, ptr <ptr>"
+    Object* current_object = ast_node->object;
+    assert(current_object && "Emitting code for declaration with null object");
+
+    IRValue* address = ir_build_alloca(&lowering->builder, type_to_string(current_object->type));
+    lowering->local_variables[current_object] = address;
+
+    // node has an initializer
+    if (ast_node->rhs) {
+      TypedValue initializer = convert(lowering, lower_expression(lowering, ast_node->rhs), current_object->type);
+      store_object(lowering, initializer.value, current_object->type, address);
+    }
+    return;
+  }
+
+  case ASTNodeType::Return: {
+    assert(ast_node->scope->return_type && "codegen for return statement with no return type");
+    if (!ast_node->rhs) {
+      ir_build_ret(&lowering->builder, nullptr);
+      return;
+    }
+
+    TypedValue value = lower_expression(lowering, ast_node->rhs);
+    IRValue* converted = convert(lowering, value, lowering->return_type).value;
+    if (converted == value.value)
+      mark_tail_call(lowering, ast_node->rhs, converted);
+    ir_build_ret(&lowering->builder, converted);
+    return;
+  }
+
+  case ASTNodeType::If: {
+    // if (condition) lhs else rhs
+    //
+    // the current block branches to if.then or if.else, both of which fall
+    // through to if.end. Without an else, the false edge goes to if.end
+    IRBasicBlock* current_block = lowering->builder.insertion_block;
+    IRBasicBlock* then_block = insert_ir_basic_block_after(current_block, "if.then");
+    IRBasicBlock* else_block = ast_node->rhs ? insert_ir_basic_block_after(then_block, "if.else") : nullptr;
+    IRBasicBlock* end_block = insert_ir_basic_block_after(else_block ? else_block : then_block, "if.end");
+
+    lower_branch(lowering, ast_node->conditional, then_block, else_block ? else_block : end_block);
+
+    lowering->builder.insertion_block = then_block;
+    lower_statements(lowering, ast_node->lhs);
+    branch_if_open(lowering, end_block);
+
+    if (else_block) {
+      lowering->builder.insertion_block = else_block;
+      lower_statements(lowering, ast_node->rhs);
+      branch_if_open(lowering, end_block);
+    }
+
+    lowering->builder.insertion_block = end_block;
+    return;
+  }
+
+  case ASTNodeType::For:
+  case ASTNodeType::While:
+    lower_loop(lowering, ast_node);
+    return;
+
+  case ASTNodeType::DoWhile:
+    lower_do_while(lowering, ast_node);
+    return;
+
+  case ASTNodeType::Switch:
+    lower_switch(lowering, ast_node);
+    return;
+
+  case ASTNodeType::Case:
+  case ASTNodeType::Default:
+    lower_switch_label(lowering, ast_node);
+    return;
+
+  case ASTNodeType::Break:
+  case ASTNodeType::Continue: {
+    // a continue in a switch that isn't in a loop has nowhere to go
+    LoopTargets const* targets = lowering->loop_targets.empty() ? nullptr : &lowering->loop_targets.back();
+    IRBasicBlock* target = !targets ? nullptr : ast_node->type == ASTNodeType::Break ? targets->break_target : targets->continue_target;
+    if (!target)
+      error_and_stop("break or continue outside of a loop\n");
+
+    ir_build_br(&lowering->builder, target);
+    return;
+  }
+
+  default:
+    // expression statement, evaluated for its side effects
+    lower_expression(lowering, ast_node);
+    return;
+  }
+}
+
+static void lower_statements(FunctionLowering* lowering, ASTNode const* first_ast_node)
+{
+  for (ASTNode const* current_ast_node = first_ast_node; current_ast_node; current_ast_node = current_ast_node->next)
+    lower_statement(lowering, current_ast_node);
+}
+
+// falling off the end of main returns 0 (5.1.2.2.3), falling off the end of
+// any other non-void function is only undefined if the caller uses the value
+static void terminate_function(FunctionLowering* lowering)
+{
+  if (ir_block_terminator(lowering->builder.insertion_block))
+    return;
+
+  if (lowering->return_type->fundamental_type == FundamentalType::Void)
+    ir_build_ret(&lowering->builder, nullptr);
+  else if (lowering->function_object->identifier == "main")
+    ir_build_ret(&lowering->builder, ir_constant(type_to_string(lowering->return_type), 0));
+  else
+    ir_build_unreachable(&lowering->builder);
+}
+
+// blocks nothing branches to, left behind by code after a return
+static void remove_unreachable_blocks(IRFunction* function)
+{
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    std::unordered_map<IRBasicBlock const*, unsigned> predecessor_count;
+    for (IRBasicBlock* block = function->first_block; block; block = block->next)
+      if (IRInstruction* terminator = ir_block_terminator(block))
+        for (unsigned i = 0; i < terminator->target_count; i++)
+          predecessor_count[terminator->targets[i]]++;
+
+    for (IRBasicBlock* block = function->first_block->next; block; block = block->next) {
+      if (predecessor_count[block])
+        continue;
+
+      block->previous->next = block->next;
+      if (block->next)
+        block->next->previous = block->previous;
+      else
+        function->last_block = block->previous;
+      changed = true;
+    }
+  }
+}
+
+// every function gets its IRFunction before any body is lowered, so calls
+// can refer to functions declared or defined after the caller. A function
+// can be declared any number of times, and static on any of those gives it
+// internal linkage (6.2.2). Likewise for _Noreturn and inline (6.7.4)
+static IRFunction* declare_function(IRModule* module, std::unordered_map<std::string, IRFunction*>* functions, Object const* function_object)
+{
+  FunctionData const* function_data = function_object->type->function_data;
+  assert(function_data->return_type);
+
+  IRFunction* function;
+  if (functions->contains(function_object->identifier)) {
+    function = functions->at(function_object->identifier);
+  } else {
+    unsigned argument_count = 0;
+    for (FunctionParameter const* current_param = function_data->parameter_list; current_param; current_param = current_param->next_parameter)
+      argument_count++;
+
+    function = new_ir_function(module, function_object, function_object->identifier.c_str(), type_to_string(function_data->return_type),
+        argument_count);
+
+    unsigned count = 0;
+    for (FunctionParameter const* current_param = function_data->parameter_list; current_param; current_param = current_param->next_parameter) {
+      Type const* parameter_type = current_param->parameter_type;
+      function->arguments[count] = ir_argument(type_to_string(parameter_type), count);
+
+      // 6.7.3.1, what a restrict pointer points to is only accessed through it
+      function->arguments[count]->is_noalias = parameter_type->fundamental_type == FundamentalType::Pointer
+          && (parameter_type->declaration_specifier_flags.flags & TypeModifierFlag::Restrict);
+      count++;
+    }
+
+    (*functions)[function_object->identifier] = function;
+  }
+
+  int flags = function_object->declaration_specifier_flags.flags;
+  if (flags & TypeModifierFlag::Static)
+    function->is_internal = true;
+  if (flags & TypeModifierFlag::NoReturn)
+    function->is_noreturn = true;
+  if (flags & TypeModifierFlag::Inline)
+    function->is_inline_hint = true;
+
+  return function;
+}
+
+// a tail call reuses the caller's frame, so the callee mustn't be able to
+// reach any of the caller's allocas
+static void remove_tail_calls_if_allocas_escape(IRFunction* function)
+{
+  std::unordered_set<IRValue const*> non_escaping = find_non_escaping_allocas(function);
+  bool escapes = false;
+  for (IRBasicBlock* block = function->first_block; block; block = block->next)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      if (instruction->opcode == IROpcode::Alloca && !non_escaping.contains(instruction->result))
+        escapes = true;
+
+  if (!escapes)
+    return;
+  for (IRBasicBlock* block = function->first_block; block; block = block->next)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      instruction->tail_call_kind = IRTailCallKind::None;
+}
+
+// in C, the function body is a compound statment, so after setting up the
+// parameters we just need to lower the statements in it
+static void lower_function_definition(IRFunction* function, Object const* function_object,
+    std::unordered_map<std::string, IRFunction*> const* functions, std::unordered_map<std::string, Object*> const* globals = nullptr)
+{
+  assert(function_body(function_object));
+  FunctionData const* function_data = function_object->type->function_data;
+
+  if (!ir_function_is_declaration(function))
+    error_and_stop("Redefinition of function\n");
+
+  // the parameter names come from the definition, not from any earlier declaration
+  function->object = function_object;
+
+  FunctionLowering lowering;
+  lowering.builder.function = function;
+  lowering.function_object = function_object;
+  lowering.return_type = function_data->return_type;
+  lowering.functions = functions;
+  lowering.globals = globals;
+
+  // begin the function definition with the "entry" basic block
+  lowering.builder.insertion_block = new_ir_basic_block(function, "entry");
+
+  // parameters are copied into allocas so they can be assigned to like any other local
+  unsigned count = 0;
+  for (FunctionParameter const* current_param = function_data->parameter_list; current_param; current_param = current_param->next_parameter) {
+    if (current_param->identifier == "")
+      error_and_stop("Function definition parameters must have identifiers");
+
+    IRValue* argument = function->arguments[count++];
+    IRValue* address = ir_build_alloca(&lowering.builder, argument->type);
+    store_object(&lowering, argument, current_param->parameter_type, address);
+    lowering.parameters[current_param->identifier] = { address, current_param->parameter_type };
+  }
+
+  lower_statements(&lowering, function_body(function_object));
+  terminate_function(&lowering);
+  remove_unreachable_blocks(function);
+  remove_tail_calls_if_allocas_escape(function);
+}
+
+IRModule* lower_translation_unit(ExternalDeclaration const* external_declaration)
+{
+  IRModule* module = new_ir_module();
+  std::unordered_map<std::string, IRFunction*> functions;
+
+  for (ExternalDeclaration const* current_declaration = external_declaration; current_declaration; current_declaration = current_declaration->next)
+    for (ASTNode const* declaration_node = current_declaration->root_ast_node; declaration_node; declaration_node = declaration_node->next) {
+      if (declaration_node->object->type->fundamental_type != FundamentalType::Function)
+        assert(false && "codegen for declarations not implemented\n");
+      declare_function(module, &functions, declaration_node->object);
+    }
+
+  for (ExternalDeclaration const* current_declaration = external_declaration; current_declaration; current_declaration = current_declaration->next) {
+    if (current_declaration->type != ExternalDeclarationType::FunctionDefinition)
+      continue;
+
+    Object const* function_object = current_declaration->root_ast_node->object;
+    lower_function_definition(functions.at(function_object->identifier), function_object, &functions);
+  }
+
+  return module;
+}
+
+ModuleLowering* new_module_lowering()
+{
+  ModuleLowering* lowering = new ModuleLowering;
+  lowering->module = new_ir_module();
+  lowering->releases_function_bodies = false;
+  return lowering;
+}
+
+// whether the body calls a function that hasn't been declared yet. Only a
+// call through a name that isn't local can be to a function
+static bool calls_undeclared_function(ModuleLowering const* lowering, ASTNode const* node)
+{
+  for (; node; node = node->next) {
+    if (node->type == ASTNodeType::FunctionCall && node->lhs->type == ASTNodeType::VariableReference
+        && !lowering->functions.contains(node->lhs->referenced_variable))
+      return true;
+    if (calls_undeclared_function(lowering, node->lhs) || calls_undeclared_function(lowering, node->rhs)
+        || calls_undeclared_function(lowering, node->conditional) || calls_undeclared_function(lowering, node->arguments)
+        || calls_undeclared_function(lowering, node->body))
+      return true;
+  }
+  return false;
+}
+
+static void lower_definition_now(ModuleLowering* lowering, Object* function_object)
+{
+  lower_function_definition(lowering->functions.at(function_object->identifier), function_object, &lowering->functions, &lowering->globals);
+  if (lowering->releases_function_bodies)
+    delete_function_body(function_object);
+}
+
+// lowering a definition as soon as it comes gives the same module as
+// lower_translation_unit: functions are still declared in the order they
+// were first declared, and lowering one definition doesn't depend on which
+// others have been
+void lower_external_declaration(ModuleLowering* lowering, ExternalDeclaration const* external_declaration)
+{
+  for (ASTNode const* declaration_node = external_declaration->root_ast_node; declaration_node; declaration_node = declaration_node->next) {
+    if (declaration_node->object->type->fundamental_type != FundamentalType::Function)
+      assert(false && "codegen for declarations not implemented\n");
+    declare_function(lowering->module, &lowering->functions, declaration_node->object);
+    lowering->globals.insert_or_assign(declaration_node->object->identifier, declaration_node->object);
+  }
+
+  if (external_declaration->type != ExternalDeclarationType::FunctionDefinition)
+    return;
+  Object* function_object = external_declaration->root_ast_node->object;
+  if (calls_undeclared_function(lowering, function_body(function_object)))
+    lowering->waiting_definitions.push_back(function_object);
+  else
+    lower_definition_now(lowering, function_object);
+}
+
+IRModule* finish_module_lowering(ModuleLowering* lowering)
+{
+  for (Object* function_object : lowering->waiting_definitions)
+    lower_definition_now(lowering, function_object);
+  IRModule* module = lowering->module;
+  delete lowering;
+  return module;
+}
+
+// before any pass runs, see include/profile.h
+static void apply_profile_options(IRModule* module, CompilerOptions const* options)
+{
+  if (options->profile_generate)
+    instrument_ir_module(module);
+
+  if (!options->profile_use_path)
+    return;
+
+  FILE* file = fopen(options->profile_use_path, "r");
+  if (!file) {
+    fprintf(stderr, "Could not open profile %s, aborting.\n", options->profile_use_path);
+    exit(1);
+  }
+
+  Profile profile;
+  if (!read_profile(file, &profile)) {
+    fprintf(stderr, "%s is not a miniclang profile, aborting.\n", options->profile_use_path);
+    exit(1);
+  }
+  fclose(file);
+  apply_profile(module, &profile);
+}
+
+void emit_llvm_from_translation_unit(ExternalDeclaration const* external_declaration, FILE* outfile, CompilerOptions const* options,
+    OptimizationStatistics* statistics)
+{
+  emit_llvm_from_module(lower_translation_unit(external_declaration), outfile, options, statistics);
+}
+
+void emit_llvm_from_module(IRModule* module, FILE* outfile, CompilerOptions const* options, OptimizationStatistics* statistics)
+{
+  apply_profile_options(module, options);
+  optimize_ir_module(module, options->optimization_level, statistics);
+
+  // the native backend has no use for weights, LLVM lays out blocks by them
+  estimate_branch_weights(module);
+  print_ir_module(module, outfile);
+}
+
+// the same middle end, then the native backend rather than printing LLVM IR
+void emit_object_from_translation_unit(ExternalDeclaration const* external_declaration, FILE* outfile, CompilerOptions const* options,
+    OptimizationStatistics* statistics)
+{
+  emit_object_from_module(lower_translation_unit(external_declaration), outfile, options, statistics);
+}
+
+void emit_object_from_module(IRModule* module, FILE* outfile, CompilerOptions const* options, OptimizationStatistics* statistics)
+{
+  apply_profile_options(module, options);
+  optimize_ir_module(module, options->optimization_level, statistics);
+
+  ObjectFile object = generate_x86_64_object(module, statistics);
+  write_elf_object(&object, outfile);
+}
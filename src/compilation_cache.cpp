@@ -0,0 +1,341 @@
+#include "compilation_cache.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// the compilation cache, after ccache's direct mode
+//
+// an entry is named by a hash of the file being compiled, the directory it's
+// in, the working directory, the command line options that change the
+// output, and the compiler binary itself. It holds the output, and the path and hash of every file
+// the compile read besides: the headers it included, and any precompiled
+// header or profile. A lookup hashes those files again and only uses the
+// entry if none of them changed, so editing a header misses without the
+// file having to be preprocessed to find out
+//
+// an entry is written to a temporary file and renamed into place, so
+// compiles running at the same time never see half of one. Hits touch the
+// entry's modification time, and once the directory holds more than
+// --cache-max-size, the entries used longest ago are deleted
+//
+// like ccache in direct mode, a header that appears where an include would
+// now find it first, ahead of the one the entry recorded, isn't noticed
+
+static constexpr char entry_magic[] = "miniclang cache 1\n";
+
+// evicting goes a little further than it has to, so a full cache isn't
+// scanned again by every compile
+static constexpr unsigned long long eviction_target_percent = 90;
+
+static CompilationCacheStatistics statistics;
+
+// XXH64, https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+static constexpr uint64_t prime64_1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t prime64_2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t prime64_3 = 0x165667B19E3779F9ull;
+static constexpr uint64_t prime64_4 = 0x85EBCA77C2B2AE63ull;
+static constexpr uint64_t prime64_5 = 0x27D4EB2F165667C5ull;
+
+static uint64_t rotate_left(uint64_t value, unsigned count) { return (value << count) | (value >> (64 - count)); }
+
+static uint64_t read_64(unsigned char const* bytes)
+{
+  uint64_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static uint32_t read_32(unsigned char const* bytes)
+{
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static uint64_t round_64(uint64_t accumulator, uint64_t lane)
+{
+  accumulator += lane * prime64_2;
+  accumulator = rotate_left(accumulator, 31);
+  return accumulator * prime64_1;
+}
+
+static uint64_t merge_accumulator(uint64_t hash, uint64_t accumulator)
+{
+  hash ^= round_64(0, accumulator);
+  return hash * prime64_1 + prime64_4;
+}
+
+static uint64_t xxh64(void const* data, size_t length, uint64_t seed)
+{
+  unsigned char const* bytes = (unsigned char const*)data;
+  unsigned char const* end = bytes + length;
+  uint64_t hash;
+
+  if (length >= 32) {
+    uint64_t accumulators[4] = { seed + prime64_1 + prime64_2, seed + prime64_2, seed, seed - prime64_1 };
+    for (; end - bytes >= 32; bytes += 32)
+      for (unsigned i = 0; i < 4; i++)
+        accumulators[i] = round_64(accumulators[i], read_64(bytes + 8 * i));
+
+    hash = rotate_left(accumulators[0], 1) + rotate_left(accumulators[1], 7) + rotate_left(accumulators[2], 12)
+        + rotate_left(accumulators[3], 18);
+    for (unsigned i = 0; i < 4; i++)
+      hash = merge_accumulator(hash, accumulators[i]);
+  } else {
+    hash = seed + prime64_5;
+  }
+  hash += length;
+
+  for (; end - bytes >= 8; bytes += 8)
+    hash = rotate_left(hash ^ round_64(0, read_64(bytes)), 27) * prime64_1 + prime64_4;
+  if (end - bytes >= 4) {
+    hash = rotate_left(hash ^ (read_32(bytes) * prime64_1), 23) * prime64_2 + prime64_3;
+    bytes += 4;
+  }
+  for (; bytes < end; bytes++)
+    hash = rotate_left(hash ^ (*bytes * prime64_5), 11) * prime64_1;
+
+  hash ^= hash >> 33;
+  hash *= prime64_2;
+  hash ^= hash >> 29;
+  hash *= prime64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+static std::string hex(uint64_t value)
+{
+  char buffer[17];
+  snprintf(buffer, sizeof(buffer), "%016" PRIx64, value);
+  return buffer;
+}
+
+// false if the file can't be read
+static bool read_whole_file(char const* path, std::string* contents)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return false;
+
+  char buffer[65536];
+  contents->clear();
+  for (size_t read; (read = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+    contents->append(buffer, read);
+  fclose(file);
+  return true;
+}
+
+// empty if the file can't be read, which no file hashes to
+static std::string hash_file(char const* path)
+{
+  std::string contents;
+  if (!read_whole_file(path, &contents))
+    return "";
+  return hex(xxh64(contents.data(), contents.size(), 0));
+}
+
+// a rebuilt compiler can compile the same file differently
+static std::string compiler_identity()
+{
+  struct stat status;
+  if (stat("/proc/self/exe", &status) != 0)
+    return "";
+  return std::to_string(status.st_size) + " " + std::to_string(status.st_mtim.tv_sec) + "." + std::to_string(status.st_mtim.tv_nsec);
+}
+
+std::string cache_entry_key(std::string const& text)
+{
+  std::string key_text = compiler_identity() + '\0' + text;
+
+  // 128 bits, two 64 bit hashes with different seeds
+  return hex(xxh64(key_text.data(), key_text.size(), 0)) + hex(xxh64(key_text.data(), key_text.size(), prime64_1));
+}
+
+std::string compilation_cache_key(char const* source, char const* path, std::string const& flags)
+{
+  // quoted includes are looked for next to the file, so the same text in
+  // another directory can include other headers. Both directories are
+  // relative to the working directory, as are the paths the entry records
+  char const* slash = strrchr(path, '/');
+  std::string directory = slash ? std::string(path, slash - path) : ".";
+  char working_directory[4096];
+  std::string cwd = getcwd(working_directory, sizeof(working_directory)) ? working_directory : "";
+
+  return cache_entry_key(cwd + '\0' + directory + '\0' + flags + '\0' + source);
+}
+
+static std::string entry_path(CompilerOptions const* options, std::string const& key)
+{
+  return std::string(options->cache_directory) + "/" + key;
+}
+
+// an entry is
+//      miniclang cache 1
+//      <number of files it depends on>
+//      <hash> <path>, for each of them
+//      <size of the output>
+//      the output
+static bool read_entry(std::string const& contents, std::string* output)
+{
+  size_t position = strlen(entry_magic);
+  if (contents.compare(0, position, entry_magic) != 0)
+    return false;
+
+  auto read_line = [&](std::string* line) {
+    size_t end = contents.find('\n', position);
+    if (end == std::string::npos)
+      return false;
+    *line = contents.substr(position, end - position);
+    position = end + 1;
+    return true;
+  };
+
+  std::string line;
+  if (!read_line(&line))
+    return false;
+  unsigned long dependency_count = strtoul(line.c_str(), nullptr, 10);
+  for (unsigned long i = 0; i < dependency_count; i++) {
+    if (!read_line(&line) || line.size() < 18 || line[16] != ' ')
+      return false;
+    if (hash_file(line.c_str() + 17) != line.substr(0, 16))
+      return false;
+  }
+
+  if (!read_line(&line))
+    return false;
+  unsigned long long size = strtoull(line.c_str(), nullptr, 10);
+  if (contents.size() - position != size)
+    return false;
+  *output = contents.substr(position);
+  return true;
+}
+
+bool read_cache_entry(CompilerOptions const* options, std::string const& key, std::string* contents)
+{
+  std::string path = entry_path(options, key);
+  if (!read_whole_file(path.c_str(), contents))
+    return false;
+
+  // the entries used longest ago are the first to go
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  return true;
+}
+
+bool lookup_compilation_cache(CompilerOptions const* options, std::string const& key, std::string* output)
+{
+  std::string contents;
+  if (!read_cache_entry(options, key, &contents) || !read_entry(contents, output)) {
+    statistics.misses++;
+    return false;
+  }
+  statistics.hits++;
+  return true;
+}
+
+struct CacheEntry {
+  std::string path;
+  unsigned long long size;
+  timespec last_used;
+};
+
+static void evict_entries(CompilerOptions const* options)
+{
+  DIR* directory = opendir(options->cache_directory);
+  if (!directory)
+    return;
+
+  std::vector<CacheEntry> entries;
+  unsigned long long total_size = 0;
+  while (dirent* file = readdir(directory)) {
+    std::string path = std::string(options->cache_directory) + "/" + file->d_name;
+    struct stat status;
+    // entries are named by 32 hex digits, anything else is being written
+    if (strlen(file->d_name) != 32 || stat(path.c_str(), &status) != 0 || !S_ISREG(status.st_mode))
+      continue;
+    entries.push_back({ path, (unsigned long long)status.st_size, status.st_mtim });
+    total_size += status.st_size;
+  }
+  closedir(directory);
+
+  if (total_size <= options->cache_max_size)
+    return;
+
+  std::sort(entries.begin(), entries.end(), [](CacheEntry const& left, CacheEntry const& right) {
+    if (left.last_used.tv_sec != right.last_used.tv_sec)
+      return left.last_used.tv_sec < right.last_used.tv_sec;
+    return left.last_used.tv_nsec < right.last_used.tv_nsec;
+  });
+  unsigned long long target = options->cache_max_size / 100 * eviction_target_percent;
+  for (CacheEntry const& entry : entries) {
+    if (total_size <= target)
+      break;
+    if (unlink(entry.path.c_str()) == 0) {
+      total_size -= entry.size;
+      statistics.entries_evicted++;
+    }
+  }
+}
+
+void store_compilation_cache(CompilerOptions const* options, std::string const& key, Preprocessor const* preprocessor,
+    std::string const& output)
+{
+  std::vector<char const*> dependencies;
+  for (FileEntry const* file : preprocessor->included_files)
+    dependencies.push_back(file->path);
+  if (options->include_pch_path)
+    dependencies.push_back(options->include_pch_path);
+  if (options->profile_use_path)
+    dependencies.push_back(options->profile_use_path);
+
+  std::string contents = entry_magic;
+  contents += std::to_string(dependencies.size()) + "\n";
+  for (char const* dependency : dependencies) {
+    // a file that can't be hashed now won't match later either
+    std::string hash = hash_file(dependency);
+    if (hash.empty() || strchr(dependency, '\n'))
+      return;
+    contents += hash + " " + dependency + "\n";
+  }
+  contents += std::to_string(output.size()) + "\n";
+  contents += output;
+  write_cache_entry(options, key, contents);
+}
+
+void write_cache_entry(CompilerOptions const* options, std::string const& key, std::string const& contents)
+{
+  mkdir(options->cache_directory, 0777);
+  std::string path = entry_path(options, key);
+  std::string temporary_path = path + ".tmp." + std::to_string(getpid());
+  FILE* file = fopen(temporary_path.c_str(), "wb");
+  if (!file)
+    return;
+  bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+  if (fclose(file) != 0 || !written || rename(temporary_path.c_str(), path.c_str()) != 0) {
+    unlink(temporary_path.c_str());
+    return;
+  }
+
+  evict_entries(options);
+}
+
+CompilationCacheStatistics compilation_cache_statistics() { return statistics; }
+
+void reset_compilation_cache_statistics() { statistics = {}; }
+
+void print_compilation_cache_statistics(FILE* outfile)
+{
+  fprintf(outfile, "===-------------------------------------------===\n");
+  fprintf(outfile, "          miniclang compilation cache statistics\n");
+  fprintf(outfile, "===-------------------------------------------===\n");
+  fprintf(outfile, "%8u hits\n", statistics.hits);
+  fprintf(outfile, "%8u misses\n", statistics.misses);
+  fprintf(outfile, "%8u entries evicted\n", statistics.entries_evicted);
+}
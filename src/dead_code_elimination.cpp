@@ -0,0 +1,83 @@
+#include "analysis.h"
+#include "optimize.h"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// aggressive dead code elimination, with dead store elimination folded in
+//
+// instead of deleting instructions nobody uses and repeating until nothing
+// changes, assume everything is dead and mark live only what is needed. The
+// roots are instructions with side effects: terminators, and stores to memory
+// something else could look at. Anything a live instruction uses is live.
+// This also catches values that only feed each other, which the delete-unused
+// approach never removes
+//
+// stores to an alloca that doesn't escape are not roots. Nothing can read that
+// memory except a load of the alloca itself, so its stores only become live
+// once one of those loads does. A local that is written but never read ends up
+// with no live stores, and with no live users its alloca goes too. This is
+// what gets rid of the allocas codegen makes for every declaration and
+// parameter, once value numbering has forwarded their stores to their loads
+
+struct DeadCodeElimination {
+  std::unordered_set<IRValue const*> non_escaping_allocas;
+  std::unordered_map<IRValue const*, std::vector<IRInstruction*>> stores_to_alloca;
+
+  std::unordered_set<IRInstruction const*> live;
+  std::vector<IRInstruction*> worklist;
+};
+
+static bool is_store_to_non_escaping_alloca(DeadCodeElimination const* state, IRInstruction const* instruction)
+{
+  return instruction->opcode == IROpcode::Store && state->non_escaping_allocas.contains(instruction->operands[1]);
+}
+
+static void mark_live(DeadCodeElimination* state, IRInstruction* instruction)
+{
+  if (state->live.insert(instruction).second)
+    state->worklist.push_back(instruction);
+}
+
+void run_dead_code_elimination(IRFunction* function, OptimizationStatistics* statistics)
+{
+  DeadCodeElimination state;
+  state.non_escaping_allocas = find_non_escaping_allocas(function);
+
+  for (IRBasicBlock* block = function->first_block; block; block = block->next)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      if (is_store_to_non_escaping_alloca(&state, instruction))
+        state.stores_to_alloca[instruction->operands[1]].push_back(instruction);
+      else if (ir_instruction_has_side_effects(instruction))
+        mark_live(&state, instruction);
+    }
+
+  while (!state.worklist.empty()) {
+    IRInstruction* instruction = state.worklist.back();
+    state.worklist.pop_back();
+
+    for (unsigned i = 0; i < instruction->operand_count; i++)
+      if (instruction->operands[i]->kind == IRValueKind::Instruction)
+        mark_live(&state, instruction->operands[i]->instruction);
+
+    if (instruction->opcode == IROpcode::Load && state.non_escaping_allocas.contains(instruction->operands[0]))
+      for (IRInstruction* store : state.stores_to_alloca[instruction->operands[0]])
+        mark_live(&state, store);
+  }
+
+  for (IRBasicBlock* block = function->first_block; block; block = block->next) {
+    IRInstruction* next_instruction;
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = next_instruction) {
+      next_instruction = instruction->next;
+      if (state.live.contains(instruction))
+        continue;
+
+      if (is_store_to_non_escaping_alloca(&state, instruction))
+        statistics->dead_stores_eliminated++;
+      else
+        statistics->dead_code_eliminated++;
+      ir_remove_instruction(instruction);
+    }
+  }
+}
@@ -0,0 +1,200 @@
+#include "object_file.h"
+
+#include <cassert>
+
+// https://refspecs.linuxfoundation.org/elf/gabi4+/contents.html
+//
+// the structures are written out field by field in little endian, rather
+// than by including <elf.h>, which macOS doesn't have
+//
+// the file is laid out as
+//      ELF header
+//      .text
+//      .rela.text
+//      .symtab
+//      .strtab
+//      .shstrtab
+//      section headers
+// plus an empty .note.GNU-stack, which tells the linker the stack doesn't
+// need to be executable
+
+enum ElfSection : unsigned {
+  SectionNull,
+  SectionText,
+  SectionRelaText,
+  SectionSymtab,
+  SectionStrtab,
+  SectionShstrtab,
+  SectionNoteGnuStack,
+  SectionCount
+};
+
+struct ElfBuffer {
+  std::vector<unsigned char> bytes;
+};
+
+static void append_bytes(ElfBuffer* buffer, unsigned long long value, unsigned count)
+{
+  for (unsigned i = 0; i < count; i++)
+    buffer->bytes.push_back((unsigned char)(value >> (8 * i)));
+}
+
+static void align_to(ElfBuffer* buffer, unsigned alignment)
+{
+  while (buffer->bytes.size() % alignment)
+    buffer->bytes.push_back(0);
+}
+
+// string tables start with a null byte, so index 0 is the empty string
+static unsigned add_string(std::string* table, std::string const& string)
+{
+  unsigned index = table->size();
+  *table += string;
+  table->push_back('\0');
+  return index;
+}
+
+struct SectionHeader {
+  unsigned name;
+  unsigned type;
+  unsigned long long flags;
+  unsigned long long offset;
+  unsigned long long size;
+  unsigned link;
+  unsigned info;
+  unsigned long long alignment;
+  unsigned long long entry_size;
+};
+
+static void write_symbol(ElfBuffer* buffer, unsigned name, unsigned char info, unsigned short section, unsigned long long value,
+    unsigned long long size)
+{
+  append_bytes(buffer, name, 4);
+  append_bytes(buffer, info, 1);
+  append_bytes(buffer, 0, 1); // st_other, default visibility
+  append_bytes(buffer, section, 2);
+  append_bytes(buffer, value, 8);
+  append_bytes(buffer, size, 8);
+}
+
+unsigned find_or_add_object_symbol(ObjectFile* object, std::string const& name)
+{
+  for (unsigned i = 0; i < object->symbols.size(); i++)
+    if (object->symbols[i].name == name)
+      return i;
+
+  object->symbols.push_back({ name, 0, 0, true, false });
+  return object->symbols.size() - 1;
+}
+
+void write_elf_object(ObjectFile const* object, FILE* outfile)
+{
+  constexpr unsigned char STB_LOCAL = 0, STB_GLOBAL = 1;
+  constexpr unsigned char STT_NOTYPE = 0, STT_FUNC = 2, STT_SECTION = 3;
+
+  ElfBuffer buffer;
+  SectionHeader sections[SectionCount] = {};
+
+  std::string section_names(1, '\0');
+  std::string symbol_names(1, '\0');
+
+  // ELF header, e_shoff is patched at the end
+  buffer.bytes = { 0x7f, 'E', 'L', 'F', 2 /* 64 bit */, 1 /* little endian */, 1 /* version */, 0 /* System V ABI */ };
+  append_bytes(&buffer, 0, 8);
+  append_bytes(&buffer, 1, 2);  // e_type, relocatable
+  append_bytes(&buffer, 62, 2); // e_machine, x86-64
+  append_bytes(&buffer, 1, 4);  // e_version
+  append_bytes(&buffer, 0, 8);  // e_entry
+  append_bytes(&buffer, 0, 8);  // e_phoff
+  size_t section_header_offset_position = buffer.bytes.size();
+  append_bytes(&buffer, 0, 8);            // e_shoff
+  append_bytes(&buffer, 0, 4);            // e_flags
+  append_bytes(&buffer, 64, 2);           // e_ehsize
+  append_bytes(&buffer, 0, 2);            // e_phentsize
+  append_bytes(&buffer, 0, 2);            // e_phnum
+  append_bytes(&buffer, 64, 2);           // e_shentsize
+  append_bytes(&buffer, SectionCount, 2); // e_shnum
+  append_bytes(&buffer, SectionShstrtab, 2);
+  assert(buffer.bytes.size() == 64);
+
+  // .text
+  align_to(&buffer, 16);
+  sections[SectionText] = { add_string(&section_names, ".text"), 1 /* SHT_PROGBITS */, 0x6 /* SHF_ALLOC | SHF_EXECINSTR */, buffer.bytes.size(),
+    object->text.size(), 0, 0, 16, 0 };
+  buffer.bytes.insert(buffer.bytes.end(), object->text.begin(), object->text.end());
+
+  // local symbols have to come before global ones, so work out where each
+  // symbol ends up before writing relocations that refer to them. 0 is the
+  // null symbol and 1 the .text section
+  std::vector<unsigned> symbol_index(object->symbols.size());
+  unsigned next_index = 2;
+  for (int pass = 0; pass < 2; pass++)
+    for (size_t i = 0; i < object->symbols.size(); i++)
+      if (object->symbols[i].is_global == (pass == 1))
+        symbol_index[i] = next_index++;
+  unsigned first_global = 2;
+  for (ObjectSymbol const& symbol : object->symbols)
+    first_global += !symbol.is_global;
+
+  // .rela.text
+  align_to(&buffer, 8);
+  sections[SectionRelaText] = { add_string(&section_names, ".rela.text"), 4 /* SHT_RELA */, 0x40 /* SHF_INFO_LINK */, buffer.bytes.size(),
+    object->relocations.size() * 24, SectionSymtab, SectionText, 8, 24 };
+  for (ObjectRelocation const& relocation : object->relocations) {
+    append_bytes(&buffer, relocation.offset, 8);
+    append_bytes(&buffer, ((unsigned long long)symbol_index[relocation.symbol] << 32) | (unsigned)relocation.type, 8);
+    append_bytes(&buffer, (unsigned long long)relocation.addend, 8);
+  }
+
+  // .symtab
+  align_to(&buffer, 8);
+  size_t symtab_offset = buffer.bytes.size();
+  write_symbol(&buffer, 0, 0, 0, 0, 0);
+  write_symbol(&buffer, 0, (STB_LOCAL << 4) | STT_SECTION, SectionText, 0, 0);
+  for (int pass = 0; pass < 2; pass++)
+    for (ObjectSymbol const& symbol : object->symbols) {
+      if (symbol.is_global != (pass == 1))
+        continue;
+
+      unsigned char binding = symbol.is_global ? STB_GLOBAL : STB_LOCAL;
+      unsigned char type = symbol.is_defined ? STT_FUNC : STT_NOTYPE;
+      unsigned short section = symbol.is_defined ? (unsigned short)SectionText : 0 /* SHN_UNDEF */;
+      write_symbol(&buffer, add_string(&symbol_names, symbol.name), (binding << 4) | type, section, symbol.offset, symbol.size);
+    }
+  sections[SectionSymtab] = { add_string(&section_names, ".symtab"), 2 /* SHT_SYMTAB */, 0, symtab_offset, buffer.bytes.size() - symtab_offset,
+    SectionStrtab, first_global, 8, 24 };
+
+  // .strtab
+  sections[SectionStrtab]
+      = { add_string(&section_names, ".strtab"), 3 /* SHT_STRTAB */, 0, buffer.bytes.size(), symbol_names.size(), 0, 0, 1, 0 };
+  buffer.bytes.insert(buffer.bytes.end(), symbol_names.begin(), symbol_names.end());
+
+  // .note.GNU-stack has no contents, it only has to exist
+  sections[SectionNoteGnuStack] = { add_string(&section_names, ".note.GNU-stack"), 1 /* SHT_PROGBITS */, 0, buffer.bytes.size(), 0, 0, 0, 1, 0 };
+
+  // .shstrtab, which has to name itself before it's written out
+  unsigned shstrtab_name = add_string(&section_names, ".shstrtab");
+  sections[SectionShstrtab] = { shstrtab_name, 3 /* SHT_STRTAB */, 0, buffer.bytes.size(), section_names.size(), 0, 0, 1, 0 };
+  buffer.bytes.insert(buffer.bytes.end(), section_names.begin(), section_names.end());
+
+  // section headers
+  align_to(&buffer, 8);
+  unsigned long long section_header_offset = buffer.bytes.size();
+  for (SectionHeader const& section : sections) {
+    append_bytes(&buffer, section.name, 4);
+    append_bytes(&buffer, section.type, 4);
+    append_bytes(&buffer, section.flags, 8);
+    append_bytes(&buffer, 0, 8); // sh_addr
+    append_bytes(&buffer, section.offset, 8);
+    append_bytes(&buffer, section.size, 8);
+    append_bytes(&buffer, section.link, 4);
+    append_bytes(&buffer, section.info, 4);
+    append_bytes(&buffer, section.alignment, 8);
+    append_bytes(&buffer, section.entry_size, 8);
+  }
+
+  for (unsigned i = 0; i < 8; i++)
+    buffer.bytes[section_header_offset_position + i] = (unsigned char)(section_header_offset >> (8 * i));
+
+  fwrite(buffer.bytes.data(), 1, buffer.bytes.size(), outfile);
+}
@@ -0,0 +1,320 @@
+#include "optimize.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// hot/cold splitting, after LLVM's HotColdSplitting pass
+//
+// code that hardly ever runs still takes up room in the instruction cache and
+// the TLB next to the code that does. Cold regions of a function are moved
+// out into functions of their own, and whole functions are placed in
+// .text.hot or .text.unlikely, so what runs ends up packed together
+//
+// a block is cold if
+//
+//   it ends in unreachable, which is where calls to _Noreturn functions
+//   leave off, or calls a function that is cold itself
+//
+//   the profile says every edge into it was never taken
+//
+//   every block it branches to is cold, or every block branching to it is
+//
+// a cold block dominating a region of cold blocks that nothing leaves except
+// by returning or not returning at all becomes f.cold.N, taking every value
+// from outside the region it uses as an argument
+//
+//   if.then1:                        if.then1:
+//     %5 = load i32, ptr %2            call void @f.cold.1(ptr %2)
+//     call void @fail(i32 %5)          unreachable
+//     unreachable
+//                                    define internal void @f.cold.1(ptr %0) cold noreturn section ".text.unlikely"
+//
+// a region that returns returns the function's value from f.cold.N, which the
+// caller then returns. Allocas stay behind in the caller's entry block and
+// are passed by address, which is safe because this runs after every pass
+// that relies on locals not escaping
+//
+// whole functions are cold if their entry block is, or if the profile says
+// they never ran, and hot if the profile has them entered at least a
+// hundredth as often as the most frequently entered function
+
+// the call that replaces a region and passing its arguments cost about as much
+// as a few instructions, so smaller regions are left where they are
+static constexpr unsigned minimum_outlined_instructions = 4;
+
+static constexpr unsigned long long hot_entry_count_fraction = 100;
+
+// every edge from from to to has weight zero, while some edge out of from doesn't
+static bool is_cold_edge(IRBasicBlock const* from, IRBasicBlock const* to)
+{
+  IRInstruction const* terminator = ir_block_terminator(from);
+  if (!terminator || !terminator->branch_weights)
+    return false;
+
+  unsigned long long total = 0;
+  unsigned long long to_target = 0;
+  for (unsigned i = 0; i < terminator->target_count; i++) {
+    total += terminator->branch_weights[i];
+    if (terminator->targets[i] == to)
+      to_target += terminator->branch_weights[i];
+  }
+  return total && !to_target;
+}
+
+static bool calls_cold_function(IRBasicBlock const* block)
+{
+  for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+    if (instruction->opcode == IROpcode::Call && instruction->callee->is_cold)
+      return true;
+  return false;
+}
+
+static std::unordered_set<IRBasicBlock const*> find_cold_blocks(IRFunction* function, ControlFlowGraph const* cfg)
+{
+  std::unordered_set<IRBasicBlock const*> cold;
+  for (IRBasicBlock* block : cfg->reverse_postorder) {
+    IRInstruction const* terminator = ir_block_terminator(block);
+    if ((terminator && terminator->opcode == IROpcode::Unreachable) || calls_cold_function(block))
+      cold.insert(block);
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (IRBasicBlock* block : cfg->reverse_postorder) {
+      if (cold.contains(block))
+        continue;
+
+      std::vector<IRBasicBlock*> const& successors = cfg->successors.at(block);
+      bool all_successors_cold = !successors.empty();
+      for (IRBasicBlock* successor : successors)
+        all_successors_cold = all_successors_cold && cold.contains(successor);
+
+      // the entry block has the function's caller as a predecessor too
+      bool all_predecessors_cold = false;
+      if (block != function->first_block) {
+        std::vector<IRBasicBlock*> const& predecessors = cfg->predecessors.at(block);
+        all_predecessors_cold = !predecessors.empty();
+        for (IRBasicBlock* predecessor : predecessors)
+          all_predecessors_cold = all_predecessors_cold && (cold.contains(predecessor) || is_cold_edge(predecessor, block));
+      }
+
+      if (all_successors_cold || all_predecessors_cold) {
+        cold.insert(block);
+        changed = true;
+      }
+    }
+  }
+  return cold;
+}
+
+static bool is_cold_function(IRFunction* function)
+{
+  if (function->has_entry_count && function->entry_count == 0)
+    return true;
+
+  ControlFlowGraph cfg = compute_control_flow_graph(function);
+  return find_cold_blocks(function, &cfg).contains(function->first_block);
+}
+
+// the blocks dominated by entry, entry first and the rest in layout order, or
+// nothing if they can't be outlined
+static std::vector<IRBasicBlock*> find_cold_region(IRFunction* function, IRBasicBlock* entry, ControlFlowGraph const* cfg,
+    DominatorTree const* dominators, std::unordered_set<IRBasicBlock const*> const* cold)
+{
+  std::unordered_set<IRBasicBlock const*> region;
+  std::vector<IRBasicBlock*> worklist = { entry };
+  while (!worklist.empty()) {
+    IRBasicBlock* block = worklist.back();
+    worklist.pop_back();
+    region.insert(block);
+    if (dominators->children.contains(block))
+      worklist.insert(worklist.end(), dominators->children.at(block).begin(), dominators->children.at(block).end());
+  }
+
+  std::vector<IRBasicBlock*> blocks = { entry };
+  unsigned instruction_count = 0;
+  for (IRBasicBlock* block = function->first_block; block; block = block->next) {
+    if (!region.contains(block))
+      continue;
+    if (!cold->contains(block))
+      return {};
+
+    for (IRBasicBlock* successor : cfg->successors.at(block))
+      if (!region.contains(successor))
+        return {};
+    if (block != entry)
+      for (IRBasicBlock* predecessor : cfg->predecessors.at(block))
+        if (!region.contains(predecessor))
+          return {};
+
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      instruction_count += !ir_opcode_is_terminator(instruction->opcode);
+    if (block != entry)
+      blocks.push_back(block);
+  }
+
+  if (instruction_count < minimum_outlined_instructions)
+    return {};
+  return blocks;
+}
+
+static void move_block(IRBasicBlock* block, IRFunction* to)
+{
+  IRFunction* from = block->parent;
+  if (block->previous)
+    block->previous->next = block->next;
+  else
+    from->first_block = block->next;
+  if (block->next)
+    block->next->previous = block->previous;
+  else
+    from->last_block = block->previous;
+
+  block->parent = to;
+  block->id = to->next_block_id++;
+  block->next = nullptr;
+  block->previous = to->last_block;
+  if (to->last_block)
+    to->last_block->next = block;
+  else
+    to->first_block = block;
+  to->last_block = block;
+}
+
+static void outline_region(IRModule* module, IRFunction* function, std::vector<IRBasicBlock*> const* blocks,
+    ControlFlowGraph const* cfg, unsigned index)
+{
+  std::unordered_set<IRBasicBlock const*> region(blocks->begin(), blocks->end());
+  IRBasicBlock* entry = (*blocks)[0];
+
+  std::vector<IRValue*> inputs;
+  std::unordered_map<IRValue const*, unsigned> input_index;
+  bool returns = false;
+  for (IRBasicBlock* block : *blocks)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      returns = returns || instruction->opcode == IROpcode::Ret;
+      for (unsigned i = 0; i < instruction->operand_count; i++) {
+        IRValue* operand = instruction->operands[i];
+        bool is_input = operand && (operand->kind == IRValueKind::Argument
+            || (operand->kind == IRValueKind::Instruction && !region.contains(operand->instruction->parent)));
+        if (is_input && !input_index.contains(operand)) {
+          input_index[operand] = inputs.size();
+          inputs.push_back(operand);
+        }
+      }
+    }
+
+  std::string name = std::string(function->name) + ".cold." + std::to_string(index);
+  IRFunction* outlined = new_ir_function(module, nullptr, strdup(name.c_str()), returns ? function->return_type : "void", inputs.size());
+  outlined->is_internal = true;
+  outlined->is_cold = true;
+  outlined->is_noreturn = !returns;
+  for (unsigned i = 0; i < inputs.size(); i++)
+    outlined->arguments[i] = ir_argument(inputs[i]->type, i);
+
+  // the entry block can't have predecessors, and entry may be a loop header
+  IRBuilder builder;
+  builder.function = outlined;
+  builder.insertion_block = new_ir_basic_block(outlined, "newFuncRoot");
+  ir_build_br(&builder, entry);
+
+  IRBasicBlock* replacement = insert_ir_basic_block_after(entry, "codeRepl");
+  for (IRBasicBlock* predecessor : cfg->predecessors.at(entry)) {
+    if (region.contains(predecessor))
+      continue;
+    IRInstruction* terminator = ir_block_terminator(predecessor);
+    for (unsigned i = 0; i < terminator->target_count; i++)
+      if (terminator->targets[i] == entry)
+        terminator->targets[i] = replacement;
+  }
+
+  for (IRBasicBlock* block : *blocks) {
+    move_block(block, outlined);
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      for (unsigned i = 0; i < instruction->operand_count; i++)
+        if (instruction->operands[i] && input_index.contains(instruction->operands[i]))
+          instruction->operands[i] = outlined->arguments[input_index.at(instruction->operands[i])];
+
+      // the prototypes no longer match
+      if (instruction->tail_call_kind == IRTailCallKind::MustTail)
+        instruction->tail_call_kind = IRTailCallKind::Tail;
+    }
+  }
+
+  // not a tail call, the arguments can point into this frame
+  builder.function = function;
+  builder.insertion_block = replacement;
+  IRValue* result = ir_build_call(&builder, outlined, inputs.data(), inputs.size());
+  if (returns)
+    ir_build_ret(&builder, result);
+  else
+    ir_build_unreachable(&builder);
+}
+
+static unsigned split_cold_regions(IRModule* module, IRFunction* function)
+{
+  ControlFlowGraph cfg = compute_control_flow_graph(function);
+  DominatorTree dominators = compute_dominator_tree(function, &cfg);
+  std::unordered_set<IRBasicBlock const*> cold = find_cold_blocks(function, &cfg);
+
+  // regions that can be outlined don't overlap, nothing inside one but its
+  // entry has a predecessor outside it
+  std::vector<std::vector<IRBasicBlock*>> regions;
+  for (IRBasicBlock* block : cfg.reverse_postorder) {
+    if (block == function->first_block || !cold.contains(block))
+      continue;
+
+    bool entered_from_hot_code = false;
+    for (IRBasicBlock* predecessor : cfg.predecessors.at(block))
+      entered_from_hot_code = entered_from_hot_code || !cold.contains(predecessor);
+    if (!entered_from_hot_code)
+      continue;
+
+    std::vector<IRBasicBlock*> region = find_cold_region(function, block, &cfg, &dominators, &cold);
+    if (!region.empty())
+      regions.push_back(region);
+  }
+
+  for (unsigned i = 0; i < regions.size(); i++)
+    outline_region(module, function, &regions[i], &cfg, i + 1);
+  return regions.size();
+}
+
+void run_hot_cold_splitting(IRModule* module, OptimizationStatistics* statistics)
+{
+  std::vector<IRFunction*> functions;
+  unsigned long long maximum_entry_count = 0;
+  for (IRFunction* function = module->first_function; function; function = function->next)
+    if (!ir_function_is_declaration(function)) {
+      functions.push_back(function);
+      if (function->has_entry_count && function->entry_count > maximum_entry_count)
+        maximum_entry_count = function->entry_count;
+    }
+
+  // a function that only calls a cold function is cold too
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (IRFunction* function : functions)
+      if (!function->is_cold && is_cold_function(function)) {
+        function->is_cold = true;
+        statistics->hot_cold_cold_functions++;
+        changed = true;
+      }
+  }
+
+  for (IRFunction* function : functions) {
+    if (function->is_cold)
+      continue;
+
+    if (function->has_entry_count && function->entry_count * hot_entry_count_fraction >= maximum_entry_count) {
+      function->is_hot = true;
+      statistics->hot_cold_hot_functions++;
+    }
+    statistics->hot_cold_regions_outlined += split_cold_regions(module, function);
+  }
+}
@@ -0,0 +1,523 @@
+#include "incremental.h"
+
+#include "codegen.h"
+#include "compilation_cache.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+// incremental compiles
+//
+// the parser hashes each external declaration's tokens, after macro
+// expansion. A function's code depends on its own declarations, and on the
+// functions it refers to, since a call can be inlined or make the caller
+// cold. So each function is keyed by its own hashes and the keys of the
+// functions it refers to. Changing a function only changes the keys of the
+// functions that reach it, not the ones it calls, or the ones that call
+// something else
+//
+// the exception is the inliner's bonus for the last call to an internal
+// function, which depends on how many calls to it are left in the whole
+// module. Every function whose body can end up with a call to an internal
+// function g, by referring to g directly or to something that does, counts
+// towards it, so a caller that might inline g depends on all of them:
+//
+//      f --> calls(g) --> everything that reaches g
+//
+// keys are per strongly connected component of those dependencies, since a
+// component's functions depend on each other's keys. Declarations that
+// aren't of functions, e.g. typedefs, go into every key
+//
+// a component with no entry in the cache directory is compiled along with
+// everything it depends on, which inlining and the call counts need, and
+// what compiling it printed for each of its functions is its entry. The
+// printed functions are spliced together in the order compiling the whole
+// file would have put them in: functions in the order they were first
+// declared, then the cold regions hot/cold splitting outlined, in the order
+// of the functions they came from. Metadata is numbered again across all of
+// them, so the output is exactly what compiling the whole file prints
+//
+// whether an internal function is deleted once nothing calls it depends on
+// all of its callers, so entries keep every function, as it was before
+// internal functions were deleted, and they're deleted when splicing
+
+static constexpr char entry_magic[] = "miniclang incremental 2\n";
+
+static IncrementalStatistics statistics;
+
+struct KeptFunction {
+  std::string name;
+  // the function a cold region was outlined from, empty for the others
+  std::string outlined_from;
+
+  // for deleting the internal functions nothing calls. What it calls is from
+  // before cold regions were outlined from it
+  bool is_internal;
+  std::vector<std::string> callees;
+
+  PrintedIRFunction printed;
+};
+
+// a function's declarations and what its definition refers to
+struct DeclaredFunction {
+  std::string name;
+  std::vector<ExternalDeclaration const*> declarations;
+  std::vector<unsigned> references;
+  bool is_defined;
+  bool is_internal;
+};
+
+struct Component {
+  // in the order they were declared
+  std::vector<unsigned> functions;
+  std::string key;
+
+  // in the order compiling it printed them
+  std::vector<KeptFunction> printed_functions;
+  bool was_kept;
+};
+
+bool can_compile_incrementally(CompilerOptions const* options)
+{
+  // profiles add globals, and weigh each function against the hottest in
+  // the module. Declarations read from a precompiled header have no hash
+  return !options->emit_object && !options->emit_pch && !options->emit_index && !options->profile_generate && !options->profile_use_path
+      && !options->include_pch_path;
+}
+
+// every name a function body refers to, even where a local hides the global
+// of that name. Depending on a function needlessly only costs recompiling
+static void collect_references(ASTNode const* node, std::vector<std::string const*>* names)
+{
+  for (; node; node = node->next) {
+    if (node->type == ASTNodeType::VariableReference)
+      names->push_back(&node->referenced_variable);
+    collect_references(node->lhs, names);
+    collect_references(node->rhs, names);
+    collect_references(node->conditional, names);
+    collect_references(node->arguments, names);
+    collect_references(node->body, names);
+  }
+}
+
+// Tarjan's algorithm, as for the call graph in src/analysis.cpp
+struct DependencyComponents {
+  std::vector<std::vector<unsigned>> const* edges;
+  std::vector<unsigned> index;
+  std::vector<unsigned> lowlink;
+  std::vector<bool> is_on_stack;
+  std::vector<unsigned> stack;
+  unsigned next_index;
+
+  // each node's component, numbered in the order they're found, which is
+  // every component after the ones it depends on
+  std::vector<unsigned> component;
+  unsigned component_count;
+};
+
+static constexpr unsigned unvisited = ~0u;
+
+static void strong_connect(DependencyComponents* state, unsigned node)
+{
+  state->index[node] = state->lowlink[node] = state->next_index++;
+  state->stack.push_back(node);
+  state->is_on_stack[node] = true;
+
+  for (unsigned successor : (*state->edges)[node]) {
+    if (state->index[successor] == unvisited) {
+      strong_connect(state, successor);
+      state->lowlink[node] = std::min(state->lowlink[node], state->lowlink[successor]);
+    } else if (state->is_on_stack[successor]) {
+      state->lowlink[node] = std::min(state->lowlink[node], state->index[successor]);
+    }
+  }
+
+  if (state->lowlink[node] != state->index[node])
+    return;
+  unsigned member;
+  do {
+    member = state->stack.back();
+    state->stack.pop_back();
+    state->is_on_stack[member] = false;
+    state->component[member] = state->component_count;
+  } while (member != node);
+  state->component_count++;
+}
+
+static DependencyComponents find_dependency_components(std::vector<std::vector<unsigned>> const* edges)
+{
+  DependencyComponents state;
+  state.edges = edges;
+  state.index.assign(edges->size(), unvisited);
+  state.lowlink.assign(edges->size(), 0);
+  state.is_on_stack.assign(edges->size(), false);
+  state.next_index = 0;
+  state.component.assign(edges->size(), 0);
+  state.component_count = 0;
+  for (unsigned node = 0; node < edges->size(); node++)
+    if (state.index[node] == unvisited)
+      strong_connect(&state, node);
+  return state;
+}
+
+static std::string hash_text(unsigned long long hash)
+{
+  char text[17];
+  snprintf(text, sizeof(text), "%016llx", hash);
+  return text;
+}
+
+// an entry is
+//      miniclang incremental 2
+//      <number of functions>
+//      for each of them
+//      <name> <outlined from, or -> <internal, 0 or 1> <tbaa nodes> <metadata nodes> <size of the text>
+//      the functions it calls, separated by spaces
+//      the text, then its metadata nodes a line each
+static std::string write_entry(std::vector<KeptFunction> const& functions)
+{
+  std::string contents = entry_magic;
+  contents += std::to_string(functions.size()) + "\n";
+  for (KeptFunction const& function : functions) {
+    PrintedIRFunction const& printed = function.printed;
+    contents += function.name + " " + (function.outlined_from.empty() ? "-" : function.outlined_from) + " ";
+    contents += std::string(function.is_internal ? "1" : "0") + " ";
+    contents += std::to_string(printed.tbaa_node_count) + " " + std::to_string(printed.metadata.size()) + " ";
+    contents += std::to_string(printed.text.size()) + "\n";
+    for (size_t i = 0; i < function.callees.size(); i++)
+      contents += (i ? " " : "") + function.callees[i];
+    contents += "\n";
+    contents += printed.text;
+    for (std::string const& node : printed.metadata)
+      contents += node + "\n";
+  }
+  return contents;
+}
+
+static bool read_entry(std::string const& contents, std::vector<KeptFunction>* functions)
+{
+  size_t position = strlen(entry_magic);
+  if (contents.compare(0, position, entry_magic) != 0)
+    return false;
+
+  auto read_line = [&](std::string* line) {
+    size_t end = contents.find('\n', position);
+    if (end == std::string::npos)
+      return false;
+    *line = contents.substr(position, end - position);
+    position = end + 1;
+    return true;
+  };
+
+  std::string line;
+  if (!read_line(&line))
+    return false;
+  unsigned long function_count = strtoul(line.c_str(), nullptr, 10);
+  for (unsigned long i = 0; i < function_count; i++) {
+    if (!read_line(&line))
+      return false;
+    char name[256];
+    char outlined_from[256];
+    unsigned is_internal;
+    unsigned tbaa_node_count;
+    unsigned metadata_count;
+    size_t text_size;
+    if (sscanf(line.c_str(), "%255s %255s %u %u %u %zu", name, outlined_from, &is_internal, &tbaa_node_count, &metadata_count, &text_size) != 6
+        || tbaa_node_count > metadata_count)
+      return false;
+
+    KeptFunction function;
+    function.name = name;
+    if (strcmp(outlined_from, "-") != 0)
+      function.outlined_from = outlined_from;
+    function.is_internal = is_internal;
+
+    if (!read_line(&line))
+      return false;
+    for (size_t start = 0; start < line.size();) {
+      size_t end = line.find(' ', start);
+      if (end == std::string::npos)
+        end = line.size();
+      function.callees.push_back(line.substr(start, end - start));
+      start = end + 1;
+    }
+
+    if (contents.size() - position < text_size)
+      return false;
+    function.printed.text = contents.substr(position, text_size);
+    position += text_size;
+    function.printed.tbaa_node_count = tbaa_node_count;
+    function.printed.metadata.resize(metadata_count);
+    for (std::string& node : function.printed.metadata)
+      if (!read_line(&node))
+        return false;
+    functions->push_back(std::move(function));
+  }
+  return position == contents.size();
+}
+
+void emit_llvm_incrementally(TranslationUnit const* translation_unit, std::string const& flags, FILE* outfile, CompilerOptions const* options,
+    OptimizationStatistics* optimization_statistics)
+{
+  // the functions in the order they were first declared, which is the order
+  // codegen declares them in, and the hashes of the other declarations
+  std::vector<DeclaredFunction> functions;
+  std::unordered_map<std::string, unsigned> function_named;
+  std::string shared_hashes;
+  std::vector<ExternalDeclaration const*> declarations;
+  for (ExternalDeclaration const* declaration = translation_unit->external_declarations; declaration; declaration = declaration->next) {
+    declarations.push_back(declaration);
+    bool is_shared = !declaration->root_ast_node;
+    for (ASTNode const* node = declaration->root_ast_node; node; node = node->next) {
+      Object const* object = node->object;
+      if (object->type->fundamental_type != FundamentalType::Function) {
+        is_shared = true;
+        continue;
+      }
+      auto [named, is_new] = function_named.try_emplace(object->identifier, (unsigned)functions.size());
+      if (is_new) {
+        functions.emplace_back();
+        functions.back().name = object->identifier;
+        functions.back().is_defined = false;
+        functions.back().is_internal = false;
+      }
+      DeclaredFunction* function = &functions[named->second];
+      function->declarations.push_back(declaration);
+      function->is_defined |= declaration->type == ExternalDeclarationType::FunctionDefinition;
+      function->is_internal |= (object->declaration_specifier_flags.flags & TypeModifierFlag::Static) != 0;
+    }
+    if (is_shared)
+      shared_hashes += hash_text(declaration->token_hash);
+  }
+
+  for (DeclaredFunction& function : functions)
+    for (ExternalDeclaration const* declaration : function.declarations) {
+      if (declaration->type != ExternalDeclarationType::FunctionDefinition)
+        continue;
+      std::vector<std::string const*> names;
+      collect_references(function_body(declaration->root_ast_node->object), &names);
+      for (std::string const* name : names)
+        if (auto referenced = function_named.find(*name); referenced != function_named.end())
+          if (std::find(function.references.begin(), function.references.end(), referenced->second) == function.references.end())
+            function.references.push_back(referenced->second);
+    }
+
+  // the functions are the first nodes, then a calls(g) node for each
+  // internal function g, see the comment at the top
+  std::vector<std::vector<unsigned>> edges(functions.size());
+  std::vector<std::vector<unsigned>> referenced_by(functions.size());
+  for (unsigned i = 0; i < functions.size(); i++) {
+    edges[i] = functions[i].references;
+    for (unsigned reference : functions[i].references)
+      referenced_by[reference].push_back(i);
+  }
+
+  for (unsigned internal = 0; internal < functions.size(); internal++) {
+    if (!functions[internal].is_internal)
+      continue;
+    unsigned calls = (unsigned)edges.size();
+    edges.emplace_back();
+
+    std::vector<bool> reaches(functions.size(), false);
+    std::vector<unsigned> worklist = { internal };
+    reaches[internal] = true;
+    while (!worklist.empty()) {
+      unsigned function = worklist.back();
+      worklist.pop_back();
+      edges[calls].push_back(function);
+      // a call to itself is never inlined
+      if (function != internal)
+        edges[function].push_back(calls);
+      for (unsigned caller : referenced_by[function])
+        if (!reaches[caller]) {
+          reaches[caller] = true;
+          worklist.push_back(caller);
+        }
+    }
+  }
+
+  DependencyComponents dependencies = find_dependency_components(&edges);
+  std::vector<Component> components(dependencies.component_count);
+  for (unsigned i = 0; i < functions.size(); i++)
+    components[dependencies.component[i]].functions.push_back(i);
+
+  // components are found after the ones they depend on, so those have keys
+  // by the time they're needed
+  for (unsigned c = 0; c < components.size(); c++) {
+    std::vector<std::string> dependency_keys;
+    for (unsigned node = 0; node < edges.size(); node++) {
+      if (dependencies.component[node] != c)
+        continue;
+      for (unsigned successor : edges[node])
+        if (unsigned dependency = dependencies.component[successor]; dependency != c)
+          dependency_keys.push_back(components[dependency].key);
+    }
+    std::sort(dependency_keys.begin(), dependency_keys.end());
+    dependency_keys.erase(std::unique(dependency_keys.begin(), dependency_keys.end()), dependency_keys.end());
+
+    Component& component = components[c];
+    std::string key_text = std::string("incremental") + '\0' + flags + '\0' + shared_hashes + '\0';
+    for (unsigned function : component.functions) {
+      key_text += functions[function].name + " ";
+      for (ExternalDeclaration const* declaration : functions[function].declarations)
+        key_text += hash_text(declaration->token_hash);
+      key_text += '\0';
+    }
+    for (std::string const& dependency_key : dependency_keys)
+      key_text += dependency_key;
+    component.key = cache_entry_key(key_text);
+
+    // a calls(g) node alone is in nothing's output
+    if (component.functions.empty()) {
+      component.was_kept = true;
+      continue;
+    }
+    std::string contents;
+    component.was_kept = read_cache_entry(options, component.key, &contents) && read_entry(contents, &component.printed_functions);
+    if (!component.was_kept)
+      component.printed_functions.clear();
+  }
+
+  // the components that changed and everything they depend on
+  std::vector<bool> is_compiled(edges.size(), false);
+  std::vector<unsigned> worklist;
+  for (unsigned i = 0; i < functions.size(); i++)
+    if (!components[dependencies.component[i]].was_kept) {
+      is_compiled[i] = true;
+      worklist.push_back(i);
+    }
+  while (!worklist.empty()) {
+    unsigned node = worklist.back();
+    worklist.pop_back();
+    for (unsigned successor : edges[node])
+      if (!is_compiled[successor]) {
+        is_compiled[successor] = true;
+        worklist.push_back(successor);
+      }
+  }
+
+  // their declarations and the shared ones, still in order. Codegen only
+  // follows next, so copies can be chained differently
+  std::vector<ExternalDeclaration> to_compile;
+  to_compile.reserve(declarations.size());
+  for (ExternalDeclaration const* declaration : declarations) {
+    bool is_needed = !declaration->root_ast_node;
+    for (ASTNode const* node = declaration->root_ast_node; node; node = node->next) {
+      auto function = function_named.find(node->object->identifier);
+      is_needed |= function == function_named.end() || is_compiled[function->second];
+    }
+    if (!is_needed)
+      continue;
+    to_compile.push_back(*declaration);
+    to_compile.back().next = nullptr;
+    if (to_compile.size() > 1)
+      to_compile[to_compile.size() - 2].next = &to_compile.back();
+  }
+
+  bool is_optimized = options->optimization_level > 0;
+  if (!to_compile.empty()) {
+    IRModule* module = lower_translation_unit(&to_compile[0]);
+    std::unordered_map<std::string, KeptFunction> kept_functions;
+    if (is_optimized)
+      optimize_ir_functions(module, optimization_statistics);
+    for (IRFunction const* function = module->first_function; function; function = function->next) {
+      KeptFunction& kept = kept_functions[function->name];
+      kept.name = function->name;
+      kept.is_internal = function->is_internal;
+      for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+        for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+          if (instruction->opcode == IROpcode::Call
+              && std::find(kept.callees.begin(), kept.callees.end(), instruction->callee->name) == kept.callees.end())
+            kept.callees.push_back(instruction->callee->name);
+    }
+    if (is_optimized)
+      run_hot_cold_splitting(module, optimization_statistics);
+    estimate_branch_weights(module);
+
+    for (IRFunction const* function = module->first_function; function; function = function->next) {
+      // outlined regions are named <function>.cold.<n>, which no C name can be
+      KeptFunction kept;
+      if (char const* suffix = strstr(function->name, ".cold.")) {
+        kept.name = function->name;
+        kept.outlined_from.assign(function->name, suffix - function->name);
+        kept.is_internal = function->is_internal;
+      } else {
+        kept = std::move(kept_functions.at(function->name));
+      }
+      kept.printed = print_ir_function_alone(function);
+
+      Component& component = components[dependencies.component[function_named.at(kept.outlined_from.empty() ? kept.name : kept.outlined_from)]];
+      if (!component.was_kept)
+        component.printed_functions.push_back(std::move(kept));
+    }
+  }
+
+  for (unsigned i = 0; i < functions.size(); i++) {
+    if (!functions[i].is_defined)
+      continue;
+    if (is_compiled[i])
+      statistics.functions_compiled++;
+    if (components[dependencies.component[i]].was_kept)
+      statistics.functions_reused++;
+  }
+  for (Component const& component : components)
+    if (!component.was_kept)
+      write_cache_entry(options, component.key, write_entry(component.printed_functions));
+
+  std::unordered_map<std::string, KeptFunction const*> printed_functions;
+  std::unordered_map<std::string, std::vector<PrintedIRFunction const*>> outlined;
+  for (Component const& component : components)
+    for (KeptFunction const& function : component.printed_functions) {
+      if (function.outlined_from.empty())
+        printed_functions[function.name] = &function;
+      else
+        outlined[function.outlined_from].push_back(&function.printed);
+    }
+
+  // the internal functions nothing calls any more, as compiling the whole
+  // file deletes them before outlining cold regions
+  if (is_optimized) {
+    std::unordered_map<std::string, unsigned> call_sites;
+    for (auto const& [name, function] : printed_functions)
+      for (std::string const& callee : function->callees)
+        call_sites[callee]++;
+    std::vector<std::string> uncalled;
+    for (auto const& [name, function] : printed_functions)
+      if (function->is_internal && !call_sites.contains(name))
+        uncalled.push_back(name);
+    while (!uncalled.empty()) {
+      auto function = printed_functions.find(uncalled.back());
+      uncalled.pop_back();
+      for (std::string const& callee : function->second->callees)
+        if (--call_sites[callee] == 0 && printed_functions.contains(callee) && printed_functions.at(callee)->is_internal)
+          uncalled.push_back(callee);
+      printed_functions.erase(function);
+      optimization_statistics->inliner_functions_deleted++;
+    }
+  }
+
+  std::vector<PrintedIRFunction const*> printed;
+  for (DeclaredFunction const& function : functions)
+    if (auto kept = printed_functions.find(function.name); kept != printed_functions.end())
+      printed.push_back(&kept->second->printed);
+  for (DeclaredFunction const& function : functions)
+    if (auto regions = outlined.find(function.name); regions != outlined.end() && printed_functions.contains(function.name))
+      printed.insert(printed.end(), regions->second.begin(), regions->second.end());
+  print_spliced_ir_functions(printed, outfile);
+}
+
+IncrementalStatistics incremental_statistics() { return statistics; }
+
+void reset_incremental_statistics() { statistics = {}; }
+
+void print_incremental_statistics(FILE* outfile)
+{
+  fprintf(outfile, "===-------------------------------------------===\n");
+  fprintf(outfile, "          miniclang incremental statistics\n");
+  fprintf(outfile, "===-------------------------------------------===\n");
+  fprintf(outfile, "%8u functions reused\n", statistics.functions_reused);
+  fprintf(outfile, "%8u functions compiled\n", statistics.functions_compiled);
+}
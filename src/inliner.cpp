@@ -0,0 +1,242 @@
+#include "analysis.h"
+#include "optimize.h"
+
+#include <unordered_map>
+#include <vector>
+
+// function inlining
+//
+// a call to a small function costs more than the function does: arguments
+// are moved into registers, the call and ret, the callee's prologue and
+// epilogue, and every value the caller had in a register being treated as
+// clobbered. Inlining replaces the call with a copy of the callee's body,
+// after which the caller's passes can also optimize the two together
+//
+// functions are visited bottom up over the call graph, see
+// optimize_ir_module, so by the time a call is considered its callee has
+// already had its own calls inlined and been optimized. Its cost is then what
+// the copy would really cost, and a chain of small helpers collapses into its
+// outermost caller. Calls within a strongly connected component are
+// recursive and never inlined
+//
+// the cost model is LLVM's in miniature. A callee costs an instruction's
+// worth per instruction, minus the call and argument moves inlining saves,
+// and a call site is inlined if that is under a threshold, a higher one if
+// the callee was declared inline. The exception is
+// the last call to an internal function: once it's inlined nobody can call
+// the function, so it's deleted and inlining is a pure win unless the
+// function is huge. To keep a caller from growing without bound when it
+// calls many functions that are each cheap enough, inlining into it stops
+// once it gets too big
+//
+// the transformation, for %r = call @f(args) in block b
+//
+//   b:                      b:
+//     ...                     ...
+//     %r = call @f(args)      br inline.entry
+//     rest              =>  inline.entry: f's body, args for f's arguments
+//                             ret v becomes store v, %slot; br inline.cont
+//                           inline.cont:
+//                             %r = load %slot
+//                             rest
+//
+// the return value goes through an alloca since there are no phis, value
+// numbering forwards the store to the load when there's a single return. The
+// slot is accessed as char, the C type of the value is long gone
+// f's allocas join the caller's at the top of its entry block
+
+// the cost a call site may have and still be inlined
+static constexpr int inline_threshold = 40;
+
+// the same for functions declared inline, which LLVM also inlines more
+// eagerly when clang marks them inlinehint
+static constexpr int inline_hint_threshold = 100;
+
+// subtracted from the cost of the last call to an internal function
+static constexpr int last_call_to_internal_bonus = 400;
+
+// no more inlining into a function once it's this many instructions
+static constexpr unsigned caller_size_limit = 2000;
+
+// allocas are free, they only make the caller's frame bigger
+static int function_cost(IRFunction const* function)
+{
+  int cost = 0;
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      if (instruction->opcode != IROpcode::Alloca)
+        cost++;
+  return cost;
+}
+
+static std::unordered_map<IRFunction const*, unsigned> count_call_sites(IRModule const* module)
+{
+  std::unordered_map<IRFunction const*, unsigned> call_sites;
+  for (IRFunction const* function = module->first_function; function; function = function->next)
+    for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+      for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+        if (instruction->opcode == IROpcode::Call)
+          call_sites[instruction->callee]++;
+  return call_sites;
+}
+
+static int call_site_cost(IRInstruction const* call, std::unordered_map<IRFunction const*, unsigned> const* call_sites)
+{
+  IRFunction const* callee = call->callee;
+
+  // the call itself and moving each argument into place go away
+  int cost = function_cost(callee) - 1 - (int)call->operand_count;
+
+  if (callee->is_internal && call_sites->at(callee) == 1)
+    cost -= last_call_to_internal_bonus;
+
+  return cost;
+}
+
+static IRValue* mapped_value(std::unordered_map<IRValue const*, IRValue*> const* value_map, IRValue* value)
+{
+  auto mapping = value_map->find(value);
+  return mapping == value_map->end() ? value : mapping->second;
+}
+
+static void inline_call(IRInstruction* call)
+{
+  IRBasicBlock* block = call->parent;
+  IRFunction* caller = block->parent;
+  IRFunction const* callee = call->callee;
+
+  IRBuilder builder;
+  builder.function = caller;
+
+  // the caller's copy of the callee's return value
+  IRValue* return_slot = call->result ? ir_build_alloca(&builder, call->result->type) : nullptr;
+
+  std::unordered_map<IRValue const*, IRValue*> value_map;
+  for (unsigned i = 0; i < callee->argument_count; i++)
+    value_map[callee->arguments[i]] = call->operands[i];
+
+  // everything after the call moves to a new block, which the inlined returns branch to
+  IRBasicBlock* continuation = insert_ir_basic_block_after(block, "inline.cont");
+  if (call->result) {
+    builder.insertion_block = continuation;
+    IRValue* result = ir_build_load(&builder, call->result->type, return_slot);
+    result->instruction->tbaa_type = ir_tbaa_omnipotent_char();
+    ir_replace_all_uses(caller, call->result, result);
+  }
+  while (call->next) {
+    IRInstruction* moved = call->next;
+    ir_remove_instruction(moved);
+    ir_append_instruction(continuation, moved);
+  }
+
+  // copy the blocks first, so branches can be pointed at their copies
+  std::unordered_map<IRBasicBlock const*, IRBasicBlock*> block_map;
+  IRBasicBlock* previous_copy = block;
+  for (IRBasicBlock const* callee_block = callee->first_block; callee_block; callee_block = callee_block->next) {
+    char const* name = callee_block == callee->first_block ? "inline.entry" : callee_block->name;
+    previous_copy = insert_ir_basic_block_after(previous_copy, name);
+    block_map[callee_block] = previous_copy;
+  }
+
+  std::vector<IRInstruction*> copies;
+  for (IRBasicBlock const* callee_block = callee->first_block; callee_block; callee_block = callee_block->next) {
+    IRBasicBlock* copy_block = block_map.at(callee_block);
+
+    for (IRInstruction const* instruction = callee_block->first_instruction; instruction; instruction = instruction->next) {
+      if (instruction->opcode == IROpcode::Alloca) {
+        value_map[instruction->result] = ir_build_alloca(&builder, instruction->allocated_type);
+        continue;
+      }
+
+      if (instruction->opcode == IROpcode::Ret) {
+        builder.insertion_block = copy_block;
+        if (instruction->operand_count == 1) {
+          ir_build_store(&builder, instruction->operands[0], return_slot);
+          copy_block->last_instruction->tbaa_type = ir_tbaa_omnipotent_char();
+          copies.push_back(copy_block->last_instruction);
+        }
+        ir_build_br(&builder, continuation);
+        continue;
+      }
+
+      // the ret after a tail call became a br to inline.cont
+      IRInstruction* copy = ir_clone_instruction(instruction);
+      copy->tail_call_kind = IRTailCallKind::None;
+      for (unsigned i = 0; i < copy->target_count; i++)
+        copy->targets[i] = block_map.at(copy->targets[i]);
+      if (instruction->result)
+        value_map[instruction->result] = copy->result;
+
+      ir_append_instruction(copy_block, copy);
+      copies.push_back(copy);
+    }
+  }
+
+  // operands can refer to values defined in blocks copied later, so they're
+  // only remapped once everything has been copied
+  for (IRInstruction* copy : copies)
+    for (unsigned i = 0; i < copy->operand_count; i++)
+      copy->operands[i] = mapped_value(&value_map, copy->operands[i]);
+
+  ir_remove_instruction(call);
+  builder.insertion_block = block;
+  ir_build_br(&builder, block_map.at(callee->first_block));
+}
+
+void run_inliner(IRModule* module, IRFunction* function, CallGraph const* call_graph, OptimizationStatistics* statistics)
+{
+  unsigned component = call_graph->component.at(function);
+
+  // calls in the inlined code aren't considered again, they were already
+  // turned down when inlining into the callee
+  std::vector<IRInstruction*> calls;
+  for (IRBasicBlock* block = function->first_block; block; block = block->next)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      if (instruction->opcode == IROpcode::Call && !ir_function_is_declaration(instruction->callee)
+          && call_graph->component.at(instruction->callee) != component)
+        calls.push_back(instruction);
+
+  for (IRInstruction* call : calls) {
+    std::unordered_map<IRFunction const*, unsigned> call_sites = count_call_sites(module);
+    int cost = call_site_cost(call, &call_sites);
+    if (cost > (call->callee->is_inline_hint ? inline_hint_threshold : inline_threshold))
+      continue;
+
+    int caller_size = (int)ir_count_instructions(function);
+    if (caller_size + cost > (int)caller_size_limit)
+      continue;
+
+    inline_call(call);
+    statistics->inliner_call_sites_inlined++;
+  }
+}
+
+// internal functions nobody calls any more, usually because every call to
+// them was inlined. Deleting one can leave the functions only it called
+// uncalled too
+void remove_unused_internal_functions(IRModule* module, OptimizationStatistics* statistics)
+{
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    std::unordered_map<IRFunction const*, unsigned> call_sites = count_call_sites(module);
+
+    IRFunction* previous = nullptr;
+    for (IRFunction* function = module->first_function; function; function = function->next) {
+      if (!function->is_internal || call_sites.contains(function)) {
+        previous = function;
+        continue;
+      }
+
+      if (previous)
+        previous->next = function->next;
+      else
+        module->first_function = function->next;
+      if (module->last_function == function)
+        module->last_function = previous;
+
+      statistics->inliner_functions_deleted++;
+      changed = true;
+    }
+  }
+}
@@ -0,0 +1,1199 @@
+#include "ir.h"
+
+#include <cassert>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+IRModule* new_ir_module()
+{
+  IRModule* module = (IRModule*)malloc(sizeof(IRModule));
+
+  module->first_function = nullptr;
+  module->last_function = nullptr;
+  module->first_global = nullptr;
+  module->last_global = nullptr;
+
+  return module;
+}
+
+static IRValue* new_ir_value(IRValueKind kind, char const* type)
+{
+  IRValue* value = (IRValue*)malloc(sizeof(IRValue));
+
+  value->kind = kind;
+  value->type = type;
+  value->constant = 0;
+  value->argument_index = 0;
+  value->instruction = nullptr;
+  value->global = nullptr;
+  value->is_noalias = false;
+
+  return value;
+}
+
+IRValue* ir_constant(char const* type, long long constant)
+{
+  IRValue* value = new_ir_value(IRValueKind::Constant, type);
+  value->constant = constant;
+  return value;
+}
+
+IRValue* ir_argument(char const* type, unsigned index)
+{
+  IRValue* value = new_ir_value(IRValueKind::Argument, type);
+  value->argument_index = index;
+  return value;
+}
+
+IRGlobal* new_ir_global(IRModule* module, char const* name, char const* type, char const* initializer)
+{
+  IRGlobal* global = (IRGlobal*)malloc(sizeof(IRGlobal));
+
+  global->name = name;
+  global->type = type;
+  global->initializer = initializer;
+  global->section = nullptr;
+  global->is_private = false;
+  global->is_constant = false;
+  global->is_used = false;
+  global->next = nullptr;
+
+  if (module->last_global)
+    module->last_global->next = global;
+  else
+    module->first_global = global;
+  module->last_global = global;
+
+  return global;
+}
+
+IRValue* ir_global_address(IRGlobal* global)
+{
+  IRValue* value = new_ir_value(IRValueKind::Global, "ptr");
+  value->global = global;
+  return value;
+}
+
+bool ir_value_is_constant(IRValue const* value, long long constant)
+{
+  return value->kind == IRValueKind::Constant && value->constant == constant;
+}
+
+// vector types are interned, so they can be compared by pointer like the
+// string literals every other type is
+char const* ir_vector_type(char const* element_type, unsigned lanes)
+{
+  static std::unordered_set<std::string> vector_types;
+  return vector_types.insert("<" + std::to_string(lanes) + " x " + element_type + ">").first->c_str();
+}
+
+IRTBAAType const* ir_tbaa_type(char const* name, IRTBAAType const* parent)
+{
+  static std::unordered_map<std::string, IRTBAAType*> types;
+  IRTBAAType*& type = types[name];
+  if (!type) {
+    type = (IRTBAAType*)malloc(sizeof(IRTBAAType));
+    type->name = strdup(name);
+    type->parent = parent;
+  }
+  assert(type->parent == parent && "a tbaa type with two parents");
+  return type;
+}
+
+IRTBAAType const* ir_tbaa_omnipotent_char() { return ir_tbaa_type("omnipotent char", ir_tbaa_type("Simple C/C++ TBAA", nullptr)); }
+
+bool ir_type_is_vector(char const* type) { return type[0] == '<'; }
+
+unsigned ir_vector_lanes(char const* type)
+{
+  assert(ir_type_is_vector(type));
+  return (unsigned)atoi(type + 1);
+}
+
+char const* ir_vector_element_type(char const* type)
+{
+  assert(ir_type_is_vector(type));
+  static std::unordered_set<std::string> element_types;
+
+  char const* element = strstr(type, " x ") + 3;
+  return element_types.insert(std::string(element, strlen(element) - 1)).first->c_str();
+}
+
+unsigned ir_type_size(char const* type)
+{
+  if (ir_type_is_vector(type))
+    return ir_vector_lanes(type) * ir_type_size(ir_vector_element_type(type));
+  if (strcmp(type, "ptr") == 0)
+    return 8;
+
+  assert(type[0] == 'i' && "ir_type_size of a non integer type");
+  unsigned bits = (unsigned)atoi(type + 1);
+  return bits <= 8 ? 1 : bits / 8;
+}
+
+IRFunction* new_ir_function(IRModule* module, Object const* object, char const* name, char const* return_type, unsigned argument_count)
+{
+  IRFunction* function = (IRFunction*)malloc(sizeof(IRFunction));
+
+  function->object = object;
+  function->name = name;
+  function->return_type = return_type;
+  function->is_internal = false;
+  function->is_noreturn = false;
+  function->is_inline_hint = false;
+  function->is_hot = false;
+  function->is_cold = false;
+  function->has_entry_count = false;
+  function->entry_count = 0;
+
+  function->argument_count = argument_count;
+  function->arguments = (IRValue**)malloc(sizeof(IRValue*) * (argument_count + 1));
+
+  function->first_block = nullptr;
+  function->last_block = nullptr;
+  function->next_block_id = 0;
+  function->next = nullptr;
+
+  if (module->last_function)
+    module->last_function->next = function;
+  else
+    module->first_function = function;
+  module->last_function = function;
+
+  return function;
+}
+
+IRBasicBlock* new_ir_basic_block(IRFunction* function, char const* name)
+{
+  IRBasicBlock* block = (IRBasicBlock*)malloc(sizeof(IRBasicBlock));
+
+  block->name = name;
+  block->id = function->next_block_id++;
+  block->first_instruction = nullptr;
+  block->last_instruction = nullptr;
+  block->parent = function;
+  block->next = nullptr;
+  block->previous = function->last_block;
+
+  if (function->last_block)
+    function->last_block->next = block;
+  else
+    function->first_block = block;
+  function->last_block = block;
+
+  return block;
+}
+
+// blocks are printed in list order, so where a block gets inserted decides the layout
+IRBasicBlock* insert_ir_basic_block_after(IRBasicBlock* after, char const* name)
+{
+  IRFunction* function = after->parent;
+  IRBasicBlock* block = new_ir_basic_block(function, name);
+
+  if (after == block->previous)
+    return block;
+
+  // unlink from the end, where new_ir_basic_block put it
+  function->last_block = block->previous;
+  function->last_block->next = nullptr;
+
+  block->previous = after;
+  block->next = after->next;
+  if (after->next)
+    after->next->previous = block;
+  else
+    function->last_block = block;
+  after->next = block;
+
+  return block;
+}
+
+static IRInstruction* new_ir_instruction(IROpcode opcode, unsigned operand_count, unsigned target_count)
+{
+  IRInstruction* instruction = (IRInstruction*)malloc(sizeof(IRInstruction));
+
+  instruction->opcode = opcode;
+  instruction->comparison = IRComparison::None;
+  instruction->result = nullptr;
+  instruction->allocated_type = nullptr;
+  instruction->callee = nullptr;
+  instruction->tail_call_kind = IRTailCallKind::None;
+  instruction->is_volatile = false;
+  instruction->tbaa_type = nullptr;
+  instruction->branch_weights = nullptr;
+
+  instruction->operand_count = operand_count;
+  instruction->operands = (IRValue**)calloc(operand_count + 1, sizeof(IRValue*));
+  instruction->target_count = target_count;
+  instruction->targets = (IRBasicBlock**)calloc(target_count + 1, sizeof(IRBasicBlock*));
+  instruction->case_values = nullptr;
+
+  instruction->parent = nullptr;
+  instruction->previous = nullptr;
+  instruction->next = nullptr;
+
+  return instruction;
+}
+
+static IRValue* give_instruction_result(IRInstruction* instruction, char const* type)
+{
+  instruction->result = new_ir_value(IRValueKind::Instruction, type);
+  instruction->result->instruction = instruction;
+  return instruction->result;
+}
+
+IRComparison ir_inverse_comparison(IRComparison comparison)
+{
+  switch (comparison) {
+  case IRComparison::Eq:
+    return IRComparison::Ne;
+  case IRComparison::Ne:
+    return IRComparison::Eq;
+  case IRComparison::Ugt:
+    return IRComparison::Ule;
+  case IRComparison::Uge:
+    return IRComparison::Ult;
+  case IRComparison::Ult:
+    return IRComparison::Uge;
+  case IRComparison::Ule:
+    return IRComparison::Ugt;
+  case IRComparison::Sgt:
+    return IRComparison::Sle;
+  case IRComparison::Sge:
+    return IRComparison::Slt;
+  case IRComparison::Slt:
+    return IRComparison::Sge;
+  case IRComparison::Sle:
+    return IRComparison::Sgt;
+  default:
+    assert(false && "ir_inverse_comparison got no comparison");
+    return IRComparison::None;
+  }
+}
+
+bool ir_opcode_is_terminator(IROpcode opcode)
+{
+  switch (opcode) {
+  case IROpcode::Br:
+  case IROpcode::CondBr:
+  case IROpcode::Switch:
+  case IROpcode::Ret:
+  case IROpcode::Unreachable:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool ir_opcode_is_binary_operator(IROpcode opcode)
+{
+  switch (opcode) {
+  case IROpcode::Add:
+  case IROpcode::Sub:
+  case IROpcode::Mul:
+  case IROpcode::SDiv:
+  case IROpcode::UDiv:
+  case IROpcode::SRem:
+  case IROpcode::URem:
+  case IROpcode::Shl:
+  case IROpcode::LShr:
+  case IROpcode::AShr:
+  case IROpcode::And:
+  case IROpcode::Or:
+  case IROpcode::Xor:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool ir_opcode_is_commutative(IROpcode opcode)
+{
+  switch (opcode) {
+  case IROpcode::Add:
+  case IROpcode::Mul:
+  case IROpcode::And:
+  case IROpcode::Or:
+  case IROpcode::Xor:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// anything that can't be deleted just because nobody uses its result
+//
+// nothing says what a call does, so calls are assumed to have side effects.
+// They can't touch locals though, since no local's address ever escapes
+bool ir_instruction_has_side_effects(IRInstruction const* instruction)
+{
+  switch (instruction->opcode) {
+  case IROpcode::Store:
+  case IROpcode::Call:
+    return true;
+
+  case IROpcode::Load:
+    return instruction->is_volatile;
+
+  default:
+    return ir_opcode_is_terminator(instruction->opcode);
+  }
+}
+
+IRInstruction* ir_block_terminator(IRBasicBlock const* block)
+{
+  IRInstruction* last = block->last_instruction;
+  if (last && ir_opcode_is_terminator(last->opcode))
+    return last;
+  return nullptr;
+}
+
+bool ir_function_is_declaration(IRFunction const* function) { return function->first_block == nullptr; }
+
+void ir_remove_instruction(IRInstruction* instruction)
+{
+  IRBasicBlock* block = instruction->parent;
+  assert(block && "removing an instruction that is not in a block");
+
+  if (instruction->previous)
+    instruction->previous->next = instruction->next;
+  else
+    block->first_instruction = instruction->next;
+
+  if (instruction->next)
+    instruction->next->previous = instruction->previous;
+  else
+    block->last_instruction = instruction->previous;
+
+  instruction->parent = nullptr;
+  instruction->previous = nullptr;
+  instruction->next = nullptr;
+}
+
+void ir_insert_instruction_before(IRInstruction* before, IRInstruction* instruction)
+{
+  IRBasicBlock* block = before->parent;
+
+  instruction->parent = block;
+  instruction->next = before;
+  instruction->previous = before->previous;
+
+  if (before->previous)
+    before->previous->next = instruction;
+  else
+    block->first_instruction = instruction;
+  before->previous = instruction;
+}
+
+void ir_append_instruction(IRBasicBlock* block, IRInstruction* instruction)
+{
+  instruction->parent = block;
+  instruction->next = nullptr;
+  instruction->previous = block->last_instruction;
+
+  if (block->last_instruction)
+    block->last_instruction->next = instruction;
+  else
+    block->first_instruction = instruction;
+  block->last_instruction = instruction;
+}
+
+void ir_replace_all_uses(IRFunction* function, IRValue* old_value, IRValue* new_value)
+{
+  for (IRBasicBlock* block = function->first_block; block; block = block->next)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      for (unsigned i = 0; i < instruction->operand_count; i++)
+        if (instruction->operands[i] == old_value)
+          instruction->operands[i] = new_value;
+}
+
+IRInstruction* ir_clone_instruction(IRInstruction const* instruction)
+{
+  IRInstruction* clone = new_ir_instruction(instruction->opcode, instruction->operand_count, instruction->target_count);
+  clone->comparison = instruction->comparison;
+  clone->allocated_type = instruction->allocated_type;
+  clone->callee = instruction->callee;
+  clone->tail_call_kind = instruction->tail_call_kind;
+  clone->is_volatile = instruction->is_volatile;
+  clone->tbaa_type = instruction->tbaa_type;
+  clone->case_values = instruction->case_values;
+  clone->branch_weights = instruction->branch_weights;
+
+  for (unsigned i = 0; i < instruction->operand_count; i++)
+    clone->operands[i] = instruction->operands[i];
+  for (unsigned i = 0; i < instruction->target_count; i++)
+    clone->targets[i] = instruction->targets[i];
+
+  if (instruction->result)
+    give_instruction_result(clone, instruction->result->type);
+  return clone;
+}
+
+unsigned ir_count_instructions(IRFunction const* function)
+{
+  unsigned count = 0;
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      count++;
+  return count;
+}
+
+// builders
+
+static void build(IRBuilder* builder, IRInstruction* instruction)
+{
+  assert(builder->insertion_block && "building an instruction with no insertion block");
+  assert(!ir_block_terminator(builder->insertion_block) && "building an instruction after a terminator");
+  ir_append_instruction(builder->insertion_block, instruction);
+}
+
+// allocas all go at the top of the entry block, which is where LLVM's mem2reg
+// expects to find them
+IRValue* ir_build_alloca(IRBuilder* builder, char const* type)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Alloca, 0, 0);
+  instruction->allocated_type = type;
+  IRValue* result = give_instruction_result(instruction, "ptr");
+
+  IRBasicBlock* entry = builder->function->first_block;
+  IRInstruction* first_non_alloca = entry->first_instruction;
+  while (first_non_alloca && first_non_alloca->opcode == IROpcode::Alloca)
+    first_non_alloca = first_non_alloca->next;
+
+  if (first_non_alloca)
+    ir_insert_instruction_before(first_non_alloca, instruction);
+  else
+    ir_append_instruction(entry, instruction);
+
+  return result;
+}
+
+IRValue* ir_build_load(IRBuilder* builder, char const* type, IRValue* pointer)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Load, 1, 0);
+  instruction->allocated_type = type;
+  instruction->operands[0] = pointer;
+  build(builder, instruction);
+  return give_instruction_result(instruction, type);
+}
+
+void ir_build_store(IRBuilder* builder, IRValue* value, IRValue* pointer)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Store, 2, 0);
+  instruction->operands[0] = value;
+  instruction->operands[1] = pointer;
+  build(builder, instruction);
+}
+
+IRValue* ir_build_getelementptr(IRBuilder* builder, char const* element_type, IRValue* pointer, IRValue* index)
+{
+  assert(strcmp(index->type, "i64") == 0 && "getelementptr indices are i64");
+  IRInstruction* instruction = new_ir_instruction(IROpcode::GetElementPtr, 2, 0);
+  instruction->allocated_type = element_type;
+  instruction->operands[0] = pointer;
+  instruction->operands[1] = index;
+  build(builder, instruction);
+  return give_instruction_result(instruction, "ptr");
+}
+
+IRValue* ir_build_binary(IRBuilder* builder, IROpcode opcode, IRValue* lhs, IRValue* rhs)
+{
+  assert(ir_opcode_is_binary_operator(opcode));
+  IRInstruction* instruction = new_ir_instruction(opcode, 2, 0);
+  instruction->operands[0] = lhs;
+  instruction->operands[1] = rhs;
+  build(builder, instruction);
+  return give_instruction_result(instruction, lhs->type);
+}
+
+IRValue* ir_build_icmp(IRBuilder* builder, IRComparison comparison, IRValue* lhs, IRValue* rhs)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::ICmp, 2, 0);
+  instruction->comparison = comparison;
+  instruction->operands[0] = lhs;
+  instruction->operands[1] = rhs;
+  build(builder, instruction);
+  return give_instruction_result(instruction, "i1");
+}
+
+IRValue* ir_build_cast(IRBuilder* builder, IROpcode opcode, IRValue* value, char const* type)
+{
+  IRInstruction* instruction = new_ir_instruction(opcode, 1, 0);
+  instruction->operands[0] = value;
+  build(builder, instruction);
+  return give_instruction_result(instruction, type);
+}
+
+IRValue* ir_build_splat(IRBuilder* builder, IRValue* value, unsigned lanes)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Splat, 1, 0);
+  instruction->operands[0] = value;
+  build(builder, instruction);
+  return give_instruction_result(instruction, ir_vector_type(value->type, lanes));
+}
+
+IRValue* ir_build_select(IRBuilder* builder, IRValue* condition, IRValue* true_value, IRValue* false_value)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Select, 3, 0);
+  instruction->operands[0] = condition;
+  instruction->operands[1] = true_value;
+  instruction->operands[2] = false_value;
+  build(builder, instruction);
+  return give_instruction_result(instruction, true_value->type);
+}
+
+void ir_build_br(IRBuilder* builder, IRBasicBlock* target)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Br, 0, 1);
+  instruction->targets[0] = target;
+  build(builder, instruction);
+}
+
+void ir_build_cond_br(IRBuilder* builder, IRValue* condition, IRBasicBlock* true_target, IRBasicBlock* false_target)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::CondBr, 1, 2);
+  instruction->operands[0] = condition;
+  instruction->targets[0] = true_target;
+  instruction->targets[1] = false_target;
+  build(builder, instruction);
+}
+
+void ir_build_switch(IRBuilder* builder, IRValue* condition, IRBasicBlock* default_target, long long const* case_values,
+    IRBasicBlock* const* case_targets, unsigned case_count)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Switch, 1, case_count + 1);
+  instruction->operands[0] = condition;
+  instruction->targets[0] = default_target;
+  instruction->case_values = (long long*)malloc(case_count * sizeof(long long));
+  for (unsigned i = 0; i < case_count; i++) {
+    instruction->case_values[i] = case_values[i];
+    instruction->targets[i + 1] = case_targets[i];
+  }
+  build(builder, instruction);
+}
+
+// calls to void functions produce no value and return null
+IRValue* ir_build_call(IRBuilder* builder, IRFunction* callee, IRValue** arguments, unsigned argument_count)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Call, argument_count, 0);
+  instruction->callee = callee;
+  for (unsigned i = 0; i < argument_count; i++)
+    instruction->operands[i] = arguments[i];
+  build(builder, instruction);
+
+  if (strcmp(callee->return_type, "void") == 0)
+    return nullptr;
+  return give_instruction_result(instruction, callee->return_type);
+}
+
+void ir_build_ret(IRBuilder* builder, IRValue* value)
+{
+  IRInstruction* instruction = new_ir_instruction(IROpcode::Ret, value ? 1 : 0, 0);
+  instruction->operands[0] = value;
+  build(builder, instruction);
+}
+
+void ir_build_unreachable(IRBuilder* builder)
+{
+  build(builder, new_ir_instruction(IROpcode::Unreachable, 0, 0));
+}
+
+// printing
+//
+// LLVM requires unnamed values to be numbered in order, starting with the
+// arguments. Passes delete and move instructions freely, so numbers are only
+// handed out here, at the very end
+
+using ValueNumbers = std::unordered_map<IRValue const*, unsigned>;
+
+// metadata is numbered across the whole module, it's printed after the last
+// function. Every tbaa type gets a node, and every type something is loaded
+// or stored as also gets an access tag pointing at that node. Branch weights
+// and entry counts come after those, a node each
+struct MetadataNumbers {
+  std::unordered_map<IRTBAAType const*, unsigned> type_nodes;
+  std::unordered_map<IRTBAAType const*, unsigned> access_tags;
+
+  // in order of their numbers, true for access tags
+  std::vector<std::pair<IRTBAAType const*, bool>> nodes;
+
+  std::unordered_map<IRInstruction const*, unsigned> branch_weights;
+  std::unordered_map<IRFunction const*, unsigned> entry_counts;
+
+  // the text between the braces, in order of their numbers
+  std::vector<std::string> profile_nodes;
+};
+
+static char const* opcode_to_string(IROpcode opcode)
+{
+  switch (opcode) {
+  case IROpcode::Alloca:
+    return "alloca";
+  case IROpcode::Load:
+    return "load";
+  case IROpcode::Store:
+    return "store";
+  case IROpcode::GetElementPtr:
+    return "getelementptr inbounds";
+  case IROpcode::Add:
+    return "add";
+  case IROpcode::Sub:
+    return "sub";
+  case IROpcode::Mul:
+    return "mul";
+  case IROpcode::SDiv:
+    return "sdiv";
+  case IROpcode::UDiv:
+    return "udiv";
+  case IROpcode::SRem:
+    return "srem";
+  case IROpcode::URem:
+    return "urem";
+  case IROpcode::Shl:
+    return "shl";
+  case IROpcode::LShr:
+    return "lshr";
+  case IROpcode::AShr:
+    return "ashr";
+  case IROpcode::And:
+    return "and";
+  case IROpcode::Or:
+    return "or";
+  case IROpcode::Xor:
+    return "xor";
+  case IROpcode::ICmp:
+    return "icmp";
+  case IROpcode::ZExt:
+    return "zext";
+  case IROpcode::SExt:
+    return "sext";
+  case IROpcode::Trunc:
+    return "trunc";
+  case IROpcode::Splat:
+    return "shufflevector";
+  case IROpcode::Select:
+    return "select";
+  case IROpcode::Call:
+    return "call";
+  case IROpcode::Br:
+  case IROpcode::CondBr:
+    return "br";
+  case IROpcode::Switch:
+    return "switch";
+  case IROpcode::Ret:
+    return "ret";
+  case IROpcode::Unreachable:
+    return "unreachable";
+  }
+  assert(false && "opcode_to_string UNREACHABLE");
+}
+
+static char const* comparison_to_string(IRComparison comparison)
+{
+  switch (comparison) {
+  case IRComparison::Eq:
+    return "eq";
+  case IRComparison::Ne:
+    return "ne";
+  case IRComparison::Ugt:
+    return "ugt";
+  case IRComparison::Uge:
+    return "uge";
+  case IRComparison::Ult:
+    return "ult";
+  case IRComparison::Ule:
+    return "ule";
+  case IRComparison::Sgt:
+    return "sgt";
+  case IRComparison::Sge:
+    return "sge";
+  case IRComparison::Slt:
+    return "slt";
+  case IRComparison::Sle:
+    return "sle";
+  case IRComparison::None:
+    break;
+  }
+  assert(false && "printing icmp without a predicate");
+}
+
+static void print_value(IRValue const* value, ValueNumbers const& numbers, FILE* outfile)
+{
+  switch (value->kind) {
+  case IRValueKind::Constant:
+    if (ir_type_is_vector(value->type)) {
+      // vector constants are splats, e.g. <i32 1, i32 1, i32 1, i32 1>
+      unsigned lanes = ir_vector_lanes(value->type);
+      fprintf(outfile, "<");
+      for (unsigned i = 0; i < lanes; i++)
+        fprintf(outfile, "%s%s %lld", i ? ", " : "", ir_vector_element_type(value->type), value->constant);
+      fprintf(outfile, ">");
+    } else if (value->type[0] == 'i' && value->type[1] == '1' && value->type[2] == '\0') {
+      fprintf(outfile, "%s", value->constant ? "true" : "false");
+    } else if (strcmp(value->type, "ptr") == 0 && value->constant == 0) {
+      // a pointer compared with 0, e.g. for !p
+      fprintf(outfile, "null");
+    } else {
+      fprintf(outfile, "%lld", value->constant);
+    }
+    return;
+
+  case IRValueKind::Argument:
+  case IRValueKind::Instruction:
+    assert(numbers.contains(value) && "printing a value that was never defined");
+    fprintf(outfile, "%%%u", numbers.at(value));
+    return;
+
+  case IRValueKind::Global:
+    fprintf(outfile, "@%s", value->global->name);
+    return;
+  }
+}
+
+static void print_typed_value(IRValue const* value, ValueNumbers const& numbers, FILE* outfile)
+{
+  fprintf(outfile, "%s ", value->type);
+  print_value(value, numbers, outfile);
+}
+
+static void print_block_label(IRBasicBlock const* block, FILE* outfile)
+{
+  if (block == block->parent->first_block)
+    fprintf(outfile, "%%entry");
+  else
+    fprintf(outfile, "%%%s%u", block->name, block->id);
+}
+
+// vectors are only as aligned as their elements, they come from arbitrary
+// positions in an array. Without an alignment LLVM assumes the whole vector's
+static void print_alignment(char const* type, FILE* outfile)
+{
+  if (ir_type_is_vector(type))
+    fprintf(outfile, ", align %u", ir_type_size(ir_vector_element_type(type)));
+}
+
+static void print_instruction(IRInstruction const* instruction, ValueNumbers const& numbers, MetadataNumbers const& metadata, FILE* outfile)
+{
+  IRValue* const* operands = instruction->operands;
+
+  // LLVM has no splat instruction, the idiom is to insert the scalar into lane
+  // 0 and shuffle it into the rest. The intermediate vector gets a name, since
+  // unnamed values have to be numbered in order
+  if (instruction->opcode == IROpcode::Splat) {
+    unsigned number = numbers.at(instruction->result);
+    char const* type = instruction->result->type;
+    fprintf(outfile, "  %%splat.%u = insertelement %s poison, ", number, type);
+    print_typed_value(operands[0], numbers, outfile);
+    fprintf(outfile, ", i64 0\n");
+    fprintf(outfile, "  %%%u = shufflevector %s %%splat.%u, %s poison, <%u x i32> zeroinitializer\n", number, type, number, type,
+        ir_vector_lanes(type));
+    return;
+  }
+
+  fprintf(outfile, "  ");
+  if (instruction->result)
+    fprintf(outfile, "%%%u = ", numbers.at(instruction->result));
+  if (instruction->tail_call_kind == IRTailCallKind::Tail)
+    fprintf(outfile, "tail ");
+  if (instruction->tail_call_kind == IRTailCallKind::MustTail)
+    fprintf(outfile, "musttail ");
+  fprintf(outfile, "%s", opcode_to_string(instruction->opcode));
+  if (instruction->is_volatile)
+    fprintf(outfile, " volatile");
+
+  switch (instruction->opcode) {
+  case IROpcode::Alloca:
+    fprintf(outfile, " %s", instruction->allocated_type);
+    break;
+
+  case IROpcode::Load:
+    fprintf(outfile, " %s, ", instruction->allocated_type);
+    print_typed_value(operands[0], numbers, outfile);
+    print_alignment(instruction->allocated_type, outfile);
+    break;
+
+  case IROpcode::Store:
+    fprintf(outfile, " ");
+    print_typed_value(operands[0], numbers, outfile);
+    fprintf(outfile, ", ");
+    print_typed_value(operands[1], numbers, outfile);
+    print_alignment(operands[0]->type, outfile);
+    break;
+
+  case IROpcode::GetElementPtr:
+    fprintf(outfile, " %s, ", instruction->allocated_type);
+    print_typed_value(operands[0], numbers, outfile);
+    fprintf(outfile, ", ");
+    print_typed_value(operands[1], numbers, outfile);
+    break;
+
+  case IROpcode::ICmp:
+    fprintf(outfile, " %s", comparison_to_string(instruction->comparison));
+    [[fallthrough]];
+  case IROpcode::Add:
+  case IROpcode::Sub:
+  case IROpcode::Mul:
+  case IROpcode::SDiv:
+  case IROpcode::UDiv:
+  case IROpcode::SRem:
+  case IROpcode::URem:
+  case IROpcode::Shl:
+  case IROpcode::LShr:
+  case IROpcode::AShr:
+  case IROpcode::And:
+  case IROpcode::Or:
+  case IROpcode::Xor:
+    fprintf(outfile, " ");
+    print_typed_value(operands[0], numbers, outfile);
+    fprintf(outfile, ", ");
+    print_value(operands[1], numbers, outfile);
+    break;
+
+  case IROpcode::ZExt:
+  case IROpcode::SExt:
+  case IROpcode::Trunc:
+    fprintf(outfile, " ");
+    print_typed_value(operands[0], numbers, outfile);
+    fprintf(outfile, " to %s", instruction->result->type);
+    break;
+
+  case IROpcode::Select:
+    fprintf(outfile, " ");
+    print_typed_value(operands[0], numbers, outfile);
+    fprintf(outfile, ", ");
+    print_typed_value(operands[1], numbers, outfile);
+    fprintf(outfile, ", ");
+    print_typed_value(operands[2], numbers, outfile);
+    break;
+
+  case IROpcode::Call:
+    fprintf(outfile, " %s @%s(", instruction->callee->return_type, instruction->callee->name);
+    for (unsigned i = 0; i < instruction->operand_count; i++) {
+      fprintf(outfile, "%s", i ? ", " : "");
+      print_typed_value(operands[i], numbers, outfile);
+    }
+    fprintf(outfile, ")");
+    break;
+
+  case IROpcode::Br:
+    fprintf(outfile, " label ");
+    print_block_label(instruction->targets[0], outfile);
+    break;
+
+  case IROpcode::CondBr:
+    fprintf(outfile, " ");
+    print_typed_value(operands[0], numbers, outfile);
+    fprintf(outfile, ", label ");
+    print_block_label(instruction->targets[0], outfile);
+    fprintf(outfile, ", label ");
+    print_block_label(instruction->targets[1], outfile);
+    break;
+
+  // switch i32 %c, label %default [
+  //   i32 1, label %case
+  // ]
+  case IROpcode::Switch:
+    fprintf(outfile, " ");
+    print_typed_value(operands[0], numbers, outfile);
+    fprintf(outfile, ", label ");
+    print_block_label(instruction->targets[0], outfile);
+    fprintf(outfile, " [\n");
+    for (unsigned i = 1; i < instruction->target_count; i++) {
+      fprintf(outfile, "    %s %lld, label ", operands[0]->type, instruction->case_values[i - 1]);
+      print_block_label(instruction->targets[i], outfile);
+      fprintf(outfile, "\n");
+    }
+    fprintf(outfile, "  ]");
+    break;
+
+  case IROpcode::Ret:
+    fprintf(outfile, " ");
+    if (instruction->operand_count == 0)
+      fprintf(outfile, "void");
+    else
+      print_typed_value(operands[0], numbers, outfile);
+    break;
+
+  case IROpcode::Unreachable:
+    break;
+
+  case IROpcode::Splat:
+    assert(false && "splats are printed above");
+  }
+
+  if (instruction->tbaa_type)
+    fprintf(outfile, ", !tbaa !%u", metadata.access_tags.at(instruction->tbaa_type));
+  if (instruction->branch_weights)
+    fprintf(outfile, ", !prof !%u", metadata.branch_weights.at(instruction));
+  fprintf(outfile, "\n");
+}
+
+// https://llvm.org/docs/LangRef.html#function-attributes
+static void print_function_attributes(IRFunction const* function, FILE* outfile)
+{
+  if (function->is_noreturn)
+    fprintf(outfile, " noreturn");
+  if (function->is_inline_hint)
+    fprintf(outfile, " inlinehint");
+  if (function->is_hot)
+    fprintf(outfile, " hot");
+  if (function->is_cold)
+    fprintf(outfile, " cold");
+}
+
+// https://llvm.org/docs/LangRef.html#functions
+// define [linkage] <ResultType> @<FunctionName>([argument list]) [attributes] [section "<name>"] { basic blocks }
+// declare <ResultType> @<FunctionName>([argument types])
+static void print_ir_function(IRFunction const* function, MetadataNumbers const& metadata, FILE* outfile)
+{
+  ValueNumbers numbers;
+  unsigned count = 0;
+
+  if (ir_function_is_declaration(function)) {
+    fprintf(outfile, "declare %s @%s(", function->return_type, function->name);
+    for (unsigned i = 0; i < function->argument_count; i++)
+      fprintf(outfile, "%s%s", i ? ", " : "", function->arguments[i]->type);
+    fprintf(outfile, ")");
+    print_function_attributes(function, outfile);
+    fprintf(outfile, "\n");
+    return;
+  }
+
+  fprintf(outfile, "define");
+  if (function->is_internal)
+    fprintf(outfile, " internal");
+  fprintf(outfile, " %s @%s(", function->return_type, function->name);
+
+  for (unsigned i = 0; i < function->argument_count; i++) {
+    numbers[function->arguments[i]] = count;
+    IRValue const* argument = function->arguments[i];
+    fprintf(outfile, "%s%s%s %%%u", i ? ", " : "", argument->type, argument->is_noalias ? " noalias" : "", count++);
+  }
+  fprintf(outfile, ")");
+  print_function_attributes(function, outfile);
+  if (function->is_hot)
+    fprintf(outfile, " section \".text.hot\"");
+  if (function->is_cold)
+    fprintf(outfile, " section \".text.unlikely\"");
+  if (function->has_entry_count)
+    fprintf(outfile, " !prof !%u", metadata.entry_counts.at(function));
+  fprintf(outfile, "{\n");
+
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      if (instruction->result)
+        numbers[instruction->result] = count++;
+
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next) {
+    if (block == function->first_block)
+      fprintf(outfile, "entry:\n");
+    else
+      fprintf(outfile, "%s%u:\n", block->name, block->id);
+
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      print_instruction(instruction, numbers, metadata, outfile);
+  }
+
+  fprintf(outfile, "}\n");
+}
+
+// a type's ancestors are numbered before it
+static void number_tbaa_type(IRTBAAType const* type, MetadataNumbers* metadata)
+{
+  if (metadata->type_nodes.contains(type))
+    return;
+  if (type->parent)
+    number_tbaa_type(type->parent, metadata);
+  metadata->type_nodes[type] = (unsigned)metadata->nodes.size();
+  metadata->nodes.push_back({ type, false });
+}
+
+static void number_tbaa_nodes(IRFunction const* function, MetadataNumbers* metadata)
+{
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      IRTBAAType const* type = instruction->tbaa_type;
+      if (!type || metadata->access_tags.contains(type))
+        continue;
+      number_tbaa_type(type, metadata);
+      metadata->access_tags[type] = (unsigned)metadata->nodes.size();
+      metadata->nodes.push_back({ type, true });
+    }
+}
+
+// https://llvm.org/docs/BranchWeightMetadata.html
+static void number_profile_nodes(IRFunction const* function, MetadataNumbers* metadata)
+{
+  if (function->has_entry_count) {
+    metadata->entry_counts[function] = (unsigned)(metadata->nodes.size() + metadata->profile_nodes.size());
+    metadata->profile_nodes.push_back("!\"function_entry_count\", i64 " + std::to_string(function->entry_count));
+  }
+
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      if (!instruction->branch_weights)
+        continue;
+      std::string node = "!\"branch_weights\"";
+      for (unsigned i = 0; i < instruction->target_count; i++)
+        node += ", i32 " + std::to_string(instruction->branch_weights[i]);
+      metadata->branch_weights[instruction] = (unsigned)(metadata->nodes.size() + metadata->profile_nodes.size());
+      metadata->profile_nodes.push_back(node);
+    }
+}
+
+static MetadataNumbers number_metadata(IRModule const* module)
+{
+  MetadataNumbers metadata;
+  for (IRFunction const* function = module->first_function; function; function = function->next)
+    number_tbaa_nodes(function, &metadata);
+  for (IRFunction const* function = module->first_function; function; function = function->next)
+    number_profile_nodes(function, &metadata);
+  return metadata;
+}
+
+// the root is !{!"name"}, every other type !{!"name", !parent, i64 0}, and an
+// access tag for a scalar type is !{!type, !type, i64 0}, the access being at
+// offset 0 of an object of that same type
+static std::string tbaa_node(MetadataNumbers const& metadata, unsigned number)
+{
+  auto [type, is_access_tag] = metadata.nodes[number];
+  if (is_access_tag) {
+    std::string type_node = "!" + std::to_string(metadata.type_nodes.at(type));
+    return type_node + ", " + type_node + ", i64 0";
+  }
+  if (!type->parent)
+    return std::string("!\"") + type->name + "\"";
+  return std::string("!\"") + type->name + "\", !" + std::to_string(metadata.type_nodes.at(type->parent)) + ", i64 0";
+}
+
+static void print_metadata(MetadataNumbers const& metadata, FILE* outfile)
+{
+  for (unsigned i = 0; i < metadata.nodes.size(); i++)
+    fprintf(outfile, "!%u = !{%s}\n", i, tbaa_node(metadata, i).c_str());
+
+  for (unsigned i = 0; i < metadata.profile_nodes.size(); i++)
+    fprintf(outfile, "!%zu = !{%s}\n", metadata.nodes.size() + i, metadata.profile_nodes[i].c_str());
+}
+
+// https://llvm.org/docs/LangRef.html#global-variables
+// @<name> = [private] global|constant <type> <initializer>[, section "<name>"]
+// @<name> = external global <type>
+static void print_ir_globals(IRModule const* module, FILE* outfile)
+{
+  std::vector<IRGlobal const*> used;
+  for (IRGlobal const* global = module->first_global; global; global = global->next) {
+    if (!global->initializer) {
+      fprintf(outfile, "@%s = external global %s\n", global->name, global->type);
+      continue;
+    }
+
+    fprintf(outfile, "@%s = %s%s %s %s", global->name, global->is_private ? "private " : "", global->is_constant ? "constant" : "global",
+        global->type, global->initializer);
+    if (global->section)
+      fprintf(outfile, ", section \"%s\"", global->section);
+    fprintf(outfile, "\n");
+
+    if (global->is_used)
+      used.push_back(global);
+  }
+
+  if (used.empty())
+    return;
+  fprintf(outfile, "@llvm.used = appending global [%zu x ptr] [", used.size());
+  for (size_t i = 0; i < used.size(); i++)
+    fprintf(outfile, "%sptr @%s", i ? ", " : "", used[i]->name);
+  fprintf(outfile, "], section \"llvm.metadata\"\n");
+}
+
+void print_ir_module(IRModule const* module, FILE* outfile)
+{
+  MetadataNumbers metadata = number_metadata(module);
+  print_ir_globals(module, outfile);
+  for (IRFunction const* function = module->first_function; function; function = function->next)
+    print_ir_function(function, metadata, outfile);
+  print_metadata(metadata, outfile);
+}
+
+PrintedIRFunction print_ir_function_alone(IRFunction const* function)
+{
+  MetadataNumbers metadata;
+  number_tbaa_nodes(function, &metadata);
+  number_profile_nodes(function, &metadata);
+
+  char* memory = nullptr;
+  size_t memory_size = 0;
+  FILE* outfile = open_memstream(&memory, &memory_size);
+  print_ir_function(function, metadata, outfile);
+  fclose(outfile);
+
+  PrintedIRFunction printed;
+  printed.text.assign(memory, memory_size);
+  free(memory);
+  printed.tbaa_node_count = (unsigned)metadata.nodes.size();
+  for (unsigned i = 0; i < metadata.nodes.size(); i++)
+    printed.metadata.push_back(tbaa_node(metadata, i));
+  for (std::string const& node : metadata.profile_nodes)
+    printed.metadata.push_back(node);
+  return printed;
+}
+
+// replaces every !N with !numbers[N]. Names like !tbaa and strings like
+// !"int" don't start with a digit
+static std::string renumber_metadata(std::string const& text, std::vector<unsigned> const& numbers)
+{
+  std::string renumbered;
+  renumbered.reserve(text.size());
+  for (size_t i = 0; i < text.size();) {
+    if (text[i] != '!' || i + 1 == text.size() || !isdigit((unsigned char)text[i + 1])) {
+      renumbered.push_back(text[i++]);
+      continue;
+    }
+    size_t end = i + 1;
+    unsigned number = 0;
+    for (; end < text.size() && isdigit((unsigned char)text[end]); end++)
+      number = number * 10 + (text[end] - '0');
+    renumbered += "!" + std::to_string(numbers.at(number));
+    i = end;
+  }
+  return renumbered;
+}
+
+// number_metadata gives a module's tbaa nodes in the order its functions
+// first use them, so the module's nodes are each function's own nodes in
+// turn, less the ones a function before it already had. Tbaa types are
+// interned by name, so two nodes are the same type exactly when their text
+// is, once the nodes they point at are renumbered. Profile nodes aren't
+// shared, they follow all the tbaa nodes in function order
+void print_spliced_ir_functions(std::vector<PrintedIRFunction const*> const& functions, FILE* outfile)
+{
+  std::vector<std::string> tbaa_nodes;
+  std::unordered_map<std::string, unsigned> tbaa_numbers;
+  std::vector<std::vector<unsigned>> numbers(functions.size());
+  for (unsigned i = 0; i < functions.size(); i++)
+    for (unsigned node = 0; node < functions[i]->tbaa_node_count; node++) {
+      std::string text = renumber_metadata(functions[i]->metadata[node], numbers[i]);
+      auto [number, is_new] = tbaa_numbers.try_emplace(text, (unsigned)tbaa_nodes.size());
+      if (is_new)
+        tbaa_nodes.push_back(text);
+      numbers[i].push_back(number->second);
+    }
+
+  std::vector<std::string const*> profile_nodes;
+  for (unsigned i = 0; i < functions.size(); i++)
+    for (unsigned node = functions[i]->tbaa_node_count; node < functions[i]->metadata.size(); node++) {
+      numbers[i].push_back((unsigned)(tbaa_nodes.size() + profile_nodes.size()));
+      profile_nodes.push_back(&functions[i]->metadata[node]);
+    }
+
+  for (unsigned i = 0; i < functions.size(); i++)
+    fputs(renumber_metadata(functions[i]->text, numbers[i]).c_str(), outfile);
+  for (unsigned i = 0; i < tbaa_nodes.size(); i++)
+    fprintf(outfile, "!%u = !{%s}\n", i, tbaa_nodes[i].c_str());
+  for (unsigned i = 0; i < profile_nodes.size(); i++)
+    fprintf(outfile, "!%zu = !{%s}\n", tbaa_nodes.size() + i, profile_nodes[i]->c_str());
+}
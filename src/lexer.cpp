@@ -1,13 +1,25 @@
 #include "lexer.h"
+#include "preprocessor.h"
 
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 
 bool token_equals(Token const* left, Token const* right)
 {
   return left->type == right->type && left->string == right->string;
 }
 
+// FNV-1a, over the same things token_equals compares
+unsigned long long hash_token(unsigned long long hash, Token const* token)
+{
+  hash = (hash ^ (unsigned char)token->type) * 1099511628211ull;
+  for (char c : token->string)
+    hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+  // so that "ab" "c" and "a" "bc" differ
+  return (hash ^ 0xff) * 1099511628211ull;
+}
+
 static void lexer_update_start_of_token(Lexer* lexer)
 {
   lexer->beginning_of_current_token = lexer->current_location;
@@ -23,7 +35,7 @@ static void advance(Lexer* lexer)
   lexer->current_column++;
 }
 
-Lexer new_lexer(char const* text)
+Lexer new_lexer(char const* text, Preprocessor* preprocessor)
 {
   Lexer lexer;
   // printf("initializing lexer with input: %s\n", text);
@@ -37,8 +49,17 @@ Lexer new_lexer(char const* text)
 
   lexer.current_line = 0;
   lexer.current_column = 0;
+  lexer.at_start_of_line = true;
+
+  lexer.file_tokens = nullptr;
+  lexer.next_file_token = 0;
+  lexer.is_lexing_ahead = false;
+  lexer.token_hash = nullptr;
+  lexer.replayed_tokens = nullptr;
+  lexer.next_replayed_token = 0;
 
   lexer.current_token.type = TokenType::NotStarted;
+  lexer.preprocessor = preprocessor ? preprocessor : new_preprocessor();
 
   return lexer;
 }
@@ -95,16 +116,18 @@ static Token lexer_make_token_without_advancing(Lexer* lexer,
     TokenType token_type,
     std::string string = "")
 {
-  return make_token(token_type, lexer->beginning_of_token_line,
+  Token token = make_token(token_type, lexer->beginning_of_token_line,
       lexer->beginning_of_token_column, string);
+  token.starts_line = lexer->at_start_of_line;
+  lexer->at_start_of_line = false;
+  return token;
 }
 
 static Token lexer_make_token_and_advance(Lexer* lexer, TokenType token_type,
     std::string string = "")
 {
 
-  Token token = make_token(token_type, lexer->beginning_of_token_line,
-      lexer->beginning_of_token_column, string);
+  Token token = lexer_make_token_without_advancing(lexer, token_type, string);
   advance(lexer);
   return token;
 }
@@ -118,12 +141,18 @@ Token make_token(TokenType token_type, unsigned line, unsigned column,
   token.line = line;
   token.column = column;
   token.string = string;
+  token.starts_line = false;
+  token.hide_set = nullptr;
 
   return token;
 }
 
 Token error_token(Lexer* lexer, char const* error_message)
 {
+  // it's for whoever lexes the text for real to report
+  if (lexer->is_lexing_ahead)
+    return lexer_make_token_and_advance(lexer, TokenType::Error);
+
   lexer_print_error_message(lexer, error_message);
   exit(1);
   return lexer_make_token_and_advance(lexer, TokenType::Error);
@@ -147,6 +176,7 @@ static void new_line(Lexer* lexer)
 {
   lexer->current_line++;
   lexer->current_column = 0;
+  lexer->at_start_of_line = true;
 }
 
 static char current_char(Lexer* lexer) { return *lexer->current_location; }
@@ -181,13 +211,12 @@ static void skip_whitespace(Lexer* lexer)
 static void skip_line_comment(Lexer* lexer)
 {
   // presumes lexer starts on first / out of the //
-  char c = current_char(lexer);
-  assert(c == '/' && peek_next_char(lexer) == '/');
+  assert(current_char(lexer) == '/' && peek_next_char(lexer) == '/');
 
-  while (c != '\n' && c != '\0')
+  while (current_char(lexer) != '\n' && current_char(lexer) != '\0')
     advance(lexer);
 
-  if (c == '\n') {
+  if (current_char(lexer) == '\n') {
     new_line(lexer);
     advance(lexer);
   }
@@ -196,13 +225,19 @@ static void skip_line_comment(Lexer* lexer)
 static void skip_block_comment(Lexer* lexer)
 {
   assert(current_char(lexer) == '/' && peek_next_char(lexer) == '*');
-  while (current_char(lexer) != '\0' || !(current_char(lexer) == '*' && peek_next_char(lexer) == '/')) {
+  advance(lexer);
+  advance(lexer);
+  while (current_char(lexer) != '\0' && !(current_char(lexer) == '*' && peek_next_char(lexer) == '/')) {
 
     if (current_char(lexer) == '\n')
       new_line(lexer);
 
     advance(lexer);
   }
+
+  // past the */
+  advance(lexer);
+  advance(lexer);
 }
 
 bool is_on_line_comment(Lexer* lexer)
@@ -230,6 +265,76 @@ static void skip_whitespace_and_comments(Lexer* lexer)
   }
 }
 
+// a directive ends at the end of its line, unless a backslash continues it
+bool lexer_at_end_of_line(Lexer* lexer)
+{
+  for (;;) {
+    char c = current_char(lexer);
+    if (c == ' ' || c == '\t' || c == '\r') {
+      advance(lexer);
+    } else if (c == '\\' && (peek_next_char(lexer) == '\n' || (peek_next_char(lexer) == '\r' && char_lookahead(lexer, 2) == '\n'))) {
+      while (current_char(lexer) != '\n')
+        advance(lexer);
+      new_line(lexer);
+      advance(lexer);
+    } else if (is_on_block_comment(lexer)) {
+      skip_block_comment(lexer);
+    } else {
+      return c == '\n' || c == '\0' || is_on_line_comment(lexer);
+    }
+  }
+}
+
+// the lines in a group a conditional leaves out don't have to be lexed, and
+// might not even lex. Stops on the # of the next line starting with one, or
+// at the end of the file
+void skip_to_next_directive(Lexer* lexer)
+{
+  for (;;) {
+    while (current_char(lexer) != '\n' && current_char(lexer) != '\0')
+      advance(lexer);
+    if (current_char(lexer) == '\0')
+      return;
+
+    new_line(lexer);
+    advance(lexer);
+    while (current_char(lexer) == ' ' || current_char(lexer) == '\t' || current_char(lexer) == '\r')
+      advance(lexer);
+    if (current_char(lexer) == '#')
+      return;
+  }
+}
+
+// 6.4.7 header-name
+//          < h-char-sequence >
+//          " q-char-sequence "
+//
+// only ever after #include, where "file.h" isn't a string literal. False if
+// the rest of the line isn't one
+bool lex_header_name(Lexer* lexer, std::string* name, bool* is_angled)
+{
+  while (current_char(lexer) == ' ' || current_char(lexer) == '\t')
+    advance(lexer);
+
+  char open = current_char(lexer);
+  if (open != '"' && open != '<')
+    return false;
+  char close = open == '"' ? '"' : '>';
+
+  advance(lexer);
+  char const* start = lexer->current_location;
+  while (current_char(lexer) != close) {
+    if (current_char(lexer) == '\n' || current_char(lexer) == '\0')
+      return false;
+    advance(lexer);
+  }
+
+  *name = std::string(start, lexer->current_location);
+  *is_angled = open == '<';
+  advance(lexer);
+  return true;
+}
+
 // this works if current_location is the position after the last char of the
 // token
 static unsigned token_length(Lexer* lexer)
@@ -455,7 +560,6 @@ static Token lex_ellipses(Lexer* lexer)
   assert(current_char(lexer) == '.');
   advance(lexer);
   assert(current_char(lexer) == '.');
-  advance(lexer);
   return lexer_make_token_and_advance(lexer, TokenType::Ellipsis);
 }
 
@@ -506,6 +610,13 @@ Token lex_next_token(Lexer* lexer)
   case '?':
     return lexer_make_token_and_advance(lexer, TokenType::QuestionMark);
 
+  case '#':
+    if (peek_next_char(lexer) == '#') {
+      advance(lexer);
+      return lexer_make_token_and_advance(lexer, TokenType::HashHash);
+    }
+    return lexer_make_token_and_advance(lexer, TokenType::Hash);
+
   case '^':
     if (peek_next_char(lexer) == '=') {
       advance(lexer);
@@ -657,6 +768,9 @@ Token lex_next_token(Lexer* lexer)
   while (is_alphanumeric(current_char(lexer)))
     advance(lexer);
 
+  if (token_length(lexer) == 0)
+    return error_token(lexer, "unexpected character");
+
   switch (peek_char_in_token(lexer, 0)) {
   case '_':
     switch (peek_char_in_token(lexer, 1)) {
@@ -828,11 +942,287 @@ Token lex_next_token(Lexer* lexer)
   assert(false && "Lex next token UNREACHABLE");
 }
 
+// how a token is written, for pasting tokens together. Keywords and
+// punctuation don't keep their text
+char const* token_spelling(Token const* token)
+{
+  if (!token->string.empty())
+    return token->string.c_str();
+
+  switch (token->type) {
+  case TokenType::Comma:
+    return ",";
+  case TokenType::Dot:
+    return ".";
+  case TokenType::Bang:
+    return "!";
+  case TokenType::LParen:
+    return "(";
+  case TokenType::RParen:
+    return ")";
+  case TokenType::LBracket:
+    return "[";
+  case TokenType::RBracket:
+    return "]";
+  case TokenType::LBrace:
+    return "{";
+  case TokenType::RBrace:
+    return "}";
+  case TokenType::Asterisk:
+    return "*";
+  case TokenType::Semicolon:
+    return ";";
+  case TokenType::Plus:
+    return "+";
+  case TokenType::Minus:
+    return "-";
+  case TokenType::ForwardSlash:
+    return "/";
+  case TokenType::BackSlash:
+    return "\\";
+  case TokenType::GreaterThan:
+    return ">";
+  case TokenType::LessThan:
+    return "<";
+  case TokenType::SingleQuote:
+    return "'";
+  case TokenType::DoubleQuote:
+    return "\"";
+  case TokenType::Equals:
+    return "=";
+  case TokenType::LessThanOrEqualTo:
+    return "<=";
+  case TokenType::GreaterThanOrEqualTo:
+    return ">=";
+  case TokenType::DoubleEquals:
+    return "==";
+  case TokenType::Ellipsis:
+    return "...";
+  case TokenType::Caret:
+    return "^";
+  case TokenType::Ampersand:
+    return "&";
+  case TokenType::Pipe:
+    return "|";
+  case TokenType::BitShiftLeft:
+    return "<<";
+  case TokenType::BitShiftRight:
+    return ">>";
+  case TokenType::Tilde:
+    return "~";
+  case TokenType::PlusPlus:
+    return "++";
+  case TokenType::MinusMinus:
+    return "--";
+  case TokenType::LogicalAnd:
+    return "&&";
+  case TokenType::LogicalOr:
+    return "||";
+  case TokenType::QuestionMark:
+    return "?";
+  case TokenType::Colon:
+    return ":";
+  case TokenType::Modulo:
+    return "%";
+  case TokenType::TimesEquals:
+    return "*=";
+  case TokenType::PlusEquals:
+    return "+=";
+  case TokenType::MinusEquals:
+    return "-=";
+  case TokenType::DividedByEquals:
+    return "/=";
+  case TokenType::BitShiftLeftEquals:
+    return "<<=";
+  case TokenType::BitShiftRightEquals:
+    return ">>=";
+  case TokenType::BitwiseAndEquals:
+    return "&=";
+  case TokenType::BitwiseOrEquals:
+    return "|=";
+  case TokenType::XorEquals:
+    return "^=";
+  case TokenType::ModuloEquals:
+    return "%=";
+  case TokenType::NotEquals:
+    return "!=";
+  case TokenType::ArrowOperator:
+    return "->";
+  case TokenType::Hash:
+    return "#";
+  case TokenType::HashHash:
+    return "##";
+  case TokenType::For:
+    return "for";
+  case TokenType::Do:
+    return "do";
+  case TokenType::While:
+    return "while";
+  case TokenType::If:
+    return "if";
+  case TokenType::Else:
+    return "else";
+  case TokenType::Switch:
+    return "switch";
+  case TokenType::Default:
+    return "default";
+  case TokenType::Case:
+    return "case";
+  case TokenType::Continue:
+    return "continue";
+  case TokenType::Break:
+    return "break";
+  case TokenType::GoTo:
+    return "goto";
+  case TokenType::Return:
+    return "return";
+  case TokenType::SizeOf:
+    return "sizeof";
+  case TokenType::Int:
+    return "int";
+  case TokenType::Float:
+    return "float";
+  case TokenType::Double:
+    return "double";
+  case TokenType::Unsigned:
+    return "unsigned";
+  case TokenType::Void:
+    return "void";
+  case TokenType::Char:
+    return "char";
+  case TokenType::Short:
+    return "short";
+  case TokenType::Long:
+    return "long";
+  case TokenType::Signed:
+    return "signed";
+  case TokenType::Bool:
+    return "_Bool";
+  case TokenType::Complex:
+    return "_Complex";
+  case TokenType::Struct:
+    return "struct";
+  case TokenType::Union:
+    return "union";
+  case TokenType::Enum:
+    return "enum";
+  case TokenType::Typedef:
+    return "typedef";
+  case TokenType::Extern:
+    return "extern";
+  case TokenType::Static:
+    return "static";
+  case TokenType::ThreadLocal:
+    return "_Thread_local";
+  case TokenType::Auto:
+    return "auto";
+  case TokenType::Register:
+    return "register";
+  case TokenType::Const:
+    return "const";
+  case TokenType::Restrict:
+    return "restrict";
+  case TokenType::Volatile:
+    return "volatile";
+  case TokenType::Atomic:
+    return "_Atomic";
+  case TokenType::Inline:
+    return "inline";
+  case TokenType::NoReturn:
+    return "_Noreturn";
+  case TokenType::AlignAs:
+    return "_Alignas";
+  default:
+    return "";
+  }
+}
+
+// with the current token a { lexed from text, moves past the matching }
+// without lexing what's between, for DeferredFunctionBody. Returns where the
+// { was, or null with the lexer left as it was if what's between could lex
+// or preprocess to something other than what a brace count sees: a
+// directive, a macro, a line continuation, or a character the lexer might
+// not lex. Skipped tokens aren't hashed, so not with a token_hash either
+char const* skip_braced_text(Lexer* lexer)
+{
+  if (lexer->token_hash || lexer->file_tokens || lexer->replayed_tokens || !lexer->pending_tokens.empty() || lexer->current_token.hide_set
+      || lexer->current_token.type != TokenType::LBrace || *lexer->beginning_of_current_token != '{')
+    return nullptr;
+
+  MacroTable const* macros = lexer->preprocessor->macros;
+  char const* c = lexer->current_location;
+  char const* line_start = nullptr;
+  unsigned lines = 0;
+  for (unsigned depth = 1; depth > 0;) {
+    if (is_non_digit(*c)) {
+      char const* identifier = c;
+      while (is_alphanumeric(*c))
+        c++;
+      Identifier const* name = find_identifier(macros, identifier, (unsigned)(c - identifier));
+      if (name && name->macro)
+        return nullptr;
+    } else if (is_digit(*c)) {
+      // a number's letters aren't identifiers
+      while (is_alphanumeric(*c) || *c == '.')
+        c++;
+    } else if (c[0] == '/' && c[1] == '/') {
+      while (*c != '\n' && *c != '\0')
+        c++;
+    } else if (c[0] == '/' && c[1] == '*') {
+      char const* end = strstr(c + 2, "*/");
+      if (!end)
+        return nullptr;
+      for (; c < end; c++)
+        if (*c == '\n') {
+          lines++;
+          line_start = c + 1;
+        }
+      c = end + 2;
+    } else if (*c == '\n') {
+      lines++;
+      line_start = ++c;
+    } else if (*c == '{' || *c == '}') {
+      depth += *c == '{' ? 1 : -1;
+      c++;
+    } else if (*c != '\0' && (is_whitespace(*c) || strchr("()[];,:?~!%^&*-+=<>|./", *c))) {
+      c++;
+    } else {
+      // including the end of the text, and # and \ and quotes
+      return nullptr;
+    }
+  }
+
+  // columns count from 0 on the first line and 1 after a newline, the way
+  // new_line and advance count them
+  char const* brace = lexer->beginning_of_current_token;
+  lexer->current_column = line_start ? (unsigned)(c - line_start) + 1 : lexer->current_column + (unsigned)(c - lexer->current_location);
+  lexer->current_line += lines;
+  lexer->current_location = c;
+  lexer->at_start_of_line = false;
+  return brace;
+}
+
+// the parser sees tokens after preprocessing, lex_next_token is only what's
+// in the file
 Token const* get_next_token(Lexer* lexer)
 {
   if (lexer->current_token.type == TokenType::Eof)
     return &lexer->current_token;
 
-  lexer->current_token = lex_next_token(lexer);
+  if (!lexer->replayed_tokens)
+    lexer->current_token = preprocess_next_token(lexer);
+  else if (lexer->next_replayed_token < lexer->replayed_tokens->size())
+    lexer->current_token = (*lexer->replayed_tokens)[lexer->next_replayed_token++];
+  else
+    lexer->current_token = make_token(TokenType::Eof, lexer->current_token.line, lexer->current_token.column);
+
+  // errors point at the token being replayed
+  if (lexer->replayed_tokens) {
+    lexer->beginning_of_token_line = lexer->current_token.line;
+    lexer->beginning_of_token_column = lexer->current_token.column;
+  }
+
+  if (lexer->token_hash)
+    *lexer->token_hash = hash_token(*lexer->token_hash, &lexer->current_token);
   return &lexer->current_token;
 }
@@ -0,0 +1,454 @@
+#include "x86_64.h"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+
+// linear scan register allocation, from Poletto and Sarkar's "Linear Scan
+// Register Allocation", with the interval splitting from Wimmer and
+// Mössenböck's "Optimized Interval Splitting in a Linear Scan Register
+// Allocator" cut down to a single split point
+//
+// instructions are numbered in layout order, and each virtual register gets
+// one live interval from its first to its last live position. The intervals
+// are visited in order of their start. When one starts and no register is
+// free, whichever of it and the active intervals is next used furthest away
+// gives up its register: the active interval keeps it up to the split point
+// and lives in a stack slot from there on
+//
+// a graph coloring allocator would do better, but building the interference
+// graph alone is quadratic, and the point of this backend is compiling fast
+//
+// values that ever live in memory are stored to their slot after every
+// definition, so the slot is always up to date and a register part of an
+// interval never has to be written back. The other direction, an edge from a
+// block where the value is in memory to one that expects it in a register, is
+// fixed up with a load on the edge
+
+// only callee saved registers are handed out. rax, rcx and rdx are taken by
+// division and shifts, and r10 and r11 are scratch registers for operands in
+// stack slots. Caller saved registers can join the pool once there are calls
+// to save them around
+static X86Register const allocatable_registers[] = { X86Register::Rbx, X86Register::R12, X86Register::R13, X86Register::R14, X86Register::R15 };
+static X86Register const scratch_registers[] = { X86Register::R10, X86Register::R11 };
+
+struct LiveInterval {
+  unsigned reg;
+
+  // inclusive, in instruction positions
+  unsigned start;
+  unsigned end;
+
+  // positions the register is read or written at, ascending
+  std::vector<unsigned> uses;
+
+  bool has_register;
+  X86Register physical_register;
+
+  // from this position on the value lives in its stack slot. The start of
+  // the interval if it was spilled entirely, past its end if it never was
+  unsigned split_position;
+  unsigned stack_slot;
+};
+
+// each block gets a position for its start followed by two per instruction,
+// the even one where operands are read and the odd one where the result is written
+struct Numbering {
+  std::vector<unsigned> block_start;
+  std::vector<unsigned> block_end;
+};
+
+static bool is_virtual(MachineOperand const* operand)
+{
+  return operand->kind == MachineOperandKind::Register && operand->reg >= first_virtual_register;
+}
+
+static unsigned instruction_position(Numbering const* numbering, unsigned block, unsigned index)
+{
+  return numbering->block_start[block] + 2 * (index + 1);
+}
+
+static std::vector<MachineBasicBlock*> successors(MachineBasicBlock const* block)
+{
+  std::vector<MachineBasicBlock*> result;
+  for (MachineInstruction const& instruction : block->instructions) {
+    if (instruction.opcode == MachineOpcode::Jmp || instruction.opcode == MachineOpcode::Jcc)
+      result.push_back(instruction.operands[0].block);
+    if (instruction.opcode == MachineOpcode::JumpTable)
+      result.insert(result.end(), instruction.jump_table->begin(), instruction.jump_table->end());
+  }
+
+  // a jump table usually has the default and other targets more than once
+  std::sort(result.begin(), result.end(), [](MachineBasicBlock const* a, MachineBasicBlock const* b) { return a->id < b->id; });
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+// classic backwards dataflow, live_in = uses ∪ (live_out - defs)
+static std::vector<std::vector<bool>> compute_live_in(MachineFunction const* function)
+{
+  size_t block_count = function->blocks.size();
+  unsigned register_count = function->next_virtual_register;
+
+  std::vector<std::vector<bool>> uses(block_count, std::vector<bool>(register_count));
+  std::vector<std::vector<bool>> defs(block_count, std::vector<bool>(register_count));
+  for (size_t b = 0; b < block_count; b++)
+    for (MachineInstruction const& instruction : function->blocks[b]->instructions) {
+      for (unsigned i = 0; i < instruction.operand_count; i++)
+        if (is_virtual(&instruction.operands[i]) && machine_operand_is_use(&instruction, i) && !defs[b][instruction.operands[i].reg])
+          uses[b][instruction.operands[i].reg] = true;
+      for (unsigned i = 0; i < instruction.operand_count; i++)
+        if (is_virtual(&instruction.operands[i]) && machine_operand_is_def(&instruction, i))
+          defs[b][instruction.operands[i].reg] = true;
+    }
+
+  std::vector<std::vector<bool>> live_in = uses;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t b = block_count; b-- > 0;)
+      for (MachineBasicBlock const* successor : successors(function->blocks[b]))
+        for (unsigned reg = first_virtual_register; reg < register_count; reg++)
+          if (live_in[successor->id][reg] && !defs[b][reg] && !live_in[b][reg]) {
+            live_in[b][reg] = true;
+            changed = true;
+          }
+  }
+
+  return live_in;
+}
+
+static void extend_interval(std::vector<LiveInterval>* intervals, unsigned reg, unsigned position)
+{
+  LiveInterval* interval = &(*intervals)[reg];
+  interval->start = std::min(interval->start, position);
+  interval->end = std::max(interval->end, position);
+}
+
+static std::vector<LiveInterval> build_intervals(MachineFunction const* function, Numbering const* numbering)
+{
+  std::vector<std::vector<bool>> live_in = compute_live_in(function);
+
+  std::vector<LiveInterval> intervals(function->next_virtual_register);
+  for (unsigned reg = 0; reg < intervals.size(); reg++) {
+    intervals[reg].reg = reg;
+    intervals[reg].start = UINT_MAX;
+    intervals[reg].end = 0;
+    intervals[reg].has_register = false;
+    intervals[reg].split_position = UINT_MAX;
+  }
+
+  for (MachineBasicBlock const* block : function->blocks) {
+    unsigned b = block->id;
+    for (unsigned reg = first_virtual_register; reg < intervals.size(); reg++)
+      if (live_in[b][reg])
+        extend_interval(&intervals, reg, numbering->block_start[b]);
+
+    for (MachineBasicBlock const* successor : successors(block))
+      for (unsigned reg = first_virtual_register; reg < intervals.size(); reg++)
+        if (live_in[successor->id][reg])
+          extend_interval(&intervals, reg, numbering->block_end[b]);
+
+    for (unsigned index = 0; index < block->instructions.size(); index++) {
+      MachineInstruction const* instruction = &block->instructions[index];
+      unsigned position = instruction_position(numbering, b, index);
+      for (unsigned i = 0; i < instruction->operand_count; i++) {
+        MachineOperand const* operand = &instruction->operands[i];
+        if (!is_virtual(operand))
+          continue;
+
+        unsigned at = machine_operand_is_use(instruction, i) ? position : position + 1;
+        extend_interval(&intervals, operand->reg, at);
+        intervals[operand->reg].uses.push_back(at);
+      }
+    }
+  }
+
+  for (LiveInterval& interval : intervals)
+    std::sort(interval.uses.begin(), interval.uses.end());
+  return intervals;
+}
+
+static unsigned next_use(LiveInterval const* interval, unsigned position)
+{
+  auto use = std::lower_bound(interval->uses.begin(), interval->uses.end(), position);
+  return use == interval->uses.end() ? UINT_MAX : *use;
+}
+
+static void linear_scan(std::vector<LiveInterval>* intervals, OptimizationStatistics* statistics)
+{
+  std::vector<LiveInterval*> unhandled;
+  for (LiveInterval& interval : *intervals)
+    if (interval.reg >= first_virtual_register && interval.start != UINT_MAX)
+      unhandled.push_back(&interval);
+  std::sort(unhandled.begin(), unhandled.end(), [](LiveInterval const* a, LiveInterval const* b) { return a->start < b->start; });
+
+  std::vector<LiveInterval*> active;
+  std::vector<X86Register> free_registers(std::rbegin(allocatable_registers), std::rend(allocatable_registers));
+
+  for (LiveInterval* current : unhandled) {
+    // an interval ending where this one starts has had its last use read before the result is written
+    for (size_t i = 0; i < active.size();) {
+      if (active[i]->end < current->start) {
+        free_registers.push_back(active[i]->physical_register);
+        active[i] = active.back();
+        active.pop_back();
+      } else {
+        i++;
+      }
+    }
+
+    if (!free_registers.empty()) {
+      current->has_register = true;
+      current->physical_register = free_registers.back();
+      free_registers.pop_back();
+      active.push_back(current);
+      continue;
+    }
+
+    size_t victim = active.size();
+    unsigned furthest_use = next_use(current, current->start);
+    for (size_t i = 0; i < active.size(); i++) {
+      unsigned use = next_use(active[i], current->start);
+      if (use > furthest_use) {
+        furthest_use = use;
+        victim = i;
+      }
+    }
+
+    if (victim == active.size()) {
+      current->split_position = current->start;
+      statistics->intervals_spilled++;
+      continue;
+    }
+
+    LiveInterval* split = active[victim];
+    split->split_position = current->start;
+    statistics->intervals_split++;
+
+    current->has_register = true;
+    current->physical_register = split->physical_register;
+    active[victim] = current;
+  }
+}
+
+static bool in_register(LiveInterval const* interval, unsigned position) { return interval->has_register && position < interval->split_position; }
+
+static bool allows_memory(MachineInstruction const* instruction, unsigned operand_index)
+{
+  switch (instruction->opcode) {
+  case MachineOpcode::Mov:
+    // there's no mov from a 64 bit immediate to memory
+    return operand_index == 1 || instruction->operands[1].kind != MachineOperandKind::Immediate || instruction->size != 8
+        || (instruction->operands[1].immediate >= INT_MIN && instruction->operands[1].immediate <= INT_MAX);
+
+  case MachineOpcode::Add:
+  case MachineOpcode::Sub:
+  case MachineOpcode::And:
+  case MachineOpcode::Or:
+  case MachineOpcode::Xor:
+  case MachineOpcode::Cmp:
+    return true;
+
+  case MachineOpcode::IMul:
+  case MachineOpcode::MovZX:
+  case MachineOpcode::MovSX:
+  case MachineOpcode::CMov:
+    return operand_index == 1;
+
+  case MachineOpcode::Test:
+  case MachineOpcode::Shl:
+  case MachineOpcode::Shr:
+  case MachineOpcode::Sar:
+  case MachineOpcode::Neg:
+  case MachineOpcode::SetCC:
+  case MachineOpcode::IDiv:
+  case MachineOpcode::Div:
+    return operand_index == 0;
+
+  default:
+    return false;
+  }
+}
+
+static MachineInstruction spill_move(MachineOperand destination, MachineOperand source)
+{
+  MachineInstruction move = {};
+  move.opcode = MachineOpcode::Mov;
+  move.size = 8;
+  move.operands[0] = destination;
+  move.operands[1] = source;
+  move.operand_count = 2;
+  return move;
+}
+
+// replace virtual registers with physical registers and stack slots
+static void rewrite_block(MachineBasicBlock* block, Numbering const* numbering, std::vector<LiveInterval> const* intervals)
+{
+  std::vector<MachineInstruction> rewritten;
+  rewritten.reserve(block->instructions.size());
+
+  for (unsigned index = 0; index < block->instructions.size(); index++) {
+    MachineInstruction instruction = block->instructions[index];
+    unsigned position = instruction_position(numbering, block->id, index);
+
+    std::vector<MachineInstruction> after;
+    bool has_memory_operand = false;
+    for (unsigned i = 0; i < instruction.operand_count; i++)
+      has_memory_operand |= instruction.operands[i].kind == MachineOperandKind::StackSlot;
+
+    for (unsigned i = 0; i < instruction.operand_count; i++) {
+      MachineOperand* operand = &instruction.operands[i];
+      if (!is_virtual(operand))
+        continue;
+
+      LiveInterval const* interval = &(*intervals)[operand->reg];
+      bool is_use = machine_operand_is_use(&instruction, i);
+      bool is_def = machine_operand_is_def(&instruction, i);
+      unsigned at = is_use ? position : position + 1;
+
+      if (in_register(interval, at)) {
+        *operand = machine_register((unsigned)interval->physical_register);
+        if (is_def && interval->split_position != UINT_MAX)
+          after.push_back(spill_move(machine_stack_slot(interval->stack_slot), *operand));
+        continue;
+      }
+
+      MachineOperand slot = machine_stack_slot(interval->stack_slot);
+      if (!has_memory_operand && allows_memory(&instruction, i)) {
+        *operand = slot;
+        has_memory_operand = true;
+        continue;
+      }
+
+      *operand = machine_register((unsigned)scratch_registers[i]);
+      if (is_use)
+        rewritten.push_back(spill_move(*operand, slot));
+      if (is_def)
+        after.push_back(spill_move(slot, *operand));
+    }
+
+    rewritten.push_back(instruction);
+    rewritten.insert(rewritten.end(), after.begin(), after.end());
+  }
+
+  block->instructions = std::move(rewritten);
+}
+
+// loads for values that are in memory at the end of a predecessor but
+// expected in a register at the start of its successor
+static void resolve_edges(MachineFunction* function, Numbering const* numbering, std::vector<LiveInterval> const* intervals,
+    std::vector<std::vector<bool>> const* live_in)
+{
+  std::vector<unsigned> predecessor_count(function->blocks.size());
+  for (MachineBasicBlock const* block : function->blocks)
+    for (MachineBasicBlock const* successor : successors(block))
+      predecessor_count[successor->id]++;
+
+  size_t original_block_count = function->blocks.size();
+  for (size_t b = 0; b < original_block_count; b++) {
+    MachineBasicBlock* predecessor = function->blocks[b];
+    std::vector<MachineBasicBlock*> predecessor_successors = successors(predecessor);
+
+    for (MachineBasicBlock* successor : predecessor_successors) {
+      std::vector<MachineInstruction> loads;
+      for (unsigned reg = first_virtual_register; reg < intervals->size(); reg++) {
+        if (!(*live_in)[successor->id][reg])
+          continue;
+
+        LiveInterval const* interval = &(*intervals)[reg];
+        if (in_register(interval, numbering->block_start[successor->id]) && !in_register(interval, numbering->block_end[b]))
+          loads.push_back(spill_move(machine_register((unsigned)interval->physical_register), machine_stack_slot(interval->stack_slot)));
+      }
+
+      if (loads.empty())
+        continue;
+
+      // at the end of the predecessor, before its jump. Not before a jump
+      // table's, whose index could be in a register the loads overwrite
+      if (predecessor_successors.size() == 1 && predecessor->instructions.back().opcode != MachineOpcode::JumpTable) {
+        std::vector<MachineInstruction>* instructions = &predecessor->instructions;
+        instructions->insert(instructions->end() - 1, loads.begin(), loads.end());
+        continue;
+      }
+
+      // at the start of the successor
+      if (predecessor_count[successor->id] == 1) {
+        successor->instructions.insert(successor->instructions.begin(), loads.begin(), loads.end());
+        continue;
+      }
+
+      // a critical edge, which gets a block of its own
+      MachineBasicBlock* edge_block = new MachineBasicBlock();
+      edge_block->id = function->blocks.size();
+      edge_block->instructions = loads;
+
+      MachineInstruction jump = {};
+      jump.opcode = MachineOpcode::Jmp;
+      jump.operands[0] = machine_block(successor);
+      jump.operand_count = 1;
+      edge_block->instructions.push_back(jump);
+      function->blocks.push_back(edge_block);
+
+      for (MachineInstruction& instruction : predecessor->instructions) {
+        if ((instruction.opcode == MachineOpcode::Jmp || instruction.opcode == MachineOpcode::Jcc) && instruction.operands[0].block == successor)
+          instruction.operands[0].block = edge_block;
+        if (instruction.opcode == MachineOpcode::JumpTable)
+          std::replace(instruction.jump_table->begin(), instruction.jump_table->end(), successor, edge_block);
+      }
+    }
+  }
+}
+
+// the frame below rbp is the saved callee saved registers, then the stack slots
+static void lay_out_frame(MachineFunction* function)
+{
+  unsigned saved_bytes = 8 * function->used_callee_saved_registers.size();
+  unsigned offset = saved_bytes;
+  for (StackSlot& slot : function->stack_slots) {
+    if (slot.offset > 0)
+      continue;
+
+    offset = (offset + slot.size + slot.size - 1) / slot.size * slot.size;
+    slot.offset = -(int)offset;
+  }
+
+  // the return address and saved rbp leave rsp 16 byte aligned at rbp
+  unsigned aligned = (offset + 15) / 16 * 16;
+  function->frame_size = aligned - saved_bytes;
+}
+
+void allocate_registers(MachineFunction* function, OptimizationStatistics* statistics)
+{
+  Numbering numbering;
+  unsigned position = 0;
+  for (MachineBasicBlock const* block : function->blocks) {
+    numbering.block_start.push_back(position);
+    position += 2 * (block->instructions.size() + 1);
+    numbering.block_end.push_back(position - 1);
+  }
+
+  std::vector<LiveInterval> intervals = build_intervals(function, &numbering);
+  linear_scan(&intervals, statistics);
+
+  bool is_used[16] = {};
+  for (LiveInterval& interval : intervals) {
+    if (interval.has_register)
+      is_used[(unsigned)interval.physical_register] = true;
+
+    if (interval.split_position != UINT_MAX) {
+      interval.stack_slot = function->stack_slots.size();
+      function->stack_slots.push_back({ 8, 0 });
+    }
+  }
+  for (X86Register reg : allocatable_registers)
+    if (is_used[(unsigned)reg])
+      function->used_callee_saved_registers.push_back(reg);
+
+  std::vector<std::vector<bool>> live_in = compute_live_in(function);
+  for (MachineBasicBlock* block : function->blocks)
+    rewrite_block(block, &numbering, &intervals);
+  resolve_edges(function, &numbering, &intervals, &live_in);
+
+  lay_out_frame(function);
+}
@@ -0,0 +1,152 @@
+#include "analysis.h"
+#include "optimize.h"
+
+#include <cassert>
+#include <unordered_set>
+
+// loop invariant code motion
+//
+// an instruction in a loop whose operands are all defined outside of it
+// computes the same value on every iteration, so it can be computed once in
+// the preheader instead. Once it's moved, instructions using it may become
+// invariant too, and visiting the loop's blocks in reverse postorder means
+// definitions are always seen before their uses, so one pass finds them all
+//
+// loops are visited innermost first. Something hoisted out of an inner loop
+// lands in its preheader, which is still inside the outer loop, and gets
+// another chance to move when the outer loop is visited
+//
+// with every local in an alloca, most invariant expressions start with loads,
+// e.g. n*k in a loop is load n, load k, mul. A load from an alloca that
+// doesn't escape and isn't stored to anywhere in the loop reads the same value
+// on every iteration, so those are hoisted as well
+
+// hoisted code runs even if the loop body never would have, e.g. when the loop
+// runs zero times, so it has to be safe to execute speculatively. Division by
+// zero and INT_MIN / -1 trap, everything else here can't. An out of bounds
+// getelementptr is only a problem if something loads from it
+static bool can_speculate(IRInstruction const* instruction)
+{
+  IRValue const* divisor = instruction->operand_count == 2 ? instruction->operands[1] : nullptr;
+
+  switch (instruction->opcode) {
+  case IROpcode::SDiv:
+  case IROpcode::SRem:
+    return divisor->kind == IRValueKind::Constant && divisor->constant != 0 && divisor->constant != -1;
+
+  case IROpcode::UDiv:
+  case IROpcode::URem:
+    return divisor->kind == IRValueKind::Constant && divisor->constant != 0;
+
+  case IROpcode::ICmp:
+  case IROpcode::ZExt:
+  case IROpcode::SExt:
+  case IROpcode::Trunc:
+  case IROpcode::GetElementPtr:
+  case IROpcode::Splat:
+  case IROpcode::Select:
+    return true;
+
+  default:
+    return ir_opcode_is_binary_operator(instruction->opcode);
+  }
+}
+
+static bool is_defined_outside_loop(Loop const* loop, IRValue const* value)
+{
+  return value->kind != IRValueKind::Instruction || !loop->blocks.contains(value->instruction->parent);
+}
+
+static bool is_loop_invariant(IRInstruction const* instruction, Loop const* loop, std::unordered_set<IRValue const*> const& non_escaping_allocas,
+    std::unordered_set<IRValue const*> const& stored_allocas)
+{
+  if (instruction->opcode == IROpcode::Load) {
+    IRValue const* pointer = instruction->operands[0];
+    return non_escaping_allocas.contains(pointer) && !stored_allocas.contains(pointer);
+  }
+
+  if (!can_speculate(instruction))
+    return false;
+
+  for (unsigned i = 0; i < instruction->operand_count; i++)
+    if (!is_defined_outside_loop(loop, instruction->operands[i]))
+      return false;
+  return true;
+}
+
+// a new block between the header and everything outside the loop that
+// branches to it
+static void insert_preheader(Loop const* loop, ControlFlowGraph const* cfg)
+{
+  IRBasicBlock* header = loop->header;
+  assert(header->previous && "the entry block can't be a loop header");
+
+  IRBasicBlock* preheader = insert_ir_basic_block_after(header->previous, "preheader");
+  IRBuilder builder = { header->parent, preheader };
+  ir_build_br(&builder, header);
+
+  for (IRBasicBlock* predecessor : cfg->predecessors.at(header)) {
+    if (loop->blocks.contains(predecessor))
+      continue;
+
+    IRInstruction* terminator = ir_block_terminator(predecessor);
+    for (unsigned i = 0; i < terminator->target_count; i++)
+      if (terminator->targets[i] == header)
+        terminator->targets[i] = preheader;
+  }
+}
+
+void run_loop_invariant_code_motion(IRFunction* function, OptimizationStatistics* statistics)
+{
+  ControlFlowGraph cfg = compute_control_flow_graph(function);
+  DominatorTree dominator_tree = compute_dominator_tree(function, &cfg);
+  LoopInfo loop_info = compute_loop_info(&cfg, &dominator_tree);
+
+  if (loop_info.loops.empty())
+    return;
+
+  // codegen's loops already have preheaders, but make sure before relying on it.
+  // Adding one changes the CFG, so everything is recomputed afterwards
+  bool inserted_preheader = false;
+  for (Loop const* loop : loop_info.loops)
+    if (!loop_preheader(loop, &cfg)) {
+      insert_preheader(loop, &cfg);
+      inserted_preheader = true;
+    }
+
+  if (inserted_preheader) {
+    cfg = compute_control_flow_graph(function);
+    dominator_tree = compute_dominator_tree(function, &cfg);
+    loop_info = compute_loop_info(&cfg, &dominator_tree);
+  }
+
+  std::unordered_set<IRValue const*> non_escaping_allocas = find_non_escaping_allocas(function);
+
+  for (Loop const* loop : loop_info.loops) {
+    IRBasicBlock* preheader = loop_preheader(loop, &cfg);
+    assert(preheader && "loop without a preheader after inserting preheaders");
+    IRInstruction* insertion_point = ir_block_terminator(preheader);
+
+    std::unordered_set<IRValue const*> stored_allocas;
+    for (IRBasicBlock const* block : loop->blocks)
+      for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+        if (instruction->opcode == IROpcode::Store)
+          stored_allocas.insert(instruction->operands[1]);
+
+    for (IRBasicBlock* block : cfg.reverse_postorder) {
+      if (!loop->blocks.contains(block))
+        continue;
+
+      IRInstruction* next_instruction;
+      for (IRInstruction* instruction = block->first_instruction; instruction; instruction = next_instruction) {
+        next_instruction = instruction->next;
+        if (!is_loop_invariant(instruction, loop, non_escaping_allocas, stored_allocas))
+          continue;
+
+        ir_remove_instruction(instruction);
+        ir_insert_instruction_before(insertion_point, instruction);
+        statistics->licm_hoisted++;
+      }
+    }
+  }
+}
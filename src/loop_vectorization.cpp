@@ -0,0 +1,514 @@
+#include "analysis.h"
+#include "optimize.h"
+
+#include <cassert>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// loop vectorization of counted loops
+//
+// the kernels worth vectorizing look like
+//
+//      for (int i = 0; i < n; i++)
+//        a[i] = b[i] + c[i];
+//
+// where every iteration does the same thing to the next element of each
+// array. Doing it to four elements at a time with SSE's 16 byte vectors does
+// a quarter of the loads, adds and stores, and a quarter of the branches
+//
+// only the simplest shape is recognised, the one codegen produces for the
+// loop above once the other passes are done with it. The induction variable
+// is an i32 local, loaded in the header, compared against something loop
+// invariant with <, <=, or their unsigned versions, and incremented by one at
+// the end of the body. The body is straight line code in which every memory
+// access is p[i] for a loop invariant p, all of one element type, and
+// everything else is arithmetic on values loaded that way, loop invariant
+// values and constants. Anything else, a call, a branch, a reduction into a
+// local, a[i + 1], a conversion, and the loop is left alone
+//
+// the vector loop is put in front of the original one, which stays behind to
+// finish off the iterations that don't make up a whole vector
+//
+//   preheader:                   preheader:
+//     br for.cond                  br vector.ph
+//                                vector.ph:
+//                                  splat loop invariant operands
+//                                  runtime alias checks, br vector.cond or for.cond
+//                         =>     vector.cond:
+//                                  br vector.body if i + lanes - 1 < n, else for.cond
+//                                vector.body:
+//                                  the body on <lanes x T>, i += lanes, br vector.cond
+//   for.cond: ...                for.cond: ... the original loop, unchanged
+//
+// since i lives in memory, there are no phis to fix up. The original loop
+// just picks up wherever the vector loop left i. The trip count check is done
+// in 64 bits, so i + lanes - 1 can't overflow where i itself wouldn't have
+//
+// vectorizing is only correct if the stores of one iteration don't change
+// what the loads of the next few read, which they can if the arrays overlap.
+// The loop's accesses to each array cover p + begin up to p + end, so before
+// entering the vector loop each array stored to is checked against every
+// other array for overlap, falling back to the original loop if any do. A
+// restrict pointer can't overlap anything else the loop accesses, so pairs
+// where either side is restrict need no check
+//
+// vector multiplies only exist for some element sizes in SSE, pmullw and
+// pmulld, so loops multiplying anything else aren't vectorized. Everything
+// this pass produces can then be lowered by the native backend too
+
+// SSE's registers, which every x86-64 has
+static constexpr unsigned vector_bytes = 16;
+
+struct VectorizableLoop {
+  IRBasicBlock* preheader;
+  IRBasicBlock* header;
+
+  // the induction variable's alloca and its load in the header
+  IRValue* induction_variable;
+  IRValue* induction_value;
+
+  // the loop runs while induction_value <comparison> bound
+  IRComparison comparison;
+  IRValue* bound;
+
+  char const* element_type;
+  unsigned lanes;
+
+  // the body in order, minus the induction variable's extensions and
+  // increment, and the branches
+  std::vector<IRInstruction*> body;
+
+  // the distinct arrays the loop stores to and accesses at all
+  std::vector<IRValue*> stored_arrays;
+  std::vector<IRValue*> arrays;
+};
+
+static bool is_defined_outside_loop(Loop const* loop, IRValue const* value)
+{
+  return value->kind != IRValueKind::Instruction || !loop->blocks.contains(value->instruction->parent);
+}
+
+static bool is_instruction(IRValue const* value, IROpcode opcode)
+{
+  return value->kind == IRValueKind::Instruction && value->instruction->opcode == opcode;
+}
+
+static bool same_type(char const* first, char const* second) { return strcmp(first, second) == 0; }
+
+static bool comparison_is_signed(IRComparison comparison) { return comparison == IRComparison::Slt || comparison == IRComparison::Sle; }
+
+// the operations SSE has a vector instruction for, at each element size
+static bool has_vector_instruction(IROpcode opcode, unsigned element_size)
+{
+  switch (opcode) {
+  case IROpcode::Add:
+  case IROpcode::Sub:
+  case IROpcode::And:
+  case IROpcode::Or:
+  case IROpcode::Xor:
+    return true;
+  case IROpcode::Mul:
+    return element_size == 2 || element_size == 4;
+  default:
+    return false;
+  }
+}
+
+static void add_array(std::vector<IRValue*>* arrays, IRValue* array)
+{
+  for (IRValue* existing : *arrays)
+    if (existing == array)
+      return;
+  arrays->push_back(array);
+}
+
+// the condition in the header is i < n, or the icmp/zext/icmp ne 0 chain codegen wraps around it
+static IRInstruction* find_exit_comparison(IRInstruction const* terminator)
+{
+  IRValue* condition = terminator->operands[0];
+  if (!is_instruction(condition, IROpcode::ICmp))
+    return nullptr;
+
+  IRInstruction* comparison = condition->instruction;
+  bool compares_to_zero = comparison->comparison == IRComparison::Ne && ir_value_is_constant(comparison->operands[1], 0);
+  if (compares_to_zero && is_instruction(comparison->operands[0], IROpcode::ZExt)) {
+    IRValue* extended = comparison->operands[0]->instruction->operands[0];
+    if (is_instruction(extended, IROpcode::ICmp))
+      return extended->instruction;
+  }
+  return comparison;
+}
+
+static bool analyze_header(VectorizableLoop* candidate, Loop const* loop, std::unordered_set<IRValue const*> const* non_escaping_allocas)
+{
+  IRBasicBlock* header = candidate->header;
+  IRInstruction* terminator = ir_block_terminator(header);
+  if (terminator->opcode != IROpcode::CondBr || !loop->blocks.contains(terminator->targets[0]) || loop->blocks.contains(terminator->targets[1]))
+    return false;
+
+  IRInstruction* comparison = find_exit_comparison(terminator);
+  if (!comparison)
+    return false;
+
+  switch (comparison->comparison) {
+  case IRComparison::Slt:
+  case IRComparison::Sle:
+  case IRComparison::Ult:
+  case IRComparison::Ule:
+    break;
+  default:
+    return false;
+  }
+
+  IRValue* induction_value = comparison->operands[0];
+  if (!is_instruction(induction_value, IROpcode::Load) || induction_value->instruction->parent != header
+      || !same_type(induction_value->type, "i32"))
+    return false;
+
+  IRValue* induction_variable = induction_value->instruction->operands[0];
+  if (!non_escaping_allocas->contains(induction_variable) || !is_defined_outside_loop(loop, comparison->operands[1]))
+    return false;
+
+  // nothing else may happen in the header, it's run one more time than the body
+  for (IRInstruction* instruction = header->first_instruction; instruction; instruction = instruction->next) {
+    bool is_exit_test = instruction == induction_value->instruction || instruction == comparison || instruction == terminator
+        || (instruction->result && instruction->result == terminator->operands[0])
+        || (instruction->opcode == IROpcode::ZExt && instruction->operands[0] == comparison->result);
+    if (!is_exit_test)
+      return false;
+  }
+
+  candidate->induction_variable = induction_variable;
+  candidate->induction_value = induction_value;
+  candidate->comparison = comparison->comparison;
+  candidate->bound = comparison->operands[1];
+  return true;
+}
+
+// a value the vector body can have as a vector: one it computes itself, a
+// constant, or something loop invariant that gets splatted
+static bool is_vector_operand(VectorizableLoop const* candidate, Loop const* loop, std::unordered_set<IRValue const*> const* vectors,
+    IRValue const* value)
+{
+  if (vectors->contains(value))
+    return true;
+  return is_defined_outside_loop(loop, value) && candidate->element_type && same_type(value->type, candidate->element_type);
+}
+
+static bool analyze_body(VectorizableLoop* candidate, Loop const* loop, std::vector<IRBasicBlock*> const* body_blocks,
+    std::unordered_map<IRValue const*, unsigned> const* use_counts)
+{
+  IRValue* induction_value = candidate->induction_value;
+  bool is_signed = comparison_is_signed(candidate->comparison);
+
+  std::unordered_set<IRValue const*> indices;
+  std::unordered_set<IRValue const*> addresses;
+  std::unordered_set<IRValue const*> vectors;
+  IRValue const* increment = nullptr;
+  bool stored_increment = false;
+
+  for (IRBasicBlock* block : *body_blocks)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      IRValue* const* operands = instruction->operands;
+
+      switch (instruction->opcode) {
+      case IROpcode::Br:
+        continue;
+
+      // the index of every access, i extended the way its comparison treats
+      // it. The vector body has its own
+      case IROpcode::SExt:
+      case IROpcode::ZExt:
+        if (operands[0] != induction_value || (instruction->opcode == IROpcode::SExt) != is_signed)
+          return false;
+        indices.insert(instruction->result);
+        continue;
+
+      case IROpcode::GetElementPtr:
+        if (!indices.contains(operands[1]) || !is_defined_outside_loop(loop, operands[0]))
+          return false;
+        if (!candidate->element_type)
+          candidate->element_type = instruction->allocated_type;
+        if (!same_type(instruction->allocated_type, candidate->element_type))
+          return false;
+        addresses.insert(instruction->result);
+        add_array(&candidate->arrays, operands[0]);
+        break;
+
+      case IROpcode::Load:
+        if (!addresses.contains(operands[0]) || instruction->is_volatile)
+          return false;
+        vectors.insert(instruction->result);
+        break;
+
+      case IROpcode::Store:
+        if (operands[1] == candidate->induction_variable) {
+          if (stored_increment || operands[0] != increment)
+            return false;
+          stored_increment = true;
+          continue;
+        }
+
+        if (!addresses.contains(operands[1]) || instruction->is_volatile || !is_vector_operand(candidate, loop, &vectors, operands[0]))
+          return false;
+        add_array(&candidate->stored_arrays, operands[1]->instruction->operands[0]);
+        break;
+
+      default: {
+        if (!ir_opcode_is_binary_operator(instruction->opcode))
+          return false;
+
+        // i + 1, stored straight back to i
+        if (instruction->opcode == IROpcode::Add && operands[0] == induction_value && ir_value_is_constant(operands[1], 1)) {
+          auto uses = use_counts->find(instruction->result);
+          if (increment || uses == use_counts->end() || uses->second != 1)
+            return false;
+          increment = instruction->result;
+          continue;
+        }
+
+        if (!candidate->element_type || !same_type(instruction->result->type, candidate->element_type)
+            || !has_vector_instruction(instruction->opcode, ir_type_size(candidate->element_type)))
+          return false;
+        if (!is_vector_operand(candidate, loop, &vectors, operands[0]) || !is_vector_operand(candidate, loop, &vectors, operands[1]))
+          return false;
+        vectors.insert(instruction->result);
+        break;
+      }
+      }
+
+      candidate->body.push_back(instruction);
+    }
+
+  if (!stored_increment || candidate->stored_arrays.empty())
+    return false;
+
+  candidate->lanes = vector_bytes / ir_type_size(candidate->element_type);
+  return candidate->lanes > 1;
+}
+
+static bool analyze_loop(VectorizableLoop* candidate, Loop const* loop, ControlFlowGraph const* cfg,
+    std::unordered_set<IRValue const*> const* non_escaping_allocas, std::unordered_map<IRValue const*, unsigned> const* use_counts)
+{
+  candidate->header = loop->header;
+  candidate->preheader = loop_preheader(loop, cfg);
+  candidate->element_type = nullptr;
+  if (!candidate->preheader || loop->latches.size() != 1)
+    return false;
+
+  if (!analyze_header(candidate, loop, non_escaping_allocas))
+    return false;
+
+  // the body has to be a straight line of blocks from the header back to it
+  std::vector<IRBasicBlock*> body_blocks;
+  IRBasicBlock* block = ir_block_terminator(loop->header)->targets[0];
+  while (block != loop->header) {
+    IRInstruction* terminator = ir_block_terminator(block);
+    if (terminator->opcode != IROpcode::Br || cfg->predecessors.at(block).size() != 1)
+      return false;
+    body_blocks.push_back(block);
+    block = terminator->targets[0];
+  }
+  if (body_blocks.size() + 1 != loop->blocks.size())
+    return false;
+
+  return analyze_body(candidate, loop, &body_blocks, use_counts);
+}
+
+static IRValue* extend_to_i64(IRBuilder* builder, IRValue* value, bool is_signed)
+{
+  if (value->kind == IRValueKind::Constant)
+    return ir_constant("i64", is_signed ? value->constant : value->constant & 0xffffffffll);
+  return ir_build_cast(builder, is_signed ? IROpcode::SExt : IROpcode::ZExt, value, "i64");
+}
+
+// accessed as the loop already accesses it
+static IRValue* load_induction_variable(IRBuilder* builder, VectorizableLoop const* candidate)
+{
+  IRValue* value = ir_build_load(builder, "i32", candidate->induction_variable);
+  value->instruction->tbaa_type = candidate->induction_value->instruction->tbaa_type;
+  return value;
+}
+
+// the part of an array the loop accesses, [begin, end)
+struct AccessedRange {
+  IRValue* begin;
+  IRValue* end;
+};
+
+// whether two ranges don't overlap, which is first.end <= second.begin or second.end <= first.begin
+static IRValue* build_no_overlap_check(IRBuilder* builder, AccessedRange first, AccessedRange second)
+{
+  IRValue* first_below = ir_build_icmp(builder, IRComparison::Ule, first.end, second.begin);
+  IRValue* second_below = ir_build_icmp(builder, IRComparison::Ule, second.end, first.begin);
+  return ir_build_binary(builder, IROpcode::Or, first_below, second_below);
+}
+
+static void vectorize_loop(IRFunction* function, VectorizableLoop const* candidate, OptimizationStatistics* statistics)
+{
+  IRBasicBlock* header = candidate->header;
+  bool is_signed = comparison_is_signed(candidate->comparison);
+  bool is_inclusive = candidate->comparison == IRComparison::Sle || candidate->comparison == IRComparison::Ule;
+  char const* vector_type = ir_vector_type(candidate->element_type, candidate->lanes);
+
+  IRBasicBlock* vector_preheader = insert_ir_basic_block_after(candidate->preheader, "vector.ph");
+  IRBasicBlock* vector_condition = insert_ir_basic_block_after(vector_preheader, "vector.cond");
+  IRBasicBlock* vector_body = insert_ir_basic_block_after(vector_condition, "vector.body");
+
+  IRInstruction* preheader_terminator = ir_block_terminator(candidate->preheader);
+  for (unsigned i = 0; i < preheader_terminator->target_count; i++)
+    if (preheader_terminator->targets[i] == header)
+      preheader_terminator->targets[i] = vector_preheader;
+
+  IRBuilder builder = { function, vector_preheader };
+
+  // the end of the range of i, exclusive
+  IRValue* end = extend_to_i64(&builder, candidate->bound, is_signed);
+  if (is_inclusive)
+    end = end->kind == IRValueKind::Constant ? ir_constant("i64", end->constant + 1)
+                                              : ir_build_binary(&builder, IROpcode::Add, end, ir_constant("i64", 1));
+
+  // loop invariant operands are splatted once, up front. Every operand of a
+  // load, store or arithmetic that isn't computed in the body or a constant is one
+  std::unordered_set<IRValue const*> body_values;
+  for (IRInstruction* instruction : candidate->body)
+    body_values.insert(instruction->result);
+
+  std::unordered_map<IRValue const*, IRValue*> splats;
+  for (IRInstruction* instruction : candidate->body) {
+    if (instruction->opcode == IROpcode::GetElementPtr)
+      continue;
+
+    for (unsigned i = 0; i < instruction->operand_count; i++) {
+      IRValue* operand = instruction->operands[i];
+      if (operand->kind != IRValueKind::Constant && !body_values.contains(operand) && !splats.contains(operand))
+        splats[operand] = ir_build_splat(&builder, operand, candidate->lanes);
+    }
+  }
+
+  // every pair of arrays where one is stored to, and neither is restrict
+  IRValue* no_overlap = nullptr;
+  IRValue* begin = nullptr;
+  std::unordered_map<IRValue const*, AccessedRange> ranges;
+  for (size_t i = 0; i < candidate->arrays.size(); i++)
+    for (size_t j = i + 1; j < candidate->arrays.size(); j++) {
+      IRValue* first = candidate->arrays[i];
+      IRValue* second = candidate->arrays[j];
+
+      bool is_stored = false;
+      for (IRValue* stored : candidate->stored_arrays)
+        is_stored |= stored == first || stored == second;
+      if (!is_stored || first->is_noalias || second->is_noalias)
+        continue;
+
+      if (!begin)
+        begin = extend_to_i64(&builder, load_induction_variable(&builder, candidate), is_signed);
+      for (IRValue* array : { first, second })
+        if (!ranges.contains(array))
+          ranges[array] = { ir_build_getelementptr(&builder, candidate->element_type, array, begin),
+            ir_build_getelementptr(&builder, candidate->element_type, array, end) };
+
+      IRValue* check = build_no_overlap_check(&builder, ranges.at(first), ranges.at(second));
+      no_overlap = no_overlap ? ir_build_binary(&builder, IROpcode::And, no_overlap, check) : check;
+      statistics->loop_vectorization_alias_checks++;
+    }
+
+  if (no_overlap)
+    ir_build_cond_br(&builder, no_overlap, vector_condition, header);
+  else
+    ir_build_br(&builder, vector_condition);
+
+  // whether lanes more iterations are left, the last one being i + lanes - 1
+  builder.insertion_block = vector_condition;
+  IRValue* induction_value = load_induction_variable(&builder, candidate);
+  IRValue* index = extend_to_i64(&builder, induction_value, is_signed);
+  IRValue* last = ir_build_binary(&builder, IROpcode::Add, index, ir_constant("i64", candidate->lanes - 1));
+  IRComparison in_range = is_signed ? IRComparison::Slt : IRComparison::Ult;
+  ir_build_cond_br(&builder, ir_build_icmp(&builder, in_range, last, end), vector_body, header);
+
+  builder.insertion_block = vector_body;
+  std::unordered_map<IRValue const*, IRValue*> vector_values;
+  auto vector_operand = [&](IRValue* value) -> IRValue* {
+    if (vector_values.contains(value))
+      return vector_values.at(value);
+    if (value->kind == IRValueKind::Constant)
+      return ir_constant(vector_type, value->constant);
+    return splats.at(value);
+  };
+
+  for (IRInstruction* instruction : candidate->body) {
+    IRValue* const* operands = instruction->operands;
+    switch (instruction->opcode) {
+    case IROpcode::GetElementPtr:
+      vector_values[instruction->result] = ir_build_getelementptr(&builder, candidate->element_type, operands[0], index);
+      break;
+
+    // each lane is accessed as the element type, the same as the scalar access
+    case IROpcode::Load:
+      vector_values[instruction->result] = ir_build_load(&builder, vector_type, vector_values.at(operands[0]));
+      vector_values[instruction->result]->instruction->tbaa_type = instruction->tbaa_type;
+      break;
+
+    case IROpcode::Store:
+      ir_build_store(&builder, vector_operand(operands[0]), vector_values.at(operands[1]));
+      builder.insertion_block->last_instruction->tbaa_type = instruction->tbaa_type;
+      break;
+
+    default:
+      vector_values[instruction->result]
+          = ir_build_binary(&builder, instruction->opcode, vector_operand(operands[0]), vector_operand(operands[1]));
+      break;
+    }
+  }
+
+  IRValue* next = ir_build_binary(&builder, IROpcode::Add, induction_value, ir_constant("i32", candidate->lanes));
+  ir_build_store(&builder, next, candidate->induction_variable);
+  builder.insertion_block->last_instruction->tbaa_type = candidate->induction_value->instruction->tbaa_type;
+  ir_build_br(&builder, vector_condition);
+
+  statistics->loop_vectorization_loops_vectorized++;
+}
+
+void run_loop_vectorization(IRFunction* function, OptimizationStatistics* statistics)
+{
+  // loops already vectorized, or turned down. The original loop stays behind
+  // after vectorizing, and shouldn't be looked at again
+  std::unordered_set<IRBasicBlock const*> visited_headers;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    ControlFlowGraph cfg = compute_control_flow_graph(function);
+    DominatorTree dominator_tree = compute_dominator_tree(function, &cfg);
+    LoopInfo loop_info = compute_loop_info(&cfg, &dominator_tree);
+    std::unordered_set<IRValue const*> non_escaping_allocas = find_non_escaping_allocas(function);
+
+    std::unordered_map<IRValue const*, unsigned> use_counts;
+    for (IRBasicBlock* block = function->first_block; block; block = block->next)
+      for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next)
+        for (unsigned i = 0; i < instruction->operand_count; i++)
+          use_counts[instruction->operands[i]]++;
+
+    // only innermost loops
+    std::unordered_set<Loop const*> has_inner_loop;
+    for (Loop const* loop : loop_info.loops)
+      if (loop->parent)
+        has_inner_loop.insert(loop->parent);
+
+    for (Loop const* loop : loop_info.loops) {
+      if (has_inner_loop.contains(loop) || !visited_headers.insert(loop->header).second)
+        continue;
+
+      VectorizableLoop candidate;
+      if (!analyze_loop(&candidate, loop, &cfg, &non_escaping_allocas, &use_counts))
+        continue;
+
+      vectorize_loop(function, &candidate, statistics);
+      changed = true;
+      break;
+    }
+  }
+}
@@ -1,7 +1,15 @@
 #include "codegen.h"
+#include "compilation_cache.h"
+#include "incremental.h"
 #include "parser.h"
+#include "pipeline.h"
+#include "precompiled_header.h"
+#include "preprocessor.h"
+#include "server.h"
+#include "symbol_index.h"
 
 #include <cstdlib>
+#include <cstring>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -33,26 +41,200 @@ static char* read_file(char const* path)
   return buffer;
 }
 
-int main(int argc, char** argv)
+// flags start with a -, everything else is a file to compile
+//      -O<n>       optimization level, -O0 by default
+//      --stats     print what the optimization passes did to stderr
+//      -c          compile to an object file with the x86-64 backend
+//      -fprofile-generate
+//                  count branches, link with runtime/profile.c to write the counts out
+//      -fprofile-use=<path>
+//                  optimize for the counts in a profile
+//      -I<dir>     look for included files in dir
+//      --emit-pch  write each file's declarations and macros to a precompiled header
+//      --include-pch=<path>
+//                  compile each file as if the header path was made from came first
+//      --index     write each file's declarations to a symbol index, without compiling it
+//      --cache-dir=<dir>
+//                  reuse what compiling a file that hasn't changed wrote last time
+//      --cache-max-size=<megabytes>
+//                  delete the entries used longest ago past this, 512 by default
+//      --incremental
+//                  only recompile the functions that changed since last time, needs --cache-dir
+//      --pipeline  parse and lower on two threads at once
+static void parse_option(char const* argument, CompilerOptions* options)
+{
+  if (argument[0] != '-')
+    return;
+
+  if (argument[1] == 'O' && argument[2] >= '0' && argument[2] <= '9' && argument[3] == '\0')
+    options->optimization_level = argument[2] - '0';
+  else if (strcmp(argument, "--stats") == 0)
+    options->print_statistics = true;
+  else if (strcmp(argument, "-c") == 0)
+    options->emit_object = true;
+  else if (strcmp(argument, "-fprofile-generate") == 0)
+    options->profile_generate = true;
+  else if (strncmp(argument, "-fprofile-use=", strlen("-fprofile-use=")) == 0)
+    options->profile_use_path = argument + strlen("-fprofile-use=");
+  else if (strcmp(argument, "--emit-pch") == 0)
+    options->emit_pch = true;
+  else if (strncmp(argument, "--include-pch=", strlen("--include-pch=")) == 0)
+    options->include_pch_path = argument + strlen("--include-pch=");
+  else if (strcmp(argument, "--index") == 0)
+    options->emit_index = true;
+  else if (strncmp(argument, "--cache-dir=", strlen("--cache-dir=")) == 0)
+    options->cache_directory = argument + strlen("--cache-dir=");
+  else if (strncmp(argument, "--cache-max-size=", strlen("--cache-max-size=")) == 0)
+    options->cache_max_size = strtoull(argument + strlen("--cache-max-size="), nullptr, 10) << 20;
+  else if (strcmp(argument, "--incremental") == 0)
+    options->incremental = true;
+  else if (strcmp(argument, "--pipeline") == 0)
+    options->pipelined = true;
+  else if (argument[1] == 'I' && argument[2] != '\0')
+    add_include_directory(argument + 2);
+  else
+    fprintf(stderr, "Unknown option %s, ignoring.\n", argument);
+}
+
+// whether the option can change what compiling a file writes, and so goes
+// into the compilation cache's key
+static bool changes_output(char const* argument)
 {
+  return argument[0] == '-' && strcmp(argument, "--stats") != 0 && strncmp(argument, "--cache-dir=", strlen("--cache-dir=")) != 0
+      && strncmp(argument, "--cache-max-size=", strlen("--cache-max-size=")) != 0;
+}
+
+// flags are the options that change the output, for the compilation cache
+static void compile_file(char const* path, std::string const& flags, CompilerOptions const* options, OptimizationStatistics* statistics)
+{
+  char* buffer = read_file(path);
+
+  std::string outfile_name = output_path(path, options);
+
+  // a precompiled header or an index is written from the parse itself,
+  // there's nothing to skip by caching it
+  bool is_cached = options->cache_directory && !options->emit_pch && !options->emit_index;
+  std::string cache_key;
+  std::string output;
+  if (is_cached) {
+    cache_key = compilation_cache_key(buffer, path, flags);
+    if (lookup_compilation_cache(options, cache_key, &output)) {
+      FILE* outfile = fopen(outfile_name.c_str(), "wb");
+      fwrite(output.data(), 1, output.size(), outfile);
+      fclose(outfile);
+      return;
+    }
+  }
+
+  // the declarations read out of it belong to one translation unit
+  PrecompiledHeader* precompiled_header = nullptr;
+  if (options->include_pch_path && !(precompiled_header = read_precompiled_header(options->include_pch_path))) {
+    fprintf(stderr, "%s is not a miniclang precompiled header, aborting.\n", options->include_pch_path);
+    exit(1);
+  }
+
+  // written to memory first when it's going into the cache too
+  char* memory = nullptr;
+  size_t memory_size = 0;
+  FILE* outfile = is_cached ? open_memstream(&memory, &memory_size)
+                            : fopen(outfile_name.c_str(), options->emit_object || options->emit_pch || options->emit_index ? "wb" : "w");
 
+  TranslationUnit translation_unit;
+  if (options->pipelined && can_compile_pipelined(options)) {
+    translation_unit = emit_pipelined(buffer, path, outfile, options, statistics);
+  } else {
+    // an index has no use for function bodies
+    translation_unit = parse_whole_translation_unit(buffer, path, precompiled_header, options->emit_index);
+    if (options->emit_pch)
+      write_precompiled_header(&translation_unit, outfile);
+    else if (options->emit_index)
+      write_symbol_index(&translation_unit, outfile);
+    else if (options->emit_object)
+      emit_object_from_translation_unit(translation_unit.external_declarations, outfile, options, statistics);
+    else if (options->incremental && can_compile_incrementally(options))
+      emit_llvm_incrementally(&translation_unit, flags, outfile, options, statistics);
+    else
+      emit_llvm_from_translation_unit(translation_unit.external_declarations, outfile, options, statistics);
+  }
+  fclose(outfile);
+
+  if (is_cached) {
+    output.assign(memory, memory_size);
+    free(memory);
+    store_compilation_cache(options, cache_key, translation_unit.preprocessor, output);
+
+    outfile = fopen(outfile_name.c_str(), "wb");
+    fwrite(output.data(), 1, output.size(), outfile);
+    fclose(outfile);
+  }
+}
+
+// everything running miniclang does, short of the server
+static int compile_command_line(int argc, char** argv)
+{
+  CompilerOptions options = default_compiler_options();
+  std::string flags;
   for (int i = 1; i < argc; i++) {
-    if (access(argv[i], F_OK) == 0) {
-      char* buffer = read_file(argv[i]);
+    parse_option(argv[i], &options);
+    if (changes_output(argv[i]))
+      flags += std::string(argv[i]) + " ";
+  }
+
+  if (options.profile_generate && options.emit_object) {
+    fprintf(stderr, "-fprofile-generate needs LLVM IR output, the x86-64 backend can't emit the counters yet.\n");
+    return 1;
+  }
 
-      std::string outfile_name;
-      for (char const* s = argv[i]; *s != '.' && *s != '\0'; s++)
-        outfile_name.push_back(*s);
-      outfile_name += ".ll";
+  if (options.incremental && !options.cache_directory) {
+    fprintf(stderr, "--incremental keeps what it compiled in the cache, it needs --cache-dir.\n");
+    return 1;
+  }
+
+  OptimizationStatistics statistics = new_optimization_statistics();
 
-      FILE* outfile = fopen(outfile_name.c_str(), "w");
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-')
+      continue;
 
-      ExternalDeclaration* external_declarations = parse_translation_unit(buffer);
-      emit_llvm_from_translation_unit(external_declarations, outfile);
-    } else {
+    if (access(argv[i], F_OK) == 0)
+      compile_file(argv[i], flags, &options, &statistics);
+    else
       fprintf(stderr, "File %s not found, aborting.\n", argv[i]);
-    }
+  }
+
+  if (options.print_statistics) {
+    if (options.cache_directory)
+      print_compilation_cache_statistics(stderr);
+    if (options.incremental)
+      print_incremental_statistics(stderr);
+    print_preprocessor_statistics(stderr);
+    print_optimization_statistics(&statistics, stderr);
   }
 
   return 0;
 }
+
+// --server=<socket> [--jobs=<n>]
+//                  compile command lines sent by clients, in n worker processes, one per CPU by default
+// --connect=<socket> <anything else>
+//                  have the server compile the rest of the command line, or compile it here if there's no server
+int main(int argc, char** argv)
+{
+  if (argc >= 2 && strncmp(argv[1], "--server=", strlen("--server=")) == 0) {
+    long worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc >= 3 && strncmp(argv[2], "--jobs=", strlen("--jobs=")) == 0)
+      worker_count = strtol(argv[2] + strlen("--jobs="), nullptr, 10);
+    return run_compile_server(argv[1] + strlen("--server="), worker_count > 0 ? (unsigned)worker_count : 1, compile_command_line);
+  }
+
+  if (argc >= 2 && strncmp(argv[1], "--connect=", strlen("--connect=")) == 0) {
+    char const* socket_path = argv[1] + strlen("--connect=");
+    argv[1] = argv[0];
+    int status;
+    if (compile_on_server(socket_path, argc - 1, argv + 1, &status))
+      return status;
+    return compile_command_line(argc - 1, argv + 1);
+  }
+
+  return compile_command_line(argc, argv);
+}
@@ -0,0 +1,87 @@
+#include "optimize.h"
+
+OptimizationStatistics new_optimization_statistics()
+{
+  OptimizationStatistics statistics;
+  statistics.value_numbering_eliminated = 0;
+  statistics.dead_code_eliminated = 0;
+  statistics.dead_stores_eliminated = 0;
+  statistics.licm_hoisted = 0;
+  statistics.loop_vectorization_loops_vectorized = 0;
+  statistics.loop_vectorization_alias_checks = 0;
+  statistics.inliner_call_sites_inlined = 0;
+  statistics.inliner_functions_deleted = 0;
+  statistics.tail_calls_eliminated = 0;
+  statistics.peephole_rewrites = 0;
+  statistics.hot_cold_regions_outlined = 0;
+  statistics.hot_cold_hot_functions = 0;
+  statistics.hot_cold_cold_functions = 0;
+  statistics.intervals_split = 0;
+  statistics.intervals_spilled = 0;
+  return statistics;
+}
+
+void print_optimization_statistics(OptimizationStatistics const* statistics, FILE* outfile)
+{
+  fprintf(outfile, "===-------------------------------------------===\n");
+  fprintf(outfile, "          miniclang optimization statistics\n");
+  fprintf(outfile, "===-------------------------------------------===\n");
+  fprintf(outfile, "%8u inliner - call sites inlined\n", statistics->inliner_call_sites_inlined);
+  fprintf(outfile, "%8u inliner - unused internal functions deleted\n", statistics->inliner_functions_deleted);
+  fprintf(outfile, "%8u tail recursion elimination - calls turned into branches\n", statistics->tail_calls_eliminated);
+  fprintf(outfile, "%8u value numbering - instructions eliminated\n", statistics->value_numbering_eliminated);
+  fprintf(outfile, "%8u loop invariant code motion - instructions hoisted\n", statistics->licm_hoisted);
+  fprintf(outfile, "%8u loop vectorization - loops vectorized\n", statistics->loop_vectorization_loops_vectorized);
+  fprintf(outfile, "%8u loop vectorization - runtime alias checks\n", statistics->loop_vectorization_alias_checks);
+  fprintf(outfile, "%8u peephole - instructions rewritten\n", statistics->peephole_rewrites);
+  fprintf(outfile, "%8u dead code elimination - instructions eliminated\n", statistics->dead_code_eliminated);
+  fprintf(outfile, "%8u dead code elimination - dead stores eliminated\n", statistics->dead_stores_eliminated);
+  fprintf(outfile, "%8u hot/cold splitting - cold regions outlined\n", statistics->hot_cold_regions_outlined);
+  fprintf(outfile, "%8u hot/cold splitting - functions placed in .text.hot\n", statistics->hot_cold_hot_functions);
+  fprintf(outfile, "%8u hot/cold splitting - functions placed in .text.unlikely\n", statistics->hot_cold_cold_functions);
+  fprintf(outfile, "%8u linear scan - live intervals split\n", statistics->intervals_split);
+  fprintf(outfile, "%8u linear scan - live intervals spilled\n", statistics->intervals_spilled);
+}
+
+// callees are inlined into and optimized before their callers, so what gets
+// inlined is their optimized body
+void optimize_ir_functions(IRModule* module, OptimizationStatistics* statistics)
+{
+  CallGraph call_graph = compute_call_graph(module);
+  for (std::vector<IRFunction*> const& component : call_graph.bottom_up_components)
+    for (IRFunction* function : component) {
+      run_inliner(module, function, &call_graph, statistics);
+      run_tail_recursion_elimination(function, statistics);
+
+      run_value_numbering(function, statistics);
+      run_loop_invariant_code_motion(function, statistics);
+
+      // loads hoisted out of loops land next to the stores that feed them, and
+      // loads hoisted from different loops can be the same load
+      run_value_numbering(function, statistics);
+
+      // after the other passes have reduced loops to the shape it looks for
+      run_loop_vectorization(function, statistics);
+
+      // after value numbering has forwarded stored values to the loads, which
+      // lines up the extensions and truncations around them
+      run_peephole(function, statistics);
+
+      // value numbering forwards stores to loads, leaving the stores and allocas behind for DCE
+      run_dead_code_elimination(function, statistics);
+    }
+}
+
+// -O0 leaves the IR exactly as codegen produced it, which is what the tests
+// under tests/codegen expect
+void optimize_ir_module(IRModule* module, unsigned optimization_level, OptimizationStatistics* statistics)
+{
+  if (optimization_level == 0)
+    return;
+
+  optimize_ir_functions(module, statistics);
+  remove_unused_internal_functions(module, statistics);
+
+  // last, outlining cold code lets allocas escape into the outlined functions
+  run_hot_cold_splitting(module, statistics);
+}
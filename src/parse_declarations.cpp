@@ -1,7 +1,9 @@
 #include "lexer.h"
 #include "parser.h"
+#include "precompiled_header.h"
 #include "type.h"
 
+#include <algorithm>
 #include <cassert>
 
 static void error_and_stop_parsing(char const* message)
@@ -12,13 +14,18 @@ static void error_and_stop_parsing(char const* message)
 
 ASTNode* new_ast_node(Scope* scope, ASTNodeType type = ASTNodeType::Void)
 {
-  ASTNode* new_node = (ASTNode*)malloc(sizeof(ASTNode));
+  // ASTNodes, Objects and FunctionParameters own std::strings, so they need
+  // their constructors run, which malloc won't do
+  ASTNode* new_node = new ASTNode;
 
   new_node->type = type;
   new_node->data_type = FundamentalType::Void;
   new_node->scope = scope;
+  new_node->object = nullptr;
 
   new_node->conditional = nullptr;
+  new_node->arguments = nullptr;
+  new_node->body = nullptr;
   new_node->lhs = nullptr;
   new_node->rhs = nullptr;
   new_node->next = nullptr;
@@ -28,10 +35,16 @@ ASTNode* new_ast_node(Scope* scope, ASTNodeType type = ASTNodeType::Void)
 
 static Object* new_object(std::string const& identifier, Type const* type)
 {
-  Object* new_object = (Object*)malloc(sizeof(Object));
+  Object* new_object = new Object;
   new_object->identifier = identifier;
   new_object->type = type;
   new_object->function_body = nullptr;
+  new_object->deferred_body = nullptr;
+  new_object->declaration_specifier_flags.flags = 0;
+  new_object->declaration_number = 0;
+  new_object->path = nullptr;
+  new_object->line = 0;
+  new_object->column = 0;
 
   return new_object;
 }
@@ -49,7 +62,7 @@ static FunctionData const* new_function_data(Type const* return_type, FunctionPa
 
 static FunctionParameter* new_function_parameter(Type const* parameter_type, std::string const& identifier)
 {
-  FunctionParameter* new_parameter = (FunctionParameter*)malloc(sizeof(FunctionParameter));
+  FunctionParameter* new_parameter = new FunctionParameter;
 
   new_parameter->parameter_type = parameter_type;
   new_parameter->next_parameter = nullptr;
@@ -60,15 +73,32 @@ static FunctionParameter* new_function_parameter(Type const* parameter_type, std
 
 Object* variable_in_scope(std::string const& variable_name, Scope* scope)
 {
+  unsigned visible_declarations = ~0u;
+  for (Scope* current_scope = scope; current_scope != nullptr; current_scope = current_scope->parent_scope) {
 
-  for (Scope* current_scope = scope; current_scope != nullptr; current_scope = current_scope->parent_scope)
+    if (current_scope->variables.contains(variable_name)) {
+      Object* object = current_scope->variables[variable_name];
+      if (object->declaration_number < visible_declarations)
+        return object;
+    }
 
-    if (current_scope->variables.contains(variable_name))
-      return current_scope->variables[variable_name];
+    if (current_scope->precompiled_header)
+      if (Object* object = precompiled_variable(current_scope->precompiled_header, variable_name))
+        return object;
+
+    visible_declarations = std::min(visible_declarations, current_scope->visible_declarations);
+  }
 
   return nullptr;
 }
 
+void declare_in_scope(Scope* scope, Object* object)
+{
+  auto [declared, is_new] = scope->variables.try_emplace(object->identifier, object);
+  object->declaration_number = is_new ? scope->declaration_count++ : declared->second->declaration_number;
+  declared->second = object;
+}
+
 static bool typedef_name_in_scope(std::string const& type_name, Scope* scope)
 {
 
@@ -77,6 +107,9 @@ static bool typedef_name_in_scope(std::string const& type_name, Scope* scope)
     if (current_scope->typedef_names.contains(type_name)) {
       return true;
     }
+
+    if (current_scope->precompiled_header && precompiled_typedef_name(current_scope->precompiled_header, type_name))
+      return true;
   }
 
   return false;
@@ -199,7 +232,8 @@ ASTNode* parse_declaration(Lexer* lexer, Scope* scope)
 
   ASTNode* ast_node = new_ast_node(scope, ASTNodeType::Declaration);
   ast_node->object = parse_declarator(lexer, fundamental_type_ptr, scope);
-  scope->variables.insert_or_assign(ast_node->object->identifier, ast_node->object);
+  ast_node->object->declaration_specifier_flags = declaration;
+  declare_in_scope(scope, ast_node->object);
 
   parse_rest_of_declaration(lexer, scope, ast_node);
 
@@ -227,12 +261,13 @@ void parse_rest_of_declaration(Lexer* lexer, Scope* scope, ASTNode* head_ast_nod
     // make new node with object from declarator
     ASTNode* current_ast_node = new_ast_node(scope, ASTNodeType::Declaration);
     current_ast_node->object = parse_declarator(lexer, head_ast_node->object->type, scope);
-    scope->variables[current_ast_node->object->identifier] = current_ast_node->object;
+    current_ast_node->object->declaration_specifier_flags = head_ast_node->object->declaration_specifier_flags;
+    declare_in_scope(scope, current_ast_node->object);
 
     // new identifier is explicitly initialized - get initializer
     if (get_current_token(lexer)->type == TokenType::Equals) {
       get_next_token(lexer);
-      parse_initializer(lexer, scope);
+      current_ast_node->rhs = parse_initializer(lexer, scope);
     }
 
     previous_ast_node->next = current_ast_node;
@@ -306,7 +341,7 @@ static Type const* parse_parameter_list(Lexer* lexer, Type const* return_type, S
     // regular parameter, definitely starting with a type specifier
     DeclarationSpecifierFlags flags = parse_declaration_specifiers(lexer, scope);
 
-    Type const* parameter_type = get_fundamental_type_pointer(fundamental_type_from_declaration(&flags));
+    Type const* parameter_type = declaration_to_fundamental_type(&flags);
 
     // potentially a pointer argument
     if (get_current_token(lexer)->type == TokenType::Asterisk)
@@ -367,6 +402,9 @@ Object* parse_declarator(Lexer* lexer, Type const* base_type, Scope* scope)
   // after checking for pointer types, a declarator needs to specify an identifier
   Token const* identifier_token = get_current_token(lexer);
   std::string const identifier = identifier_token->string;
+  char const* path = lexer->current_filepath;
+  unsigned line = identifier_token->line;
+  unsigned column = identifier_token->column;
 
   expect_and_get_next_token(lexer, TokenType::Identifier,
       "Parsing declarator, expected identifier name "
@@ -381,7 +419,11 @@ Object* parse_declarator(Lexer* lexer, Type const* base_type, Scope* scope)
   else if (get_current_token(lexer)->type == TokenType::LBracket)
     return_type = parse_array_dimensions(lexer);
 
-  return new_object(identifier, return_type);
+  Object* object = new_object(identifier, return_type);
+  object->path = path;
+  object->line = line;
+  object->column = column;
+  return object;
 }
 
 // e.g. parse a const*
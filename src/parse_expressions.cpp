@@ -191,6 +191,9 @@ ASTNode* parse_primary_expression(Lexer* lexer, Scope* scope)
 
     ASTNode* identifier_node = new_ast_node(scope, ASTNodeType::VariableReference);
     identifier_node->referenced_variable = get_current_token(lexer)->string;
+    // codegen declares what the translation unit's external declarations
+    // do, so a declaration from a precompiled header has to be read in by now
+    variable_in_scope(identifier_node->referenced_variable, scope);
     get_next_token(lexer);
     return identifier_node;
   }
@@ -198,11 +201,52 @@ ASTNode* parse_primary_expression(Lexer* lexer, Scope* scope)
   case TokenType::Number:
     return parse_number(lexer);
 
+  case TokenType::LParen: {
+    get_next_token(lexer);
+    ASTNode* parenthesized_node = parse_expression(lexer, scope);
+    expect_and_get_next_token(lexer, TokenType::RParen, "Parsing parenthesized expression, expected right parenthesis");
+    return parenthesized_node;
+  }
+
   default:
     assert(false && "Default case in parse_primary_expression");
   }
 }
 
+// 6.5.2.2 function calls
+//      postfix-expression ( argument-expression-list(opt) )
+//
+// argument-expression-list:
+//      assignment-expression
+//      argument-expression-list , assignment-expression
+//
+// the arguments are assignment expressions so the commas between them aren't
+// taken for comma operators
+static ASTNode* parse_function_call(Lexer* lexer, Scope* scope, ASTNode* callee)
+{
+  assert(get_current_token(lexer)->type == TokenType::LParen);
+  get_next_token(lexer);
+
+  ASTNode* call_node = new_ast_node(scope, ASTNodeType::FunctionCall);
+  call_node->lhs = callee;
+
+  ASTNode argument_anchor;
+  argument_anchor.next = nullptr;
+  ASTNode* previous_argument = &argument_anchor;
+
+  while (get_current_token(lexer)->type != TokenType::RParen) {
+    if (previous_argument != &argument_anchor)
+      expect_and_get_next_token(lexer, TokenType::Comma, "Parsing function call, expected comma or right parenthesis");
+
+    previous_argument->next = parse_assignment_expression(lexer, scope);
+    previous_argument = previous_argument->next;
+  }
+  get_next_token(lexer);
+
+  call_node->arguments = argument_anchor.next;
+  return call_node;
+}
+
 // 6.5.2
 // postfix expressions:
 //       primary expression
@@ -218,11 +262,37 @@ ASTNode* parse_postfix_expression(Lexer* lexer, Scope* scope)
 {
   ASTNode* root = parse_primary_expression(lexer, scope);
 
-  // FIXME
+  // x++ is a node with lhs x, and x++++ is one with lhs x++ (which is then
+  // rejected for not being an lvalue)
   Token const* current_token = get_current_token(lexer);
-  while (current_token->type == TokenType::LBracket || current_token->type == TokenType::LParen || current_token->type == TokenType::Dot
-      || current_token->type == TokenType::ArrowOperator || current_token->type == TokenType::PlusPlus
-      || current_token->type == TokenType::MinusMinus) { }
+  while (current_token->type == TokenType::PlusPlus || current_token->type == TokenType::MinusMinus || current_token->type == TokenType::LParen
+      || current_token->type == TokenType::LBracket) {
+    if (current_token->type == TokenType::LParen) {
+      root = parse_function_call(lexer, scope, root);
+      current_token = get_current_token(lexer);
+      continue;
+    }
+
+    // 6.5.2.1 a[i], whose lhs is a and rhs is i
+    if (current_token->type == TokenType::LBracket) {
+      get_next_token(lexer);
+      ASTNode* subscript_node = new_ast_node(scope, ASTNodeType::ArraySubscript);
+      subscript_node->lhs = root;
+      subscript_node->rhs = parse_expression(lexer, scope);
+      expect_and_get_next_token(lexer, TokenType::RBracket, "Parsing array subscript, expected right bracket");
+      root = subscript_node;
+      current_token = get_current_token(lexer);
+      continue;
+    }
+
+    ASTNodeType type = current_token->type == TokenType::PlusPlus ? ASTNodeType::PostIncrement : ASTNodeType::PostDecrement;
+    ASTNode* postfix_node = new_ast_node(scope, type);
+    postfix_node->lhs = root;
+    root = postfix_node;
+
+    current_token = get_next_token(lexer);
+  }
+  // FIXME: ., ->
   // FIXME: type name initializer list ones
 
   return root;
@@ -247,8 +317,30 @@ static bool is_unary_operator(Token* token)
 ASTNode* parse_unary_expression(Lexer* lexer, Scope* scope)
 {
   Token* current_token = get_current_token(lexer);
-  // FIXME: Unary operators
-  while (is_unary_operator(current_token)) { }
+
+  if (is_unary_operator(current_token)) {
+    switch (current_token->type) {
+    case TokenType::PlusPlus:
+    case TokenType::MinusMinus: {
+      ASTNodeType type = current_token->type == TokenType::PlusPlus ? ASTNodeType::PreIncrement : ASTNodeType::PreDecrement;
+      ASTNode* prefix_node = new_ast_node(scope, type);
+      get_next_token(lexer);
+      prefix_node->lhs = parse_unary_expression(lexer, scope);
+      return prefix_node;
+    }
+
+    case TokenType::Bang: {
+      ASTNode* not_node = new_ast_node(scope, ASTNodeType::LogicalNot);
+      get_next_token(lexer);
+      not_node->lhs = parse_cast_expression(lexer, scope);
+      return not_node;
+    }
+
+    default:
+      // FIXME: Unary operators
+      assert(false && "parsing this unary operator not implemented");
+    }
+  }
 
   ASTNode* root = parse_postfix_expression(lexer, scope);
   return root;
@@ -257,11 +349,18 @@ ASTNode* parse_unary_expression(Lexer* lexer, Scope* scope)
 // 6.5.4 cast-expr
 //          unary-expr
 //          (typename) cast-expr
+//
+// a ( only starts a cast if a type name follows it, otherwise it's a
+// parenthesized expression, which is left to parse_primary_expression
 ASTNode* parse_cast_expression(Lexer* lexer, Scope* scope)
 {
   if (get_current_token(lexer)->type == TokenType::LParen) {
+    Lexer lookahead = *lexer;
+    get_next_token(&lookahead);
+
     // FIXME: Parse typename
-    expect_and_get_next_token(lexer, TokenType::RParen, "Type cast expected RParen");
+    if (token_is_declaration_specifier(get_current_token(&lookahead), scope))
+      assert(false && "parsing casts not implemented");
   }
 
   ASTNode* root = parse_unary_expression(lexer, scope);
@@ -594,9 +693,8 @@ ASTNode* parse_logical_or_expression(Lexer* lexer, Scope* scope)
 // 6.5.15 conditional-expression
 //          logical-or-expr
 //          logical-or-expr ? expression : conditional-expression
-// implement as
-//          logical-or (? expression : logical-or)*
-// the ast here looks like
+// the else arm being a conditional expression makes ?: right associative,
+// a ? b : c ? d : e is a ? b : (c ? d : e). The ast here looks like
 //          ?
 //       /  |   \
 // or-expr if  else
@@ -613,7 +711,7 @@ ASTNode* parse_conditional_expression(Lexer* lexer, Scope* scope)
     conditional_node->lhs = parse_expression(lexer, scope);
     expect_and_get_next_token(lexer, TokenType::Colon, "Parsing ternary expression: expected ':' after expression");
 
-    conditional_node->rhs = parse_logical_or_expression(lexer, scope);
+    conditional_node->rhs = parse_conditional_expression(lexer, scope);
 
     return conditional_node;
   }
@@ -633,13 +731,54 @@ static bool is_assignment_operator(Token* token)
       || t == TokenType::BitwiseAndEquals || t == TokenType::XorEquals || t == TokenType::BitwiseOrEquals);
 }
 
+// x op= y is parsed as x = x op y. Assignments only go to variables so far,
+// so evaluating x twice is harmless
+static ASTNodeType compound_assignment_operation(TokenType type)
+{
+  switch (type) {
+  case TokenType::TimesEquals:
+    return ASTNodeType::Multiplication;
+  case TokenType::DividedByEquals:
+    return ASTNodeType::Division;
+  case TokenType::ModuloEquals:
+    return ASTNodeType::Modulo;
+  case TokenType::PlusEquals:
+    return ASTNodeType::Addition;
+  case TokenType::MinusEquals:
+    return ASTNodeType::Subtraction;
+  case TokenType::BitShiftLeftEquals:
+    return ASTNodeType::BitShiftLeft;
+  case TokenType::BitShiftRightEquals:
+    return ASTNodeType::BitShiftRight;
+  case TokenType::BitwiseAndEquals:
+    return ASTNodeType::BitwiseAnd;
+  case TokenType::XorEquals:
+    return ASTNodeType::BitwiseXor;
+  case TokenType::BitwiseOrEquals:
+    return ASTNodeType::BitwiseOr;
+  default:
+    assert(false && "compound_assignment_operation got a non compound assignment");
+    return ASTNodeType::Void;
+  }
+}
+
+// assignment is right associative, x = y = 3 is x = (y = 3), so recur on the
+// rhs instead of looping. The grammar wants a unary-expr on the lhs, but like
+// chibicc we parse a conditional-expr and leave checking it's an lvalue to codegen
 ASTNode* parse_assignment_expression(Lexer* lexer, Scope* scope)
 {
   ASTNode* root = parse_conditional_expression(lexer, scope);
 
-  while (is_assignment_operator(get_current_token(lexer))) {
-    // FIXME:
-    break;
+  Token* current_token = get_current_token(lexer);
+  if (is_assignment_operator(current_token)) {
+    TokenType assignment_operator = current_token->type;
+    get_next_token(lexer);
+
+    ASTNode* rhs = parse_assignment_expression(lexer, scope);
+    if (assignment_operator != TokenType::Equals)
+      rhs = new_binary_expression_node(compound_assignment_operation(assignment_operator), root, rhs, scope);
+
+    return new_binary_expression_node(ASTNodeType::Assignment, root, rhs, scope);
   }
 
   return root;
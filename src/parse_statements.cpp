@@ -1,17 +1,23 @@
 #include "lexer.h"
 #include "parser.h"
+#include "precompiled_header.h"
+#include "preprocessor.h"
 #include "type.h"
 
 #include <cassert>
+#include <unordered_set>
 
-Scope* new_scope(Scope* parent_scope, Type const* return_type = nullptr)
+Scope* new_scope(Scope* parent_scope, Type const* return_type)
 {
-  Scope* current_scope = (Scope*)malloc(sizeof(Scope));
+  Scope* current_scope = new Scope;
 
   current_scope->parent_scope = parent_scope;
   current_scope->return_type = return_type;
   current_scope->variables = std::unordered_map<std::string, Object*>();
   current_scope->typedef_names = std::unordered_map<std::string, Object*>();
+  current_scope->precompiled_header = nullptr;
+  current_scope->declaration_count = 0;
+  current_scope->visible_declarations = ~0u;
 
   return current_scope;
 }
@@ -30,16 +36,25 @@ static ExternalDeclaration* new_external_declaration(ExternalDeclarationType typ
   new_ext_dec->next = nullptr;
   new_ext_dec->root_ast_node = head_node;
   new_ext_dec->type = type;
+  new_ext_dec->token_hash = 0;
 
   return new_ext_dec;
 }
 
+// a qualified type gets its own copy of the fundamental type to carry the
+// qualifiers, e.g. the pointed to type in volatile int *p
 Type const* declaration_to_fundamental_type(DeclarationSpecifierFlags* declaration)
 {
 
   FundamentalType fundamental_type = fundamental_type_from_declaration(declaration);
 
-  return get_fundamental_type_pointer(fundamental_type);
+  int qualifiers = declaration->flags & (TypeModifierFlag::Const | TypeModifierFlag::Restrict | TypeModifierFlag::Volatile);
+  if (!qualifiers)
+    return get_fundamental_type_pointer(fundamental_type);
+
+  Type* qualified_type = new_type(fundamental_type);
+  qualified_type->declaration_specifier_flags.flags = qualifiers;
+  return qualified_type;
 }
 
 // 6.8 Statements
@@ -54,7 +69,16 @@ ASTNode* parse_statement(Lexer* lexer, Scope* scope)
   ASTNode* ast_node = new_ast_node(scope, ASTNodeType::Void);
   switch (get_current_token(lexer)->type) {
 
-  case TokenType::Identifier:
+  case TokenType::Identifier: {
+    // only identifier : is a label, anything else starting with an identifier
+    // is an expression like x = 3. The lexer is a plain struct, so peeking is
+    // lexing the next token from a copy of it
+    Lexer lookahead = *lexer;
+    if (get_next_token(&lookahead)->type == TokenType::Colon)
+      return parse_labeled_statement(lexer, scope);
+    return parse_expression_statement(lexer, scope);
+  }
+
   case TokenType::Case:
   case TokenType::Default:
     return parse_labeled_statement(lexer, scope);
@@ -88,12 +112,34 @@ ASTNode* parse_statement(Lexer* lexer, Scope* scope)
 //      identifier : statement for use with goto
 //      case const-expression : statement
 //      default : statement
+//
+// case and default only mark where a switch jumps to, the statement after
+// them is the body. The value of a case is a constant expression (6.6),
+// which is a conditional expression, evaluated by codegen
 static ASTNode* parse_labeled_statement(Lexer* lexer, Scope* scope)
 {
-  (void)scope;
-  ASTNode* ast_node = new_ast_node(scope, ASTNodeType::Void);
-  get_current_token(lexer);
-  return ast_node;
+  switch (get_current_token(lexer)->type) {
+  case TokenType::Case: {
+    ASTNode* ast_node = new_ast_node(scope, ASTNodeType::Case);
+    get_next_token(lexer);
+    ast_node->lhs = parse_conditional_expression(lexer, scope);
+    expect_and_get_next_token(lexer, TokenType::Colon, "Expected colon after case value\n");
+    ast_node->body = parse_statement(lexer, scope);
+    return ast_node;
+  }
+
+  case TokenType::Default: {
+    ASTNode* ast_node = new_ast_node(scope, ASTNodeType::Default);
+    expect_next_token_and_skip(lexer, TokenType::Colon, "Expected colon after default\n");
+    ast_node->body = parse_statement(lexer, scope);
+    return ast_node;
+  }
+
+  // FIXME: labels for goto
+  default:
+    get_current_token(lexer);
+    return new_ast_node(scope, ASTNodeType::Void);
+  }
 }
 
 // compound statement are blocks of declarations and other statements wrapped in
@@ -102,7 +148,8 @@ static ASTNode* parse_labeled_statement(Lexer* lexer, Scope* scope)
 // compound-statement: ( declaration | statement )*
 static ASTNode* parse_compound_statement(Lexer* lexer, Scope* scope, Type const* return_type)
 {
-  Scope* current_scope = new_scope(scope, return_type);
+  // nested blocks are still in the same function
+  Scope* current_scope = new_scope(scope, return_type ? return_type : scope->return_type);
 
   assert(get_current_token(lexer)->type == TokenType::LBrace);
   get_next_token(lexer);
@@ -120,8 +167,11 @@ static ASTNode* parse_compound_statement(Lexer* lexer, Scope* scope, Type const*
       current_ast_node = parse_statement(lexer, current_scope);
     }
 
+    // declarations of several variables and nested compound statements are
+    // lists themselves, so append the whole list
     previous_ast_node->next = current_ast_node;
-    previous_ast_node = previous_ast_node->next;
+    while (previous_ast_node->next)
+      previous_ast_node = previous_ast_node->next;
   }
 
   expect_and_get_next_token(lexer, TokenType::RBrace, "Expected closing brace after compound statement\n");
@@ -150,7 +200,7 @@ static ASTNode* parse_selection_statement(Lexer* lexer, Scope* scope)
   if (!scope->return_type)
     error_token(lexer, "Selection statement not allowed in global scope\n");
 
-  Scope* current_scope = new_scope(scope);
+  Scope* current_scope = new_scope(scope, scope->return_type);
 
   switch (get_current_token(lexer)->type) {
 
@@ -177,7 +227,7 @@ static ASTNode* parse_selection_statement(Lexer* lexer, Scope* scope)
     ast_node->conditional = parse_expression(lexer, current_scope);
     expect_and_get_next_token(lexer, TokenType::RParen, "Expected closing parentheses after switch condition\n");
 
-    // FIXME: Switch statements
+    ast_node->body = parse_statement(lexer, current_scope);
     return ast_node;
   }
   default:
@@ -192,31 +242,37 @@ static ASTNode* parse_iteration_statement(Lexer* lexer, Scope* scope)
     error_token(lexer, "Iteration statement not allowed in global scope\n");
 
   Scope* current_scope = new_scope(scope, scope->return_type);
-  ASTNode* ast_node = new_ast_node(current_scope, ASTNodeType::For);
 
+  // the body goes in its own field rather than next, since the enclosing
+  // compound statement links the following statements through next
   switch (get_current_token(lexer)->type) {
     // while ( expression ) statement
-  case TokenType::While:
+  case TokenType::While: {
+    ASTNode* ast_node = new_ast_node(current_scope, ASTNodeType::While);
 
     expect_next_token_and_skip(lexer, TokenType::LParen, "Expected parentheses after while\n");
     ast_node->conditional = parse_expression(lexer, current_scope);
 
     expect_and_get_next_token(lexer, TokenType::RParen, "Expected closing parentheses after while condition\n");
-    ast_node->next = parse_statement(lexer, current_scope);
+    ast_node->body = parse_statement(lexer, current_scope);
 
     return ast_node;
+  }
 
-  case TokenType::For:
+  case TokenType::For: {
     // for (expression(opt); expression(opt); expression(opt)) statement OR
     // for (declaration expression(opt); expression(opt)) statement
     // the first is for when you declare a variable ahead of time and set it in the first expression, e.g.
     //      int x;
     //      for (x = 0; x<10; x++)
     // the second is the typical for (int i = 0; i<10; i++)
+    ASTNode* ast_node = new_ast_node(current_scope, ASTNodeType::For);
     expect_next_token_and_skip(lexer, TokenType::LParen, "Expected parentheses after for\n");
 
     // first expression/declaration
-    if (token_is_declaration_specifier(get_current_token(lexer), current_scope))
+    if (get_current_token(lexer)->type == TokenType::Semicolon)
+      expect_and_get_next_token(lexer, TokenType::Semicolon, "should be skipping semicolon with no for initializer\n");
+    else if (token_is_declaration_specifier(get_current_token(lexer), current_scope))
       ast_node->lhs = parse_declaration(lexer, current_scope);
     else {
       ast_node->lhs = parse_expression(lexer, current_scope);
@@ -239,13 +295,15 @@ static ASTNode* parse_iteration_statement(Lexer* lexer, Scope* scope)
       expect_and_get_next_token(lexer, TokenType::RParen, "Expected closing parenthesis after for loop\n");
     }
 
-    ast_node->next = parse_statement(lexer, current_scope);
+    ast_node->body = parse_statement(lexer, current_scope);
     return ast_node;
+  }
 
-  case TokenType::Do:
+  case TokenType::Do: {
+    ASTNode* ast_node = new_ast_node(current_scope, ASTNodeType::DoWhile);
     expect_and_get_next_token(lexer, TokenType::Do, "should be skipping do in do while\n");
 
-    ast_node->next = parse_statement(lexer, current_scope);
+    ast_node->body = parse_statement(lexer, current_scope);
 
     expect_and_get_next_token(lexer, TokenType::While, "Expected while after statement in do while\n");
     expect_and_get_next_token(lexer, TokenType::LParen, "Expected parentheses after while in do while\n");
@@ -254,12 +312,12 @@ static ASTNode* parse_iteration_statement(Lexer* lexer, Scope* scope)
     expect_and_get_next_token(lexer, TokenType::Semicolon, "Expected semicolon after condition in do while\n");
 
     return ast_node;
+  }
 
   default:
     assert(false && "Parsing iteration statement not starting with do/while/for");
+    return nullptr;
   }
-
-  return ast_node;
 }
 
 // jumps are goto identifier; continue; break; return;
@@ -277,20 +335,25 @@ static ASTNode* parse_jump_statement(Lexer* lexer, Scope* scope)
 
   case TokenType::Return: {
     get_next_token(lexer);
-    if (get_current_token(lexer)->type != TokenType::Semicolon) {
+    ASTNode* return_statement_node = new_ast_node(scope, ASTNodeType::Return);
 
-      ASTNode* return_statement_node = new_ast_node(scope, ASTNodeType::Return);
-      ASTNode* return_value_node = parse_expression(lexer, scope);
-      return_statement_node->rhs = return_value_node;
-      expect_and_get_next_token(lexer, TokenType::Semicolon, "Expected semicolon after return statement\n");
-      return return_statement_node;
-    }
+    // return; has no value
+    if (get_current_token(lexer)->type != TokenType::Semicolon)
+      return_statement_node->rhs = parse_expression(lexer, scope);
+
+    expect_and_get_next_token(lexer, TokenType::Semicolon, "Expected semicolon after return statement\n");
+    return return_statement_node;
   }
 
   case TokenType::Continue:
-  case TokenType::Break:
+  case TokenType::Break: {
+    ASTNodeType jump_type = get_current_token(lexer)->type == TokenType::Break ? ASTNodeType::Break : ASTNodeType::Continue;
+    ASTNode* jump_statement_node = new_ast_node(scope, jump_type);
+
+    get_next_token(lexer);
     expect_and_get_next_token(lexer, TokenType::Semicolon, "Expected semicolon after jump statement\n");
-    break;
+    return jump_statement_node;
+  }
 
   default:
     assert(false);
@@ -300,6 +363,113 @@ static ASTNode* parse_jump_statement(Lexer* lexer, Scope* scope)
   assert(false);
 }
 
+// matches the body's braces without parsing it. Directives and macros in
+// the body are still carried out in order
+static DeferredFunctionBody* skip_function_body(Lexer* lexer, Scope* scope, Type const* return_type)
+{
+  DeferredFunctionBody* body = new DeferredFunctionBody;
+  body->scope = scope;
+  body->visible_declarations = scope->declaration_count;
+  body->return_type = return_type;
+  body->path = lexer->current_filepath;
+  body->preprocessor = lexer->preprocessor;
+  body->line = get_current_token(lexer)->line;
+  body->column = get_current_token(lexer)->column;
+
+  body->text = skip_braced_text(lexer);
+  if (body->text) {
+    get_next_token(lexer);
+    return body;
+  }
+
+  unsigned depth = 0;
+  do {
+    Token const* token = get_current_token(lexer);
+    if (token->type == TokenType::Eof)
+      error_token(lexer, "Expected closing brace after compound statement\n");
+    if (token->type == TokenType::LBrace)
+      depth++;
+    else if (token->type == TokenType::RBrace)
+      depth--;
+    body->tokens.push_back(*token);
+    get_next_token(lexer);
+  } while (depth > 0);
+  return body;
+}
+
+ASTNode* function_body(Object const* object)
+{
+  DeferredFunctionBody* deferred_body = object->deferred_body;
+  if (!deferred_body)
+    return object->function_body;
+
+  // skip_braced_text made sure the text lexes to what preprocessing it would
+  // have given, at the time. Macros defined since mustn't expand in it
+  if (deferred_body->text) {
+    Lexer text_lexer = new_lexer(deferred_body->text, deferred_body->preprocessor);
+    text_lexer.current_filepath = deferred_body->path;
+    text_lexer.current_line = deferred_body->line;
+    text_lexer.current_column = deferred_body->column;
+    unsigned depth = 0;
+    do {
+      Token token = lex_next_token(&text_lexer);
+      if (token.type == TokenType::LBrace)
+        depth++;
+      else if (token.type == TokenType::RBrace)
+        depth--;
+      deferred_body->tokens.push_back(token);
+    } while (depth > 0);
+  }
+
+  Lexer lexer = new_lexer("", deferred_body->preprocessor);
+  lexer.current_filepath = deferred_body->path;
+  lexer.replayed_tokens = &deferred_body->tokens;
+  get_next_token(&lexer);
+
+  // between the body and the scope it was in, hiding what was declared
+  // after it
+  Scope* scope = new_scope(deferred_body->scope, deferred_body->scope->return_type);
+  scope->visible_declarations = deferred_body->visible_declarations;
+
+  // parsed once, the object is the same declaration either way
+  Object* parsed_object = const_cast<Object*>(object);
+  parsed_object->function_body = parse_compound_statement(&lexer, scope, deferred_body->return_type);
+  parsed_object->deferred_body = nullptr;
+  delete deferred_body;
+  return parsed_object->function_body;
+}
+
+static void collect_body(ASTNode* node, std::unordered_set<ASTNode*>* nodes, std::unordered_set<Scope*>* scopes)
+{
+  for (; node && nodes->insert(node).second; node = node->next) {
+    // everything but the global scope is the function's own, including the
+    // one a deferred body was parsed in
+    for (Scope* scope = node->scope; scope && scope->parent_scope && scopes->insert(scope).second; scope = scope->parent_scope)
+      ;
+    collect_body(node->lhs, nodes, scopes);
+    collect_body(node->rhs, nodes, scopes);
+    collect_body(node->conditional, nodes, scopes);
+    collect_body(node->arguments, nodes, scopes);
+    collect_body(node->body, nodes, scopes);
+  }
+}
+
+void delete_function_body(Object* object)
+{
+  std::unordered_set<ASTNode*> nodes;
+  std::unordered_set<Scope*> scopes;
+  collect_body(function_body(object), &nodes, &scopes);
+
+  for (Scope* scope : scopes) {
+    for (auto& [name, local] : scope->variables)
+      delete local;
+    delete scope;
+  }
+  for (ASTNode* node : nodes)
+    delete node;
+  object->function_body = nullptr;
+}
+
 // a translation unit is ( function definition | declaration )*
 //
 // function-definition:
@@ -311,50 +481,88 @@ static ASTNode* parse_jump_statement(Lexer* lexer, Scope* scope)
 // both start with declaration specifiers and declarators
 // if the declarator declares a function and is followed by a compound
 // statement, we have a function definition
-ExternalDeclaration* parse_translation_unit(char const* file)
+TranslationUnit parse_whole_translation_unit(char const* file, char const* path, PrecompiledHeader* precompiled_header, bool defers_function_bodies,
+    ExternalDeclarationParsed const& on_parsed)
 {
   Lexer lexer = new_lexer(file);
-  Scope current_scope;
-  current_scope.parent_scope = nullptr;
+  if (path) {
+    lexer.current_filepath = path;
+    lexer.preprocessor->main_file_path = path;
+  }
+
+  // every scope in the returned AST chains up to this one, so it has to outlive this function
+  Scope* global_scope = new_scope(nullptr);
+  if (precompiled_header)
+    use_precompiled_header(precompiled_header, global_scope, lexer.preprocessor->macros);
 
   ExternalDeclaration declaration_anchor;
   declaration_anchor.next = nullptr;
   declaration_anchor.root_ast_node = nullptr;
   ExternalDeclaration* previous_declaration = &declaration_anchor;
 
+  // each declaration's hash starts from its first token, which was read
+  // while parsing the one before. It ends with the first token of the next,
+  // which a change to only that token recompiles needlessly, but harmlessly
+  // only matching a skipped body's braces is what makes deferring fast, so
+  // those aren't hashed. Only compiling uses the hashes
+  unsigned long long token_hash;
+  lexer.token_hash = defers_function_bodies ? nullptr : &token_hash;
+
   for (get_next_token(&lexer); get_current_token(&lexer)->type != TokenType::Eof;) {
+    token_hash = hash_token(fnv_offset_basis, get_current_token(&lexer));
 
-    if (!token_is_declaration_specifier(get_current_token(&lexer), &current_scope))
+    if (!token_is_declaration_specifier(get_current_token(&lexer), global_scope))
       error_token(&lexer, "Expected declaration specifier\n");
 
     // parse declaration specifiers and turn to type, either types of variables declared or return type of function defined
-    DeclarationSpecifierFlags declaration_specifiers = parse_declaration_specifiers(&lexer, &current_scope);
+    DeclarationSpecifierFlags declaration_specifiers = parse_declaration_specifiers(&lexer, global_scope);
     Type const* fundamental_type_ptr = declaration_to_fundamental_type(&declaration_specifiers);
 
     // prepare to parse declaration - overwrite declaration types if we find a function definition in the switch
-    ASTNode* ast_node = new_ast_node(&current_scope, ASTNodeType::Declaration);
+    ASTNode* ast_node = new_ast_node(global_scope, ASTNodeType::Declaration);
     ExternalDeclarationType declaration_type = ExternalDeclarationType::Declaration;
 
-    ast_node->object = parse_declarator(&lexer, fundamental_type_ptr, &current_scope);
+    ast_node->object = parse_declarator(&lexer, fundamental_type_ptr, global_scope);
+    ast_node->object->declaration_specifier_flags = declaration_specifiers;
+
+    // added before the body is parsed, so a function can call itself
+    declare_in_scope(global_scope, ast_node->object);
 
     switch (ast_node->object->type->fundamental_type) {
     case FundamentalType::Function:
       // if the current object is a function followed by a {, this is a function definition
       if (get_current_token(&lexer)->type == TokenType::LBrace) {
         declaration_type = ExternalDeclarationType::FunctionDefinition;
-        ast_node->object->function_body = parse_compound_statement(&lexer, &current_scope, fundamental_type_ptr);
+        if (defers_function_bodies)
+          ast_node->object->deferred_body = skip_function_body(&lexer, global_scope, fundamental_type_ptr);
+        else
+          ast_node->object->function_body = parse_compound_statement(&lexer, global_scope, fundamental_type_ptr);
         break;
       }
 
       // otherwise, whether a function or not, continue parsing a declaration
     default:
-      parse_rest_of_declaration(&lexer, &current_scope, ast_node);
+      parse_rest_of_declaration(&lexer, global_scope, ast_node);
     }
 
     ExternalDeclaration* current_declaration = new_external_declaration(declaration_type, ast_node);
+    current_declaration->token_hash = token_hash;
     previous_declaration->next = current_declaration;
     previous_declaration = current_declaration;
+    if (on_parsed)
+      on_parsed(current_declaration);
   } // end for loop
 
-  return declaration_anchor.next;
+  TranslationUnit translation_unit;
+  translation_unit.external_declarations = declaration_anchor.next;
+  if (precompiled_header)
+    translation_unit.external_declarations = prepend_precompiled_declarations(precompiled_header, declaration_anchor.next);
+  translation_unit.global_scope = global_scope;
+  translation_unit.preprocessor = lexer.preprocessor;
+  return translation_unit;
+}
+
+ExternalDeclaration* parse_translation_unit(char const* file, char const* path)
+{
+  return parse_whole_translation_unit(file, path, nullptr).external_declarations;
 }
@@ -0,0 +1,428 @@
+#include "analysis.h"
+#include "optimize.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+// a peephole optimizer driven by a table of rules, in the spirit of LLVM's
+// InstCombine patterns and GlobalISel's combiner tables
+//
+// a rule says what an instruction and its operands have to look like, and
+// what the instruction becomes. Operands are tested one level deep, a rule
+// for trunc (zext x) matches a trunc whose operand is a zext, and the rewrite
+// can name x as operand 0's operand 0. An instruction either becomes another
+// instruction in place, which never changes its type, or is replaced by an
+// existing value and left for DCE
+//
+// rather than trying every rule on every instruction, the rules are compiled
+// into a decision tree the first time the pass runs. The root is keyed on the
+// opcode and comparison, and each level below tests one operand, with rules
+// sharing a test sharing the node. Matching follows every branch whose test
+// passes and takes the first rule, in table order, whose condition holds
+//
+// an instruction keeps being matched until no rule applies, so rules can
+// build on each other. icmp eq (zext i1 %b), 0 becomes xor %b, true, and if
+// %b is itself a comparison, that becomes the inverse comparison
+
+enum class OperandTest {
+  Any,
+  Constant,
+  NotConstant,
+  Zero,
+  One,
+
+  // a constant with exactly one bit set, in the width of its type
+  PowerOfTwo,
+
+  // the result of an instruction with the given opcode
+  Instruction
+};
+
+struct OperandPattern {
+  OperandTest test;
+  IROpcode opcode;
+};
+
+// checks that don't fit in the tree, made once a rule's patterns match
+enum class RuleCondition {
+  None,
+
+  // about x, operand 0's operand 0, and the instruction's result
+  InnerOperandIsBool,
+  InnerOperandIsResultType,
+  InnerOperandIsNarrower,
+  InnerOperandIsWider
+};
+
+// where the operands of a rewritten instruction come from
+enum class ValueSource {
+  None,
+  Operand0,
+  Operand1,
+  InnerOperand0,
+  InnerOperand1,
+  Log2OfOperand1,
+  Operand1MinusOne,
+  True,
+
+  // the instruction evaluated on its constant operands
+  Folded
+};
+
+enum class RewriteKind {
+  // uses of the instruction use operands[0] instead
+  ReplaceWith,
+
+  // the instruction gets a new opcode and operands
+  Become
+};
+
+struct Rewrite {
+  RewriteKind kind;
+  IROpcode opcode;
+  ValueSource operands[2];
+
+  // for becoming an icmp, take operand 0's comparison and invert it
+  bool invert_inner_comparison;
+};
+
+struct PeepholeRule {
+  char const* name;
+  IROpcode opcode;
+
+  // None for anything, or for instructions that aren't comparisons
+  IRComparison comparison;
+  OperandPattern operands[2];
+  RuleCondition condition;
+  Rewrite rewrite;
+};
+
+static constexpr OperandPattern any = { OperandTest::Any, IROpcode::Alloca };
+static constexpr OperandPattern constant = { OperandTest::Constant, IROpcode::Alloca };
+static constexpr OperandPattern not_constant = { OperandTest::NotConstant, IROpcode::Alloca };
+static constexpr OperandPattern zero = { OperandTest::Zero, IROpcode::Alloca };
+static constexpr OperandPattern one = { OperandTest::One, IROpcode::Alloca };
+static constexpr OperandPattern power_of_two = { OperandTest::PowerOfTwo, IROpcode::Alloca };
+static constexpr OperandPattern result_of(IROpcode opcode) { return { OperandTest::Instruction, opcode }; }
+
+static constexpr Rewrite replace_with(ValueSource value)
+{
+  return { RewriteKind::ReplaceWith, IROpcode::Alloca, { value, ValueSource::None }, false };
+}
+static constexpr Rewrite become(IROpcode opcode, ValueSource lhs, ValueSource rhs = ValueSource::None)
+{
+  return { RewriteKind::Become, opcode, { lhs, rhs }, false };
+}
+
+using enum IROpcode;
+using enum ValueSource;
+
+// earlier rules win, so identities come before the strength reductions that
+// would otherwise turn x * 1 into x << 0
+static PeepholeRule const rules[] = {
+  // constant folding
+  { "fold", ZExt, IRComparison::None, { constant, any }, RuleCondition::None, replace_with(Folded) },
+  { "fold", SExt, IRComparison::None, { constant, any }, RuleCondition::None, replace_with(Folded) },
+  { "fold", Trunc, IRComparison::None, { constant, any }, RuleCondition::None, replace_with(Folded) },
+  { "fold", Add, IRComparison::None, { constant, constant }, RuleCondition::None, replace_with(Folded) },
+  { "fold", Sub, IRComparison::None, { constant, constant }, RuleCondition::None, replace_with(Folded) },
+  { "fold", Mul, IRComparison::None, { constant, constant }, RuleCondition::None, replace_with(Folded) },
+  { "fold", And, IRComparison::None, { constant, constant }, RuleCondition::None, replace_with(Folded) },
+  { "fold", Or, IRComparison::None, { constant, constant }, RuleCondition::None, replace_with(Folded) },
+  { "fold", Xor, IRComparison::None, { constant, constant }, RuleCondition::None, replace_with(Folded) },
+
+  // constants go on the right, so the rules below only need to look there
+  { "commute constant", Add, IRComparison::None, { constant, not_constant }, RuleCondition::None, become(Add, Operand1, Operand0) },
+  { "commute constant", Mul, IRComparison::None, { constant, not_constant }, RuleCondition::None, become(Mul, Operand1, Operand0) },
+  { "commute constant", And, IRComparison::None, { constant, not_constant }, RuleCondition::None, become(And, Operand1, Operand0) },
+  { "commute constant", Or, IRComparison::None, { constant, not_constant }, RuleCondition::None, become(Or, Operand1, Operand0) },
+  { "commute constant", Xor, IRComparison::None, { constant, not_constant }, RuleCondition::None, become(Xor, Operand1, Operand0) },
+
+  // identities
+  { "x + 0", Add, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand0) },
+  { "x - 0", Sub, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand0) },
+  { "x | 0", Or, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand0) },
+  { "x ^ 0", Xor, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand0) },
+  { "x << 0", Shl, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand0) },
+  { "x >> 0", LShr, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand0) },
+  { "x >> 0", AShr, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand0) },
+  { "x * 1", Mul, IRComparison::None, { any, one }, RuleCondition::None, replace_with(Operand0) },
+  { "x / 1", SDiv, IRComparison::None, { any, one }, RuleCondition::None, replace_with(Operand0) },
+  { "x / 1", UDiv, IRComparison::None, { any, one }, RuleCondition::None, replace_with(Operand0) },
+  { "x * 0", Mul, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand1) },
+  { "x & 0", And, IRComparison::None, { any, zero }, RuleCondition::None, replace_with(Operand1) },
+
+  // strength reduction. Signed division rounds towards zero, which a shift doesn't
+  { "x * 2^k", Mul, IRComparison::None, { any, power_of_two }, RuleCondition::None, become(Shl, Operand0, Log2OfOperand1) },
+  { "unsigned x / 2^k", UDiv, IRComparison::None, { any, power_of_two }, RuleCondition::None, become(LShr, Operand0, Log2OfOperand1) },
+  { "unsigned x % 2^k", URem, IRComparison::None, { any, power_of_two }, RuleCondition::None, become(And, Operand0, Operand1MinusOne) },
+
+  // extensions and truncations that undo each other
+  { "trunc (zext x) to x's type", Trunc, IRComparison::None, { result_of(ZExt), any }, RuleCondition::InnerOperandIsResultType,
+      replace_with(InnerOperand0) },
+  { "trunc (sext x) to x's type", Trunc, IRComparison::None, { result_of(SExt), any }, RuleCondition::InnerOperandIsResultType,
+      replace_with(InnerOperand0) },
+  { "trunc (zext x) wider than x", Trunc, IRComparison::None, { result_of(ZExt), any }, RuleCondition::InnerOperandIsNarrower,
+      become(ZExt, InnerOperand0) },
+  { "trunc (sext x) wider than x", Trunc, IRComparison::None, { result_of(SExt), any }, RuleCondition::InnerOperandIsNarrower,
+      become(SExt, InnerOperand0) },
+  { "trunc (zext x) narrower than x", Trunc, IRComparison::None, { result_of(ZExt), any }, RuleCondition::InnerOperandIsWider,
+      become(Trunc, InnerOperand0) },
+  { "trunc (sext x) narrower than x", Trunc, IRComparison::None, { result_of(SExt), any }, RuleCondition::InnerOperandIsWider,
+      become(Trunc, InnerOperand0) },
+  { "trunc (trunc x)", Trunc, IRComparison::None, { result_of(Trunc), any }, RuleCondition::None, become(Trunc, InnerOperand0) },
+  { "zext (zext x)", ZExt, IRComparison::None, { result_of(ZExt), any }, RuleCondition::None, become(ZExt, InnerOperand0) },
+  { "sext (sext x)", SExt, IRComparison::None, { result_of(SExt), any }, RuleCondition::None, become(SExt, InnerOperand0) },
+  { "sext (zext x)", SExt, IRComparison::None, { result_of(ZExt), any }, RuleCondition::None, become(ZExt, InnerOperand0) },
+
+  // compares of compares, left by a comparison used as a value and then tested
+  { "zext i1 b != 0", ICmp, IRComparison::Ne, { result_of(ZExt), zero }, RuleCondition::InnerOperandIsBool, replace_with(InnerOperand0) },
+  { "zext i1 b == 0", ICmp, IRComparison::Eq, { result_of(ZExt), zero }, RuleCondition::InnerOperandIsBool, become(Xor, InnerOperand0, True) },
+  { "(a < b) ^ true", Xor, IRComparison::None, { result_of(ICmp), one }, RuleCondition::None,
+      { RewriteKind::Become, ICmp, { InnerOperand0, InnerOperand1 }, true } },
+};
+
+struct DecisionNode {
+  // the next level's tests, tried in order
+  std::vector<std::pair<OperandPattern, DecisionNode*>> children;
+
+  // indices into rules, at the last level
+  std::vector<unsigned> rules;
+};
+
+struct DecisionTree {
+  std::map<std::pair<IROpcode, IRComparison>, DecisionNode*> roots;
+};
+
+static bool same_pattern(OperandPattern a, OperandPattern b)
+{
+  return a.test == b.test && (a.test != OperandTest::Instruction || a.opcode == b.opcode);
+}
+
+static DecisionNode* child_for(DecisionNode* node, OperandPattern pattern)
+{
+  for (auto& [test, child] : node->children)
+    if (same_pattern(test, pattern))
+      return child;
+  node->children.push_back({ pattern, new DecisionNode() });
+  return node->children.back().second;
+}
+
+static DecisionTree const* decision_tree()
+{
+  static DecisionTree* tree = nullptr;
+  if (tree)
+    return tree;
+
+  tree = new DecisionTree();
+  for (unsigned i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+    DecisionNode*& root = tree->roots[{ rules[i].opcode, rules[i].comparison }];
+    if (!root)
+      root = new DecisionNode();
+    child_for(child_for(root, rules[i].operands[0]), rules[i].operands[1])->rules.push_back(i);
+  }
+  return tree;
+}
+
+static unsigned long long constant_bits(IRValue const* value)
+{
+  unsigned bits = 8 * ir_type_size(value->type);
+  unsigned long long mask = bits >= 64 ? ~0ull : (1ull << bits) - 1;
+  return (unsigned long long)value->constant & mask;
+}
+
+// constants are kept sign extended from the width of their type
+static IRValue* integer_constant(char const* type, unsigned long long bits)
+{
+  unsigned width = strcmp(type, "i1") == 0 ? 1 : 8 * ir_type_size(type);
+  if (width < 64)
+    bits = (unsigned long long)((long long)(bits << (64 - width)) >> (64 - width));
+  return ir_constant(type, (long long)bits);
+}
+
+static IRValue* fold(IRInstruction const* instruction)
+{
+  char const* type = instruction->result->type;
+  IRValue const* lhs = instruction->operands[0];
+  unsigned long long a = (unsigned long long)lhs->constant;
+  unsigned long long b = instruction->operand_count > 1 ? (unsigned long long)instruction->operands[1]->constant : 0;
+
+  switch (instruction->opcode) {
+  case IROpcode::ZExt:
+    return integer_constant(type, strcmp(lhs->type, "i1") == 0 ? a & 1 : constant_bits(lhs));
+  case IROpcode::SExt:
+  case IROpcode::Trunc:
+    return integer_constant(type, a);
+  case IROpcode::Add:
+    return integer_constant(type, a + b);
+  case IROpcode::Sub:
+    return integer_constant(type, a - b);
+  case IROpcode::Mul:
+    return integer_constant(type, a * b);
+  case IROpcode::And:
+    return integer_constant(type, a & b);
+  case IROpcode::Or:
+    return integer_constant(type, a | b);
+  case IROpcode::Xor:
+    return integer_constant(type, a ^ b);
+  default:
+    assert(false && "no folding for this opcode");
+    return nullptr;
+  }
+}
+
+static bool test_operand(OperandPattern pattern, IRValue const* value)
+{
+  switch (pattern.test) {
+  case OperandTest::Any:
+    return true;
+  case OperandTest::Constant:
+    return value && value->kind == IRValueKind::Constant;
+  case OperandTest::NotConstant:
+    return value && value->kind != IRValueKind::Constant;
+  case OperandTest::Zero:
+    return value && ir_value_is_constant(value, 0);
+  case OperandTest::One:
+    return value && ir_value_is_constant(value, 1);
+  case OperandTest::PowerOfTwo:
+    return value && value->kind == IRValueKind::Constant && std::has_single_bit(constant_bits(value));
+  case OperandTest::Instruction:
+    return value && value->kind == IRValueKind::Instruction && value->instruction->opcode == pattern.opcode;
+  }
+  return false;
+}
+
+static void collect_rules(DecisionNode const* node, IRInstruction const* instruction, unsigned level, std::vector<unsigned>* candidates)
+{
+  if (level == 2) {
+    candidates->insert(candidates->end(), node->rules.begin(), node->rules.end());
+    return;
+  }
+
+  IRValue const* operand = level < instruction->operand_count ? instruction->operands[level] : nullptr;
+  for (auto const& [test, child] : node->children)
+    if (test_operand(test, operand))
+      collect_rules(child, instruction, level + 1, candidates);
+}
+
+static IRValue* inner_operand(IRInstruction const* instruction, unsigned index) { return instruction->operands[0]->instruction->operands[index]; }
+
+static bool holds(RuleCondition condition, IRInstruction const* instruction)
+{
+  if (condition == RuleCondition::None)
+    return true;
+
+  char const* inner_type = inner_operand(instruction, 0)->type;
+  switch (condition) {
+  case RuleCondition::InnerOperandIsBool:
+    return strcmp(inner_type, "i1") == 0;
+  case RuleCondition::InnerOperandIsResultType:
+    return strcmp(inner_type, instruction->result->type) == 0;
+  case RuleCondition::InnerOperandIsNarrower:
+    return ir_type_size(inner_type) < ir_type_size(instruction->result->type);
+  case RuleCondition::InnerOperandIsWider:
+    return ir_type_size(inner_type) > ir_type_size(instruction->result->type);
+  default:
+    return false;
+  }
+}
+
+// the first rule in table order whose patterns and condition hold, or null
+static PeepholeRule const* match(IRInstruction const* instruction)
+{
+  DecisionTree const* tree = decision_tree();
+
+  std::vector<unsigned> candidates;
+  for (IRComparison comparison : { instruction->comparison, IRComparison::None }) {
+    auto root = tree->roots.find({ instruction->opcode, comparison });
+    if (root != tree->roots.end())
+      collect_rules(root->second, instruction, 0, &candidates);
+    if (comparison == IRComparison::None)
+      break;
+  }
+
+  std::sort(candidates.begin(), candidates.end());
+  for (unsigned candidate : candidates)
+    if (holds(rules[candidate].condition, instruction))
+      return &rules[candidate];
+  return nullptr;
+}
+
+static IRValue* source_value(ValueSource source, IRInstruction const* instruction)
+{
+  switch (source) {
+  case ValueSource::None:
+    return nullptr;
+  case ValueSource::Operand0:
+    return instruction->operands[0];
+  case ValueSource::Operand1:
+    return instruction->operands[1];
+  case ValueSource::InnerOperand0:
+    return inner_operand(instruction, 0);
+  case ValueSource::InnerOperand1:
+    return inner_operand(instruction, 1);
+  case ValueSource::Log2OfOperand1:
+    return ir_constant(instruction->operands[1]->type, std::countr_zero(constant_bits(instruction->operands[1])));
+  case ValueSource::Operand1MinusOne:
+    return ir_constant(instruction->operands[1]->type, (long long)(constant_bits(instruction->operands[1]) - 1));
+  case ValueSource::True:
+    return ir_constant("i1", 1);
+  case ValueSource::Folded:
+    return fold(instruction);
+  }
+  return nullptr;
+}
+
+// what the instruction was replaced with, if it was
+static IRValue* apply(PeepholeRule const* rule, IRInstruction* instruction)
+{
+  Rewrite const* rewrite = &rule->rewrite;
+  if (rewrite->kind == RewriteKind::ReplaceWith)
+    return source_value(rewrite->operands[0], instruction);
+
+  // everything is read before anything is written
+  IRValue* lhs = source_value(rewrite->operands[0], instruction);
+  IRValue* rhs = source_value(rewrite->operands[1], instruction);
+  IRComparison comparison = IRComparison::None;
+  if (rewrite->invert_inner_comparison)
+    comparison = ir_inverse_comparison(instruction->operands[0]->instruction->comparison);
+
+  // operand arrays have room for one more, so a cast can become a binary operator
+  instruction->opcode = rewrite->opcode;
+  instruction->comparison = comparison;
+  instruction->operand_count = rhs ? 2 : 1;
+  instruction->operands[0] = lhs;
+  instruction->operands[1] = rhs;
+  return nullptr;
+}
+
+void run_peephole(IRFunction* function, OptimizationStatistics* statistics)
+{
+  ControlFlowGraph cfg = compute_control_flow_graph(function);
+
+  // in reverse postorder every use is visited after what it uses, so it sees
+  // what that was replaced with. The replaced instructions stay for DCE
+  std::unordered_map<IRValue*, IRValue*> replacements;
+  for (IRBasicBlock* block : cfg.reverse_postorder)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      for (unsigned i = 0; i < instruction->operand_count; i++)
+        if (replacements.contains(instruction->operands[i]))
+          instruction->operands[i] = replacements.at(instruction->operands[i]);
+
+      if (!instruction->result || ir_type_is_vector(instruction->result->type))
+        continue;
+
+      while (PeepholeRule const* rule = match(instruction)) {
+        statistics->peephole_rewrites++;
+        if (IRValue* replacement = apply(rule, instruction)) {
+          replacements[instruction->result] = replacement;
+          break;
+        }
+      }
+    }
+}
@@ -0,0 +1,100 @@
+#include "pipeline.h"
+
+#include "codegen.h"
+
+#include <atomic>
+#include <thread>
+
+// pipelined compiles
+//
+// lowering a function only needs the declarations before it, so it doesn't
+// have to wait for the rest of the file to be parsed. The parser runs on a
+// thread of its own and hands each external declaration it finishes to the
+// lowering thread through a bounded queue, and each function body is freed
+// as soon as it's lowered. The parse and lowering overlap, and the file's
+// whole AST is never in memory at once, only its declarations and the
+// bodies waiting in the queue. The middle end and the backend still need
+// the whole module, and run once it's all lowered
+//
+// the parser's global scope is the one thing both threads could touch while
+// the parser is still writing to it. Lowering looks global names up in a
+// table of its own instead, see ModuleLowering. A definition calling a
+// function that's declared further down is lowered once everything is. The
+// output is the same as compiling the file the usual way
+//
+// a precompiled header reads declarations in as the global scope looks them
+// up, and --incremental groups the whole file's functions before lowering
+// any, so neither is pipelined
+
+// declarations parsed but not lowered yet. More than this and the parser
+// waits, so a slow lowering doesn't let the ASTs pile up
+static constexpr unsigned queue_capacity = 64;
+
+// one thread pushes, one other pops. head and tail only ever grow, so full
+// and empty are told apart without a spare slot. Each side waits on the
+// other's index. A full queue waits to be half empty, lowering is usually the
+// slower side and waking the parser for every slot would have the threads
+// taking turns a declaration at a time
+struct DeclarationQueue {
+  ExternalDeclaration* declarations[queue_capacity];
+  alignas(64) std::atomic<unsigned> head;
+  alignas(64) std::atomic<unsigned> tail;
+};
+
+static void push_declaration(DeclarationQueue* queue, ExternalDeclaration* declaration)
+{
+  unsigned tail = queue->tail.load(std::memory_order_relaxed);
+  if (tail - queue->head.load(std::memory_order_acquire) == queue_capacity)
+    for (unsigned head; tail - (head = queue->head.load(std::memory_order_acquire)) > queue_capacity / 2;)
+      queue->head.wait(head, std::memory_order_acquire);
+
+  queue->declarations[tail % queue_capacity] = declaration;
+  queue->tail.store(tail + 1, std::memory_order_release);
+  queue->tail.notify_one();
+}
+
+static ExternalDeclaration* pop_declaration(DeclarationQueue* queue)
+{
+  unsigned head = queue->head.load(std::memory_order_relaxed);
+  for (unsigned tail; (tail = queue->tail.load(std::memory_order_acquire)) == head;)
+    queue->tail.wait(tail, std::memory_order_acquire);
+
+  ExternalDeclaration* declaration = queue->declarations[head % queue_capacity];
+  queue->head.store(head + 1, std::memory_order_release);
+  queue->head.notify_one();
+  return declaration;
+}
+
+bool can_compile_pipelined(CompilerOptions const* options)
+{
+  return !options->emit_pch && !options->emit_index && !options->include_pch_path && !options->incremental;
+}
+
+TranslationUnit emit_pipelined(char const* file, char const* path, FILE* outfile, CompilerOptions const* options,
+    OptimizationStatistics* statistics)
+{
+  DeclarationQueue queue;
+  queue.head = 0;
+  queue.tail = 0;
+
+  TranslationUnit translation_unit;
+  std::thread parser([&] {
+    translation_unit = parse_whole_translation_unit(file, path, nullptr, false,
+        [&](ExternalDeclaration* declaration) { push_declaration(&queue, declaration); });
+    // the end of the file
+    push_declaration(&queue, nullptr);
+  });
+
+  ModuleLowering* lowering = new_module_lowering();
+  lowering->releases_function_bodies = true;
+  while (ExternalDeclaration* declaration = pop_declaration(&queue))
+    lower_external_declaration(lowering, declaration);
+  parser.join();
+
+  IRModule* module = finish_module_lowering(lowering);
+  if (options->emit_object)
+    emit_object_from_module(module, outfile, options, statistics);
+  else
+    emit_llvm_from_module(module, outfile, options, statistics);
+  return translation_unit;
+}
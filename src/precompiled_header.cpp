@@ -0,0 +1,762 @@
+#include "precompiled_header.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// precompiled headers, what clang calls PCH
+//
+// --emit-pch parses a header as a translation unit of its own and writes out
+// what that left behind: the declarations in the global scope, with every
+// type, function body and inner scope they reach, and the macros. A
+// translation unit compiled with --include-pch maps the file and starts from
+// it as if the header had been included before its first line, but reads a
+// declaration in only when the translation unit names it. A big header the
+// translation unit hardly uses costs little more than mapping it
+//
+// the file holds no pointers, so it means the same wherever it's mapped and
+// records are read where they lie. Every record has a fixed size, every
+// reference to another record is its index in that record's array, or
+// no_index for none, and every string is an offset and a length in the
+// string table. Integers are in the byte order of the machine that wrote the
+// file, which the magic number and version guard along with the layout
+//
+// the file is laid out as
+//      header, where each array starts and how many records it has
+//      types
+//      function parameters
+//      objects
+//      AST nodes
+//      scopes, the global scope first
+//      the entries of the scopes but the global one
+//      the global scope's variables and typedef names, each an open
+//      addressing hash table on the name, so a name is found without
+//      reading anything else
+//      external declarations
+//      macros
+//      macro body tokens
+//      strings
+//
+// types aren't interned by the parser, so the file has one record for each
+// Type the declarations point to. The fundamental types are the exception,
+// their records stand for VoidType, IntType and the rest, which codegen
+// compares against
+
+static constexpr char magic[8] = { 'm', 'c', 'p', 'c', 'h', '\0', '\0', '\0' };
+static constexpr uint32_t format_version = 1;
+static constexpr uint32_t no_index = UINT32_MAX;
+
+struct PCHArray {
+  uint32_t offset;
+  uint32_t count;
+};
+
+struct PCHString {
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct PCHFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+
+  PCHArray types;
+  PCHArray parameters;
+  PCHArray objects;
+  PCHArray nodes;
+  PCHArray scopes;
+  PCHArray scope_entries;
+  PCHArray global_variables;
+  PCHArray global_typedef_names;
+  PCHArray external_declarations;
+  PCHArray macros;
+  PCHArray macro_tokens;
+  // in bytes
+  PCHArray strings;
+};
+
+enum PCHTypeFlag : uint32_t {
+  // one of the shared Types for a fundamental type, nothing else is read
+  IsFundamental = 1,
+  HasFunctionData = 1 << 1,
+  IsVariadic = 1 << 2,
+};
+
+struct PCHType {
+  uint32_t fundamental_type;
+  int32_t declaration_specifier_flags;
+  uint32_t flags;
+  uint32_t pointed_type;
+  uint32_t return_type;
+  uint32_t first_parameter;
+};
+
+struct PCHParameter {
+  uint32_t type;
+  uint32_t next;
+  PCHString identifier;
+};
+
+struct PCHObject {
+  PCHString identifier;
+  uint32_t type;
+  uint32_t function_body;
+  int32_t declaration_specifier_flags;
+};
+
+struct PCHNode {
+  uint32_t type;
+  uint32_t scope;
+  uint32_t data_type;
+  uint32_t object;
+  uint32_t next;
+  uint32_t lhs;
+  uint32_t rhs;
+  uint32_t conditional;
+  uint32_t arguments;
+  uint32_t body;
+  PCHString referenced_variable;
+  // ASTNode::data_as as it is in memory
+  unsigned char data[16];
+};
+
+static_assert(sizeof(ASTNode::data_as) <= sizeof(PCHNode::data));
+
+// a scope's variables, then its typedef names
+struct PCHScope {
+  uint32_t parent;
+  uint32_t return_type;
+  uint32_t first_entry;
+  uint32_t variable_count;
+  uint32_t typedef_name_count;
+};
+
+// also a slot in the global scope's hash tables, empty if object is no_index
+struct PCHScopeEntry {
+  PCHString name;
+  uint32_t object;
+};
+
+struct PCHExternalDeclaration {
+  uint32_t type;
+  uint32_t root_node;
+};
+
+enum PCHMacroFlag : uint32_t {
+  IsFunctionLike = 1,
+  IsVariadicMacro = 1 << 1,
+};
+
+struct PCHMacro {
+  PCHString name;
+  uint32_t flags;
+  uint32_t parameter_count;
+  uint32_t first_token;
+  uint32_t token_count;
+};
+
+struct PCHToken {
+  uint32_t type;
+  int32_t parameter;
+  uint32_t line;
+  uint32_t column;
+  PCHString string;
+};
+
+static unsigned hash_name(char const* name, unsigned length)
+{
+  unsigned hash = 2166136261u;
+  for (unsigned i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  return hash;
+}
+
+// writing
+
+struct PCHWriter {
+  Scope const* global_scope;
+
+  std::vector<PCHType> types;
+  std::vector<PCHParameter> parameters;
+  std::vector<PCHObject> objects;
+  std::vector<PCHNode> nodes;
+  std::vector<PCHScope> scopes;
+  std::vector<PCHScopeEntry> scope_entries;
+  std::vector<PCHScopeEntry> global_variables;
+  std::vector<PCHScopeEntry> global_typedef_names;
+  std::vector<PCHExternalDeclaration> external_declarations;
+  std::vector<PCHMacro> macros;
+  std::vector<PCHToken> macro_tokens;
+  std::string strings;
+
+  // what's been written already, so what's shared stays shared
+  std::unordered_map<Type const*, uint32_t> type_indices;
+  std::unordered_map<FunctionParameter const*, uint32_t> parameter_indices;
+  std::unordered_map<Object const*, uint32_t> object_indices;
+  std::unordered_map<ASTNode const*, uint32_t> node_indices;
+  std::unordered_map<Scope const*, uint32_t> scope_indices;
+  std::unordered_map<std::string, PCHString> string_indices;
+};
+
+static PCHString write_string(PCHWriter* writer, std::string const& string)
+{
+  if (writer->string_indices.contains(string))
+    return writer->string_indices.at(string);
+
+  PCHString written = { (uint32_t)writer->strings.size(), (uint32_t)string.size() };
+  writer->strings += string;
+  writer->string_indices[string] = written;
+  return written;
+}
+
+static uint32_t write_type(PCHWriter*, Type const*);
+
+static uint32_t write_parameter(PCHWriter* writer, FunctionParameter const* parameter)
+{
+  if (!parameter)
+    return no_index;
+  if (writer->parameter_indices.contains(parameter))
+    return writer->parameter_indices.at(parameter);
+
+  uint32_t index = writer->parameters.size();
+  writer->parameter_indices[parameter] = index;
+  writer->parameters.emplace_back();
+
+  PCHParameter record;
+  record.type = write_type(writer, parameter->parameter_type);
+  record.next = write_parameter(writer, parameter->next_parameter);
+  record.identifier = write_string(writer, parameter->identifier);
+  writer->parameters[index] = record;
+  return index;
+}
+
+static uint32_t write_type(PCHWriter* writer, Type const* type)
+{
+  if (!type)
+    return no_index;
+  if (writer->type_indices.contains(type))
+    return writer->type_indices.at(type);
+
+  uint32_t index = writer->types.size();
+  writer->type_indices[type] = index;
+  writer->types.emplace_back();
+
+  PCHType record;
+  record.fundamental_type = (uint32_t)type->fundamental_type;
+  record.declaration_specifier_flags = type->declaration_specifier_flags.flags;
+  record.flags = type == get_fundamental_type_pointer(type->fundamental_type) ? (uint32_t)IsFundamental : 0;
+  record.pointed_type = write_type(writer, type->pointed_type);
+  record.return_type = no_index;
+  record.first_parameter = no_index;
+  if (type->function_data) {
+    record.flags |= HasFunctionData | (type->function_data->is_variadic ? (uint32_t)IsVariadic : 0);
+    record.return_type = write_type(writer, type->function_data->return_type);
+    record.first_parameter = write_parameter(writer, type->function_data->parameter_list);
+  }
+  writer->types[index] = record;
+  return index;
+}
+
+static uint32_t write_node(PCHWriter*, ASTNode const*);
+static uint32_t write_scope(PCHWriter*, Scope const*);
+
+static uint32_t write_object(PCHWriter* writer, Object const* object)
+{
+  if (!object)
+    return no_index;
+  if (writer->object_indices.contains(object))
+    return writer->object_indices.at(object);
+
+  uint32_t index = writer->objects.size();
+  writer->object_indices[object] = index;
+  writer->objects.emplace_back();
+
+  PCHObject record;
+  record.identifier = write_string(writer, object->identifier);
+  record.type = write_type(writer, object->type);
+  record.function_body = write_node(writer, function_body(object));
+  record.declaration_specifier_flags = object->declaration_specifier_flags.flags;
+  writer->objects[index] = record;
+  return index;
+}
+
+static uint32_t write_node(PCHWriter* writer, ASTNode const* node)
+{
+  if (!node)
+    return no_index;
+  if (writer->node_indices.contains(node))
+    return writer->node_indices.at(node);
+
+  uint32_t index = writer->nodes.size();
+  writer->node_indices[node] = index;
+  writer->nodes.emplace_back();
+
+  PCHNode record;
+  memset(&record, 0, sizeof(record));
+  record.type = (uint32_t)node->type;
+  record.scope = write_scope(writer, node->scope);
+  record.data_type = (uint32_t)node->data_type;
+  memcpy(record.data, &node->data_as, sizeof(node->data_as));
+  record.object = write_object(writer, node->object);
+  record.next = write_node(writer, node->next);
+  record.lhs = write_node(writer, node->lhs);
+  record.rhs = write_node(writer, node->rhs);
+  record.conditional = write_node(writer, node->conditional);
+  record.arguments = write_node(writer, node->arguments);
+  record.body = write_node(writer, node->body);
+  record.referenced_variable = write_string(writer, node->referenced_variable);
+  writer->nodes[index] = record;
+  return index;
+}
+
+static uint32_t write_scope(PCHWriter* writer, Scope const* scope)
+{
+  if (!scope)
+    return no_index;
+  if (writer->scope_indices.contains(scope))
+    return writer->scope_indices.at(scope);
+
+  uint32_t index = writer->scopes.size();
+  writer->scope_indices[scope] = index;
+  writer->scopes.emplace_back();
+
+  PCHScope record;
+  record.parent = write_scope(writer, scope->parent_scope);
+  record.return_type = write_type(writer, scope->return_type);
+  record.variable_count = 0;
+  record.typedef_name_count = 0;
+
+  // the global scope's are in the hash tables. The rest are written in one
+  // go once every object in them has been, which can write other scopes
+  std::vector<PCHScopeEntry> entries;
+  if (scope != writer->global_scope) {
+    for (auto const& [name, object] : scope->variables)
+      entries.push_back({ write_string(writer, name), write_object(writer, object) });
+    record.variable_count = entries.size();
+    for (auto const& [name, object] : scope->typedef_names)
+      entries.push_back({ write_string(writer, name), write_object(writer, object) });
+    record.typedef_name_count = entries.size() - record.variable_count;
+  }
+  record.first_entry = writer->scope_entries.size();
+  writer->scope_entries.insert(writer->scope_entries.end(), entries.begin(), entries.end());
+
+  writer->scopes[index] = record;
+  return index;
+}
+
+// at most half full, and a power of two in size so probing can mask
+static void write_global_table(PCHWriter* writer, std::unordered_map<std::string, Object*> const* names, std::vector<PCHScopeEntry>* table)
+{
+  if (names->empty())
+    return;
+
+  unsigned capacity = 1;
+  while (capacity < 2 * names->size())
+    capacity *= 2;
+  table->assign(capacity, { { 0, 0 }, no_index });
+
+  for (auto const& [name, object] : *names) {
+    uint32_t object_index = write_object(writer, object);
+    unsigned slot = hash_name(name.data(), name.size()) & (capacity - 1);
+    while ((*table)[slot].object != no_index)
+      slot = (slot + 1) & (capacity - 1);
+    (*table)[slot] = { write_string(writer, name), object_index };
+  }
+}
+
+static void write_macros(PCHWriter* writer, MacroTable const* macros)
+{
+  for (unsigned i = 0; i < macros->capacity; i++) {
+    Identifier const* identifier = macros->entries[i];
+    if (!identifier || !identifier->macro)
+      continue;
+
+    Macro const* macro = identifier->macro;
+    PCHMacro record;
+    record.name = write_string(writer, std::string(identifier->name.pointer, identifier->name.length));
+    record.flags = (macro->is_function_like ? (uint32_t)IsFunctionLike : 0) | (macro->is_variadic ? (uint32_t)IsVariadicMacro : 0);
+    record.parameter_count = macro->parameter_count;
+    record.first_token = writer->macro_tokens.size();
+    record.token_count = macro->body.size();
+    for (unsigned j = 0; j < macro->body.size(); j++) {
+      Token const* token = &macro->body[j];
+      writer->macro_tokens.push_back(
+          { (uint32_t)token->type, macro->body_parameters[j], token->line, token->column, write_string(writer, token->string) });
+    }
+    writer->macros.push_back(record);
+  }
+}
+
+// appends the records, 8 byte aligned, and says where they went
+template <typename Record>
+static PCHArray append_array(std::string* file, std::vector<Record> const* records)
+{
+  while (file->size() % 8)
+    file->push_back('\0');
+
+  PCHArray array = { (uint32_t)file->size(), (uint32_t)records->size() };
+  file->append((char const*)records->data(), records->size() * sizeof(Record));
+  return array;
+}
+
+void write_precompiled_header(TranslationUnit const* translation_unit, FILE* outfile)
+{
+  PCHWriter writer;
+  writer.global_scope = translation_unit->global_scope;
+  write_scope(&writer, translation_unit->global_scope);
+
+  for (ExternalDeclaration const* declaration = translation_unit->external_declarations; declaration; declaration = declaration->next)
+    writer.external_declarations.push_back({ (uint32_t)declaration->type, write_node(&writer, declaration->root_ast_node) });
+  write_global_table(&writer, &translation_unit->global_scope->variables, &writer.global_variables);
+  write_global_table(&writer, &translation_unit->global_scope->typedef_names, &writer.global_typedef_names);
+  write_macros(&writer, translation_unit->preprocessor->macros);
+
+  PCHFileHeader header;
+  memset(&header, 0, sizeof(header));
+  std::string file(sizeof(header), '\0');
+  memcpy(header.magic, magic, sizeof(magic));
+  header.version = format_version;
+  header.types = append_array(&file, &writer.types);
+  header.parameters = append_array(&file, &writer.parameters);
+  header.objects = append_array(&file, &writer.objects);
+  header.nodes = append_array(&file, &writer.nodes);
+  header.scopes = append_array(&file, &writer.scopes);
+  header.scope_entries = append_array(&file, &writer.scope_entries);
+  header.global_variables = append_array(&file, &writer.global_variables);
+  header.global_typedef_names = append_array(&file, &writer.global_typedef_names);
+  header.external_declarations = append_array(&file, &writer.external_declarations);
+  header.macros = append_array(&file, &writer.macros);
+  header.macro_tokens = append_array(&file, &writer.macro_tokens);
+  header.strings = { (uint32_t)file.size(), (uint32_t)writer.strings.size() };
+  file += writer.strings;
+
+  memcpy(file.data(), &header, sizeof(header));
+  fwrite(file.data(), 1, file.size(), outfile);
+}
+
+// reading
+
+struct PrecompiledHeader {
+  char const* contents;
+  PCHFileHeader const* header;
+
+  // the translation unit's, which the header's global scope becomes
+  Scope* global_scope;
+
+  // by index, null until read
+  std::vector<Type const*> types;
+  std::vector<FunctionParameter*> parameters;
+  std::vector<Object*> objects;
+  std::vector<ASTNode*> nodes;
+  std::vector<Scope*> scopes;
+};
+
+// the lengths were checked when the file was mapped, the indices in it are
+// checked as they're followed
+[[noreturn]] static void corrupt()
+{
+  fprintf(stderr, "The precompiled header is corrupt, aborting.\n");
+  exit(1);
+}
+
+template <typename Record>
+static Record const* record_at(PrecompiledHeader const* header, PCHArray array, uint32_t index)
+{
+  if (index >= array.count)
+    corrupt();
+  return (Record const*)(header->contents + array.offset) + index;
+}
+
+static std::string read_string(PrecompiledHeader const* header, PCHString string)
+{
+  if ((uint64_t)string.offset + string.length > header->header->strings.count)
+    corrupt();
+  return std::string(header->contents + header->header->strings.offset + string.offset, string.length);
+}
+
+static bool fits(PCHArray array, size_t record_size, size_t file_size)
+{
+  return array.offset % 8 == 0 && (uint64_t)array.offset + (uint64_t)array.count * record_size <= file_size;
+}
+
+PrecompiledHeader* read_precompiled_header(char const* path)
+{
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0)
+    return nullptr;
+  struct stat status;
+  if (fstat(descriptor, &status) != 0 || (size_t)status.st_size < sizeof(PCHFileHeader)) {
+    close(descriptor);
+    return nullptr;
+  }
+  void* contents = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  close(descriptor);
+  if (contents == MAP_FAILED)
+    return nullptr;
+
+  size_t size = status.st_size;
+  PCHFileHeader const* header = (PCHFileHeader const*)contents;
+  bool is_valid = memcmp(header->magic, magic, sizeof(magic)) == 0 && header->version == format_version
+      && fits(header->types, sizeof(PCHType), size) && fits(header->parameters, sizeof(PCHParameter), size)
+      && fits(header->objects, sizeof(PCHObject), size) && fits(header->nodes, sizeof(PCHNode), size)
+      && fits(header->scopes, sizeof(PCHScope), size) && fits(header->scope_entries, sizeof(PCHScopeEntry), size)
+      && fits(header->global_variables, sizeof(PCHScopeEntry), size) && fits(header->global_typedef_names, sizeof(PCHScopeEntry), size)
+      && fits(header->external_declarations, sizeof(PCHExternalDeclaration), size) && fits(header->macros, sizeof(PCHMacro), size)
+      && fits(header->macro_tokens, sizeof(PCHToken), size) && (uint64_t)header->strings.offset + header->strings.count <= size
+      && (header->global_variables.count & (header->global_variables.count - 1)) == 0
+      && (header->global_typedef_names.count & (header->global_typedef_names.count - 1)) == 0 && header->scopes.count > 0;
+  if (!is_valid) {
+    munmap(contents, size);
+    return nullptr;
+  }
+
+  PrecompiledHeader* precompiled_header = new PrecompiledHeader;
+  precompiled_header->contents = (char const*)contents;
+  precompiled_header->header = header;
+  precompiled_header->global_scope = nullptr;
+  precompiled_header->types.assign(header->types.count, nullptr);
+  precompiled_header->parameters.assign(header->parameters.count, nullptr);
+  precompiled_header->objects.assign(header->objects.count, nullptr);
+  precompiled_header->nodes.assign(header->nodes.count, nullptr);
+  precompiled_header->scopes.assign(header->scopes.count, nullptr);
+  return precompiled_header;
+}
+
+static Type const* read_type(PrecompiledHeader*, uint32_t);
+
+static FunctionParameter* read_parameter(PrecompiledHeader* header, uint32_t index)
+{
+  if (index == no_index)
+    return nullptr;
+  PCHParameter const* record = record_at<PCHParameter>(header, header->header->parameters, index);
+  if (header->parameters[index])
+    return header->parameters[index];
+
+  FunctionParameter* parameter = new FunctionParameter;
+  header->parameters[index] = parameter;
+  parameter->parameter_type = read_type(header, record->type);
+  parameter->identifier = read_string(header, record->identifier);
+  parameter->next_parameter = read_parameter(header, record->next);
+  return parameter;
+}
+
+static Type const* read_type(PrecompiledHeader* header, uint32_t index)
+{
+  if (index == no_index)
+    return nullptr;
+  PCHType const* record = record_at<PCHType>(header, header->header->types, index);
+  if (header->types[index])
+    return header->types[index];
+  if (record->fundamental_type > (uint32_t)FundamentalType::Function)
+    corrupt();
+
+  FundamentalType fundamental_type = (FundamentalType)record->fundamental_type;
+  if (record->flags & IsFundamental) {
+    header->types[index] = get_fundamental_type_pointer(fundamental_type);
+    return header->types[index];
+  }
+
+  Type* type = new_type(fundamental_type);
+  header->types[index] = type;
+  type->declaration_specifier_flags.flags = record->declaration_specifier_flags;
+  type->pointed_type = read_type(header, record->pointed_type);
+  if (record->flags & HasFunctionData) {
+    FunctionData* function_data = (FunctionData*)malloc(sizeof(FunctionData));
+    function_data->return_type = read_type(header, record->return_type);
+    function_data->parameter_list = read_parameter(header, record->first_parameter);
+    function_data->is_variadic = record->flags & IsVariadic;
+    type->function_data = function_data;
+  }
+  return type;
+}
+
+static ASTNode* read_node(PrecompiledHeader*, uint32_t);
+
+static Object* read_object(PrecompiledHeader* header, uint32_t index)
+{
+  if (index == no_index)
+    return nullptr;
+  PCHObject const* record = record_at<PCHObject>(header, header->header->objects, index);
+  if (header->objects[index])
+    return header->objects[index];
+
+  // before the body, which can call the function
+  Object* object = new Object;
+  header->objects[index] = object;
+  object->identifier = read_string(header, record->identifier);
+  object->type = read_type(header, record->type);
+  object->declaration_specifier_flags.flags = record->declaration_specifier_flags;
+  object->declaration_number = 0;
+  object->function_body = read_node(header, record->function_body);
+  object->deferred_body = nullptr;
+  object->path = nullptr;
+  object->line = 0;
+  object->column = 0;
+  return object;
+}
+
+static Scope* read_scope(PrecompiledHeader* header, uint32_t index)
+{
+  if (index == no_index)
+    return nullptr;
+  if (index == 0)
+    return header->global_scope;
+  PCHScope const* record = record_at<PCHScope>(header, header->header->scopes, index);
+  if (header->scopes[index])
+    return header->scopes[index];
+
+  Scope* scope = new_scope(read_scope(header, record->parent), read_type(header, record->return_type));
+  header->scopes[index] = scope;
+  for (uint32_t i = 0; i < record->variable_count + record->typedef_name_count; i++) {
+    PCHScopeEntry const* entry = record_at<PCHScopeEntry>(header, header->header->scope_entries, record->first_entry + i);
+    Object* object = read_object(header, entry->object);
+    if (i < record->variable_count)
+      scope->variables[read_string(header, entry->name)] = object;
+    else
+      scope->typedef_names[read_string(header, entry->name)] = object;
+  }
+  return scope;
+}
+
+static ASTNode* read_node(PrecompiledHeader* header, uint32_t index)
+{
+  if (index == no_index)
+    return nullptr;
+  PCHNode const* record = record_at<PCHNode>(header, header->header->nodes, index);
+  if (header->nodes[index])
+    return header->nodes[index];
+  if (record->type > (uint32_t)ASTNodeType::Declaration || record->data_type > (uint32_t)FundamentalType::Function)
+    corrupt();
+
+  ASTNode* node = new_ast_node(read_scope(header, record->scope), (ASTNodeType)record->type);
+  header->nodes[index] = node;
+  node->data_type = (FundamentalType)record->data_type;
+  memcpy(&node->data_as, record->data, sizeof(node->data_as));
+  node->object = read_object(header, record->object);
+  node->referenced_variable = read_string(header, record->referenced_variable);
+  node->next = read_node(header, record->next);
+  node->lhs = read_node(header, record->lhs);
+  node->rhs = read_node(header, record->rhs);
+  node->conditional = read_node(header, record->conditional);
+  node->arguments = read_node(header, record->arguments);
+  node->body = read_node(header, record->body);
+
+  // whatever a function from the header uses has to be read in too, the
+  // same as for a reference the parser sees, see parse_primary_expression
+  if (node->type == ASTNodeType::VariableReference)
+    variable_in_scope(node->referenced_variable, node->scope);
+  return node;
+}
+
+static uint32_t find_global(PrecompiledHeader const* header, PCHArray table, std::string const& name)
+{
+  if (table.count == 0)
+    return no_index;
+
+  // the table is never full, so this reaches an empty slot
+  for (uint32_t slot = hash_name(name.data(), name.size()) & (table.count - 1);; slot = (slot + 1) & (table.count - 1)) {
+    PCHScopeEntry const* entry = record_at<PCHScopeEntry>(header, table, slot);
+    if (entry->object == no_index)
+      return no_index;
+    if (entry->name.length == name.size() && read_string(header, entry->name) == name)
+      return entry->object;
+  }
+}
+
+void use_precompiled_header(PrecompiledHeader* header, Scope* global_scope, MacroTable* macros)
+{
+  assert(!header->global_scope && "a precompiled header can only be used by one translation unit");
+  header->global_scope = global_scope;
+  global_scope->precompiled_header = header;
+
+  // there are few enough of these that they're all defined up front
+  for (uint32_t i = 0; i < header->header->macros.count; i++) {
+    PCHMacro const* record = record_at<PCHMacro>(header, header->header->macros, i);
+    Macro* macro = new Macro;
+    macro->is_function_like = record->flags & IsFunctionLike;
+    macro->is_variadic = record->flags & IsVariadicMacro;
+    macro->parameter_count = record->parameter_count;
+    for (uint32_t j = 0; j < record->token_count; j++) {
+      PCHToken const* token = record_at<PCHToken>(header, header->header->macro_tokens, record->first_token + j);
+      if (token->type > (uint32_t)TokenType::IntegerSuffixLLU)
+        corrupt();
+      macro->body.push_back(make_token((TokenType)token->type, token->line, token->column, read_string(header, token->string)));
+      macro->body_parameters.push_back(token->parameter);
+    }
+
+    std::string name = read_string(header, record->name);
+    intern_identifier(macros, name.c_str(), name.size())->macro = macro;
+  }
+}
+
+Object* precompiled_variable(PrecompiledHeader* header, std::string const& name)
+{
+  return read_object(header, find_global(header, header->header->global_variables, name));
+}
+
+bool precompiled_typedef_name(PrecompiledHeader* header, std::string const& name)
+{
+  return find_global(header, header->header->global_typedef_names, name) != no_index;
+}
+
+// whether any declarator in the declaration has been read in
+static bool is_used(PrecompiledHeader const* header, uint32_t node_index)
+{
+  for (; node_index != no_index; node_index = record_at<PCHNode>(header, header->header->nodes, node_index)->next) {
+    uint32_t object = record_at<PCHNode>(header, header->header->nodes, node_index)->object;
+    if (object != no_index && object < header->objects.size() && header->objects[object])
+      return true;
+  }
+  return false;
+}
+
+ExternalDeclaration* prepend_precompiled_declarations(PrecompiledHeader* header, ExternalDeclaration* declarations)
+{
+  PCHArray array = header->header->external_declarations;
+
+  // every translation unit including the header would define these
+  for (uint32_t i = 0; i < array.count; i++) {
+    PCHExternalDeclaration const* record = record_at<PCHExternalDeclaration>(header, array, i);
+    if (record->type != (uint32_t)ExternalDeclarationType::FunctionDefinition)
+      continue;
+    PCHNode const* node = record_at<PCHNode>(header, header->header->nodes, record->root_node);
+    PCHObject const* object = record_at<PCHObject>(header, header->header->objects, node->object);
+    if (!(object->declaration_specifier_flags & TypeModifierFlag::Static))
+      read_node(header, record->root_node);
+  }
+
+  // reading a declaration in can read in the ones it uses, so this goes
+  // over them all once before deciding which are used
+  for (uint32_t i = 0; i < array.count; i++) {
+    PCHExternalDeclaration const* record = record_at<PCHExternalDeclaration>(header, array, i);
+    if (is_used(header, record->root_node))
+      read_node(header, record->root_node);
+  }
+
+  ExternalDeclaration anchor;
+  anchor.next = nullptr;
+  ExternalDeclaration* previous = &anchor;
+  for (uint32_t i = 0; i < array.count; i++) {
+    PCHExternalDeclaration const* record = record_at<PCHExternalDeclaration>(header, array, i);
+    if (!is_used(header, record->root_node))
+      continue;
+
+    ExternalDeclaration* declaration = (ExternalDeclaration*)malloc(sizeof(ExternalDeclaration));
+    declaration->next = nullptr;
+    declaration->type = (ExternalDeclarationType)record->type;
+    declaration->root_ast_node = read_node(header, record->root_node);
+    declaration->token_hash = 0;
+    previous->next = declaration;
+    previous = declaration;
+  }
+
+  previous->next = declarations;
+  return anchor.next;
+}
@@ -0,0 +1,1244 @@
+#include "preprocessor.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a power of two, so probing can mask instead of dividing
+static constexpr unsigned initial_macro_table_capacity = 256;
+
+// what GCC allows, past this an include is more likely to be including itself
+static constexpr unsigned maximum_include_depth = 200;
+
+// the files read so far and where to look for more, for the whole run. The
+// lock is for the table and for what's learned about a file while lexing it,
+// its guard and #pragma once, while lexing a file ahead of time only locks the
+// file
+struct FileTable {
+  std::mutex mutex;
+  std::map<std::pair<dev_t, ino_t>, FileEntry*> by_inode;
+  std::vector<std::string> include_directories;
+  PreprocessorStatistics statistics {};
+};
+
+static FileTable file_table;
+
+// FNV-1a
+static unsigned hash_name(char const* name, unsigned length)
+{
+  unsigned hash = 2166136261u;
+  for (unsigned i = 0; i < length; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+MacroTable* new_macro_table()
+{
+  MacroTable* table = (MacroTable*)malloc(sizeof(MacroTable));
+  table->capacity = initial_macro_table_capacity;
+  table->count = 0;
+  table->entries = (Identifier**)calloc(table->capacity, sizeof(Identifier*));
+  return table;
+}
+
+Preprocessor* new_preprocessor()
+{
+  Preprocessor* preprocessor = new Preprocessor;
+  preprocessor->macros = new_macro_table();
+  preprocessor->main_file_path = nullptr;
+  return preprocessor;
+}
+
+// the slot holding name, or the empty slot it would go in
+static Identifier** find_slot(MacroTable const* table, char const* name, unsigned length, unsigned hash)
+{
+  unsigned mask = table->capacity - 1;
+  for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+    Identifier* entry = table->entries[i];
+    if (!entry || (entry->hash == hash && entry->name.length == length && memcmp(entry->name.pointer, name, length) == 0))
+      return &table->entries[i];
+  }
+}
+
+static void grow_macro_table(MacroTable* table)
+{
+  Identifier** old_entries = table->entries;
+  unsigned old_capacity = table->capacity;
+
+  table->capacity *= 2;
+  table->entries = (Identifier**)calloc(table->capacity, sizeof(Identifier*));
+  for (unsigned i = 0; i < old_capacity; i++)
+    if (old_entries[i])
+      *find_slot(table, old_entries[i]->name.pointer, old_entries[i]->name.length, old_entries[i]->hash) = old_entries[i];
+  free(old_entries);
+}
+
+Identifier* find_identifier(MacroTable const* table, char const* name, unsigned length)
+{
+  return *find_slot(table, name, length, hash_name(name, length));
+}
+
+Identifier* intern_identifier(MacroTable* table, char const* name, unsigned length)
+{
+  unsigned hash = hash_name(name, length);
+  Identifier** slot = find_slot(table, name, length, hash);
+  if (*slot)
+    return *slot;
+
+  // kept under three quarters full, so probing always reaches an empty slot
+  if ((table->count + 1) * 4 > table->capacity * 3) {
+    grow_macro_table(table);
+    slot = find_slot(table, name, length, hash);
+  }
+
+  char* copy = (char*)malloc(length + 1);
+  memcpy(copy, name, length);
+  copy[length] = '\0';
+
+  Identifier* identifier = (Identifier*)malloc(sizeof(Identifier));
+  identifier->name = { copy, length };
+  identifier->hash = hash;
+  identifier->macro = nullptr;
+
+  *slot = identifier;
+  table->count++;
+  return identifier;
+}
+
+static Identifier* intern_token(MacroTable* table, Token const* token)
+{
+  return intern_identifier(table, token->string.c_str(), token->string.size());
+}
+
+static bool hide_set_contains(HideSet const* set, Identifier const* identifier)
+{
+  for (; set; set = set->next)
+    if (set->identifier == identifier)
+      return true;
+  return false;
+}
+
+static bool comes_before(Identifier const* left, Identifier const* right)
+{
+  return (uintptr_t)left < (uintptr_t)right;
+}
+
+static HideSet const* hide_set_union(HideSet const* left, HideSet const* right)
+{
+  if (!left || left == right)
+    return right;
+  if (!right)
+    return left;
+
+  if (left->identifier == right->identifier)
+    return new HideSet { left->identifier, hide_set_union(left->next, right->next) };
+  if (comes_before(left->identifier, right->identifier))
+    return new HideSet { left->identifier, hide_set_union(left->next, right) };
+  return new HideSet { right->identifier, hide_set_union(left, right->next) };
+}
+
+static HideSet const* hide_set_intersection(HideSet const* left, HideSet const* right)
+{
+  if (!left || !right)
+    return nullptr;
+  if (left == right)
+    return left;
+
+  if (left->identifier == right->identifier)
+    return new HideSet { left->identifier, hide_set_intersection(left->next, right->next) };
+  if (comes_before(left->identifier, right->identifier))
+    return hide_set_intersection(left->next, right);
+  return hide_set_intersection(left, right->next);
+}
+
+static HideSet const* hide_set_add(HideSet const* set, Identifier const* identifier)
+{
+  if (hide_set_contains(set, identifier))
+    return set;
+  return hide_set_union(set, new HideSet { identifier, nullptr });
+}
+
+// include guards, what GCC calls the controlling macro and clang the multiple
+// include optimization
+//
+// a file whose every token and directive is inside
+//
+//   #ifndef X              or #if !defined X, or #if !defined(X)
+//   ...
+//   #endif
+//
+// reads as nothing while X is defined. The first time through a file, the
+// lexer watches for that shape: the guard's #ifndef has to come before
+// anything else in the file, and nothing but whitespace and comments after
+// its #endif. The file is then recorded as guarded by X, and including it
+// again while X is defined skips it without opening or lexing it
+
+static IncludedFile* current_included_file(Lexer* lexer)
+{
+  return lexer->included_files.empty() ? nullptr : &lexer->included_files.back();
+}
+
+// something outside of every conditional the file opened can't be guarded
+static void note_outside_guard(Lexer* lexer)
+{
+  IncludedFile* file = current_included_file(lexer);
+  if (file && lexer->conditionals.size() == file->conditional_depth)
+    file->guard_state = IncludeGuardState::NotGuarded;
+}
+
+// the guard macro if the directive can start an include guard, otherwise ""
+static std::string guard_macro(std::string const& directive, std::vector<Token> const* line)
+{
+  if (directive == "ifndef" && line->size() == 1 && (*line)[0].type == TokenType::Identifier)
+    return (*line)[0].string;
+
+  if (directive != "if" || line->size() < 3 || (*line)[0].type != TokenType::Bang || (*line)[1].string != "defined")
+    return "";
+  if (line->size() == 3 && (*line)[2].type == TokenType::Identifier)
+    return (*line)[2].string;
+  if (line->size() == 5 && (*line)[2].type == TokenType::LParen && (*line)[3].type == TokenType::Identifier
+      && (*line)[4].type == TokenType::RParen)
+    return (*line)[3].string;
+  return "";
+}
+
+// called for every directive before it's carried out, with the rest of its line
+static void note_directive(Lexer* lexer, std::string const& directive, std::vector<Token> const* line)
+{
+  IncludedFile* file = current_included_file(lexer);
+  if (!file)
+    return;
+
+  if (file->guard_state == IncludeGuardState::NothingYet && lexer->conditionals.size() == file->conditional_depth) {
+    std::string macro = guard_macro(directive, line);
+    if (!macro.empty()) {
+      file->guard_state = IncludeGuardState::InsideGuard;
+      file->guard_macro = macro;
+      return;
+    }
+  }
+  note_outside_guard(lexer);
+
+  // the file is something even with the guard macro defined
+  bool on_guard = file->guard_state == IncludeGuardState::InsideGuard && lexer->conditionals.size() == file->conditional_depth + 1;
+  if (on_guard && (directive == "else" || directive == "elif"))
+    file->guard_state = IncludeGuardState::NotGuarded;
+}
+
+static void end_conditional(Lexer* lexer)
+{
+  lexer->conditionals.pop_back();
+
+  IncludedFile* file = current_included_file(lexer);
+  if (file && file->guard_state == IncludeGuardState::InsideGuard && lexer->conditionals.size() == file->conditional_depth)
+    file->guard_state = IncludeGuardState::AfterGuard;
+}
+
+// back to the file that included this one
+static void leave_included_file(Lexer* lexer)
+{
+  IncludedFile* file = &lexer->included_files.back();
+  if (lexer->conditionals.size() != file->conditional_depth)
+    error_token(lexer, "unterminated conditional directive");
+
+  if (file->guard_state == IncludeGuardState::AfterGuard) {
+    std::lock_guard<std::mutex> lock(file_table.mutex);
+    file->file->guard_macro = file->guard_macro;
+  }
+
+  lexer->current_filepath = file->return_filepath;
+  lexer->current_location = file->return_location;
+  lexer->current_line = file->return_line;
+  lexer->current_column = file->return_column;
+  lexer->at_start_of_line = false;
+  lexer->file_tokens = file->return_file_tokens;
+  lexer->next_file_token = file->return_next_file_token;
+  lexer->included_files.pop_back();
+}
+
+// the file being lexed comes from its tokens, if it was lexed ahead of time,
+// or from its text. Either way these see the same tokens and the same lines
+
+static Token raw_next_token(Lexer* lexer)
+{
+  if (!lexer->file_tokens)
+    return lex_next_token(lexer);
+
+  Token const* token = &(*lexer->file_tokens)[lexer->next_file_token];
+  if (token->type != TokenType::Eof)
+    lexer->next_file_token++;
+
+  // for error messages
+  lexer->beginning_of_token_line = token->line;
+  lexer->beginning_of_token_column = token->column;
+  return *token;
+}
+
+static bool raw_at_end_of_line(Lexer* lexer)
+{
+  if (!lexer->file_tokens)
+    return lexer_at_end_of_line(lexer);
+
+  Token const* token = &(*lexer->file_tokens)[lexer->next_file_token];
+  return token->starts_line || token->type == TokenType::Eof;
+}
+
+// stops before the # of the next directive
+static void raw_skip_to_next_directive(Lexer* lexer)
+{
+  if (!lexer->file_tokens) {
+    skip_to_next_directive(lexer);
+    return;
+  }
+
+  for (;; lexer->next_file_token++) {
+    Token const* token = &(*lexer->file_tokens)[lexer->next_file_token];
+    if (token->type == TokenType::Eof || (token->type == TokenType::Hash && token->starts_line))
+      return;
+  }
+}
+
+static void run_directive(Lexer* lexer);
+
+// the next token from an expansion or the files, carrying out the directives
+// on the way
+static Token next_unexpanded_token(Lexer* lexer)
+{
+  for (;;) {
+    if (!lexer->pending_tokens.empty()) {
+      Token token = lexer->pending_tokens.back();
+      lexer->pending_tokens.pop_back();
+      return token;
+    }
+
+    // tokens out of an expansion never start a line, so only a # from the
+    // file can start a directive
+    Token token = raw_next_token(lexer);
+    if (token.type == TokenType::Hash && token.starts_line) {
+      run_directive(lexer);
+      continue;
+    }
+
+    if (token.type == TokenType::Eof && !lexer->included_files.empty()) {
+      leave_included_file(lexer);
+      continue;
+    }
+    if (token.type == TokenType::Eof && !lexer->conditionals.empty())
+      error_token(lexer, "unterminated conditional directive");
+
+    if (token.type != TokenType::Eof)
+      note_outside_guard(lexer);
+    return token;
+  }
+}
+
+// the rest of the directive's line
+static std::vector<Token> read_directive_line(Lexer* lexer)
+{
+  std::vector<Token> tokens;
+  while (!raw_at_end_of_line(lexer))
+    tokens.push_back(raw_next_token(lexer));
+  return tokens;
+}
+
+static bool macros_equal(Macro const* left, Macro const* right)
+{
+  if (left->is_function_like != right->is_function_like || left->is_variadic != right->is_variadic
+      || left->parameter_count != right->parameter_count || left->body.size() != right->body.size())
+    return false;
+
+  for (unsigned i = 0; i < left->body.size(); i++)
+    if (!token_equals(&left->body[i], &right->body[i]) || left->body_parameters[i] != right->body_parameters[i])
+      return false;
+  return true;
+}
+
+// only a ( right up against the name makes a macro function-like,
+// #define f (x) is an object-like macro expanding to (x)
+static bool is_right_after(Token const* token, Token const* name)
+{
+  return token->line == name->line && token->column == name->column + name->string.size();
+}
+
+// 6.10.3 #define identifier replacement-list
+//        #define identifier( identifier-list(opt) ) replacement-list
+//        #define identifier( ... ) replacement-list
+//        #define identifier( identifier-list , ... ) replacement-list
+static void define_macro(Lexer* lexer, std::vector<Token> const* line)
+{
+  if (line->empty() || (*line)[0].type != TokenType::Identifier)
+    error_token(lexer, "macro names must be identifiers");
+
+  Token const* name = &(*line)[0];
+  Macro* macro = new Macro;
+  macro->is_function_like = false;
+  macro->is_variadic = false;
+
+  std::vector<Identifier const*> parameters;
+  unsigned i = 1;
+  if (i < line->size() && (*line)[i].type == TokenType::LParen && is_right_after(&(*line)[i], name)) {
+    macro->is_function_like = true;
+    for (i++; i < line->size() && (*line)[i].type != TokenType::RParen; i++) {
+      if (!parameters.empty()) {
+        if ((*line)[i].type != TokenType::Comma || ++i >= line->size())
+          error_token(lexer, "expected comma in macro parameter list");
+      }
+
+      if ((*line)[i].type == TokenType::Ellipsis) {
+        macro->is_variadic = true;
+        parameters.push_back(intern_identifier(lexer->preprocessor->macros, "__VA_ARGS__", strlen("__VA_ARGS__")));
+        i++;
+        break;
+      }
+
+      if ((*line)[i].type != TokenType::Identifier)
+        error_token(lexer, "invalid token in macro parameter list");
+      parameters.push_back(intern_token(lexer->preprocessor->macros, &(*line)[i]));
+    }
+
+    if (i >= line->size() || (*line)[i].type != TokenType::RParen)
+      error_token(lexer, "missing ) in macro parameter list");
+    i++;
+  }
+  macro->parameter_count = parameters.size();
+
+  for (; i < line->size(); i++) {
+    Token token = (*line)[i];
+    int parameter = -1;
+    if (token.type == TokenType::Identifier) {
+      Identifier const* identifier = intern_token(lexer->preprocessor->macros, &token);
+      for (unsigned j = 0; j < parameters.size(); j++)
+        if (parameters[j] == identifier)
+          parameter = j;
+    }
+    macro->body.push_back(token);
+    macro->body_parameters.push_back(parameter);
+  }
+
+  unsigned body_size = macro->body.size();
+  if (body_size && (macro->body[0].type == TokenType::HashHash || macro->body[body_size - 1].type == TokenType::HashHash))
+    error_token(lexer, "'##' cannot appear at either end of a macro expansion");
+
+  // string literals aren't lexed yet, so there's nothing for # to make
+  if (macro->is_function_like)
+    for (Token const& token : macro->body)
+      if (token.type == TokenType::Hash)
+        error_token(lexer, "'#' in a function-like macro isn't supported, string literals aren't lexed yet");
+
+  Identifier* identifier = intern_token(lexer->preprocessor->macros, name);
+  if (identifier->macro && !macros_equal(identifier->macro, macro))
+    fprintf(stderr, "warning: %s redefined on line %u\n", identifier->name.pointer, name->line);
+  identifier->macro = macro;
+}
+
+// 6.10.3.5 #undef identifier
+static void undefine_macro(Lexer* lexer, std::vector<Token> const* line)
+{
+  if (line->empty() || (*line)[0].type != TokenType::Identifier)
+    error_token(lexer, "macro names must be identifiers");
+
+  Identifier* identifier = find_identifier(lexer->preprocessor->macros, (*line)[0].string.c_str(), (*line)[0].string.size());
+  if (identifier)
+    identifier->macro = nullptr;
+}
+
+static char* read_whole_file(char const* path)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return nullptr;
+
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  char* contents = (char*)malloc(size + 1);
+  size_t bytes_read = fread(contents, 1, size, file);
+  contents[bytes_read] = '\0';
+  fclose(file);
+  return contents;
+}
+
+// the lexer needs a '\0' after the text, which the rest of the last page
+// provides, unless the file fills it exactly. Those are read instead
+static char const* map_file(char const* path, off_t size)
+{
+  if (size % sysconf(_SC_PAGESIZE) == 0)
+    return read_whole_file(path);
+
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0)
+    return nullptr;
+  void* contents = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  close(descriptor);
+  return contents == MAP_FAILED ? read_whole_file(path) : (char const*)contents;
+}
+
+// the file at path, read the first time any path leads to it, and again if
+// it has changed since. Null if there isn't one
+static FileEntry* lookup_file(std::string const& path)
+{
+  struct stat status;
+  if (stat(path.c_str(), &status) != 0 || !S_ISREG(status.st_mode))
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(file_table.mutex);
+  std::pair<dev_t, ino_t> key = { status.st_dev, status.st_ino };
+  if (file_table.by_inode.contains(key)) {
+    FileEntry* file = file_table.by_inode.at(key);
+    if (file->modification_time.tv_sec == status.st_mtim.tv_sec && file->modification_time.tv_nsec == status.st_mtim.tv_nsec)
+      return file;
+  }
+
+  char const* contents = map_file(path.c_str(), status.st_size);
+  if (!contents)
+    return nullptr;
+
+  // an entry for an older version of the file stays around, lexers can still
+  // be reading its tokens
+  FileEntry* file = new FileEntry;
+  file->path = strdup(path.c_str());
+  file->device = status.st_dev;
+  file->inode = status.st_ino;
+  file->modification_time = status.st_mtim;
+  file->contents = contents;
+  file->is_pragma_once = false;
+  file->lexes = false;
+  file_table.by_inode[key] = file;
+  file_table.statistics.files_read++;
+  return file;
+}
+
+// lexes the whole file, without preprocessing it, the way
+// next_unexpanded_token and run_directive would lex it. Directive lines are
+// lexed by lines, so starts_line marks where each ends, and the name after
+// #include is a HeaderName. False if the file doesn't lex, including in
+// groups a conditional might leave out
+static bool lex_file_ahead(FileEntry* file, std::vector<Token>* tokens)
+{
+  Lexer lexer = new_lexer(file->contents);
+  lexer.is_lexing_ahead = true;
+
+  for (;;) {
+    Token token = lex_next_token(&lexer);
+    if (token.type == TokenType::Error)
+      return false;
+    tokens->push_back(token);
+    if (token.type == TokenType::Eof)
+      return true;
+    if (token.type != TokenType::Hash || !token.starts_line)
+      continue;
+
+    for (bool is_name = true; !lexer_at_end_of_line(&lexer); is_name = false) {
+      Token directive_token = lex_next_token(&lexer);
+      if (directive_token.type == TokenType::Error)
+        return false;
+      directive_token.starts_line = false;
+      tokens->push_back(directive_token);
+
+      if (is_name && directive_token.type == TokenType::Identifier && directive_token.string == "include") {
+        std::string name;
+        bool is_angled;
+        if (!lex_header_name(&lexer, &name, &is_angled))
+          return false;
+        name = is_angled ? "<" + name + ">" : "\"" + name + "\"";
+        tokens->push_back(make_token(TokenType::HeaderName, directive_token.line, directive_token.column, name));
+      }
+    }
+  }
+}
+
+// the file's tokens, lexed by whichever translation unit included it first.
+// Null if it doesn't lex
+static std::vector<Token> const* lexed_ahead(FileEntry* file)
+{
+  bool lexed_now = false;
+  std::call_once(file->lexed_ahead, [file, &lexed_now] {
+    file->lexes = lex_file_ahead(file, &file->tokens);
+    lexed_now = true;
+  });
+
+  if (!file->lexes)
+    return nullptr;
+  if (!lexed_now) {
+    std::lock_guard<std::mutex> lock(file_table.mutex);
+    file_table.statistics.includes_from_token_cache++;
+  }
+  return &file->tokens;
+}
+
+static std::string directory_of(char const* path)
+{
+  char const* slash = strrchr(path, '/');
+  return slash ? std::string(path, slash + 1) : "";
+}
+
+// "file" is looked for next to the file including it first, then both are
+// looked for in the -I directories
+static FileEntry* find_include(Lexer* lexer, std::string const& name, bool is_angled)
+{
+  if (name[0] == '/')
+    return lookup_file(name);
+
+  if (!is_angled) {
+    IncludedFile const* including = current_included_file(lexer);
+    char const* including_path = including ? including->file->path : lexer->preprocessor->main_file_path;
+    FileEntry* file = lookup_file((including_path ? directory_of(including_path) : "") + name);
+    if (file)
+      return file;
+  }
+
+  for (std::string const& directory : file_table.include_directories) {
+    FileEntry* file = lookup_file(directory + "/" + name);
+    if (file)
+      return file;
+  }
+  return nullptr;
+}
+
+// 6.10.2 #include "file"
+//        #include <file>
+static void include_file(Lexer* lexer)
+{
+  std::string name;
+  bool is_angled;
+  if (lexer->file_tokens) {
+    Token header_name = raw_next_token(lexer);
+    assert(header_name.type == TokenType::HeaderName);
+    name = header_name.string.substr(1, header_name.string.size() - 2);
+    is_angled = header_name.string[0] == '<';
+  } else if (!lex_header_name(lexer, &name, &is_angled)) {
+    error_token(lexer, "expected \"FILENAME\" or <FILENAME>");
+  }
+  if (name.empty())
+    error_token(lexer, "empty filename in #include");
+  if (!raw_at_end_of_line(lexer))
+    error_token(lexer, "extra tokens at end of #include directive");
+  if (lexer->included_files.size() >= maximum_include_depth)
+    error_token(lexer, "#include nested too deeply");
+
+  FileEntry* file = find_include(lexer, name, is_angled);
+  if (!file)
+    error_token(lexer, "file not found");
+
+  Preprocessor* preprocessor = lexer->preprocessor;
+  std::unique_lock<std::mutex> lock(file_table.mutex);
+  if (file->is_pragma_once && preprocessor->included_files.contains(file)) {
+    file_table.statistics.includes_skipped_by_pragma_once++;
+    return;
+  }
+  if (!file->guard_macro.empty()) {
+    Identifier const* guard = find_identifier(preprocessor->macros, file->guard_macro.c_str(), file->guard_macro.size());
+    if (guard && guard->macro) {
+      file_table.statistics.includes_skipped_by_guard++;
+      return;
+    }
+  }
+  lock.unlock();
+  preprocessor->included_files.insert(file);
+
+  IncludedFile included;
+  included.file = file;
+  included.return_filepath = lexer->current_filepath;
+  included.return_location = lexer->current_location;
+  included.return_line = lexer->current_line;
+  included.return_column = lexer->current_column;
+  included.conditional_depth = lexer->conditionals.size();
+  included.guard_state = IncludeGuardState::NothingYet;
+  included.return_file_tokens = lexer->file_tokens;
+  included.return_next_file_token = lexer->next_file_token;
+  lexer->included_files.push_back(included);
+
+  lexer->file_tokens = lexed_ahead(file);
+  lexer->next_file_token = 0;
+
+  lexer->current_filepath = file->path;
+  lexer->current_location = file->contents;
+  lexer->current_line = 0;
+  lexer->current_column = 0;
+  lexer->at_start_of_line = true;
+}
+
+static std::vector<Token> expand_tokens(Lexer*, std::vector<Token> const*);
+
+struct ConditionParser {
+  Lexer* lexer;
+  std::vector<Token> tokens;
+  unsigned next;
+};
+
+static TokenType peek_condition_token(ConditionParser const* parser)
+{
+  return parser->next < parser->tokens.size() ? parser->tokens[parser->next].type : TokenType::Eof;
+}
+
+static void expect_condition_token(ConditionParser* parser, TokenType type, char const* error_message)
+{
+  if (peek_condition_token(parser) != type)
+    error_token(parser->lexer, error_message);
+  parser->next++;
+}
+
+static long long parse_condition(ConditionParser*);
+
+static long long parse_condition_unary(ConditionParser* parser)
+{
+  TokenType type = peek_condition_token(parser);
+  Token const* token = parser->next < parser->tokens.size() ? &parser->tokens[parser->next] : nullptr;
+  parser->next++;
+
+  switch (type) {
+  case TokenType::Bang:
+    return !parse_condition_unary(parser);
+  case TokenType::Tilde:
+    return ~parse_condition_unary(parser);
+  case TokenType::Minus:
+    return -parse_condition_unary(parser);
+  case TokenType::Plus:
+    return parse_condition_unary(parser);
+
+  case TokenType::LParen: {
+    long long value = parse_condition(parser);
+    expect_condition_token(parser, TokenType::RParen, "missing ) in preprocessor expression");
+    return value;
+  }
+
+  case TokenType::Number: {
+    char* end;
+    long long value = strtoull(token->string.c_str(), &end, 0);
+    if (*end != '\0')
+      error_token(parser->lexer, "invalid integer in preprocessor expression");
+    return value;
+  }
+
+  default:
+    error_token(parser->lexer, "expected value in preprocessor expression");
+    return 0;
+  }
+}
+
+// 0 for tokens that aren't binary operators
+static unsigned binary_precedence(TokenType type)
+{
+  switch (type) {
+  case TokenType::LogicalOr:
+    return 1;
+  case TokenType::LogicalAnd:
+    return 2;
+  case TokenType::Pipe:
+    return 3;
+  case TokenType::Caret:
+    return 4;
+  case TokenType::Ampersand:
+    return 5;
+  case TokenType::DoubleEquals:
+  case TokenType::NotEquals:
+    return 6;
+  case TokenType::LessThan:
+  case TokenType::GreaterThan:
+  case TokenType::LessThanOrEqualTo:
+  case TokenType::GreaterThanOrEqualTo:
+    return 7;
+  case TokenType::BitShiftLeft:
+  case TokenType::BitShiftRight:
+    return 8;
+  case TokenType::Plus:
+  case TokenType::Minus:
+    return 9;
+  case TokenType::Asterisk:
+  case TokenType::ForwardSlash:
+  case TokenType::Modulo:
+    return 10;
+  default:
+    return 0;
+  }
+}
+
+static long long apply_binary_operator(TokenType type, long long left, long long right)
+{
+  switch (type) {
+  case TokenType::LogicalOr:
+    return left || right;
+  case TokenType::LogicalAnd:
+    return left && right;
+  case TokenType::Pipe:
+    return left | right;
+  case TokenType::Caret:
+    return left ^ right;
+  case TokenType::Ampersand:
+    return left & right;
+  case TokenType::DoubleEquals:
+    return left == right;
+  case TokenType::NotEquals:
+    return left != right;
+  case TokenType::LessThan:
+    return left < right;
+  case TokenType::GreaterThan:
+    return left > right;
+  case TokenType::LessThanOrEqualTo:
+    return left <= right;
+  case TokenType::GreaterThanOrEqualTo:
+    return left >= right;
+  case TokenType::BitShiftLeft:
+    return left << right;
+  case TokenType::BitShiftRight:
+    return left >> right;
+  case TokenType::Plus:
+    return left + right;
+  case TokenType::Minus:
+    return left - right;
+  case TokenType::Asterisk:
+    return left * right;
+  // both sides are always evaluated, so a division by zero can be on the side
+  // of a && that doesn't count
+  case TokenType::ForwardSlash:
+    return right ? left / right : 0;
+  case TokenType::Modulo:
+    return right ? left % right : 0;
+  default:
+    assert(false && "not a binary operator");
+    return 0;
+  }
+}
+
+static long long parse_condition_binary(ConditionParser* parser, unsigned minimum_precedence)
+{
+  long long left = parse_condition_unary(parser);
+  for (;;) {
+    TokenType type = peek_condition_token(parser);
+    unsigned precedence = binary_precedence(type);
+    if (!precedence || precedence < minimum_precedence)
+      return left;
+
+    parser->next++;
+    long long right = parse_condition_binary(parser, precedence + 1);
+    left = apply_binary_operator(type, left, right);
+  }
+}
+
+static long long parse_condition(ConditionParser* parser)
+{
+  long long condition = parse_condition_binary(parser, 1);
+  if (peek_condition_token(parser) != TokenType::QuestionMark)
+    return condition;
+
+  parser->next++;
+  long long if_true = parse_condition(parser);
+  expect_condition_token(parser, TokenType::Colon, "expected : in preprocessor expression");
+  long long if_false = parse_condition(parser);
+  return condition ? if_true : if_false;
+}
+
+static bool is_integer_suffix(std::string const& string)
+{
+  return !string.empty() && string.find_first_not_of("uUlL") == std::string::npos;
+}
+
+// 6.10.1 the expression of an #if or #elif. Names still there after macros
+// are expanded are 0
+static bool evaluate_condition(Lexer* lexer, std::vector<Token> const* line)
+{
+  // defined X and defined(X) go first, so X isn't expanded
+  std::vector<Token> replaced;
+  for (unsigned i = 0; i < line->size(); i++) {
+    Token const* token = &(*line)[i];
+    if (token->type != TokenType::Identifier || token->string != "defined") {
+      replaced.push_back(*token);
+      continue;
+    }
+
+    bool is_parenthesized = i + 1 < line->size() && (*line)[i + 1].type == TokenType::LParen;
+    unsigned name = i + 1 + is_parenthesized;
+    if (name >= line->size() || (*line)[name].type != TokenType::Identifier)
+      error_token(lexer, "macro names must be identifiers");
+    if (is_parenthesized && (name + 1 >= line->size() || (*line)[name + 1].type != TokenType::RParen))
+      error_token(lexer, "missing ) after defined");
+
+    Identifier const* identifier = find_identifier(lexer->preprocessor->macros, (*line)[name].string.c_str(), (*line)[name].string.size());
+    replaced.push_back(make_token(TokenType::Number, token->line, token->column, identifier && identifier->macro ? "1" : "0"));
+    i = name + is_parenthesized;
+  }
+
+  ConditionParser parser;
+  parser.lexer = lexer;
+  parser.next = 0;
+  for (Token token : expand_tokens(lexer, &replaced)) {
+    // the lexer lexes 1u as 1 and u, and x-1 as x and -1
+    bool follows_number = !parser.tokens.empty() && parser.tokens.back().type == TokenType::Number;
+    if (token.type == TokenType::Identifier && follows_number && is_integer_suffix(token.string))
+      continue;
+    if (token.type == TokenType::Number && (token.string[0] == '-' || token.string[0] == '+')) {
+      parser.tokens.push_back(make_token(token.string[0] == '-' ? TokenType::Minus : TokenType::Plus, token.line, token.column));
+      token.string.erase(0, 1);
+    }
+
+    char first = token_spelling(&token)[0];
+    bool is_name = (first >= 'a' && first <= 'z') || (first >= 'A' && first <= 'Z') || first == '_';
+    if (is_name)
+      token = make_token(TokenType::Number, token.line, token.column, "0");
+    parser.tokens.push_back(token);
+  }
+
+  long long value = parse_condition(&parser);
+  if (parser.next != parser.tokens.size())
+    error_token(lexer, "extra tokens in preprocessor expression");
+  return value != 0;
+}
+
+static void check_inside_conditional(Lexer* lexer, char const* error_message)
+{
+  IncludedFile const* file = current_included_file(lexer);
+  if (lexer->conditionals.size() == (file ? file->conditional_depth : 0))
+    error_token(lexer, error_message);
+}
+
+// skips the lines of a group that isn't kept, up to the #elif or #else whose
+// group is, or the #endif. Conditionals inside it are skipped whole
+static void skip_group(Lexer* lexer)
+{
+  unsigned depth = 0;
+  for (;;) {
+    // the end of the file reports the missing #endif
+    raw_skip_to_next_directive(lexer);
+    TokenType hash = raw_next_token(lexer).type;
+    if (hash == TokenType::Eof)
+      return;
+    if (hash != TokenType::Hash || raw_at_end_of_line(lexer))
+      continue;
+
+    Token name_token = raw_next_token(lexer);
+    std::string name = token_spelling(&name_token);
+    if (name == "if" || name == "ifdef" || name == "ifndef") {
+      depth++;
+      continue;
+    }
+    if (depth) {
+      depth -= name == "endif";
+      continue;
+    }
+    if (name != "endif" && name != "else" && name != "elif")
+      continue;
+
+    std::vector<Token> none;
+    note_directive(lexer, name, &none);
+    if (name == "endif") {
+      end_conditional(lexer);
+      return;
+    }
+
+    Conditional* conditional = &lexer->conditionals.back();
+    if (conditional->seen_else)
+      error_token(lexer, "#else or #elif after #else");
+    conditional->seen_else = name == "else";
+
+    bool keep = name == "else";
+    if (name == "elif" && !conditional->taken) {
+      std::vector<Token> line = read_directive_line(lexer);
+      keep = evaluate_condition(lexer, &line);
+    }
+    if (keep && !conditional->taken) {
+      conditional->taken = true;
+      return;
+    }
+  }
+}
+
+// 6.10.1 #if, #ifdef and #ifndef
+static void begin_conditional(Lexer* lexer, std::string const& directive, std::vector<Token> const* line)
+{
+  bool condition;
+  if (directive == "if") {
+    condition = evaluate_condition(lexer, line);
+  } else {
+    if (line->size() != 1 || (*line)[0].type != TokenType::Identifier)
+      error_token(lexer, "macro names must be identifiers");
+    Identifier const* identifier = find_identifier(lexer->preprocessor->macros, (*line)[0].string.c_str(), (*line)[0].string.size());
+    condition = (identifier && identifier->macro) == (directive == "ifdef");
+  }
+
+  lexer->conditionals.push_back({ condition, false });
+  if (!condition)
+    skip_group(lexer);
+}
+
+// called with the # just read
+static void run_directive(Lexer* lexer)
+{
+  // a # on its own does nothing
+  if (raw_at_end_of_line(lexer))
+    return;
+
+  Token name_token = raw_next_token(lexer);
+  std::string name = token_spelling(&name_token);
+
+  // the file name isn't made of tokens
+  if (name == "include") {
+    note_outside_guard(lexer);
+    include_file(lexer);
+    return;
+  }
+  if (name == "error")
+    error_token(lexer, "#error");
+
+  std::vector<Token> line = read_directive_line(lexer);
+  note_directive(lexer, name, &line);
+
+  if (name == "define") {
+    define_macro(lexer, &line);
+  } else if (name == "undef") {
+    undefine_macro(lexer, &line);
+  } else if (name == "if" || name == "ifdef" || name == "ifndef") {
+    begin_conditional(lexer, name, &line);
+  } else if (name == "elif" || name == "else") {
+    check_inside_conditional(lexer, "#else or #elif without #if");
+    if (lexer->conditionals.back().seen_else)
+      error_token(lexer, "#else or #elif after #else");
+    lexer->conditionals.back().seen_else = name == "else";
+
+    // the group before this one was kept, so this and the rest aren't
+    skip_group(lexer);
+  } else if (name == "endif") {
+    check_inside_conditional(lexer, "#endif without #if");
+    end_conditional(lexer);
+  } else if (name == "pragma") {
+    // other pragmas are ignored, like compilers do with the ones they don't know
+    IncludedFile* file = current_included_file(lexer);
+    if (file && line.size() == 1 && line[0].string == "once") {
+      std::lock_guard<std::mutex> lock(file_table.mutex);
+      file->file->is_pragma_once = true;
+    }
+  } else {
+    error_token(lexer, "unknown preprocessing directive");
+  }
+}
+
+// the arguments of a call to a function-like macro, read up to the ) closing
+// the call, which is returned. Commas inside parentheses don't separate
+// arguments, nor do the ones going into __VA_ARGS__
+static Token collect_arguments(Lexer* lexer, Macro const* macro, std::vector<std::vector<Token>>* arguments)
+{
+  arguments->push_back({});
+  unsigned depth = 0;
+  for (;;) {
+    Token token = next_unexpanded_token(lexer);
+    if (token.type == TokenType::Eof)
+      error_token(lexer, "unterminated call to a function-like macro");
+
+    if (depth == 0 && token.type == TokenType::RParen) {
+      // f() is one empty argument, unless f takes none
+      if (macro->parameter_count == 0 && arguments->size() == 1 && arguments->back().empty())
+        arguments->clear();
+      // and f(x, ...) can be called with nothing for the ...
+      if (macro->is_variadic && arguments->size() + 1 == macro->parameter_count)
+        arguments->push_back({});
+      if (arguments->size() != macro->parameter_count)
+        error_token(lexer, "wrong number of arguments to a function-like macro");
+      return token;
+    }
+
+    if (depth == 0 && token.type == TokenType::Comma && !(macro->is_variadic && arguments->size() == macro->parameter_count)) {
+      arguments->push_back({});
+      continue;
+    }
+
+    if (token.type == TokenType::LParen)
+      depth++;
+    if (token.type == TokenType::RParen)
+      depth--;
+    token.starts_line = false;
+    arguments->back().push_back(token);
+  }
+}
+
+// an argument is expanded completely on its own before it's substituted, as
+// if it was all that was left of the file, and so is the expression of an
+// #if. An end of file behind it stops the expansion from reading past it
+static std::vector<Token> expand_tokens(Lexer* lexer, std::vector<Token> const* argument)
+{
+  std::vector<Token> rest;
+  rest.swap(lexer->pending_tokens);
+
+  lexer->pending_tokens.push_back(make_token(TokenType::Eof, 0, 0));
+  lexer->pending_tokens.insert(lexer->pending_tokens.end(), argument->rbegin(), argument->rend());
+
+  std::vector<Token> expanded;
+  for (Token token = preprocess_next_token(lexer); token.type != TokenType::Eof; token = preprocess_next_token(lexer))
+    expanded.push_back(token);
+
+  assert(lexer->pending_tokens.empty());
+  lexer->pending_tokens.swap(rest);
+  return expanded;
+}
+
+// 6.10.3.3 the ## operator, glues the spelling of left and right together and
+// lexes that again
+static Token paste_tokens(Lexer* lexer, Token const* left, Token const* right)
+{
+  // the lexer keeps pointers into its text, so it has to stay around
+  char const* text = strdup((std::string(token_spelling(left)) + token_spelling(right)).c_str());
+  Lexer paste_lexer = new_lexer(text, lexer->preprocessor);
+
+  Token token = lex_next_token(&paste_lexer);
+  if (lex_next_token(&paste_lexer).type != TokenType::Eof)
+    error_token(lexer, "pasting doesn't give a valid token");
+
+  token.hide_set = hide_set_intersection(left->hide_set, right->hide_set);
+  return token;
+}
+
+// the macro's body with its parameters replaced by the arguments. Parameters
+// next to ## are replaced by the argument as written, others by the argument
+// after expansion. An empty argument next to ## is a placemarker, which
+// pastes to whatever is on the other side
+static std::vector<Token> substitute(Lexer* lexer, Macro const* macro, std::vector<std::vector<Token>> const* arguments)
+{
+  std::vector<std::vector<Token>> expanded_arguments(macro->parameter_count);
+  std::vector<bool> is_expanded(macro->parameter_count, false);
+
+  std::vector<Token> result;
+  bool ends_in_placemarker = false;
+  unsigned body_size = macro->body.size();
+  for (unsigned i = 0; i < body_size; i++) {
+    Token const* token = &macro->body[i];
+    int parameter = macro->body_parameters[i];
+
+    if (token->type == TokenType::HashHash) {
+      i++;
+      std::vector<Token> right;
+      if (macro->body_parameters[i] >= 0)
+        right = (*arguments)[macro->body_parameters[i]];
+      else
+        right.push_back(macro->body[i]);
+
+      if (right.empty())
+        continue;
+      if (ends_in_placemarker || result.empty()) {
+        result.insert(result.end(), right.begin(), right.end());
+      } else {
+        result.back() = paste_tokens(lexer, &result.back(), &right[0]);
+        result.insert(result.end(), right.begin() + 1, right.end());
+      }
+      ends_in_placemarker = false;
+      continue;
+    }
+
+    ends_in_placemarker = false;
+    if (parameter < 0) {
+      result.push_back(*token);
+      continue;
+    }
+
+    if (i + 1 < body_size && macro->body[i + 1].type == TokenType::HashHash) {
+      std::vector<Token> const* argument = &(*arguments)[parameter];
+      result.insert(result.end(), argument->begin(), argument->end());
+      ends_in_placemarker = argument->empty();
+      continue;
+    }
+
+    if (!is_expanded[parameter]) {
+      expanded_arguments[parameter] = expand_tokens(lexer, &(*arguments)[parameter]);
+      is_expanded[parameter] = true;
+    }
+    result.insert(result.end(), expanded_arguments[parameter].begin(), expanded_arguments[parameter].end());
+  }
+  return result;
+}
+
+// the expansion is read next. Its tokens are placed where the macro name was,
+// for error messages
+static void push_expansion(Lexer* lexer, std::vector<Token> const* expansion, Token const* name, HideSet const* hide_set)
+{
+  for (auto token = expansion->rbegin(); token != expansion->rend(); token++) {
+    Token expanded = *token;
+    expanded.line = name->line;
+    expanded.column = name->column;
+    expanded.starts_line = false;
+    expanded.hide_set = hide_set_union(expanded.hide_set, hide_set);
+    lexer->pending_tokens.push_back(expanded);
+  }
+}
+
+// false if name is a function-like macro that isn't being called
+static bool expand_macro(Lexer* lexer, Token const* name, Identifier const* identifier)
+{
+  Macro const* macro = identifier->macro;
+  if (!macro->is_function_like) {
+    std::vector<Token> expansion = substitute(lexer, macro, nullptr);
+    push_expansion(lexer, &expansion, name, hide_set_add(name->hide_set, identifier));
+    return true;
+  }
+
+  Token next = next_unexpanded_token(lexer);
+  if (next.type != TokenType::LParen) {
+    lexer->pending_tokens.push_back(next);
+    return false;
+  }
+
+  std::vector<std::vector<Token>> arguments;
+  Token closing = collect_arguments(lexer, macro, &arguments);
+
+  // a name in the expansion is hidden if it was hidden both where the call
+  // starts and where it ends. Whatever comes from past the ) isn't part of
+  // this call, so it doesn't get to hide anything
+  HideSet const* hide_set = hide_set_add(hide_set_intersection(name->hide_set, closing.hide_set), identifier);
+  std::vector<Token> expansion = substitute(lexer, macro, &arguments);
+  push_expansion(lexer, &expansion, name, hide_set);
+  return true;
+}
+
+Token preprocess_next_token(Lexer* lexer)
+{
+  for (;;) {
+    Token token = next_unexpanded_token(lexer);
+    if (token.type != TokenType::Identifier)
+      return token;
+
+    Identifier const* identifier = find_identifier(lexer->preprocessor->macros, token.string.c_str(), token.string.size());
+    if (!identifier || !identifier->macro || hide_set_contains(token.hide_set, identifier))
+      return token;
+
+    // the expansion is rescanned for more macros on the way around
+    if (!expand_macro(lexer, &token, identifier))
+      return token;
+  }
+}
+
+void add_include_directory(char const* directory)
+{
+  file_table.include_directories.push_back(directory);
+}
+
+void clear_include_directories() { file_table.include_directories.clear(); }
+
+PreprocessorStatistics preprocessor_statistics()
+{
+  std::lock_guard<std::mutex> lock(file_table.mutex);
+  return file_table.statistics;
+}
+
+void reset_preprocessor_statistics()
+{
+  std::lock_guard<std::mutex> lock(file_table.mutex);
+  file_table.statistics = {};
+}
+
+void print_preprocessor_statistics(FILE* outfile)
+{
+  PreprocessorStatistics statistics = preprocessor_statistics();
+  fprintf(outfile, "===-------------------------------------------===\n");
+  fprintf(outfile, "          miniclang preprocessor statistics\n");
+  fprintf(outfile, "===-------------------------------------------===\n");
+  fprintf(outfile, "%8u files read\n", statistics.files_read);
+  fprintf(outfile, "%8u includes lexed by an earlier include\n", statistics.includes_from_token_cache);
+  fprintf(outfile, "%8u includes skipped by include guards\n", statistics.includes_skipped_by_guard);
+  fprintf(outfile, "%8u includes skipped by #pragma once\n", statistics.includes_skipped_by_pragma_once);
+}
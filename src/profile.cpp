@@ -0,0 +1,232 @@
+#include "profile.h"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+// the instrumentation, for a function f with two conditional edges
+//
+//   @__miniclang_profile_counters_f = private global [3 x i64] zeroinitializer
+//   @__miniclang_profile_name_f = private constant [2 x i8] c"f\00"
+//   @__miniclang_profile_data_f = private global { ptr, ptr, i64, i64 }
+//       { ptr @__miniclang_profile_name_f, ptr @__miniclang_profile_counters_f, i64 <hash>, i64 3 },
+//       section "miniclang_profile"
+//
+// counter 0 is bumped at the top of the entry block. Each edge out of a
+// conditional branch or switch gets a prof.edge block of its own that bumps
+// its counter and branches on to where the edge went. The data records all
+// end up next to each other in the miniclang_profile section, which is how
+// the runtime finds them without any registration, the same trick LLVM's
+// __llvm_prf_data section plays. Listing them in @llvm.used keeps LLVM from
+// deleting them for having no users
+//
+// nothing calls into the runtime, so a reference to a variable it defines
+// makes the linker take it out of the library, like clang's reference to
+// __llvm_profile_runtime does
+
+static bool is_conditional(IRInstruction const* terminator)
+{
+  return terminator && (terminator->opcode == IROpcode::CondBr || terminator->opcode == IROpcode::Switch);
+}
+
+static std::vector<IRInstruction*> conditional_terminators(IRFunction const* function)
+{
+  std::vector<IRInstruction*> terminators;
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+    if (is_conditional(ir_block_terminator(block)))
+      terminators.push_back(ir_block_terminator(block));
+  return terminators;
+}
+
+static unsigned count_counters(std::vector<IRInstruction*> const* terminators)
+{
+  unsigned count = 1;
+  for (IRInstruction const* terminator : *terminators)
+    count += terminator->target_count;
+  return count;
+}
+
+// FNV-1a over each block's terminator and how many places it goes
+static unsigned long long control_flow_hash(IRFunction const* function)
+{
+  unsigned long long hash = 14695981039346656037ull;
+  auto mix = [&hash](unsigned long long value) {
+    hash ^= value;
+    hash *= 1099511628211ull;
+  };
+
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next) {
+    IRInstruction const* terminator = ir_block_terminator(block);
+    mix(terminator ? (unsigned long long)terminator->opcode : ULLONG_MAX);
+    mix(terminator ? terminator->target_count : 0);
+  }
+
+  // printed as an i64
+  return hash >> 1;
+}
+
+static char const* profile_symbol(char const* prefix, char const* function_name)
+{
+  return strdup((std::string(prefix) + function_name).c_str());
+}
+
+// the builder only appends, so everything from before on is set aside and put back after
+static void increment_counter(IRBasicBlock* block, IRInstruction* before, IRGlobal* counters, unsigned index)
+{
+  std::vector<IRInstruction*> rest;
+  while (before) {
+    IRInstruction* next = before->next;
+    ir_remove_instruction(before);
+    rest.push_back(before);
+    before = next;
+  }
+
+  IRBuilder builder;
+  builder.function = block->parent;
+  builder.insertion_block = block;
+  IRValue* counter = ir_build_getelementptr(&builder, "i64", ir_global_address(counters), ir_constant("i64", index));
+  // nothing in C can access the counters, so they have a type of their own
+  // that doesn't alias any of the function's loads and stores
+  IRTBAAType const* counter_type = ir_tbaa_type("miniclang profile counter", ir_tbaa_omnipotent_char());
+  IRValue* count = ir_build_load(&builder, "i64", counter);
+  count->instruction->tbaa_type = counter_type;
+  ir_build_store(&builder, ir_build_binary(&builder, IROpcode::Add, count, ir_constant("i64", 1)), counter);
+  block->last_instruction->tbaa_type = counter_type;
+
+  for (IRInstruction* instruction : rest)
+    ir_append_instruction(block, instruction);
+}
+
+static void instrument_function(IRModule* module, IRFunction* function)
+{
+  unsigned long long hash = control_flow_hash(function);
+  std::vector<IRInstruction*> terminators = conditional_terminators(function);
+  unsigned counter_count = count_counters(&terminators);
+
+  std::string array_type = "[" + std::to_string(counter_count) + " x i64]";
+  IRGlobal* counters = new_ir_global(module, profile_symbol("__miniclang_profile_counters_", function->name), strdup(array_type.c_str()),
+      "zeroinitializer");
+  counters->is_private = true;
+
+  std::string name_type = "[" + std::to_string(strlen(function->name) + 1) + " x i8]";
+  std::string name_initializer = std::string("c\"") + function->name + "\\00\"";
+  IRGlobal* name = new_ir_global(module, profile_symbol("__miniclang_profile_name_", function->name), strdup(name_type.c_str()),
+      strdup(name_initializer.c_str()));
+  name->is_private = true;
+  name->is_constant = true;
+
+  std::string data_initializer = std::string("{ ptr @") + name->name + ", ptr @" + counters->name + ", i64 " + std::to_string(hash) + ", i64 "
+      + std::to_string(counter_count) + " }";
+  IRGlobal* data = new_ir_global(module, profile_symbol("__miniclang_profile_data_", function->name), "{ ptr, ptr, i64, i64 }",
+      strdup(data_initializer.c_str()));
+  data->is_private = true;
+  data->section = "miniclang_profile";
+  data->is_used = true;
+
+  IRBasicBlock* entry = function->first_block;
+  IRInstruction* first_non_alloca = entry->first_instruction;
+  while (first_non_alloca && first_non_alloca->opcode == IROpcode::Alloca)
+    first_non_alloca = first_non_alloca->next;
+  increment_counter(entry, first_non_alloca, counters, 0);
+
+  unsigned index = 1;
+  for (IRInstruction* terminator : terminators) {
+    IRBasicBlock* previous = terminator->parent;
+    for (unsigned i = 0; i < terminator->target_count; i++) {
+      IRBasicBlock* edge = insert_ir_basic_block_after(previous, "prof.edge");
+      increment_counter(edge, nullptr, counters, index++);
+
+      IRBuilder builder;
+      builder.function = function;
+      builder.insertion_block = edge;
+      ir_build_br(&builder, terminator->targets[i]);
+
+      terminator->targets[i] = edge;
+      previous = edge;
+    }
+  }
+}
+
+void instrument_ir_module(IRModule* module)
+{
+  bool instrumented = false;
+  for (IRFunction* function = module->first_function; function; function = function->next)
+    if (!ir_function_is_declaration(function)) {
+      instrument_function(module, function);
+      instrumented = true;
+    }
+
+  if (!instrumented)
+    return;
+  new_ir_global(module, "__miniclang_profile_runtime", "i32", nullptr);
+  IRGlobal* user = new_ir_global(module, "__miniclang_profile_runtime_user", "ptr", "@__miniclang_profile_runtime");
+  user->is_private = true;
+  user->is_constant = true;
+  user->is_used = true;
+}
+
+// the format runtime/profile.c writes
+//
+//   miniclang profile
+//   <name> <hash> <number of counts>
+//   <count> <count> ...
+bool read_profile(FILE* file, Profile* profile)
+{
+  char header[32];
+  if (!fgets(header, sizeof(header), file) || strcmp(header, "miniclang profile\n") != 0)
+    return false;
+
+  char name[1024];
+  unsigned long long hash;
+  size_t count;
+  while (fscanf(file, "%1023s %llu %zu", name, &hash, &count) == 3) {
+    FunctionProfile function_profile = { hash, std::vector<unsigned long long>(count) };
+    for (size_t i = 0; i < count; i++)
+      if (fscanf(file, "%llu", &function_profile.counts[i]) != 1)
+        return false;
+    (*profile)[name] = function_profile;
+  }
+  return feof(file);
+}
+
+// branch weights are 32 bit, so counts past that are scaled down the way LLVM does it
+static unsigned long long* branch_weights(unsigned long long const* counts, unsigned count)
+{
+  unsigned long long maximum = 0;
+  for (unsigned i = 0; i < count; i++)
+    maximum = counts[i] > maximum ? counts[i] : maximum;
+
+  // a branch that never ran says nothing about which way it goes
+  if (maximum == 0)
+    return nullptr;
+
+  unsigned long long scale = maximum / UINT_MAX + 1;
+  unsigned long long* weights = (unsigned long long*)malloc(count * sizeof(unsigned long long));
+  for (unsigned i = 0; i < count; i++)
+    weights[i] = counts[i] / scale;
+  return weights;
+}
+
+void apply_profile(IRModule* module, Profile const* profile)
+{
+  for (IRFunction* function = module->first_function; function; function = function->next) {
+    if (ir_function_is_declaration(function) || !profile->contains(function->name))
+      continue;
+
+    FunctionProfile const* function_profile = &profile->at(function->name);
+    std::vector<IRInstruction*> terminators = conditional_terminators(function);
+    if (function_profile->hash != control_flow_hash(function) || function_profile->counts.size() != count_counters(&terminators)) {
+      fprintf(stderr, "warning: the profile for %s doesn't match its code, ignoring it\n", function->name);
+      continue;
+    }
+
+    function->has_entry_count = true;
+    function->entry_count = function_profile->counts[0];
+
+    unsigned index = 1;
+    for (IRInstruction* terminator : terminators) {
+      terminator->branch_weights = branch_weights(&function_profile->counts[index], terminator->target_count);
+      index += terminator->target_count;
+    }
+  }
+}
@@ -0,0 +1,341 @@
+#include "server.h"
+
+#include "compilation_cache.h"
+#include "incremental.h"
+#include "preprocessor.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// the compile server
+//
+// starting a process can cost more than compiling a small file, and a new
+// process starts with nothing cached. The server keeps workers around that
+// have already mapped and lexed the headers, interned the types and so on,
+// and clients hand them command lines over a Unix socket
+//
+// workers are processes rather than threads, since a compile error ends the
+// compile with exit, and each compile runs in its client's working
+// directory. They all accept connections off the one listening socket, so
+// no more compiles run at once than there are workers, and clients past
+// that wait in the listen backlog. A worker that exits is replaced, cold.
+// Each worker has its own caches, they aren't shared between workers.
+// Nothing a compile allocates is freed, there's no telling what of it the
+// caches point into, so a worker is retired after compiles_per_worker
+// compiles rather than growing for the whole build
+//
+// a request is
+//      miniclang request 1
+//      <number of arguments>
+//      the client's working directory, then each argument, each followed by a 0 byte
+// and the reply is
+//      <exit status>
+//      everything the compile printed
+
+static constexpr char request_magic[] = "miniclang request 1\n";
+
+// a command line longer than this is more likely garbage
+static constexpr size_t maximum_request_size = 1 << 20;
+
+// the connection a worker is compiling for and where the compile's output
+// is going, for the reply when a compile error exits
+static int serving_connection = -1;
+static FILE* serving_output;
+
+static volatile sig_atomic_t is_stopping = 0;
+
+// sockets only. A client that's gone shouldn't take the worker with it
+static bool send_all(int connection, char const* data, size_t size)
+{
+  while (size > 0) {
+    ssize_t sent = send(connection, data, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+// until the other end shuts down its side
+static bool receive_all(int connection, std::string* contents, size_t maximum_size)
+{
+  char buffer[65536];
+  for (;;) {
+    ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received < 0)
+      return false;
+    if (received == 0)
+      return true;
+    contents->append(buffer, received);
+    if (contents->size() > maximum_size)
+      return false;
+  }
+}
+
+// false if the path doesn't fit
+static bool socket_address(char const* socket_path, sockaddr_un* address)
+{
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address->sun_path))
+    return false;
+  strcpy(address->sun_path, socket_path);
+  return true;
+}
+
+// -1 if no server is listening
+static int connect_to_server(char const* socket_path)
+{
+  sockaddr_un address;
+  if (!socket_address(socket_path, &address))
+    return -1;
+  int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connection < 0)
+    return -1;
+  if (connect(connection, (sockaddr const*)&address, sizeof(address)) != 0) {
+    close(connection);
+    return -1;
+  }
+  return connection;
+}
+
+static void send_reply(int connection, int status, FILE* output)
+{
+  fflush(stdout);
+  fflush(stderr);
+  std::string reply = std::to_string(status) + "\n";
+  rewind(output);
+  char buffer[65536];
+  for (size_t read; (read = fread(buffer, 1, sizeof(buffer), output)) > 0;)
+    reply.append(buffer, read);
+  send_all(connection, reply.data(), reply.size());
+}
+
+// a compile error exits in the middle of a request
+static void send_reply_at_exit(int status, void*)
+{
+  if (serving_connection >= 0)
+    send_reply(serving_connection, status, serving_output);
+}
+
+// false if the request is malformed
+static bool parse_request(std::string const& request, std::string* working_directory, std::vector<std::string>* arguments)
+{
+  size_t position = strlen(request_magic);
+  if (request.compare(0, position, request_magic) != 0)
+    return false;
+  size_t newline = request.find('\n', position);
+  if (newline == std::string::npos)
+    return false;
+  unsigned long argument_count = strtoul(request.c_str() + position, nullptr, 10);
+  position = newline + 1;
+
+  for (unsigned long i = 0; i <= argument_count; i++) {
+    size_t end = request.find('\0', position);
+    if (end == std::string::npos)
+      return false;
+    std::string string = request.substr(position, end - position);
+    position = end + 1;
+    if (i == 0)
+      *working_directory = string;
+    else
+      arguments->push_back(string);
+  }
+  return position == request.size();
+}
+
+static void serve(int connection, CompileCommandLine compile)
+{
+  std::string request;
+  std::string working_directory;
+  std::vector<std::string> arguments;
+  if (!receive_all(connection, &request, maximum_request_size) || !parse_request(request, &working_directory, &arguments))
+    return;
+
+  FILE* output = tmpfile();
+  if (!output)
+    return;
+  if (chdir(working_directory.c_str()) != 0) {
+    fprintf(output, "Could not change to %s, aborting.\n", working_directory.c_str());
+    send_reply(connection, 1, output);
+    fclose(output);
+    return;
+  }
+
+  // header entries outlive the compile, and keep the path they were first
+  // found at, which quoted includes in them are looked for next to. Absolute
+  // paths mean the same from every client's working directory
+  for (std::string& argument : arguments) {
+    if (argument[0] != '-' && argument[0] != '/')
+      argument = working_directory + "/" + argument;
+    else if (argument.size() > 2 && argument.compare(0, 2, "-I") == 0 && argument[2] != '/')
+      argument = "-I" + working_directory + "/" + argument.substr(2);
+  }
+  std::vector<char*> argv;
+  argv.push_back((char*)"miniclang");
+  for (std::string& argument : arguments)
+    argv.push_back(argument.data());
+  argv.push_back(nullptr);
+
+  fflush(stdout);
+  fflush(stderr);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int saved_stderr = dup(STDERR_FILENO);
+  dup2(fileno(output), STDOUT_FILENO);
+  dup2(fileno(output), STDERR_FILENO);
+
+  // the caches stay warm between compiles, the settings and the --stats
+  // counts don't carry over
+  clear_include_directories();
+  reset_preprocessor_statistics();
+  reset_compilation_cache_statistics();
+  reset_incremental_statistics();
+  serving_connection = connection;
+  serving_output = output;
+  int status = compile((int)argv.size() - 1, argv.data());
+  serving_connection = -1;
+  send_reply(connection, status, output);
+
+  dup2(saved_stdout, STDOUT_FILENO);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stdout);
+  close(saved_stderr);
+  fclose(output);
+}
+
+[[noreturn]] static void run_worker(int listener, pid_t server, CompileCommandLine compile)
+{
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  // not outliving the server, even one that was killed
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != server)
+    _exit(0);
+  on_exit(send_reply_at_exit, nullptr);
+
+  for (unsigned compiles = 0; compiles < compiles_per_worker;) {
+    int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection < 0 && (errno == EINTR || errno == ECONNABORTED))
+      continue;
+    if (connection < 0)
+      _exit(1);
+    serve(connection, compile);
+    close(connection);
+    compiles++;
+  }
+  _exit(0);
+}
+
+// -1 if it couldn't be started, the server tries again when another exits
+static pid_t start_worker(int listener, CompileCommandLine compile)
+{
+  pid_t server = getpid();
+  pid_t worker = fork();
+  if (worker == 0)
+    run_worker(listener, server, compile);
+  return worker;
+}
+
+static void stop_server(int) { is_stopping = 1; }
+
+int run_compile_server(char const* socket_path, unsigned worker_count, CompileCommandLine compile)
+{
+  sockaddr_un address;
+  if (!socket_address(socket_path, &address)) {
+    fprintf(stderr, "The socket path %s is too long, aborting.\n", socket_path);
+    return 1;
+  }
+
+  // a socket left behind by a server that's gone is replaced, one a server
+  // is still listening on isn't
+  int existing = connect_to_server(socket_path);
+  if (existing >= 0) {
+    close(existing);
+    fprintf(stderr, "A compile server is already listening on %s, aborting.\n", socket_path);
+    return 1;
+  }
+  unlink(socket_path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0 || bind(listener, (sockaddr const*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+    fprintf(stderr, "Could not listen on %s, aborting.\n", socket_path);
+    return 1;
+  }
+
+  // without SA_RESTART, so wait returns to check is_stopping
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop_server;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  std::vector<pid_t> workers(worker_count);
+  for (pid_t& worker : workers)
+    worker = start_worker(listener, compile);
+
+  while (!is_stopping) {
+    pid_t exited = wait(nullptr);
+    if (exited < 0 && errno == ECHILD)
+      sleep(1);
+    for (pid_t& worker : workers)
+      if (!is_stopping && (worker == exited || worker < 0))
+        worker = start_worker(listener, compile);
+  }
+
+  for (pid_t worker : workers)
+    if (worker > 0)
+      kill(worker, SIGTERM);
+  while (wait(nullptr) > 0 || errno == EINTR) { }
+  close(listener);
+  unlink(socket_path);
+  return 0;
+}
+
+bool compile_on_server(char const* socket_path, int argc, char** argv, int* status)
+{
+  int connection = connect_to_server(socket_path);
+  if (connection < 0)
+    return false;
+
+  char working_directory[4096];
+  if (!getcwd(working_directory, sizeof(working_directory))) {
+    close(connection);
+    return false;
+  }
+  std::string request = request_magic;
+  request += std::to_string(argc - 1) + "\n";
+  request.append(working_directory, strlen(working_directory) + 1);
+  for (int i = 1; i < argc; i++)
+    request.append(argv[i], strlen(argv[i]) + 1);
+
+  std::string reply;
+  bool is_sent = send_all(connection, request.data(), request.size());
+  shutdown(connection, SHUT_WR);
+  bool is_received = is_sent && receive_all(connection, &reply, SIZE_MAX);
+  close(connection);
+
+  size_t newline = reply.find('\n');
+  if (!is_received || newline == std::string::npos) {
+    fprintf(stderr, "The compile server's worker died compiling this, aborting.\n");
+    *status = 1;
+    return true;
+  }
+  *status = atoi(reply.c_str());
+  fwrite(reply.data() + newline + 1, 1, reply.size() - newline - 1, stderr);
+  return true;
+}
@@ -0,0 +1,244 @@
+#include "symbol_index.h"
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+// symbol indexes
+//
+// code navigation only needs to know what a file declares and where, which
+// is a small part of compiling it. The index is written from a parse that
+// matched the braces of function bodies and left them unparsed, see
+// DeferredFunctionBody, and nothing past parsing runs. Declarations in the
+// included headers are indexed along with the file's own, each with the path
+// of the file it's in
+//
+// every external declaration gets a symbol, each declarator in it its own,
+// and a function declared then defined gets one for each, in the order they
+// were declared. Like a precompiled header the file is fixed size records
+// and a string table, with integers in the writer's byte order, laid out as
+//      header
+//      symbols
+//      strings, each path and signature only once
+
+static constexpr char magic[8] = { 'm', 'c', 'i', 'd', 'x', '\0', '\0', '\0' };
+static constexpr uint32_t format_version = 1;
+
+struct IndexString {
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct IndexFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t symbol_count;
+  // in bytes
+  uint32_t strings_size;
+  uint32_t reserved;
+};
+
+enum IndexSymbolFlag : uint32_t {
+  IsStatic = 1,
+  IsExtern = 1 << 1,
+};
+
+struct IndexSymbol {
+  IndexString name;
+  IndexString signature;
+  IndexString path;
+  uint32_t kind;
+  uint32_t flags;
+  uint32_t line;
+  uint32_t column;
+};
+
+static void spell_type(Type const* type, std::string* spelling)
+{
+  // a const pointer is const after the *
+  bool is_const = type->declaration_specifier_flags.flags & TypeModifierFlag::Const;
+  if (is_const && type->fundamental_type != FundamentalType::Pointer)
+    *spelling += "const ";
+
+  switch (type->fundamental_type) {
+  case FundamentalType::Void: *spelling += "void"; break;
+  case FundamentalType::Char: *spelling += "char"; break;
+  case FundamentalType::SignedChar: *spelling += "signed char"; break;
+  case FundamentalType::UnsignedChar: *spelling += "unsigned char"; break;
+  case FundamentalType::Short: *spelling += "short"; break;
+  case FundamentalType::UnsignedShort: *spelling += "unsigned short"; break;
+  case FundamentalType::Int: *spelling += "int"; break;
+  case FundamentalType::UnsignedInt: *spelling += "unsigned int"; break;
+  case FundamentalType::Long: *spelling += "long"; break;
+  case FundamentalType::UnsignedLong: *spelling += "unsigned long"; break;
+  case FundamentalType::LongLong: *spelling += "long long"; break;
+  case FundamentalType::UnsignedLongLong: *spelling += "unsigned long long"; break;
+  case FundamentalType::Float: *spelling += "float"; break;
+  case FundamentalType::Double: *spelling += "double"; break;
+  case FundamentalType::LongDouble: *spelling += "long double"; break;
+  case FundamentalType::FloatComplex: *spelling += "float _Complex"; break;
+  case FundamentalType::DoubleComplex: *spelling += "double _Complex"; break;
+  case FundamentalType::LongDoubleComplex: *spelling += "long double _Complex"; break;
+  case FundamentalType::Bool: *spelling += "_Bool"; break;
+  // the parser doesn't keep tags
+  case FundamentalType::Struct: *spelling += "struct"; break;
+  case FundamentalType::Union: *spelling += "union"; break;
+  case FundamentalType::Enum:
+  case FundamentalType::EnumeratedValue: *spelling += "enum"; break;
+  case FundamentalType::TypedefName: *spelling += "typedef name"; break;
+
+  case FundamentalType::Pointer:
+    spell_type(type->pointed_type, spelling);
+    *spelling += is_const ? "* const" : "*";
+    break;
+
+  case FundamentalType::Function: {
+    FunctionData const* function_data = type->function_data;
+    spell_type(function_data->return_type, spelling);
+    *spelling += " (";
+    for (FunctionParameter const* parameter = function_data->parameter_list; parameter; parameter = parameter->next_parameter) {
+      spell_type(parameter->parameter_type, spelling);
+      if (parameter->next_parameter)
+        *spelling += ", ";
+    }
+    if (function_data->is_variadic)
+      *spelling += function_data->parameter_list ? ", ..." : "...";
+    *spelling += ")";
+    break;
+  }
+  }
+}
+
+std::string type_signature(Type const* type)
+{
+  std::string spelling;
+  spell_type(type, &spelling);
+  return spelling;
+}
+
+// writing
+
+struct IndexWriter {
+  std::vector<IndexSymbol> symbols;
+  std::string strings;
+
+  // declarations share types and paths with the ones next to them, names
+  // are nearly all different
+  std::unordered_map<std::string, IndexString> string_indices;
+  std::unordered_map<Type const*, IndexString> signatures;
+  std::unordered_map<char const*, IndexString> paths;
+};
+
+static IndexString write_string(IndexWriter* writer, std::string const& string)
+{
+  IndexString written = { (uint32_t)writer->strings.size(), (uint32_t)string.size() };
+  writer->strings += string;
+  return written;
+}
+
+static IndexString write_shared_string(IndexWriter* writer, std::string const& string)
+{
+  auto [written, is_new] = writer->string_indices.try_emplace(string);
+  if (is_new)
+    written->second = write_string(writer, string);
+  return written->second;
+}
+
+static IndexString write_signature(IndexWriter* writer, Type const* type)
+{
+  auto [written, is_new] = writer->signatures.try_emplace(type);
+  if (is_new)
+    written->second = write_shared_string(writer, type_signature(type));
+  return written->second;
+}
+
+static IndexString write_path(IndexWriter* writer, char const* path)
+{
+  auto [written, is_new] = writer->paths.try_emplace(path);
+  if (is_new)
+    written->second = write_shared_string(writer, path ? path : "");
+  return written->second;
+}
+
+void write_symbol_index(TranslationUnit const* translation_unit, FILE* outfile)
+{
+  IndexWriter writer;
+  for (ExternalDeclaration const* declaration = translation_unit->external_declarations; declaration; declaration = declaration->next)
+    for (ASTNode const* node = declaration->root_ast_node; node; node = node->next) {
+      Object const* object = node->object;
+      SymbolKind kind = SymbolKind::Variable;
+      if (declaration->type == ExternalDeclarationType::FunctionDefinition)
+        kind = SymbolKind::FunctionDefinition;
+      else if (object->type->fundamental_type == FundamentalType::Function)
+        kind = SymbolKind::FunctionDeclaration;
+
+      int specifiers = object->declaration_specifier_flags.flags;
+      IndexSymbol symbol;
+      symbol.name = write_string(&writer, object->identifier);
+      symbol.signature = write_signature(&writer, object->type);
+      symbol.path = write_path(&writer, object->path);
+      symbol.kind = (uint32_t)kind;
+      symbol.flags = (specifiers & TypeModifierFlag::Static ? (uint32_t)IsStatic : 0)
+          | (specifiers & TypeModifierFlag::Extern ? (uint32_t)IsExtern : 0);
+      symbol.line = object->line;
+      symbol.column = object->column;
+      writer.symbols.push_back(symbol);
+    }
+
+  IndexFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, magic, sizeof(magic));
+  header.version = format_version;
+  header.symbol_count = writer.symbols.size();
+  header.strings_size = writer.strings.size();
+  fwrite(&header, sizeof(header), 1, outfile);
+  fwrite(writer.symbols.data(), sizeof(IndexSymbol), writer.symbols.size(), outfile);
+  fwrite(writer.strings.data(), 1, writer.strings.size(), outfile);
+}
+
+// reading
+
+bool read_symbol_index(char const* path, std::vector<IndexedSymbol>* symbols)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return false;
+  std::string contents;
+  char buffer[65536];
+  for (size_t read; (read = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+    contents.append(buffer, read);
+  fclose(file);
+
+  IndexFileHeader header;
+  if (contents.size() < sizeof(header))
+    return false;
+  memcpy(&header, contents.data(), sizeof(header));
+  uint64_t strings_offset = sizeof(header) + (uint64_t)header.symbol_count * sizeof(IndexSymbol);
+  if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != format_version
+      || strings_offset + header.strings_size != contents.size())
+    return false;
+
+  char const* strings = contents.data() + strings_offset;
+  auto read_string = [&](IndexString string, std::string* read) {
+    if ((uint64_t)string.offset + string.length > header.strings_size)
+      return false;
+    read->assign(strings + string.offset, string.length);
+    return true;
+  };
+
+  for (uint32_t i = 0; i < header.symbol_count; i++) {
+    IndexSymbol symbol;
+    memcpy(&symbol, contents.data() + sizeof(header) + i * sizeof(IndexSymbol), sizeof(symbol));
+    IndexedSymbol read;
+    if (!read_string(symbol.name, &read.name) || !read_string(symbol.signature, &read.signature) || !read_string(symbol.path, &read.path)
+        || symbol.kind > (uint32_t)SymbolKind::Variable)
+      return false;
+    read.kind = (SymbolKind)symbol.kind;
+    read.is_static = symbol.flags & IsStatic;
+    read.is_extern = symbol.flags & IsExtern;
+    read.line = symbol.line;
+    read.column = symbol.column;
+    symbols->push_back(std::move(read));
+  }
+  return true;
+}
@@ -0,0 +1,94 @@
+#include "optimize.h"
+
+#include <vector>
+
+// tail recursion elimination
+//
+// a function that ends by calling itself, return f(...), needs nothing of its
+// own frame once the call is made. Rather than relying on the backend to
+// reuse the frame for the call, the call becomes a branch back to the top of
+// the function, which is then an ordinary loop the other passes can work on
+//
+// without phis, the arguments become allocas of their own, stored on entry
+// and by every tail call, and loaded at the top of the loop
+//
+//   entry:                      entry:
+//     allocas                     allocas, %slot
+//     body                        store %a, %slot
+//     ...                         br tailrecurse
+//     %r = tail call @f(%x)  => tailrecurse:
+//     ret %r                      %v = load %slot, %v for %a from here on
+//                                 body
+//                                 ...
+//                                 store %x, %slot
+//                                 br tailrecurse
+//
+// only calls codegen marked tail are considered, which guarantees the ret
+// right after returns the call's result and that no alloca escapes, so the
+// loop can reuse the allocas. Calls passing variadic arguments are left alone
+
+static bool is_tail_recursive_call(IRFunction const* function, IRInstruction const* instruction)
+{
+  return instruction->opcode == IROpcode::Call && instruction->tail_call_kind != IRTailCallKind::None && instruction->callee == function
+      && instruction->operand_count == function->argument_count && instruction->next && instruction->next->opcode == IROpcode::Ret;
+}
+
+void run_tail_recursion_elimination(IRFunction* function, OptimizationStatistics* statistics)
+{
+  std::vector<IRInstruction*> calls;
+  for (IRBasicBlock* block = function->first_block; block; block = block->next)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      if (is_tail_recursive_call(function, instruction))
+        calls.push_back(instruction);
+
+  if (calls.empty())
+    return;
+
+  IRBasicBlock* entry = function->first_block;
+  IRBasicBlock* header = insert_ir_basic_block_after(entry, "tailrecurse");
+
+  IRBuilder builder;
+  builder.function = function;
+  builder.insertion_block = header;
+
+  // the arguments' C types are long gone, so their slots are accessed as char
+  std::vector<IRValue*> slots;
+  for (unsigned i = 0; i < function->argument_count; i++) {
+    IRValue* argument = function->arguments[i];
+    slots.push_back(ir_build_alloca(&builder, argument->type));
+    IRValue* value = ir_build_load(&builder, argument->type, slots[i]);
+    value->instruction->tbaa_type = ir_tbaa_omnipotent_char();
+    ir_replace_all_uses(function, argument, value);
+  }
+
+  // everything but the allocas moves into the loop
+  IRInstruction* first_moved = entry->first_instruction;
+  while (first_moved && first_moved->opcode == IROpcode::Alloca)
+    first_moved = first_moved->next;
+  while (first_moved) {
+    IRInstruction* moved = first_moved;
+    first_moved = first_moved->next;
+    ir_remove_instruction(moved);
+    ir_append_instruction(header, moved);
+  }
+
+  builder.insertion_block = entry;
+  for (unsigned i = 0; i < function->argument_count; i++) {
+    ir_build_store(&builder, function->arguments[i], slots[i]);
+    entry->last_instruction->tbaa_type = ir_tbaa_omnipotent_char();
+  }
+  ir_build_br(&builder, header);
+
+  for (IRInstruction* call : calls) {
+    builder.insertion_block = call->parent;
+    ir_remove_instruction(call->next);
+    ir_remove_instruction(call);
+
+    for (unsigned i = 0; i < function->argument_count; i++) {
+      ir_build_store(&builder, call->operands[i], slots[i]);
+      builder.insertion_block->last_instruction->tbaa_type = ir_tbaa_omnipotent_char();
+    }
+    ir_build_br(&builder, header);
+    statistics->tail_calls_eliminated++;
+  }
+}
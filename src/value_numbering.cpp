@@ -0,0 +1,239 @@
+#include "analysis.h"
+#include "optimize.h"
+
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// dominator-scoped hash-based value numbering
+//
+// two instructions compute the same value if they have the same opcode and
+// the same operands. If the first one dominates the second, the second can be
+// deleted and its uses pointed at the first. Something like a*b + a*b*c
+// parses as (a*b) + ((a*b)*c), so the second a*b goes away
+//
+// the classic way to do this (Briggs, Cooper and Simpson) is to walk the
+// dominator tree keeping a hash table of available expressions, pushing a
+// scope when entering a block and popping it when leaving. Anything in the
+// table when we visit a block was computed in one of its dominators
+//
+// loads are trickier, since a store in between can change what they read.
+// We only track loads from allocas whose address never escapes, so the only
+// way their memory changes is a store directly to them. A store makes the
+// stored value available to later loads of the same alloca, which is what
+// gets rid of the load right after "int z = x + y;". Across blocks, loads are
+// only carried into a block whose single predecessor is its immediate
+// dominator, since on any other edge a store could have happened in between
+
+struct AvailableLoad {
+  IRValue* value;
+  unsigned generation;
+};
+
+struct ValueNumbering {
+  IRFunction* function;
+  DominatorTree const* dominator_tree;
+  ControlFlowGraph const* cfg;
+  OptimizationStatistics* statistics;
+
+  std::unordered_set<IRValue const*> tracked_allocas;
+  std::unordered_map<IRValue*, IRValue*> replacements;
+
+  std::unordered_map<std::string, IRValue*> expressions;
+  std::vector<std::pair<std::string, IRValue*>> expression_undo;
+
+  std::unordered_map<IRValue const*, AvailableLoad> loads;
+  std::vector<std::pair<IRValue const*, AvailableLoad>> load_undo;
+
+  unsigned generation;
+  unsigned next_generation;
+};
+
+static IRValue* resolve(ValueNumbering* state, IRValue* value)
+{
+  while (state->replacements.contains(value))
+    value = state->replacements.at(value);
+  return value;
+}
+
+static std::string operand_key(IRValue const* value)
+{
+  char buffer[64];
+  if (value->kind == IRValueKind::Constant)
+    snprintf(buffer, sizeof(buffer), "%s#%lld", value->type, value->constant);
+  else
+    snprintf(buffer, sizeof(buffer), "%p", (void const*)value);
+  return buffer;
+}
+
+static bool instruction_is_pure(IRInstruction const* instruction)
+{
+  switch (instruction->opcode) {
+  case IROpcode::ICmp:
+  case IROpcode::ZExt:
+  case IROpcode::SExt:
+  case IROpcode::Trunc:
+  case IROpcode::GetElementPtr:
+  case IROpcode::Splat:
+  case IROpcode::Select:
+    return true;
+  default:
+    return ir_opcode_is_binary_operator(instruction->opcode);
+  }
+}
+
+static std::string expression_key(IRInstruction const* instruction)
+{
+  std::vector<std::string> operands;
+  for (unsigned i = 0; i < instruction->operand_count; i++)
+    operands.push_back(operand_key(instruction->operands[i]));
+
+  if (ir_opcode_is_commutative(instruction->opcode))
+    std::sort(operands.begin(), operands.end());
+
+  std::string key = std::to_string((int)instruction->opcode) + "." + std::to_string((int)instruction->comparison) + " " + instruction->result->type;
+
+  // a getelementptr's element type scales the index
+  if (instruction->allocated_type)
+    key += std::string(" ") + instruction->allocated_type;
+  for (std::string const& operand : operands)
+    key += " " + operand;
+  return key;
+}
+
+static void insert_expression(ValueNumbering* state, std::string const& key, IRValue* value)
+{
+  auto it = state->expressions.find(key);
+  state->expression_undo.emplace_back(key, it == state->expressions.end() ? nullptr : it->second);
+  state->expressions[key] = value;
+}
+
+static void make_load_available(ValueNumbering* state, IRValue const* pointer, IRValue* value)
+{
+  auto it = state->loads.find(pointer);
+  AvailableLoad old_load = { nullptr, 0 };
+  if (it != state->loads.end())
+    old_load = it->second;
+  state->load_undo.emplace_back(pointer, old_load);
+
+  state->loads[pointer] = { value, state->generation };
+}
+
+static IRValue* find_available_load(ValueNumbering* state, IRValue const* pointer, char const* type)
+{
+  auto it = state->loads.find(pointer);
+  if (it == state->loads.end() || !it->second.value || it->second.generation != state->generation)
+    return nullptr;
+
+  // a store of an i32 followed by a load of an i8 is not something we forward
+  if (std::string(it->second.value->type) != type)
+    return nullptr;
+
+  return it->second.value;
+}
+
+static void eliminate(ValueNumbering* state, IRInstruction* instruction, IRValue* leader)
+{
+  state->replacements[instruction->result] = leader;
+  ir_remove_instruction(instruction);
+  state->statistics->value_numbering_eliminated++;
+}
+
+static void number_block(ValueNumbering* state, IRBasicBlock* block)
+{
+  size_t expression_scope = state->expression_undo.size();
+  size_t load_scope = state->load_undo.size();
+  unsigned parent_generation = state->generation;
+
+  // memory is only known to be unchanged if we can only get here straight from the dominator
+  std::vector<IRBasicBlock*> const& predecessors = state->cfg->predecessors.at(block);
+  bool only_reached_from_dominator = predecessors.size() == 1 && block != state->dominator_tree->root
+      && predecessors[0] == state->dominator_tree->immediate_dominator.at(block);
+  if (!only_reached_from_dominator)
+    state->generation = state->next_generation++;
+
+  IRInstruction* next_instruction;
+  for (IRInstruction* instruction = block->first_instruction; instruction; instruction = next_instruction) {
+    next_instruction = instruction->next;
+
+    for (unsigned i = 0; i < instruction->operand_count; i++)
+      instruction->operands[i] = resolve(state, instruction->operands[i]);
+
+    if (instruction_is_pure(instruction)) {
+      std::string key = expression_key(instruction);
+      auto it = state->expressions.find(key);
+      if (it != state->expressions.end() && it->second)
+        eliminate(state, instruction, it->second);
+      else
+        insert_expression(state, key, instruction->result);
+      continue;
+    }
+
+    if (instruction->opcode == IROpcode::Load) {
+      IRValue const* pointer = instruction->operands[0];
+      if (!state->tracked_allocas.contains(pointer))
+        continue;
+
+      if (IRValue* available = find_available_load(state, pointer, instruction->result->type))
+        eliminate(state, instruction, available);
+      else
+        make_load_available(state, pointer, instruction->result);
+      continue;
+    }
+
+    if (instruction->opcode == IROpcode::Store) {
+      IRValue const* pointer = instruction->operands[1];
+      if (state->tracked_allocas.contains(pointer))
+        make_load_available(state, pointer, instruction->operands[0]);
+      continue;
+    }
+  }
+
+  for (IRBasicBlock* child : state->dominator_tree->children.at(block))
+    number_block(state, child);
+
+  // pop this block's scope
+  while (state->expression_undo.size() > expression_scope) {
+    auto& [key, old_value] = state->expression_undo.back();
+    state->expressions[key] = old_value;
+    state->expression_undo.pop_back();
+  }
+
+  while (state->load_undo.size() > load_scope) {
+    auto& [pointer, old_load] = state->load_undo.back();
+    state->loads[pointer] = old_load;
+    state->load_undo.pop_back();
+  }
+
+  state->generation = parent_generation;
+}
+
+void run_value_numbering(IRFunction* function, OptimizationStatistics* statistics)
+{
+  ControlFlowGraph cfg = compute_control_flow_graph(function);
+  DominatorTree dominator_tree = compute_dominator_tree(function, &cfg);
+
+  ValueNumbering state;
+  state.function = function;
+  state.dominator_tree = &dominator_tree;
+  state.cfg = &cfg;
+  state.statistics = statistics;
+  state.generation = 0;
+  state.next_generation = 1;
+
+  for (IRBasicBlock* block : cfg.reverse_postorder) {
+    dominator_tree.children[block];
+  }
+
+  state.tracked_allocas = find_non_escaping_allocas(function);
+  number_block(&state, function->first_block);
+
+  // unreachable blocks aren't in the dominator tree, but can still use eliminated values
+  for (IRBasicBlock* block = function->first_block; block; block = block->next)
+    for (IRInstruction* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      for (unsigned i = 0; i < instruction->operand_count; i++)
+        instruction->operands[i] = resolve(&state, instruction->operands[i]);
+}
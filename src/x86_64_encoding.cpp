@@ -0,0 +1,859 @@
+#include "x86_64.h"
+
+#include <cassert>
+#include <climits>
+#include <initializer_list>
+
+// turning machine instructions into bytes
+//
+// Intel's manual, volume 2, chapter 2 has the format. Every instruction here
+// is some prefixes, one to three opcode bytes, a ModRM byte naming a register
+// and a register or memory operand, then a displacement and an immediate.
+// Memory operands are [rbp + disp] or [reg], and the only SIB byte is the
+// one [rsp] and [r12] need
+//
+// jumps always use 32 bit displacements, since choosing between short and
+// near jumps means iterating until block offsets settle. A jump to the block
+// right after it is left out altogether
+//
+// jump tables are 32 bit offsets from the start of the table, like the ones
+// compilers emit for position independent code, so they need no relocations
+
+struct Fixup {
+  // where the 32 bit displacement is, and the offset it's relative to, the
+  // end of it for jumps and the start of the table for jump table entries
+  size_t position;
+  size_t base;
+  MachineBasicBlock const* target;
+};
+
+struct Encoder {
+  MachineFunction const* function;
+  ObjectFile* object;
+  std::vector<unsigned char>* text;
+  std::vector<Fixup> fixups;
+};
+
+static void emit_byte(Encoder* encoder, unsigned byte) { encoder->text->push_back((unsigned char)byte); }
+
+static void emit_immediate(Encoder* encoder, long long value, unsigned size)
+{
+  for (unsigned i = 0; i < size; i++)
+    emit_byte(encoder, (unsigned char)(value >> (8 * i)));
+}
+
+static bool fits_in_byte(long long value) { return value >= -128 && value <= 127; }
+
+static unsigned register_number(MachineOperand const* operand)
+{
+  assert((operand->kind == MachineOperandKind::Register || operand->kind == MachineOperandKind::VectorRegister)
+      && operand->reg < first_virtual_register && "encoding an unallocated register");
+  return operand->reg;
+}
+
+// prefixes, opcode and ModRM for an instruction with a register or opcode
+// extension in the reg field and a register, stack slot or, if is_indirect,
+// the memory a register points at in rm. The prefix is 0x66 for 16 bit
+// operands or the one an SSE instruction starts with, and comes before REX
+static void emit_prefixed_modrm_bytes(Encoder* encoder, unsigned prefix, bool is_64_bit, std::initializer_list<unsigned> opcode,
+    unsigned reg_field, MachineOperand const* rm, bool is_indirect, bool reg_field_is_byte_register, bool rm_is_byte_register)
+{
+  if (prefix)
+    emit_byte(encoder, prefix);
+
+  bool is_register = rm->kind != MachineOperandKind::StackSlot;
+  unsigned rm_register = is_register ? register_number(rm) : (unsigned)X86Register::Rbp;
+
+  unsigned rex = 0;
+  if (is_64_bit)
+    rex |= 0x8;
+  if (reg_field & 8)
+    rex |= 0x4;
+  if (rm_register & 8)
+    rex |= 0x1;
+
+  // without a REX prefix, byte registers 4-7 are ah, ch, dh and bh rather than spl, bpl, sil and dil
+  bool rm_needs_rex = is_register && !is_indirect && rm_is_byte_register && rm_register >= 4;
+  bool needs_rex = rex || (reg_field_is_byte_register && reg_field >= 4) || rm_needs_rex;
+  if (needs_rex)
+    emit_byte(encoder, 0x40 | rex);
+
+  for (unsigned byte : opcode)
+    emit_byte(encoder, byte);
+
+  if (is_register && !is_indirect) {
+    emit_byte(encoder, 0xc0 | (reg_field & 7) << 3 | (rm_register & 7));
+    return;
+  }
+
+  // [reg] has no displacement, except that rbp's and r13's encoding without
+  // one means rip relative, so they get a zero byte. rsp's and r12's means a
+  // SIB byte follows, which 0x24 makes plain [rsp] or [r12]
+  if (is_register) {
+    if ((rm_register & 7) == (unsigned)X86Register::Rbp) {
+      emit_byte(encoder, 0x40 | (reg_field & 7) << 3 | 0x5);
+      emit_byte(encoder, 0);
+      return;
+    }
+    emit_byte(encoder, (reg_field & 7) << 3 | (rm_register & 7));
+    if ((rm_register & 7) == (unsigned)X86Register::Rsp)
+      emit_byte(encoder, 0x24);
+    return;
+  }
+
+  assert(rm->kind == MachineOperandKind::StackSlot);
+  int offset = encoder->function->stack_slots[rm->stack_slot].offset;
+  if (fits_in_byte(offset)) {
+    emit_byte(encoder, 0x40 | (reg_field & 7) << 3 | 0x5);
+    emit_immediate(encoder, offset, 1);
+  } else {
+    emit_byte(encoder, 0x80 | (reg_field & 7) << 3 | 0x5);
+    emit_immediate(encoder, offset, 4);
+  }
+}
+
+static void emit_modrm_bytes(Encoder* encoder, unsigned size, std::initializer_list<unsigned> opcode, unsigned reg_field, MachineOperand const* rm,
+    bool reg_field_is_byte_register, bool rm_is_byte_register)
+{
+  emit_prefixed_modrm_bytes(encoder, size == 2 ? 0x66 : 0, size == 8, opcode, reg_field, rm, false, reg_field_is_byte_register, rm_is_byte_register);
+}
+
+static void emit_modrm_instruction(Encoder* encoder, unsigned size, std::initializer_list<unsigned> opcode, unsigned reg_field,
+    MachineOperand const* rm, bool reg_field_is_register = true)
+{
+  emit_modrm_bytes(encoder, size, opcode, reg_field, rm, size == 1 && reg_field_is_register, size == 1);
+}
+
+// push and pop only come in 64 bit versions, with the register in the opcode
+static void emit_push_or_pop(Encoder* encoder, unsigned opcode, X86Register reg)
+{
+  if ((unsigned)reg & 8)
+    emit_byte(encoder, 0x41);
+  emit_byte(encoder, opcode + ((unsigned)reg & 7));
+}
+
+static void emit_mov(Encoder* encoder, MachineInstruction const* instruction)
+{
+  MachineOperand const* destination = &instruction->operands[0];
+  MachineOperand const* source = &instruction->operands[1];
+  unsigned size = instruction->size;
+
+  if (source->kind == MachineOperandKind::Immediate) {
+    long long value = source->immediate;
+
+    if (destination->kind == MachineOperandKind::Register) {
+      unsigned reg = register_number(destination);
+
+      // a 32 bit mov clears the upper half, so only negative 64 bit values need more than four bytes
+      bool needs_64_bits = size == 8 && (value < 0 || value > UINT_MAX);
+      if (needs_64_bits && value >= INT_MIN && value <= INT_MAX) {
+        emit_modrm_instruction(encoder, 8, { 0xc7 }, 0, destination, false);
+        emit_immediate(encoder, value, 4);
+        return;
+      }
+
+      if (needs_64_bits || reg & 8)
+        emit_byte(encoder, 0x40 | (needs_64_bits ? 0x8 : 0) | (reg & 8 ? 0x1 : 0));
+      emit_byte(encoder, 0xb8 + (reg & 7));
+      emit_immediate(encoder, value, needs_64_bits ? 8 : 4);
+      return;
+    }
+
+    emit_modrm_instruction(encoder, size, { size == 1 ? 0xc6u : 0xc7u }, 0, destination, false);
+    emit_immediate(encoder, value, size == 8 ? 4 : size);
+    return;
+  }
+
+  if (destination->kind == MachineOperandKind::Register && source->kind == MachineOperandKind::Register) {
+    // moves between the same register are left behind by the register
+    // allocator. The upper half of a register holding a 32 bit value is never
+    // read, except by a MovZX from 32 bits, so these can go whatever the size
+    if (destination->reg == source->reg)
+      return;
+    emit_modrm_instruction(encoder, size < 4 ? 4 : size, { 0x89 }, register_number(source), destination);
+    return;
+  }
+
+  if (source->kind == MachineOperandKind::Register) {
+    emit_modrm_instruction(encoder, size, { size == 1 ? 0x88u : 0x89u }, register_number(source), destination);
+    return;
+  }
+
+  emit_modrm_instruction(encoder, size, { size == 1 ? 0x8au : 0x8bu }, register_number(destination), source);
+}
+
+// add, or, and, sub, xor and cmp share their encodings, only the opcode extension differs
+static void emit_arithmetic(Encoder* encoder, MachineInstruction const* instruction, unsigned extension)
+{
+  MachineOperand const* destination = &instruction->operands[0];
+  MachineOperand const* source = &instruction->operands[1];
+  unsigned size = instruction->size;
+  unsigned base = extension * 8;
+
+  if (source->kind == MachineOperandKind::Immediate) {
+    if (size == 1) {
+      emit_modrm_instruction(encoder, size, { 0x80 }, extension, destination, false);
+      emit_immediate(encoder, source->immediate, 1);
+    } else if (fits_in_byte(source->immediate)) {
+      emit_modrm_instruction(encoder, size, { 0x83 }, extension, destination, false);
+      emit_immediate(encoder, source->immediate, 1);
+    } else {
+      emit_modrm_instruction(encoder, size, { 0x81 }, extension, destination, false);
+      emit_immediate(encoder, source->immediate, size == 2 ? 2 : 4);
+    }
+    return;
+  }
+
+  if (source->kind == MachineOperandKind::Register) {
+    emit_modrm_instruction(encoder, size, { base + (size == 1 ? 0 : 1) }, register_number(source), destination);
+    return;
+  }
+
+  emit_modrm_instruction(encoder, size, { base + (size == 1 ? 2 : 3) }, register_number(destination), source);
+}
+
+// loads and stores through the pointer in a register, which are the stack
+// slot movs with [reg] in place of [rbp + disp]
+static void emit_load(Encoder* encoder, MachineInstruction const* instruction)
+{
+  unsigned reg = register_number(&instruction->operands[0]);
+  MachineOperand const* address = &instruction->operands[1];
+  unsigned size = instruction->size;
+
+  if (size < 4)
+    emit_prefixed_modrm_bytes(encoder, 0, false, { 0x0f, size == 1 ? 0xb6u : 0xb7u }, reg, address, true, false, false);
+  else
+    emit_prefixed_modrm_bytes(encoder, 0, size == 8, { 0x8b }, reg, address, true, false, false);
+}
+
+static void emit_store(Encoder* encoder, MachineInstruction const* instruction)
+{
+  MachineOperand const* address = &instruction->operands[0];
+  MachineOperand const* source = &instruction->operands[1];
+  unsigned size = instruction->size;
+  unsigned prefix = size == 2 ? 0x66 : 0;
+
+  if (source->kind == MachineOperandKind::Immediate) {
+    emit_prefixed_modrm_bytes(encoder, prefix, size == 8, { size == 1 ? 0xc6u : 0xc7u }, 0, address, true, false, false);
+    emit_immediate(encoder, source->immediate, size == 8 ? 4 : size);
+    return;
+  }
+
+  emit_prefixed_modrm_bytes(encoder, prefix, size == 8, { size == 1 ? 0x88u : 0x89u }, register_number(source), address, true, size == 1, false);
+}
+
+// SSE instructions are a 66, f2 or f3 prefix, 0f and the opcode, with an xmm
+// register in the reg field
+static void emit_sse(Encoder* encoder, unsigned prefix, std::initializer_list<unsigned> opcode, MachineOperand const* xmm, MachineOperand const* rm,
+    bool is_indirect)
+{
+  emit_prefixed_modrm_bytes(encoder, prefix, false, opcode, register_number(xmm), rm, is_indirect, false, false);
+}
+
+// the 66 0f opcodes of the lane-wise operations, by lane size. There is no
+// byte or quadword multiply, and the doubleword one, pmulld, is SSE4.1's
+static void emit_vector_arithmetic(Encoder* encoder, MachineInstruction const* instruction)
+{
+  unsigned lane = instruction->size == 1 ? 0 : instruction->size == 2 ? 1 : instruction->size == 4 ? 2 : 3;
+  MachineOperand const* destination = &instruction->operands[0];
+  MachineOperand const* source = &instruction->operands[1];
+
+  switch (instruction->opcode) {
+  case MachineOpcode::VectorAdd: {
+    static unsigned const opcodes[] = { 0xfc, 0xfd, 0xfe, 0xd4 };
+    emit_sse(encoder, 0x66, { 0x0f, opcodes[lane] }, destination, source, false);
+    return;
+  }
+  case MachineOpcode::VectorSub: {
+    static unsigned const opcodes[] = { 0xf8, 0xf9, 0xfa, 0xfb };
+    emit_sse(encoder, 0x66, { 0x0f, opcodes[lane] }, destination, source, false);
+    return;
+  }
+  case MachineOpcode::VectorMul:
+    assert((lane == 1 || lane == 2) && "no vector multiply for this lane size");
+    if (lane == 1)
+      emit_sse(encoder, 0x66, { 0x0f, 0xd5 }, destination, source, false);
+    else
+      emit_sse(encoder, 0x66, { 0x0f, 0x38, 0x40 }, destination, source, false);
+    return;
+  case MachineOpcode::VectorAnd:
+    emit_sse(encoder, 0x66, { 0x0f, 0xdb }, destination, source, false);
+    return;
+  case MachineOpcode::VectorOr:
+    emit_sse(encoder, 0x66, { 0x0f, 0xeb }, destination, source, false);
+    return;
+  case MachineOpcode::VectorXor:
+    emit_sse(encoder, 0x66, { 0x0f, 0xef }, destination, source, false);
+    return;
+  default:
+    assert(false && "emit_vector_arithmetic got a non vector opcode");
+  }
+}
+
+// movd or movq the register into the lowest lane, unpack it with itself
+// until it fills 32 bits, then copy that to every lane with pshufd. 64 bit
+// lanes only need the one unpack
+static void emit_broadcast(Encoder* encoder, MachineInstruction const* instruction)
+{
+  MachineOperand const* xmm = &instruction->operands[0];
+  unsigned size = instruction->size;
+
+  emit_prefixed_modrm_bytes(encoder, 0x66, size == 8, { 0x0f, 0x6e }, register_number(xmm), &instruction->operands[1], false, false, false);
+  if (size == 8) {
+    emit_sse(encoder, 0x66, { 0x0f, 0x6c }, xmm, xmm, false);
+    return;
+  }
+
+  if (size == 1)
+    emit_sse(encoder, 0x66, { 0x0f, 0x60 }, xmm, xmm, false);
+  if (size <= 2)
+    emit_sse(encoder, 0x66, { 0x0f, 0x61 }, xmm, xmm, false);
+  emit_sse(encoder, 0x66, { 0x0f, 0x70 }, xmm, xmm, false);
+  emit_byte(encoder, 0);
+}
+
+static void emit_jump(Encoder* encoder, std::initializer_list<unsigned> opcode, MachineBasicBlock const* target)
+{
+  for (unsigned byte : opcode)
+    emit_byte(encoder, byte);
+  encoder->fixups.push_back({ encoder->text->size(), encoder->text->size() + 4, target });
+  emit_immediate(encoder, 0, 4);
+}
+
+// lea r11, [rip + table]
+// movsxd index, dword [r11 + index * 4]
+// add index, r11
+// jmp index
+// then the table. r11 is free since it's a scratch register, and the index
+// isn't in it since it'd be in r10 if it were spilled
+static void emit_jump_table(Encoder* encoder, MachineInstruction const* instruction)
+{
+  MachineOperand const* index = &instruction->operands[0];
+  unsigned index_register = register_number(index);
+  unsigned base_register = (unsigned)X86Register::R11;
+  assert(index_register != base_register && index_register != (unsigned)X86Register::Rsp);
+
+  emit_byte(encoder, 0x4c);
+  emit_byte(encoder, 0x8d);
+  emit_byte(encoder, (base_register & 7) << 3 | 0x5);
+  size_t table_displacement = encoder->text->size();
+  emit_immediate(encoder, 0, 4);
+
+  emit_byte(encoder, 0x48 | (index_register & 8) >> 1 | (index_register & 8) >> 2 | (base_register & 8) >> 3);
+  emit_byte(encoder, 0x63);
+  emit_byte(encoder, (index_register & 7) << 3 | 0x4);
+  emit_byte(encoder, 0x80 | (index_register & 7) << 3 | (base_register & 7));
+
+  emit_modrm_instruction(encoder, 8, { 0x01 }, base_register, index);
+  emit_modrm_instruction(encoder, 4, { 0xff }, 4, index, false);
+
+  size_t table_start = encoder->text->size();
+  unsigned long long displacement = table_start - (table_displacement + 4);
+  for (unsigned i = 0; i < 4; i++)
+    (*encoder->text)[table_displacement + i] = (unsigned char)(displacement >> (8 * i));
+
+  for (MachineBasicBlock const* target : *instruction->jump_table) {
+    encoder->fixups.push_back({ encoder->text->size(), table_start, target });
+    emit_immediate(encoder, 0, 4);
+  }
+}
+
+static void emit_epilogue(Encoder* encoder)
+{
+  MachineFunction const* function = encoder->function;
+  if (function->frame_size) {
+    MachineOperand rsp = machine_register((unsigned)X86Register::Rsp);
+    bool is_short = fits_in_byte(function->frame_size);
+    emit_modrm_instruction(encoder, 8, { is_short ? 0x83u : 0x81u }, 0, &rsp, false);
+    emit_immediate(encoder, function->frame_size, is_short ? 1 : 4);
+  }
+
+  for (size_t i = function->used_callee_saved_registers.size(); i-- > 0;)
+    emit_push_or_pop(encoder, 0x58, function->used_callee_saved_registers[i]);
+  emit_push_or_pop(encoder, 0x58, X86Register::Rbp);
+}
+
+static void emit_prologue(Encoder* encoder)
+{
+  MachineFunction const* function = encoder->function;
+  MachineOperand rsp = machine_register((unsigned)X86Register::Rsp);
+  MachineOperand rbp = machine_register((unsigned)X86Register::Rbp);
+
+  emit_push_or_pop(encoder, 0x50, X86Register::Rbp);
+  emit_modrm_instruction(encoder, 8, { 0x89 }, register_number(&rsp), &rbp);
+
+  for (X86Register reg : function->used_callee_saved_registers)
+    emit_push_or_pop(encoder, 0x50, reg);
+
+  if (function->frame_size) {
+    bool is_short = fits_in_byte(function->frame_size);
+    emit_modrm_instruction(encoder, 8, { is_short ? 0x83u : 0x81u }, 5, &rsp, false);
+    emit_immediate(encoder, function->frame_size, is_short ? 1 : 4);
+  }
+}
+
+static void encode_instruction(Encoder* encoder, MachineInstruction const* instruction, MachineBasicBlock const* next_block)
+{
+  MachineOperand const* operands = instruction->operands;
+  unsigned size = instruction->size;
+
+  switch (instruction->opcode) {
+  case MachineOpcode::Mov:
+    emit_mov(encoder, instruction);
+    return;
+
+  case MachineOpcode::MovZX:
+  case MachineOpcode::MovSX: {
+    bool is_signed = instruction->opcode == MachineOpcode::MovSX;
+    // zero extending from 32 bits is a 32 bit mov, which clears the upper half
+    if (instruction->source_size == 4) {
+      if (is_signed)
+        emit_modrm_instruction(encoder, 8, { 0x63 }, register_number(&operands[0]), &operands[1]);
+      else
+        emit_modrm_instruction(encoder, 4, { 0x8b }, register_number(&operands[0]), &operands[1]);
+      return;
+    }
+
+    unsigned opcode = (is_signed ? 0xbe : 0xb6) + (instruction->source_size == 2 ? 1 : 0);
+
+    // the destination is a full register, but a byte source still has the byte register REX rule
+    emit_modrm_bytes(encoder, size, { 0x0f, opcode }, register_number(&operands[0]), &operands[1], false, instruction->source_size == 1);
+    return;
+  }
+
+  case MachineOpcode::Lea:
+    emit_modrm_instruction(encoder, 8, { 0x8d }, register_number(&operands[0]), &operands[1]);
+    return;
+
+  case MachineOpcode::Load:
+    emit_load(encoder, instruction);
+    return;
+  case MachineOpcode::Store:
+    emit_store(encoder, instruction);
+    return;
+
+  case MachineOpcode::VectorLoad:
+    emit_sse(encoder, 0xf3, { 0x0f, 0x6f }, &operands[0], &operands[1], operands[1].kind == MachineOperandKind::Register);
+    return;
+  case MachineOpcode::VectorStore:
+    emit_sse(encoder, 0xf3, { 0x0f, 0x7f }, &operands[1], &operands[0], operands[0].kind == MachineOperandKind::Register);
+    return;
+  case MachineOpcode::Broadcast:
+    emit_broadcast(encoder, instruction);
+    return;
+  case MachineOpcode::VectorAdd:
+  case MachineOpcode::VectorSub:
+  case MachineOpcode::VectorMul:
+  case MachineOpcode::VectorAnd:
+  case MachineOpcode::VectorOr:
+  case MachineOpcode::VectorXor:
+    emit_vector_arithmetic(encoder, instruction);
+    return;
+
+  case MachineOpcode::Add:
+    emit_arithmetic(encoder, instruction, 0);
+    return;
+  case MachineOpcode::Or:
+    emit_arithmetic(encoder, instruction, 1);
+    return;
+  case MachineOpcode::And:
+    emit_arithmetic(encoder, instruction, 4);
+    return;
+  case MachineOpcode::Sub:
+    emit_arithmetic(encoder, instruction, 5);
+    return;
+  case MachineOpcode::Xor:
+    emit_arithmetic(encoder, instruction, 6);
+    return;
+  case MachineOpcode::Cmp:
+    emit_arithmetic(encoder, instruction, 7);
+    return;
+
+  case MachineOpcode::IMul:
+    if (operands[1].kind == MachineOperandKind::Immediate) {
+      bool is_short = fits_in_byte(operands[1].immediate);
+      emit_modrm_instruction(encoder, size, { is_short ? 0x6bu : 0x69u }, register_number(&operands[0]), &operands[0]);
+      emit_immediate(encoder, operands[1].immediate, is_short ? 1 : 4);
+    } else {
+      emit_modrm_instruction(encoder, size, { 0x0f, 0xaf }, register_number(&operands[0]), &operands[1]);
+    }
+    return;
+
+  case MachineOpcode::Shl:
+  case MachineOpcode::Shr:
+  case MachineOpcode::Sar: {
+    unsigned extension = instruction->opcode == MachineOpcode::Shl ? 4 : instruction->opcode == MachineOpcode::Shr ? 5 : 7;
+    if (instruction->operand_count == 1) {
+      emit_modrm_instruction(encoder, size, { 0xd3 }, extension, &operands[0], false);
+    } else {
+      emit_modrm_instruction(encoder, size, { 0xc1 }, extension, &operands[0], false);
+      emit_immediate(encoder, operands[1].immediate, 1);
+    }
+    return;
+  }
+
+  case MachineOpcode::Neg:
+    emit_modrm_instruction(encoder, size, { 0xf7 }, 3, &operands[0], false);
+    return;
+
+  case MachineOpcode::Test:
+    emit_modrm_instruction(encoder, size, { 0x85 }, register_number(&operands[1]), &operands[0]);
+    return;
+
+  case MachineOpcode::Bt:
+    emit_modrm_instruction(encoder, size, { 0x0f, 0xa3 }, register_number(&operands[1]), &operands[0]);
+    return;
+
+  case MachineOpcode::CMov:
+    emit_modrm_instruction(encoder, size, { 0x0f, 0x40 + (unsigned)instruction->condition }, register_number(&operands[0]), &operands[1]);
+    return;
+
+  case MachineOpcode::SetCC:
+    emit_modrm_instruction(encoder, 1, { 0x0f, 0x90 + (unsigned)instruction->condition }, 0, &operands[0], false);
+    return;
+
+  case MachineOpcode::SignExtendAccumulator:
+    if (size == 8)
+      emit_byte(encoder, 0x48);
+    emit_byte(encoder, 0x99);
+    return;
+
+  case MachineOpcode::IDiv:
+    emit_modrm_instruction(encoder, size, { 0xf7 }, 7, &operands[0], false);
+    return;
+  case MachineOpcode::Div:
+    emit_modrm_instruction(encoder, size, { 0xf7 }, 6, &operands[0], false);
+    return;
+
+  case MachineOpcode::Push:
+    if (operands[0].kind == MachineOperandKind::Register) {
+      emit_push_or_pop(encoder, 0x50, (X86Register)register_number(&operands[0]));
+    } else if (fits_in_byte(operands[0].immediate)) {
+      emit_byte(encoder, 0x6a);
+      emit_immediate(encoder, operands[0].immediate, 1);
+    } else {
+      emit_byte(encoder, 0x68);
+      emit_immediate(encoder, operands[0].immediate, 4);
+    }
+    return;
+
+  // call rel32, which the linker points at the callee, or at its PLT entry
+  // if it ends up in a shared library. A tail call is the same with jmp rel32
+  case MachineOpcode::Call:
+  case MachineOpcode::TailCall: {
+    if (instruction->opcode == MachineOpcode::TailCall)
+      emit_epilogue(encoder);
+    emit_byte(encoder, instruction->opcode == MachineOpcode::TailCall ? 0xe9 : 0xe8);
+    unsigned symbol = find_or_add_object_symbol(encoder->object, operands[0].symbol);
+    encoder->object->relocations.push_back({ encoder->text->size(), symbol, RelocationType::PLT32, -4 });
+    emit_immediate(encoder, 0, 4);
+    return;
+  }
+
+  case MachineOpcode::Jmp:
+    if (operands[0].block != next_block)
+      emit_jump(encoder, { 0xe9 }, operands[0].block);
+    return;
+
+  case MachineOpcode::Jcc:
+    emit_jump(encoder, { 0x0f, 0x80 + (unsigned)instruction->condition }, operands[0].block);
+    return;
+
+  case MachineOpcode::JumpTable:
+    emit_jump_table(encoder, instruction);
+    return;
+
+  case MachineOpcode::Ret:
+    emit_epilogue(encoder);
+    emit_byte(encoder, 0xc3);
+    return;
+
+  case MachineOpcode::Ud2:
+    emit_byte(encoder, 0x0f);
+    emit_byte(encoder, 0x0b);
+    return;
+  }
+}
+
+void encode_x86_64_function(MachineFunction const* function, ObjectFile* object)
+{
+  std::vector<unsigned char>* text = &object->text;
+
+  // functions start 16 byte aligned, padded with nops
+  while (text->size() % 16)
+    text->push_back(0x90);
+
+  unsigned long long offset = text->size();
+
+  Encoder encoder;
+  encoder.function = function;
+  encoder.object = object;
+  encoder.text = text;
+
+  emit_prologue(&encoder);
+
+  std::vector<size_t> block_offsets(function->blocks.size());
+  for (size_t b = 0; b < function->blocks.size(); b++) {
+    MachineBasicBlock const* block = function->blocks[b];
+    MachineBasicBlock const* next_block = b + 1 < function->blocks.size() ? function->blocks[b + 1] : nullptr;
+    block_offsets[block->id] = text->size();
+
+    for (MachineInstruction const& instruction : block->instructions)
+      encode_instruction(&encoder, &instruction, next_block);
+  }
+
+  for (Fixup const& fixup : encoder.fixups) {
+    long long displacement = (long long)block_offsets[fixup.target->id] - (long long)fixup.base;
+    for (unsigned i = 0; i < 4; i++)
+      (*text)[fixup.position + i] = (unsigned char)(displacement >> (8 * i));
+  }
+
+  // the symbol may already be there, undefined, if an earlier function calls this one
+  ObjectSymbol* symbol = &object->symbols[find_or_add_object_symbol(object, function->ir_function->name)];
+  symbol->offset = offset;
+  symbol->size = text->size() - offset;
+  symbol->is_global = !function->ir_function->is_internal;
+  symbol->is_defined = true;
+}
+
+// there's only the one .text section, so rather than going in .text.hot and
+// .text.unlikely, hot functions go first and cold ones last
+static unsigned placement(IRFunction const* function) { return function->is_hot ? 0 : function->is_cold ? 2 : 1; }
+
+ObjectFile generate_x86_64_object(IRModule const* module, OptimizationStatistics* statistics)
+{
+  ObjectFile object;
+  for (unsigned group = 0; group < 3; group++)
+    for (IRFunction const* function = module->first_function; function; function = function->next) {
+      if (ir_function_is_declaration(function) || placement(function) != group)
+        continue;
+
+      MachineFunction* machine_function = select_x86_64_instructions(function);
+      allocate_registers(machine_function, statistics);
+      encode_x86_64_function(machine_function, &object);
+    }
+  return object;
+}
+
+static char const* register_name(unsigned reg, unsigned size)
+{
+  static char const* const names[4][16] = {
+    { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" },
+    { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" },
+    { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" },
+    { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" },
+  };
+  unsigned row = size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3;
+  return names[row][reg];
+}
+
+static char const* opcode_name(MachineInstruction const* instruction)
+{
+  switch (instruction->opcode) {
+  case MachineOpcode::Mov:
+    return "mov";
+  case MachineOpcode::MovZX:
+    return "movzx";
+  case MachineOpcode::MovSX:
+    return instruction->source_size == 4 ? "movsxd" : "movsx";
+  case MachineOpcode::Lea:
+    return "lea";
+  case MachineOpcode::Load:
+    return instruction->size < 4 ? "movzx" : "mov";
+  case MachineOpcode::Store:
+    return "mov";
+  case MachineOpcode::VectorLoad:
+  case MachineOpcode::VectorStore:
+    return "movdqu";
+  case MachineOpcode::Broadcast:
+    return "broadcast";
+  case MachineOpcode::VectorAdd:
+    return "padd";
+  case MachineOpcode::VectorSub:
+    return "psub";
+  case MachineOpcode::VectorMul:
+    return "pmull";
+  case MachineOpcode::VectorAnd:
+    return "pand";
+  case MachineOpcode::VectorOr:
+    return "por";
+  case MachineOpcode::VectorXor:
+    return "pxor";
+  case MachineOpcode::Add:
+    return "add";
+  case MachineOpcode::Sub:
+    return "sub";
+  case MachineOpcode::IMul:
+    return "imul";
+  case MachineOpcode::And:
+    return "and";
+  case MachineOpcode::Or:
+    return "or";
+  case MachineOpcode::Xor:
+    return "xor";
+  case MachineOpcode::Cmp:
+    return "cmp";
+  case MachineOpcode::Shl:
+    return "shl";
+  case MachineOpcode::Shr:
+    return "shr";
+  case MachineOpcode::Sar:
+    return "sar";
+  case MachineOpcode::Neg:
+    return "neg";
+  case MachineOpcode::Test:
+    return "test";
+  case MachineOpcode::SetCC:
+    return "set";
+  case MachineOpcode::CMov:
+    return "cmov";
+  case MachineOpcode::SignExtendAccumulator:
+    return instruction->size == 8 ? "cqo" : "cdq";
+  case MachineOpcode::IDiv:
+    return "idiv";
+  case MachineOpcode::Div:
+    return "div";
+  case MachineOpcode::Push:
+    return "push";
+  case MachineOpcode::Call:
+    return "call";
+  case MachineOpcode::Bt:
+    return "bt";
+  case MachineOpcode::Jmp:
+  case MachineOpcode::JumpTable:
+  case MachineOpcode::TailCall:
+    return "jmp";
+  case MachineOpcode::Jcc:
+    return "j";
+  case MachineOpcode::Ret:
+    return "ret";
+  case MachineOpcode::Ud2:
+    return "ud2";
+  }
+  return "";
+}
+
+static char const* condition_name(X86Condition condition)
+{
+  switch (condition) {
+  case X86Condition::B:
+    return "b";
+  case X86Condition::AE:
+    return "ae";
+  case X86Condition::E:
+    return "e";
+  case X86Condition::NE:
+    return "ne";
+  case X86Condition::BE:
+    return "be";
+  case X86Condition::A:
+    return "a";
+  case X86Condition::L:
+    return "l";
+  case X86Condition::GE:
+    return "ge";
+  case X86Condition::LE:
+    return "le";
+  case X86Condition::G:
+    return "g";
+  }
+  return "";
+}
+
+static void print_operand(MachineFunction const* function, MachineOperand const* operand, unsigned size, FILE* outfile)
+{
+  switch (operand->kind) {
+  case MachineOperandKind::None:
+    return;
+  case MachineOperandKind::Register:
+    if (operand->reg < first_virtual_register)
+      fprintf(outfile, "%s", register_name(operand->reg, size));
+    else
+      fprintf(outfile, "%%%u", operand->reg);
+    return;
+  case MachineOperandKind::VectorRegister:
+    fprintf(outfile, "xmm%u", operand->reg);
+    return;
+  case MachineOperandKind::Immediate:
+    fprintf(outfile, "%lld", operand->immediate);
+    return;
+  case MachineOperandKind::StackSlot: {
+    int offset = function->stack_slots[operand->stack_slot].offset;
+    if (offset)
+      fprintf(outfile, "[rbp %c %d]", offset < 0 ? '-' : '+', offset < 0 ? -offset : offset);
+    else
+      fprintf(outfile, "[slot %u]", operand->stack_slot);
+    return;
+  }
+  case MachineOperandKind::Block:
+    fprintf(outfile, ".LBB%u", operand->block->id);
+    return;
+  case MachineOperandKind::Symbol:
+    fprintf(outfile, "%s", operand->symbol);
+    return;
+  }
+}
+
+static bool is_vector_lane_operation(MachineOpcode opcode)
+{
+  return opcode == MachineOpcode::VectorAdd || opcode == MachineOpcode::VectorSub || opcode == MachineOpcode::VectorMul
+      || opcode == MachineOpcode::Broadcast;
+}
+
+// the operand that's an address rather than a value, if there is one
+static bool is_address_operand(MachineInstruction const* instruction, unsigned operand_index)
+{
+  if (instruction->operands[operand_index].kind != MachineOperandKind::Register)
+    return false;
+
+  switch (instruction->opcode) {
+  case MachineOpcode::Load:
+  case MachineOpcode::VectorLoad:
+    return operand_index == 1;
+  case MachineOpcode::Store:
+  case MachineOpcode::VectorStore:
+    return operand_index == 0;
+  default:
+    return false;
+  }
+}
+
+// Intel syntax, with virtual registers as %n and unplaced stack slots as
+// [slot n]. Vector lane operations get a b, w, d or q suffix
+void print_machine_function(MachineFunction const* function, FILE* outfile)
+{
+  fprintf(outfile, "%s:\n", function->ir_function->name);
+  for (MachineBasicBlock const* block : function->blocks) {
+    fprintf(outfile, ".LBB%u:\n", block->id);
+    for (MachineInstruction const& instruction : block->instructions) {
+      fprintf(outfile, "  %s", opcode_name(&instruction));
+      if (instruction.opcode == MachineOpcode::SetCC || instruction.opcode == MachineOpcode::CMov || instruction.opcode == MachineOpcode::Jcc)
+        fprintf(outfile, "%s", condition_name(instruction.condition));
+      if (is_vector_lane_operation(instruction.opcode))
+        fprintf(outfile, "%c", instruction.size == 1 ? 'b' : instruction.size == 2 ? 'w' : instruction.size == 4 ? 'd' : 'q');
+
+      for (unsigned i = 0; i < instruction.operand_count; i++) {
+        bool is_source_of_extension = i == 1 && (instruction.opcode == MachineOpcode::MovZX || instruction.opcode == MachineOpcode::MovSX);
+        unsigned size = is_source_of_extension ? instruction.source_size : instruction.size;
+        if (instruction.opcode == MachineOpcode::Load && i == 0 && size < 4)
+          size = 4;
+
+        fprintf(outfile, i == 0 ? " " : ", ");
+        if (is_address_operand(&instruction, i)) {
+          fprintf(outfile, "[");
+          print_operand(function, &instruction.operands[i], 8, outfile);
+          fprintf(outfile, "]");
+        } else {
+          print_operand(function, &instruction.operands[i], size, outfile);
+        }
+      }
+      if (instruction.opcode == MachineOpcode::JumpTable) {
+        fprintf(outfile, " [");
+        for (size_t i = 0; i < instruction.jump_table->size(); i++)
+          fprintf(outfile, "%s.LBB%u", i ? ", " : "", (*instruction.jump_table)[i]->id);
+        fprintf(outfile, "]");
+      }
+      fprintf(outfile, "\n");
+    }
+  }
+}
@@ -0,0 +1,1025 @@
+#include "x86_64.h"
+
+#include <bit>
+#include <cassert>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+// instruction selection by tree pattern matching
+//
+// the IR is a list of instructions, but an instruction whose only use is
+// later in the same block can be thought of as a subtree of that use. With
+// those folded in, each block is a forest: the roots are stores, terminators
+// and values used more than once or in other blocks, and the leaves are
+// constants, arguments, and roots computed earlier. Selection walks each tree
+// top down, picking the x86 instructions that cover as much of it as possible
+// (maximal munch, see Appel's "Modern Compiler Implementation", chapter 9)
+//
+// the patterns that matter are the ones that let one x86 instruction do the
+// work of several IR ones
+//      op x, (load slot)               op reg, [rbp - n]
+//      op x, constant                  op reg, imm
+//      store constant, slot            mov [rbp - n], imm
+//      br (icmp ne (zext (icmp p a b)), 0)     cmp a, b; jp
+// the last one is how codegen lowers every if and loop condition, and without
+// it each condition would be a cmp, setcc, movzx, cmp, jne
+//
+// a load can only be folded into its user if nothing in between could store
+// to the slot, so loads followed by a store before their use are roots too
+//
+// vector values, which only the loop vectorizer produces, are never folded.
+// Each gets a 16 byte stack slot, and every vector instruction loads its
+// operands into xmm0 and xmm1, computes, and stores the result back. That's
+// two memory round trips per instruction, still far fewer instructions than
+// the scalar loop it replaces
+
+struct InstructionSelection {
+  MachineFunction* function;
+  MachineBasicBlock* block;
+
+  std::unordered_map<IRBasicBlock const*, MachineBasicBlock*> blocks;
+  std::unordered_map<IRValue const*, unsigned> stack_slots;
+
+  // the virtual register holding each root's value
+  std::unordered_map<IRValue const*, unsigned> registers;
+
+  // the stack slot holding each vector value
+  std::unordered_map<IRValue const*, unsigned> vector_slots;
+
+  // instructions selected as part of their single user rather than on their own
+  std::unordered_set<IRInstruction const*> folded;
+
+  // blocks of a switch's comparison tree, which go right after the block the
+  // switch is in
+  std::unordered_map<MachineBasicBlock const*, std::vector<MachineBasicBlock*>> switch_blocks;
+
+  // the stack slots of the arguments after the sixth
+  std::vector<unsigned> argument_slots;
+};
+
+// the switch being selected, see select_switch
+struct SwitchSelection {
+  MachineBasicBlock* switch_block;
+  unsigned condition;
+  unsigned size;
+  MachineBasicBlock* default_block;
+  std::vector<SwitchCluster> clusters;
+};
+
+// System V passes the first six integer arguments in these
+static X86Register const argument_registers[]
+    = { X86Register::Rdi, X86Register::Rsi, X86Register::Rdx, X86Register::Rcx, X86Register::R8, X86Register::R9 };
+
+static void error_and_stop(char const* message)
+{
+  fprintf(stderr, "x86-64 backend: %s", message);
+  exit(1);
+}
+
+MachineOperand machine_register(unsigned reg)
+{
+  MachineOperand operand = {};
+  operand.kind = MachineOperandKind::Register;
+  operand.reg = reg;
+  return operand;
+}
+
+MachineOperand machine_vector_register(unsigned reg)
+{
+  MachineOperand operand = {};
+  operand.kind = MachineOperandKind::VectorRegister;
+  operand.reg = reg;
+  return operand;
+}
+
+MachineOperand machine_immediate(long long immediate)
+{
+  MachineOperand operand = {};
+  operand.kind = MachineOperandKind::Immediate;
+  operand.immediate = immediate;
+  return operand;
+}
+
+MachineOperand machine_stack_slot(unsigned slot)
+{
+  MachineOperand operand = {};
+  operand.kind = MachineOperandKind::StackSlot;
+  operand.stack_slot = slot;
+  return operand;
+}
+
+MachineOperand machine_block(MachineBasicBlock* block)
+{
+  MachineOperand operand = {};
+  operand.kind = MachineOperandKind::Block;
+  operand.block = block;
+  return operand;
+}
+
+MachineOperand machine_symbol(char const* symbol)
+{
+  MachineOperand operand = {};
+  operand.kind = MachineOperandKind::Symbol;
+  operand.symbol = symbol;
+  return operand;
+}
+
+static MachineOperand physical(X86Register reg) { return machine_register((unsigned)reg); }
+
+bool machine_operand_is_use(MachineInstruction const* instruction, unsigned operand_index)
+{
+  if (operand_index >= instruction->operand_count)
+    return false;
+
+  switch (instruction->opcode) {
+  case MachineOpcode::Mov:
+  case MachineOpcode::MovZX:
+  case MachineOpcode::MovSX:
+  case MachineOpcode::Lea:
+  case MachineOpcode::Load:
+  case MachineOpcode::VectorLoad:
+  case MachineOpcode::Broadcast:
+  case MachineOpcode::SetCC:
+    return operand_index == 1;
+  default:
+    return true;
+  }
+}
+
+bool machine_operand_is_def(MachineInstruction const* instruction, unsigned operand_index)
+{
+  if (operand_index != 0 || instruction->operand_count == 0)
+    return false;
+
+  switch (instruction->opcode) {
+  case MachineOpcode::Store:
+  case MachineOpcode::VectorStore:
+  case MachineOpcode::Cmp:
+  case MachineOpcode::Test:
+  case MachineOpcode::IDiv:
+  case MachineOpcode::Div:
+  case MachineOpcode::Push:
+  case MachineOpcode::Call:
+  case MachineOpcode::TailCall:
+  case MachineOpcode::Bt:
+  case MachineOpcode::Jmp:
+  case MachineOpcode::Jcc:
+  case MachineOpcode::JumpTable:
+    return false;
+  default:
+    return true;
+  }
+}
+
+static MachineInstruction* emit(InstructionSelection* selection, MachineOpcode opcode, unsigned size, MachineOperand first = {},
+    MachineOperand second = {})
+{
+  MachineInstruction instruction = {};
+  instruction.opcode = opcode;
+  instruction.size = size;
+  instruction.operands[0] = first;
+  instruction.operands[1] = second;
+  instruction.operand_count = first.kind == MachineOperandKind::None ? 0 : second.kind == MachineOperandKind::None ? 1 : 2;
+
+  selection->block->instructions.push_back(instruction);
+  return &selection->block->instructions.back();
+}
+
+static unsigned new_virtual_register(InstructionSelection* selection) { return selection->function->next_virtual_register++; }
+
+static unsigned type_size(char const* type)
+{
+  assert(!ir_type_is_vector(type) && "vector values are in stack slots, not registers");
+  return ir_type_size(type);
+}
+
+static bool fits_in_immediate(long long value) { return value >= -2147483648ll && value <= 2147483647ll; }
+
+static X86Condition condition_for(IRComparison comparison)
+{
+  switch (comparison) {
+  case IRComparison::Eq:
+    return X86Condition::E;
+  case IRComparison::Ne:
+    return X86Condition::NE;
+  case IRComparison::Ugt:
+    return X86Condition::A;
+  case IRComparison::Uge:
+    return X86Condition::AE;
+  case IRComparison::Ult:
+    return X86Condition::B;
+  case IRComparison::Ule:
+    return X86Condition::BE;
+  case IRComparison::Sgt:
+    return X86Condition::G;
+  case IRComparison::Sge:
+    return X86Condition::GE;
+  case IRComparison::Slt:
+    return X86Condition::L;
+  case IRComparison::Sle:
+    return X86Condition::LE;
+  case IRComparison::None:
+    break;
+  }
+  assert(false && "condition_for got no comparison");
+  return X86Condition::E;
+}
+
+// the condition codes come in pairs that differ in the lowest bit
+static X86Condition invert_condition(X86Condition condition) { return (X86Condition)((unsigned)condition ^ 1); }
+
+// a < b is b > a
+static X86Condition swap_condition(X86Condition condition)
+{
+  switch (condition) {
+  case X86Condition::B:
+    return X86Condition::A;
+  case X86Condition::AE:
+    return X86Condition::BE;
+  case X86Condition::BE:
+    return X86Condition::AE;
+  case X86Condition::A:
+    return X86Condition::B;
+  case X86Condition::L:
+    return X86Condition::G;
+  case X86Condition::GE:
+    return X86Condition::LE;
+  case X86Condition::LE:
+    return X86Condition::GE;
+  case X86Condition::G:
+    return X86Condition::L;
+  default:
+    return condition;
+  }
+}
+
+static bool is_alloca(IRValue const* value)
+{
+  return value->kind == IRValueKind::Instruction && value->instruction->opcode == IROpcode::Alloca;
+}
+
+static unsigned stack_slot_of(InstructionSelection* selection, IRValue const* pointer)
+{
+  if (!is_alloca(pointer))
+    error_and_stop("loads and stores through pointers other than locals are not supported\n");
+  return selection->stack_slots.at(pointer);
+}
+
+static void select_into(InstructionSelection*, IRInstruction const*, unsigned destination);
+
+// the operand for an IR value, as an immediate or a stack slot if the
+// instruction using it can take one, otherwise in a register
+static MachineOperand select_operand(InstructionSelection* selection, IRValue const* value, bool allow_immediate, bool allow_memory)
+{
+  switch (value->kind) {
+  case IRValueKind::Constant: {
+    if (allow_immediate && fits_in_immediate(value->constant))
+      return machine_immediate(value->constant);
+
+    unsigned reg = new_virtual_register(selection);
+    emit(selection, MachineOpcode::Mov, type_size(value->type) == 8 ? 8 : 4, machine_register(reg), machine_immediate(value->constant));
+    return machine_register(reg);
+  }
+
+  case IRValueKind::Argument:
+    return machine_register(selection->registers.at(value));
+
+  case IRValueKind::Global:
+    assert(false && "the x86-64 backend has no data sections for globals");
+    break;
+
+  case IRValueKind::Instruction:
+    break;
+  }
+
+  IRInstruction const* instruction = value->instruction;
+
+  // an alloca used as a value rather than as an address, i.e. a pointer that escapes
+  if (instruction->opcode == IROpcode::Alloca) {
+    unsigned reg = new_virtual_register(selection);
+    emit(selection, MachineOpcode::Lea, 8, machine_register(reg), machine_stack_slot(selection->stack_slots.at(value)));
+    return machine_register(reg);
+  }
+
+  if (!selection->folded.contains(instruction))
+    return machine_register(selection->registers.at(value));
+
+  if (instruction->opcode == IROpcode::Load && allow_memory && type_size(value->type) >= 4)
+    return machine_stack_slot(stack_slot_of(selection, instruction->operands[0]));
+
+  unsigned reg = new_virtual_register(selection);
+  select_into(selection, instruction, reg);
+  return machine_register(reg);
+}
+
+static unsigned select_register(InstructionSelection* selection, IRValue const* value)
+{
+  return select_operand(selection, value, false, false).reg;
+}
+
+// cmp for an icmp, returning the condition its result is true under
+static X86Condition select_compare(InstructionSelection* selection, IRInstruction const* icmp)
+{
+  IRValue const* lhs = icmp->operands[0];
+  IRValue const* rhs = icmp->operands[1];
+  X86Condition condition = condition_for(icmp->comparison);
+
+  // cmp can only take an immediate on the right
+  if (lhs->kind == IRValueKind::Constant && rhs->kind != IRValueKind::Constant) {
+    std::swap(lhs, rhs);
+    condition = swap_condition(condition);
+  }
+
+  // either side can be a stack slot, but not both
+  unsigned size = type_size(lhs->type);
+  MachineOperand right = select_operand(selection, rhs, true, true);
+  MachineOperand left = select_operand(selection, lhs, false, right.kind != MachineOperandKind::StackSlot);
+  emit(selection, MachineOpcode::Cmp, size < 4 ? 4 : size, left, right);
+  return condition;
+}
+
+static bool is_folded_instruction(InstructionSelection* selection, IRValue const* value, IROpcode opcode)
+{
+  return value->kind == IRValueKind::Instruction && value->instruction->opcode == opcode && selection->folded.contains(value->instruction);
+}
+
+// the condition for a conditional branch or select, whose icmp usually becomes
+// just the cmp. A comparison's value compared against 0, as in (a < b) != 0,
+// is
+//      %c = icmp slt i32 %a, %b
+//      %z = zext i1 %c to i32
+//      %t = icmp ne i32 %z, 0
+//      br i1 %t, ...
+// which is still just cmp %a, %b and jl
+static X86Condition select_condition(InstructionSelection* selection, IRValue const* condition)
+{
+  if (is_folded_instruction(selection, condition, IROpcode::ICmp)) {
+    IRInstruction const* icmp = condition->instruction;
+    IRComparison comparison = icmp->comparison;
+
+    bool compares_to_zero = (comparison == IRComparison::Ne || comparison == IRComparison::Eq) && ir_value_is_constant(icmp->operands[1], 0);
+    if (compares_to_zero && is_folded_instruction(selection, icmp->operands[0], IROpcode::ZExt)) {
+      IRValue const* extended = icmp->operands[0]->instruction->operands[0];
+      if (is_folded_instruction(selection, extended, IROpcode::ICmp)) {
+        X86Condition inner = select_compare(selection, extended->instruction);
+        return comparison == IRComparison::Ne ? inner : invert_condition(inner);
+      }
+    }
+
+    return select_compare(selection, icmp);
+  }
+
+  unsigned reg = select_register(selection, condition);
+  emit(selection, MachineOpcode::Test, 4, machine_register(reg), machine_register(reg));
+  return X86Condition::NE;
+}
+
+static MachineOpcode arithmetic_opcode(IROpcode opcode)
+{
+  switch (opcode) {
+  case IROpcode::Add:
+    return MachineOpcode::Add;
+  case IROpcode::Sub:
+    return MachineOpcode::Sub;
+  case IROpcode::Mul:
+    return MachineOpcode::IMul;
+  case IROpcode::And:
+    return MachineOpcode::And;
+  case IROpcode::Or:
+    return MachineOpcode::Or;
+  case IROpcode::Xor:
+    return MachineOpcode::Xor;
+  case IROpcode::Shl:
+    return MachineOpcode::Shl;
+  case IROpcode::LShr:
+    return MachineOpcode::Shr;
+  case IROpcode::AShr:
+    return MachineOpcode::Sar;
+  default:
+    assert(false && "arithmetic_opcode got a non arithmetic opcode");
+    return MachineOpcode::Add;
+  }
+}
+
+// computes an instruction's value into the given virtual register
+static void select_into(InstructionSelection* selection, IRInstruction const* instruction, unsigned destination)
+{
+  MachineOperand result = machine_register(destination);
+  IRValue* const* operands = instruction->operands;
+  unsigned size = instruction->result ? type_size(instruction->result->type) : 0;
+
+  // arithmetic on i8 and i16 is done in 32 bit registers, the upper bits are ignored
+  unsigned register_size = size == 8 ? 8 : 4;
+
+  switch (instruction->opcode) {
+  case IROpcode::Load: {
+    if (!is_alloca(operands[0])) {
+      emit(selection, MachineOpcode::Load, size, result, machine_register(select_register(selection, operands[0])));
+      return;
+    }
+
+    MachineOperand slot = machine_stack_slot(stack_slot_of(selection, operands[0]));
+    if (size < 4) {
+      MachineInstruction* load = emit(selection, MachineOpcode::MovZX, 4, result, slot);
+      load->source_size = size;
+    } else {
+      emit(selection, MachineOpcode::Mov, size, result, slot);
+    }
+    return;
+  }
+
+  // pointer + index * element size, with the multiply a shift for the power of two sizes every type has
+  case IROpcode::GetElementPtr: {
+    unsigned element_size = ir_type_size(instruction->allocated_type);
+    IRValue const* index = operands[1];
+    if (index->kind == IRValueKind::Constant && fits_in_immediate(index->constant * element_size)) {
+      emit(selection, MachineOpcode::Mov, 8, result, select_operand(selection, operands[0], false, true));
+      if (index->constant)
+        emit(selection, MachineOpcode::Add, 8, result, machine_immediate(index->constant * element_size));
+      return;
+    }
+
+    emit(selection, MachineOpcode::Mov, 8, result, select_operand(selection, index, true, true));
+    if (element_size > 1)
+      emit(selection, MachineOpcode::Shl, 8, result, machine_immediate(std::countr_zero(element_size)));
+    emit(selection, MachineOpcode::Add, 8, result, select_operand(selection, operands[0], false, true));
+    return;
+  }
+
+  case IROpcode::Add:
+  case IROpcode::Sub:
+  case IROpcode::Mul:
+  case IROpcode::And:
+  case IROpcode::Or:
+  case IROpcode::Xor: {
+    IRValue const* lhs = operands[0];
+    IRValue const* rhs = operands[1];
+    if (ir_opcode_is_commutative(instruction->opcode) && lhs->kind == IRValueKind::Constant && rhs->kind != IRValueKind::Constant)
+      std::swap(lhs, rhs);
+
+    emit(selection, MachineOpcode::Mov, register_size, result, select_operand(selection, lhs, true, true));
+    emit(selection, arithmetic_opcode(instruction->opcode), register_size, result, select_operand(selection, rhs, true, true));
+    return;
+  }
+
+  case IROpcode::Shl:
+  case IROpcode::LShr:
+  case IROpcode::AShr: {
+    emit(selection, MachineOpcode::Mov, register_size, result, select_operand(selection, operands[0], true, true));
+
+    // a variable shift count has to be in cl
+    if (operands[1]->kind == IRValueKind::Constant) {
+      emit(selection, arithmetic_opcode(instruction->opcode), register_size, result, machine_immediate(operands[1]->constant & 63));
+    } else {
+      emit(selection, MachineOpcode::Mov, 4, physical(X86Register::Rcx), select_operand(selection, operands[1], true, true));
+      emit(selection, arithmetic_opcode(instruction->opcode), register_size, result);
+    }
+    return;
+  }
+
+  case IROpcode::SDiv:
+  case IROpcode::UDiv:
+  case IROpcode::SRem:
+  case IROpcode::URem: {
+    // the dividend is edx:eax, the quotient ends up in eax and the remainder in edx
+    bool is_signed = instruction->opcode == IROpcode::SDiv || instruction->opcode == IROpcode::SRem;
+    bool is_remainder = instruction->opcode == IROpcode::SRem || instruction->opcode == IROpcode::URem;
+
+    // the divisor first, a division folded into it would overwrite eax and edx
+    MachineOperand divisor = select_operand(selection, operands[1], false, true);
+    emit(selection, MachineOpcode::Mov, register_size, physical(X86Register::Rax), select_operand(selection, operands[0], true, true));
+
+    if (is_signed) {
+      emit(selection, MachineOpcode::SignExtendAccumulator, register_size);
+      emit(selection, MachineOpcode::IDiv, register_size, divisor);
+    } else {
+      emit(selection, MachineOpcode::Xor, 4, physical(X86Register::Rdx), physical(X86Register::Rdx));
+      emit(selection, MachineOpcode::Div, register_size, divisor);
+    }
+
+    emit(selection, MachineOpcode::Mov, register_size, result, physical(is_remainder ? X86Register::Rdx : X86Register::Rax));
+    return;
+  }
+
+  case IROpcode::ICmp: {
+    // i1 values are kept in registers as exactly 0 or 1
+    X86Condition condition = select_compare(selection, instruction);
+    emit(selection, MachineOpcode::SetCC, 1, result)->condition = condition;
+    emit(selection, MachineOpcode::MovZX, 4, result, result)->source_size = 1;
+    return;
+  }
+
+  // both values first, since computing them can clobber the flags. Memory
+  // operands are only used at full size, cmov has no byte version
+  case IROpcode::Select: {
+    bool allow_memory = size >= 4;
+    MachineOperand true_value = select_operand(selection, operands[1], false, allow_memory);
+    MachineOperand false_value = select_operand(selection, operands[2], true, allow_memory);
+    emit(selection, MachineOpcode::Mov, register_size, result, false_value);
+    X86Condition condition = select_condition(selection, operands[0]);
+    emit(selection, MachineOpcode::CMov, register_size, result, true_value)->condition = condition;
+    return;
+  }
+
+  case IROpcode::ZExt:
+  case IROpcode::SExt: {
+    unsigned source_size = type_size(operands[0]->type);
+    bool is_signed = instruction->opcode == IROpcode::SExt;
+    MachineOperand source = select_operand(selection, operands[0], false, true);
+
+    if (strcmp(operands[0]->type, "i1") == 0) {
+      // already 0 or 1, sign extending turns 1 into -1
+      emit(selection, MachineOpcode::Mov, 4, result, source);
+      if (is_signed)
+        emit(selection, MachineOpcode::Neg, register_size, result);
+      return;
+    }
+
+    MachineInstruction* extension = emit(selection, is_signed ? MachineOpcode::MovSX : MachineOpcode::MovZX, register_size, result, source);
+    extension->source_size = source_size;
+    return;
+  }
+
+  case IROpcode::Trunc: {
+    emit(selection, MachineOpcode::Mov, 4, result, select_operand(selection, operands[0], false, false));
+    if (size == 1 && strcmp(instruction->result->type, "i1") == 0)
+      emit(selection, MachineOpcode::And, 4, result, machine_immediate(1));
+    return;
+  }
+
+  default:
+    assert(false && "select_into got an instruction that doesn't produce a value");
+  }
+}
+
+static MachineOpcode vector_opcode(IROpcode opcode)
+{
+  switch (opcode) {
+  case IROpcode::Add:
+    return MachineOpcode::VectorAdd;
+  case IROpcode::Sub:
+    return MachineOpcode::VectorSub;
+  case IROpcode::Mul:
+    return MachineOpcode::VectorMul;
+  case IROpcode::And:
+    return MachineOpcode::VectorAnd;
+  case IROpcode::Or:
+    return MachineOpcode::VectorOr;
+  case IROpcode::Xor:
+    return MachineOpcode::VectorXor;
+  default:
+    error_and_stop("vector operations other than add, sub, mul, and, or and xor are not supported\n");
+    return MachineOpcode::VectorAdd;
+  }
+}
+
+// puts a vector value in xmm0 or xmm1. A constant is a splat of its scalar
+static MachineOperand select_vector_operand(InstructionSelection* selection, IRValue const* value, unsigned xmm)
+{
+  MachineOperand result = machine_vector_register(xmm);
+  unsigned lane_size = ir_type_size(ir_vector_element_type(value->type));
+
+  if (value->kind == IRValueKind::Constant) {
+    unsigned reg = new_virtual_register(selection);
+    emit(selection, MachineOpcode::Mov, lane_size == 8 ? 8 : 4, machine_register(reg), machine_immediate(value->constant));
+    emit(selection, MachineOpcode::Broadcast, lane_size, result, machine_register(reg));
+    return result;
+  }
+
+  emit(selection, MachineOpcode::VectorLoad, lane_size, result, machine_stack_slot(selection->vector_slots.at(value)));
+  return result;
+}
+
+static void select_vector(InstructionSelection* selection, IRInstruction const* instruction)
+{
+  IRValue* const* operands = instruction->operands;
+  unsigned lane_size = ir_type_size(ir_vector_element_type(instruction->result->type));
+  MachineOperand xmm0 = machine_vector_register(0);
+
+  switch (instruction->opcode) {
+  case IROpcode::Load:
+    emit(selection, MachineOpcode::VectorLoad, lane_size, xmm0, machine_register(select_register(selection, operands[0])));
+    break;
+
+  case IROpcode::Splat:
+    emit(selection, MachineOpcode::Broadcast, lane_size, xmm0, machine_register(select_register(selection, operands[0])));
+    break;
+
+  default:
+    select_vector_operand(selection, operands[0], 0);
+    emit(selection, vector_opcode(instruction->opcode), lane_size, xmm0, select_vector_operand(selection, operands[1], 1));
+    break;
+  }
+
+  emit(selection, MachineOpcode::VectorStore, lane_size, machine_stack_slot(selection->vector_slots.at(instruction->result)), xmm0);
+}
+
+// a tail call can jmp to the callee once our frame is gone, and the callee
+// then returns straight to our caller. Arguments passed on the stack go
+// where our own arguments are, so there can't be more of them
+static bool is_sibling_call(IRInstruction const* instruction)
+{
+  IRFunction const* caller = instruction->parent->parent;
+  if (instruction->opcode != IROpcode::Call || instruction->tail_call_kind == IRTailCallKind::None
+      || (instruction->operand_count > 6 && instruction->operand_count > caller->argument_count))
+    return false;
+
+  IRInstruction const* ret = instruction->next;
+  return ret && ret->opcode == IROpcode::Ret && (ret->operand_count == 0 || ret->operands[0] == instruction->result);
+}
+
+// every argument has been selected already, so overwriting our own arguments
+// on the stack can't change one
+static void select_sibling_call(InstructionSelection* selection, IRInstruction const* instruction, std::vector<MachineOperand> const* arguments)
+{
+  for (unsigned i = 6; i < instruction->operand_count; i++)
+    emit(selection, MachineOpcode::Mov, 8, machine_stack_slot(selection->argument_slots[i - 6]), (*arguments)[i]);
+
+  for (unsigned i = 0; i < instruction->operand_count && i < 6; i++) {
+    unsigned size = type_size(instruction->operands[i]->type) == 8 ? 8 : 4;
+    emit(selection, MachineOpcode::Mov, size, physical(argument_registers[i]), (*arguments)[i]);
+  }
+
+  emit(selection, MachineOpcode::TailCall, 0, machine_symbol(instruction->callee->name));
+}
+
+// System V passes the first six arguments in registers and pushes the rest
+// right to left, and rsp has to be 16 byte aligned at the call. The frame
+// keeps it aligned, so only an odd number of pushes needs padding
+//
+// every argument is selected before any is moved into place, since computing
+// one can need rcx or rdx, for a shift or a division, and those are argument
+// registers too. Linear scan only hands out callee saved registers, so nothing
+// it allocated is clobbered by the call
+static void select_call(InstructionSelection* selection, IRInstruction const* instruction)
+{
+  unsigned argument_count = instruction->operand_count;
+  std::vector<MachineOperand> arguments;
+  for (unsigned i = 0; i < argument_count; i++)
+    arguments.push_back(select_operand(selection, instruction->operands[i], true, i < 6));
+
+  if (is_sibling_call(instruction)) {
+    select_sibling_call(selection, instruction, &arguments);
+    return;
+  }
+
+  unsigned stack_argument_count = argument_count > 6 ? argument_count - 6 : 0;
+  unsigned stack_bytes = 8 * (stack_argument_count + stack_argument_count % 2);
+  MachineOperand rsp = physical(X86Register::Rsp);
+
+  if (stack_argument_count % 2)
+    emit(selection, MachineOpcode::Sub, 8, rsp, machine_immediate(8));
+  for (unsigned i = argument_count; i-- > 6;)
+    emit(selection, MachineOpcode::Push, 8, arguments[i]);
+
+  for (unsigned i = 0; i < argument_count && i < 6; i++) {
+    unsigned size = type_size(instruction->operands[i]->type) == 8 ? 8 : 4;
+    emit(selection, MachineOpcode::Mov, size, physical(argument_registers[i]), arguments[i]);
+  }
+
+  emit(selection, MachineOpcode::Call, 0, machine_symbol(instruction->callee->name));
+
+  if (stack_bytes)
+    emit(selection, MachineOpcode::Add, 8, rsp, machine_immediate(stack_bytes));
+
+  if (instruction->result) {
+    unsigned size = type_size(instruction->result->type) == 8 ? 8 : 4;
+    emit(selection, MachineOpcode::Mov, size, machine_register(selection->registers.at(instruction->result)), physical(X86Register::Rax));
+  }
+}
+
+// the tree's blocks are laid out in the order they're selected into, so each
+// one's jmp to the next can be left out
+static void start_switch_block(InstructionSelection* selection, SwitchSelection const* switch_selection, MachineBasicBlock* block)
+{
+  selection->switch_blocks[switch_selection->switch_block].push_back(block);
+  selection->block = block;
+}
+
+// an immediate if it fits, cmp and sub only take 32 bit ones
+static MachineOperand switch_operand(InstructionSelection* selection, long long value, unsigned size)
+{
+  if (fits_in_immediate(value))
+    return machine_immediate(value);
+  unsigned reg = new_virtual_register(selection);
+  emit(selection, MachineOpcode::Mov, size, machine_register(reg), machine_immediate(value));
+  return machine_register(reg);
+}
+
+static void emit_switch_jump(InstructionSelection* selection, X86Condition condition, MachineBasicBlock* target, MachineBasicBlock* otherwise)
+{
+  emit(selection, MachineOpcode::Jcc, 0, machine_block(target))->condition = condition;
+  emit(selection, MachineOpcode::Jmp, 0, machine_block(otherwise));
+}
+
+// one cluster, for a condition the tree has already narrowed down to known_low
+// to known_high. Checks that narrowing makes redundant are left out, so e.g. a
+// range covering everything that's left is a plain jmp
+static void select_switch_cluster(InstructionSelection* selection, SwitchSelection const* switch_selection, SwitchCluster const* cluster,
+    long long known_low, long long known_high)
+{
+  unsigned size = switch_selection->size;
+  MachineOperand condition = machine_register(switch_selection->condition);
+  MachineBasicBlock* default_block = switch_selection->default_block;
+  bool covers_low = known_low >= cluster->low;
+  bool covers_high = known_high <= cluster->high;
+
+  if (cluster->kind == SwitchClusterKind::Range) {
+    MachineBasicBlock* target = selection->blocks.at(cluster->targets[0]);
+    if (covers_low && covers_high) {
+      emit(selection, MachineOpcode::Jmp, 0, machine_block(target));
+    } else if (cluster->low == cluster->high) {
+      emit(selection, MachineOpcode::Cmp, size, condition, switch_operand(selection, cluster->low, size));
+      emit_switch_jump(selection, X86Condition::E, target, default_block);
+    } else if (covers_low) {
+      emit(selection, MachineOpcode::Cmp, size, condition, switch_operand(selection, cluster->high, size));
+      emit_switch_jump(selection, X86Condition::LE, target, default_block);
+    } else if (covers_high) {
+      emit(selection, MachineOpcode::Cmp, size, condition, switch_operand(selection, cluster->low, size));
+      emit_switch_jump(selection, X86Condition::GE, target, default_block);
+    } else {
+      unsigned offset = new_virtual_register(selection);
+      emit(selection, MachineOpcode::Mov, size, machine_register(offset), condition);
+      emit(selection, MachineOpcode::Sub, size, machine_register(offset), switch_operand(selection, cluster->low, size));
+      emit(selection, MachineOpcode::Cmp, size, machine_register(offset), switch_operand(selection, cluster->high - cluster->low, size));
+      emit_switch_jump(selection, X86Condition::BE, target, default_block);
+    }
+    return;
+  }
+
+  // the offset into the cluster, in a register of its own since a jump table
+  // clobbers it. A 32 bit sub clears the upper half, so it indexes the table
+  // and bit tests as a 64 bit value too
+  unsigned offset = new_virtual_register(selection);
+  emit(selection, MachineOpcode::Mov, size, machine_register(offset), condition);
+  if (cluster->low)
+    emit(selection, MachineOpcode::Sub, size, machine_register(offset), switch_operand(selection, cluster->low, size));
+  if (!covers_low || !covers_high) {
+    MachineBasicBlock* in_range = new MachineBasicBlock();
+    emit(selection, MachineOpcode::Cmp, size, machine_register(offset), switch_operand(selection, cluster->high - cluster->low, size));
+    emit_switch_jump(selection, X86Condition::A, default_block, in_range);
+    start_switch_block(selection, switch_selection, in_range);
+  }
+
+  if (cluster->kind == SwitchClusterKind::JumpTable) {
+    std::vector<MachineBasicBlock*>* table = new std::vector<MachineBasicBlock*>();
+    for (IRBasicBlock* target : cluster->targets)
+      table->push_back(selection->blocks.at(target));
+    emit(selection, MachineOpcode::JumpTable, 8, machine_register(offset))->jump_table = table;
+    return;
+  }
+
+  for (size_t i = 0; i < cluster->targets.size(); i++) {
+    MachineBasicBlock* next_test = new MachineBasicBlock();
+    unsigned mask = new_virtual_register(selection);
+    emit(selection, MachineOpcode::Mov, 8, machine_register(mask), machine_immediate((long long)cluster->masks[i]));
+    emit(selection, MachineOpcode::Bt, 8, machine_register(mask), machine_register(offset));
+    emit_switch_jump(selection, X86Condition::B, selection->blocks.at(cluster->targets[i]), next_test);
+    start_switch_block(selection, switch_selection, next_test);
+  }
+  emit(selection, MachineOpcode::Jmp, 0, machine_block(default_block));
+}
+
+// a balanced binary tree over clusters first to last, comparing against the
+// low end of the middle one
+static void select_switch_tree(InstructionSelection* selection, SwitchSelection const* switch_selection, size_t first, size_t last,
+    long long known_low, long long known_high)
+{
+  std::vector<SwitchCluster> const& clusters = switch_selection->clusters;
+  if (first == last) {
+    select_switch_cluster(selection, switch_selection, &clusters[first], known_low, known_high);
+    return;
+  }
+
+  size_t middle = (first + last + 1) / 2;
+  long long pivot = clusters[middle].low;
+  MachineBasicBlock* below = new MachineBasicBlock();
+  MachineBasicBlock* above = new MachineBasicBlock();
+
+  emit(selection, MachineOpcode::Cmp, switch_selection->size, machine_register(switch_selection->condition),
+      switch_operand(selection, pivot, switch_selection->size));
+  emit(selection, MachineOpcode::Jcc, 0, machine_block(above))->condition = X86Condition::GE;
+  emit(selection, MachineOpcode::Jmp, 0, machine_block(below));
+
+  start_switch_block(selection, switch_selection, below);
+  select_switch_tree(selection, switch_selection, first, middle - 1, known_low, pivot - 1);
+  start_switch_block(selection, switch_selection, above);
+  select_switch_tree(selection, switch_selection, middle, last, pivot, known_high);
+}
+
+static void select_switch(InstructionSelection* selection, IRInstruction const* instruction)
+{
+  unsigned size = type_size(instruction->operands[0]->type);
+  if (size < 4)
+    error_and_stop("switches on values narrower than 32 bits are not supported\n");
+
+  SwitchSelection switch_selection;
+  switch_selection.switch_block = selection->block;
+  switch_selection.condition = select_register(selection, instruction->operands[0]);
+  switch_selection.size = size;
+  switch_selection.default_block = selection->blocks.at(instruction->targets[0]);
+  switch_selection.clusters = cluster_switch_cases(instruction);
+
+  if (switch_selection.clusters.empty()) {
+    emit(selection, MachineOpcode::Jmp, 0, machine_block(switch_selection.default_block));
+    return;
+  }
+
+  long long known_low = size == 4 ? INT_MIN : LLONG_MIN;
+  long long known_high = size == 4 ? INT_MAX : LLONG_MAX;
+  select_switch_tree(selection, &switch_selection, 0, switch_selection.clusters.size() - 1, known_low, known_high);
+}
+
+static void select_root(InstructionSelection* selection, IRInstruction const* instruction)
+{
+  IRValue* const* operands = instruction->operands;
+
+  switch (instruction->opcode) {
+  case IROpcode::Alloca:
+    return;
+
+  case IROpcode::Store: {
+    if (ir_type_is_vector(operands[0]->type)) {
+      unsigned lane_size = ir_type_size(ir_vector_element_type(operands[0]->type));
+      MachineOperand value = select_vector_operand(selection, operands[0], 0);
+      emit(selection, MachineOpcode::VectorStore, lane_size, machine_register(select_register(selection, operands[1])), value);
+      return;
+    }
+
+    unsigned size = type_size(operands[0]->type);
+    MachineOperand value = select_operand(selection, operands[0], true, false);
+    if (!is_alloca(operands[1])) {
+      emit(selection, MachineOpcode::Store, size, machine_register(select_register(selection, operands[1])), value);
+      return;
+    }
+    emit(selection, MachineOpcode::Mov, size, machine_stack_slot(stack_slot_of(selection, operands[1])), value);
+    return;
+  }
+
+  case IROpcode::Br:
+    emit(selection, MachineOpcode::Jmp, 0, machine_block(selection->blocks.at(instruction->targets[0])));
+    return;
+
+  case IROpcode::CondBr: {
+    X86Condition condition = select_condition(selection, operands[0]);
+    emit(selection, MachineOpcode::Jcc, 0, machine_block(selection->blocks.at(instruction->targets[0])))->condition = condition;
+    emit(selection, MachineOpcode::Jmp, 0, machine_block(selection->blocks.at(instruction->targets[1])));
+    return;
+  }
+
+  case IROpcode::Switch:
+    select_switch(selection, instruction);
+    return;
+
+  case IROpcode::Ret:
+    if (instruction->previous && is_sibling_call(instruction->previous))
+      return;
+    if (instruction->operand_count == 1) {
+      unsigned size = type_size(operands[0]->type);
+      emit(selection, MachineOpcode::Mov, size == 8 ? 8 : 4, physical(X86Register::Rax), select_operand(selection, operands[0], true, true));
+    }
+    emit(selection, MachineOpcode::Ret, 0);
+    return;
+
+  case IROpcode::Unreachable:
+    emit(selection, MachineOpcode::Ud2, 0);
+    return;
+
+  case IROpcode::Call:
+    select_call(selection, instruction);
+    return;
+
+  default:
+    if (ir_type_is_vector(instruction->result->type))
+      select_vector(selection, instruction);
+    else
+      select_into(selection, instruction, selection->registers.at(instruction->result));
+    return;
+  }
+}
+
+// decide which instructions are folded into their user
+static void find_folded_instructions(InstructionSelection* selection, IRFunction const* function)
+{
+  std::unordered_map<IRValue const*, unsigned> use_count;
+  std::unordered_map<IRValue const*, IRInstruction const*> user;
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next)
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      for (unsigned i = 0; i < instruction->operand_count; i++) {
+        use_count[instruction->operands[i]]++;
+        user[instruction->operands[i]] = instruction;
+      }
+
+  for (IRBasicBlock const* block = function->first_block; block; block = block->next) {
+    std::vector<IRInstruction const*> instructions;
+    std::unordered_map<IRInstruction const*, size_t> index;
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      index[instruction] = instructions.size();
+      instructions.push_back(instruction);
+    }
+
+    // where each instruction's code ends up, which for folded ones is where their user's is
+    std::vector<size_t> emitted_at(instructions.size());
+    for (size_t i = instructions.size(); i-- > 0;) {
+      IRInstruction const* instruction = instructions[i];
+      emitted_at[i] = i;
+
+      IRValue const* result = instruction->result;
+      if (!result || use_count[result] != 1 || user.at(result)->parent != block || ir_type_is_vector(result->type))
+        continue;
+
+      bool is_foldable = instruction->opcode == IROpcode::ICmp || instruction->opcode == IROpcode::ZExt || instruction->opcode == IROpcode::SExt
+          || instruction->opcode == IROpcode::Trunc || ir_opcode_is_binary_operator(instruction->opcode)
+          || (instruction->opcode == IROpcode::Load && is_alloca(instruction->operands[0]));
+      if (!is_foldable)
+        continue;
+
+      size_t user_position = emitted_at[index.at(user.at(result))];
+      if (instruction->opcode == IROpcode::Load) {
+        bool clobbered = false;
+        for (size_t j = i + 1; j < user_position; j++)
+          clobbered |= ir_instruction_has_side_effects(instructions[j]);
+        if (clobbered)
+          continue;
+      }
+
+      emitted_at[i] = user_position;
+      selection->folded.insert(instruction);
+    }
+  }
+}
+
+MachineFunction* select_x86_64_instructions(IRFunction const* ir_function)
+{
+  MachineFunction* function = new MachineFunction();
+  function->ir_function = ir_function;
+  function->next_virtual_register = first_virtual_register;
+
+  InstructionSelection selection;
+  selection.function = function;
+
+  for (IRBasicBlock const* block = ir_function->first_block; block; block = block->next) {
+    MachineBasicBlock* machine_block = new MachineBasicBlock();
+    machine_block->id = function->blocks.size();
+    function->blocks.push_back(machine_block);
+    selection.blocks[block] = machine_block;
+  }
+
+  find_folded_instructions(&selection, ir_function);
+
+  for (IRBasicBlock const* block = ir_function->first_block; block; block = block->next)
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next) {
+      if (instruction->opcode == IROpcode::Alloca) {
+        selection.stack_slots[instruction->result] = function->stack_slots.size();
+        function->stack_slots.push_back({ type_size(instruction->allocated_type), 0 });
+      } else if (instruction->result && ir_type_is_vector(instruction->result->type)) {
+        selection.vector_slots[instruction->result] = function->stack_slots.size();
+        function->stack_slots.push_back({ ir_type_size(instruction->result->type), 0 });
+      } else if (instruction->result && !selection.folded.contains(instruction)) {
+        selection.registers[instruction->result] = new_virtual_register(&selection);
+      }
+    }
+
+  selection.block = function->blocks.front();
+
+  // the rest of the arguments are on the stack above the return address and saved rbp
+  for (unsigned i = 0; i < ir_function->argument_count; i++) {
+    IRValue const* argument = ir_function->arguments[i];
+    unsigned reg = new_virtual_register(&selection);
+    selection.registers[argument] = reg;
+
+    unsigned size = type_size(argument->type) == 8 ? 8 : 4;
+    if (i < 6) {
+      emit(&selection, MachineOpcode::Mov, size, machine_register(reg), physical(argument_registers[i]));
+    } else {
+      unsigned slot = function->stack_slots.size();
+      function->stack_slots.push_back({ 8, (int)(16 + 8 * (i - 6)) });
+      selection.argument_slots.push_back(slot);
+      emit(&selection, MachineOpcode::Mov, size, machine_register(reg), machine_stack_slot(slot));
+    }
+  }
+
+  for (IRBasicBlock const* block = ir_function->first_block; block; block = block->next) {
+    selection.block = selection.blocks.at(block);
+    for (IRInstruction const* instruction = block->first_instruction; instruction; instruction = instruction->next)
+      if (!selection.folded.contains(instruction))
+        select_root(&selection, instruction);
+  }
+
+  std::vector<MachineBasicBlock*> layout;
+  for (MachineBasicBlock* block : function->blocks) {
+    layout.push_back(block);
+    if (selection.switch_blocks.contains(block)) {
+      std::vector<MachineBasicBlock*> const& added = selection.switch_blocks.at(block);
+      layout.insert(layout.end(), added.begin(), added.end());
+    }
+  }
+  for (unsigned i = 0; i < layout.size(); i++)
+    layout[i]->id = i;
+  function->blocks = layout;
+
+  return function;
+}
@@ -0,0 +1,184 @@
+#include "x86_64.h"
+
+#include <algorithm>
+#include <cassert>
+
+// choosing how to dispatch a switch, the way LLVM's SelectionDAGBuilder does
+//
+// a chain of compares and branches costs one compare per case, which is
+// hopeless for switches with thousands of cases. Instead the cases are
+// sorted and grouped into clusters, and instruction selection finds the
+// right cluster with a balanced tree of comparisons, so a value takes
+// log2(clusters) compares to reach its cluster. Each cluster is one of
+//
+//   a range: consecutive values going to the same place, checked with a
+//   single unsigned compare of value - low against high - low
+//
+//   a jump table: a run of values dense enough that an indirect jmp through
+//   a table with an entry per value, the holes going to the default, beats
+//   the comparisons
+//
+//   bit tests: up to three targets among values less than 64 apart, where
+//   a 64 bit mask per target says which values go there. One bt per target
+//   replaces a compare per case
+//
+// clusters are formed greedily, jump tables first and bit tests out of what
+// is left, with LLVM's thresholds. LLVM finds the fewest jump tables with
+// dynamic programming, which is quadratic in the number of cases
+
+// a jump table needs at least this many ranges, and this many percent of the
+// values it spans need to be cases
+static constexpr size_t minimum_jump_table_ranges = 4;
+static constexpr unsigned long long minimum_jump_table_density = 40;
+
+// entries are 4 bytes each
+static constexpr unsigned long long maximum_jump_table_size = 4096;
+
+// bit tests pay off once they replace enough compares. A single value needs
+// one compare and a range two
+static constexpr unsigned maximum_bit_test_targets = 3;
+static bool is_worth_bit_testing(unsigned targets, unsigned compares)
+{
+  return (targets == 1 && compares >= 3) || (targets == 2 && compares >= 5) || (targets == 3 && compares >= 6);
+}
+
+// how many values from low to high, which can be all of them for an i64
+static unsigned long long span(long long low, long long high) { return (unsigned long long)high - (unsigned long long)low + 1; }
+
+static long long sign_extend(long long value, unsigned bits)
+{
+  if (bits >= 64)
+    return value;
+  unsigned long long shifted = (unsigned long long)value << (64 - bits);
+  return (long long)shifted >> (64 - bits);
+}
+
+static SwitchCluster range_cluster(long long low, long long high, IRBasicBlock* target)
+{
+  return { SwitchClusterKind::Range, low, high, { target }, {} };
+}
+
+static std::vector<SwitchCluster> merge_into_ranges(IRInstruction const* switch_instruction)
+{
+  unsigned bits = 8 * ir_type_size(switch_instruction->operands[0]->type);
+
+  std::vector<std::pair<long long, IRBasicBlock*>> cases;
+  for (unsigned i = 1; i < switch_instruction->target_count; i++)
+    cases.push_back({ sign_extend(switch_instruction->case_values[i - 1], bits), switch_instruction->targets[i] });
+  std::sort(cases.begin(), cases.end(), [](auto const& a, auto const& b) { return a.first < b.first; });
+
+  std::vector<SwitchCluster> ranges;
+  for (auto [value, target] : cases) {
+    SwitchCluster* last = ranges.empty() ? nullptr : &ranges.back();
+    if (last && last->targets[0] == target && value - 1 == last->high)
+      last->high = value;
+    else
+      ranges.push_back(range_cluster(value, value, target));
+  }
+  return ranges;
+}
+
+static SwitchCluster jump_table_cluster(std::vector<SwitchCluster> const* ranges, size_t first, size_t last, IRBasicBlock* default_target)
+{
+  long long low = (*ranges)[first].low;
+  long long high = (*ranges)[last].high;
+
+  SwitchCluster cluster = { SwitchClusterKind::JumpTable, low, high, std::vector<IRBasicBlock*>(span(low, high), default_target), {} };
+  for (size_t i = first; i <= last; i++)
+    for (long long value = (*ranges)[i].low;; value++) {
+      cluster.targets[value - low] = (*ranges)[i].targets[0];
+      if (value == (*ranges)[i].high)
+        break;
+    }
+  return cluster;
+}
+
+// the longest run of ranges from first that's dense enough for a table, or
+// first itself if there isn't one
+static size_t find_jump_table(std::vector<SwitchCluster> const* ranges, size_t first)
+{
+  size_t best = first;
+  unsigned long long covered = 0;
+  for (size_t last = first; last < ranges->size(); last++) {
+    unsigned long long table_size = span((*ranges)[first].low, (*ranges)[last].high);
+    if (table_size == 0 || table_size > maximum_jump_table_size)
+      break;
+
+    covered += span((*ranges)[last].low, (*ranges)[last].high);
+    if (last - first + 1 >= minimum_jump_table_ranges && covered * 100 >= table_size * minimum_jump_table_density)
+      best = last;
+  }
+  return best;
+}
+
+// the same for bit tests, among ranges that aren't in a jump table
+static size_t find_bit_tests(std::vector<SwitchCluster> const* clusters, size_t first)
+{
+  size_t best = first;
+  std::vector<IRBasicBlock*> targets;
+  unsigned compares = 0;
+  for (size_t last = first; last < clusters->size(); last++) {
+    SwitchCluster const* cluster = &(*clusters)[last];
+    if (cluster->kind != SwitchClusterKind::Range || span((*clusters)[first].low, cluster->high) > 64)
+      break;
+
+    if (std::find(targets.begin(), targets.end(), cluster->targets[0]) == targets.end())
+      targets.push_back(cluster->targets[0]);
+    if (targets.size() > maximum_bit_test_targets)
+      break;
+
+    compares += cluster->low == cluster->high ? 1 : 2;
+    if (last > first && is_worth_bit_testing(targets.size(), compares))
+      best = last;
+  }
+  return best;
+}
+
+static SwitchCluster bit_test_cluster(std::vector<SwitchCluster> const* clusters, size_t first, size_t last)
+{
+  long long low = (*clusters)[first].low;
+  SwitchCluster cluster = { SwitchClusterKind::BitTest, low, (*clusters)[last].high, {}, {} };
+
+  for (size_t i = first; i <= last; i++) {
+    SwitchCluster const* range = &(*clusters)[i];
+    size_t target = std::find(cluster.targets.begin(), cluster.targets.end(), range->targets[0]) - cluster.targets.begin();
+    if (target == cluster.targets.size()) {
+      cluster.targets.push_back(range->targets[0]);
+      cluster.masks.push_back(0);
+    }
+
+    for (long long value = range->low;; value++) {
+      cluster.masks[target] |= 1ull << (value - low);
+      if (value == range->high)
+        break;
+    }
+  }
+  return cluster;
+}
+
+std::vector<SwitchCluster> cluster_switch_cases(IRInstruction const* switch_instruction)
+{
+  assert(switch_instruction->opcode == IROpcode::Switch);
+  std::vector<SwitchCluster> ranges = merge_into_ranges(switch_instruction);
+
+  std::vector<SwitchCluster> with_tables;
+  for (size_t first = 0; first < ranges.size();) {
+    size_t last = find_jump_table(&ranges, first);
+    if (last == first)
+      with_tables.push_back(ranges[first]);
+    else
+      with_tables.push_back(jump_table_cluster(&ranges, first, last, switch_instruction->targets[0]));
+    first = last + 1;
+  }
+
+  std::vector<SwitchCluster> clusters;
+  for (size_t first = 0; first < with_tables.size();) {
+    size_t last = find_bit_tests(&with_tables, first);
+    if (last == first)
+      clusters.push_back(with_tables[first]);
+    else
+      clusters.push_back(bit_test_cluster(&with_tables, first, last));
+    first = last + 1;
+  }
+  return clusters;
+}
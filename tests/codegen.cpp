@@ -0,0 +1,1311 @@
+#include "codegen.h"
+#include "compilation_cache.h"
+#include "incremental.h"
+#include "ir.h"
+#include "optimize.h"
+#include "parser.h"
+#include "pipeline.h"
+#include "precompiled_header.h"
+#include "preprocessor.h"
+#include "profile.h"
+#include "server.h"
+#include "symbol_index.h"
+
+#include <cassert>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+static std::string module_to_string(IRModule const* module)
+{
+  char* buffer = nullptr;
+  size_t size = 0;
+  FILE* stream = open_memstream(&buffer, &size);
+  print_ir_module(module, stream);
+  fclose(stream);
+
+  std::string text(buffer, size);
+  free(buffer);
+  return text;
+}
+
+static unsigned count_occurrences(std::string const& text, char const* needle)
+{
+  unsigned count = 0;
+  for (size_t position = text.find(needle); position != std::string::npos; position = text.find(needle, position + 1))
+    count++;
+  return count;
+}
+
+static IRModule* compile(char const* source, unsigned optimization_level, OptimizationStatistics* statistics)
+{
+  ExternalDeclaration* declarations = parse_translation_unit(source);
+  IRModule* module = lower_translation_unit(declarations);
+  optimize_ir_module(module, optimization_level, statistics);
+
+#ifdef TEST_VERBOSE
+  printf("%s", module_to_string(module).c_str());
+#endif
+
+  return module;
+}
+
+// tests are run from the top of the repository, see run_tests.sh
+static std::string read_test_file(char const* path)
+{
+  FILE* file = fopen(path, "rb");
+  assert(file);
+  std::string contents;
+  char buffer[4096];
+  for (size_t size; (size = fread(buffer, 1, sizeof(buffer), file)) > 0;)
+    contents.append(buffer, size);
+  fclose(file);
+  return contents;
+}
+
+void test1()
+{
+  printf("Running codegen test 1: tests/codegen/add_two_numbers...\n");
+
+  std::string source = read_test_file("tests/codegen/add_two_numbers/add.c");
+  std::string expected = read_test_file("tests/codegen/add_two_numbers/add.ll");
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  IRModule* module = compile(source.c_str(), 0, &statistics);
+  assert(module_to_string(module) == expected);
+
+  printf("test 1 passed\n\n");
+}
+
+void test2()
+{
+  printf("Running codegen test 2: if/else control flow...\n");
+
+  char const* source = "int f(int a)\n"
+                       "{\n"
+                       "  if (a < 3) { return 1; } else { return 2; }\n"
+                       "  return 3;\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string text = module_to_string(compile(source, 0, &statistics));
+
+  assert(count_occurrences(text, "icmp slt i32") == 1);
+  assert(count_occurrences(text, "br i1") == 1);
+  // return 3 can't be reached, so its block is dropped
+  assert(count_occurrences(text, "ret i32") == 2);
+
+  printf("test 2 passed\n\n");
+}
+
+void test3()
+{
+  printf("Running codegen test 3: value numbering a*b + a*b*c...\n");
+
+  char const* source = "int f(int a, int b, int c)\n"
+                       "{\n"
+                       "  return a*b + a*b*c;\n"
+                       "}\n";
+
+  OptimizationStatistics unoptimized_statistics = new_optimization_statistics();
+  std::string unoptimized = module_to_string(compile(source, 0, &unoptimized_statistics));
+  assert(count_occurrences(unoptimized, "mul i32") == 3);
+  assert(unoptimized_statistics.value_numbering_eliminated == 0);
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  // every load is forwarded from the parameter's store, which leaves the
+  // second a*b identical to the first
+  assert(count_occurrences(optimized, "mul i32") == 2);
+  assert(count_occurrences(optimized, "load i32") == 0);
+  assert(statistics.value_numbering_eliminated == 6);
+
+  printf("test 3 passed\n\n");
+}
+
+void test4()
+{
+  printf("Running codegen test 4: value numbering is dominator scoped...\n");
+
+  // a*b in the entry block dominates the one in if.then, but neither branch
+  // of an if/else dominates the other
+  char const* source = "int f(int a, int b)\n"
+                       "{\n"
+                       "  int x = a*b;\n"
+                       "  if (a) { return a*b; }\n"
+                       "  if (b) { return a - b; } else { return a - b; }\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(count_occurrences(optimized, "mul i32") == 1);
+  assert(count_occurrences(optimized, "sub i32") == 2);
+
+  printf("test 4 passed\n\n");
+}
+
+void test5()
+{
+  printf("Running codegen test 5: loads after a merge are not reused...\n");
+
+  // the merge point after the if/else has two predecessors, so a and b are
+  // loaded again, and a*b is recomputed from the new loads
+  char const* source = "int f(int a, int b)\n"
+                       "{\n"
+                       "  int x = a*b;\n"
+                       "  if (a) { int y = 1; } else { int z = 2; }\n"
+                       "  return x - a*b;\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(count_occurrences(optimized, "mul i32") == 2);
+
+  printf("test 5 passed\n\n");
+}
+
+void test6()
+{
+  printf("Running codegen test 6: dead code and dead stores...\n");
+
+  // unused is stored but never read, and once its loads are forwarded
+  // nothing reads the parameters' allocas either
+  char const* source = "int f(int a, int b)\n"
+                       "{\n"
+                       "  int unused = a*b;\n"
+                       "  int z = a + b;\n"
+                       "  return z;\n"
+                       "}\n";
+
+  char const* expected = "define i32 @f(i32 %0, i32 %1){\n"
+                         "entry:\n"
+                         "  %2 = add i32 %0, %1\n"
+                         "  ret i32 %2\n"
+                         "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(optimized == expected);
+  assert(statistics.dead_stores_eliminated == 4);
+  // the mul and the four allocas
+  assert(statistics.dead_code_eliminated == 5);
+
+  printf("test 6 passed\n\n");
+}
+
+void test7()
+{
+  printf("Running codegen test 7: hoisting out of nested loops...\n");
+
+  // a*b doesn't change in either loop, so it goes all the way out. a*b + i
+  // changes with the outer loop only, so it goes to the inner loop's preheader
+  char const* source = "int f(int n, int a, int b)\n"
+                       "{\n"
+                       "  int total = 0;\n"
+                       "  for (int i = 0; i < n; i++) {\n"
+                       "    int j = 0;\n"
+                       "    while (j < n) {\n"
+                       "      total += a*b + i;\n"
+                       "      j++;\n"
+                       "    }\n"
+                       "  }\n"
+                       "  return total;\n"
+                       "}\n";
+
+  OptimizationStatistics unoptimized_statistics = new_optimization_statistics();
+  std::string unoptimized = module_to_string(compile(source, 0, &unoptimized_statistics));
+  assert(unoptimized.find("mul i32") > unoptimized.find("while.body"));
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(count_occurrences(optimized, "mul i32") == 1);
+  assert(optimized.find("mul i32") < optimized.find("for.cond"));
+
+  size_t invariant_add = optimized.find("add i32 %6, %7");
+  assert(invariant_add != std::string::npos);
+  assert(invariant_add > optimized.find("for.body"));
+  assert(invariant_add < optimized.find("while.cond"));
+
+  assert(statistics.licm_hoisted > 0);
+
+  printf("test 7 passed\n\n");
+}
+
+void test8()
+{
+  printf("Running codegen test 8: only hoisting what can't trap...\n");
+
+  // hoisting runs the division even if the loop doesn't, so n / d stays put
+  // in case d is 0, while n / 4 moves
+  char const* source = "int f(int n, int d)\n"
+                       "{\n"
+                       "  int total = 0;\n"
+                       "  int i = 0;\n"
+                       "  while (i < n) {\n"
+                       "    total += n / d + n / 4;\n"
+                       "    i++;\n"
+                       "  }\n"
+                       "  return total;\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(optimized.find("sdiv i32 %0, 4") < optimized.find("while.cond"));
+  assert(optimized.find("sdiv i32 %0, %1") > optimized.find("while.body"));
+
+  printf("test 8 passed\n\n");
+}
+
+void test9()
+{
+  printf("Running codegen test 9: inlining static helpers...\n");
+
+  // square and add are only called once each, by sum_of_squares, and once
+  // they're inlined nothing calls them, so they're deleted
+  char const* source = "static int square(int x) { return x * x; }\n"
+                       "static int add(int a, int b) { return a + b; }\n"
+                       "int sum_of_squares(int a, int b)\n"
+                       "{\n"
+                       "  return add(square(a), square(b));\n"
+                       "}\n";
+
+  OptimizationStatistics unoptimized_statistics = new_optimization_statistics();
+  std::string unoptimized = module_to_string(compile(source, 0, &unoptimized_statistics));
+  assert(count_occurrences(unoptimized, "define internal i32 @square") == 1);
+  assert(count_occurrences(unoptimized, "call i32 @square") == 2);
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(count_occurrences(optimized, "call") == 0);
+  assert(count_occurrences(optimized, "define") == 1);
+  assert(count_occurrences(optimized, "mul i32 %0, %0") == 1);
+  assert(count_occurrences(optimized, "mul i32 %1, %1") == 1);
+  assert(statistics.inliner_call_sites_inlined == 3);
+  assert(statistics.inliner_functions_deleted == 2);
+
+  // with two returns the return value stays in memory, still tagged
+  char const* two_returns = "static int clamp(int x)\n"
+                            "{\n"
+                            "  if (x < 0)\n"
+                            "    return 0;\n"
+                            "  return x;\n"
+                            "}\n"
+                            "int f(int a) { return clamp(a) + 1; }\n";
+  statistics = new_optimization_statistics();
+  optimized = module_to_string(compile(two_returns, 1, &statistics));
+  assert(statistics.inliner_call_sites_inlined == 1);
+  assert(count_occurrences(optimized, " = load ") == 1);
+  assert(count_occurrences(optimized, " = load ") + count_occurrences(optimized, "store ") == count_occurrences(optimized, ", !tbaa !"));
+
+  printf("test 9 passed\n\n");
+}
+
+void test10()
+{
+  printf("Running codegen test 10: what the inliner leaves alone...\n");
+
+  // countdown calls itself, and big is over the threshold and external, so
+  // it has to be kept around anyway. Calls to declarations can't be inlined
+  char const* source = "int external(int x);\n"
+                       "int countdown(int n)\n"
+                       "{\n"
+                       "  if (n < 1)\n"
+                       "    return 0;\n"
+                       "  return countdown(n - 1) + 1;\n"
+                       "}\n"
+                       "int big(int a, int b)\n"
+                       "{\n"
+                       "  int total = 0;\n"
+                       "  for (int i = 0; i < a; i++) {\n"
+                       "    total += a * b - i;\n"
+                       "    total = total ^ b + i << 2;\n"
+                       "    total = total % 1000 + a / 3 - b / 7;\n"
+                       "    total = total * 3 + i * a;\n"
+                       "    total = total - a * 5 + b * 9;\n"
+                       "    total = total / 2 + i % 3;\n"
+                       "    total = total * a - b * i + 11;\n"
+                       "    total = total % 9999 + a * i - b / 5;\n"
+                       "    total = total ^ a * 7 + b;\n"
+                       "  }\n"
+                       "  return total;\n"
+                       "}\n"
+                       "int main()\n"
+                       "{\n"
+                       "  return big(3, 4) + big(5, 6) + external(countdown(3));\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(count_occurrences(optimized, "declare i32 @external(i32)") == 1);
+  assert(count_occurrences(optimized, "call i32 @external") == 1);
+  assert(count_occurrences(optimized, "call i32 @big") == 2);
+
+  // countdown is inlined into main once, but never into itself
+  assert(count_occurrences(optimized, "call i32 @countdown") == 2);
+  assert(statistics.inliner_call_sites_inlined == 1);
+  assert(statistics.inliner_functions_deleted == 0);
+
+  printf("test 10 passed\n\n");
+}
+
+void test11()
+{
+  printf("Running codegen test 11: vectorizing loops over arrays...\n");
+
+  // add's arrays could overlap, so a and b, and a and c, are checked at run
+  // time before taking the vector loop. scale's are restrict, so there's no
+  // check, and k is splatted across a vector once before the loop
+  char const* source = "void add(int *a, int *b, int *c, int n)\n"
+                       "{\n"
+                       "  for (int i = 0; i < n; i++)\n"
+                       "    a[i] = b[i] + c[i];\n"
+                       "}\n"
+                       "void scale(int *restrict a, int *restrict b, int k, int n)\n"
+                       "{\n"
+                       "  for (int i = 0; i < n; i++)\n"
+                       "    a[i] = b[i] * k;\n"
+                       "}\n";
+
+  OptimizationStatistics unoptimized_statistics = new_optimization_statistics();
+  std::string unoptimized = module_to_string(compile(source, 0, &unoptimized_statistics));
+  assert(count_occurrences(unoptimized, "<4 x i32>") == 0);
+  assert(count_occurrences(unoptimized, "define void @scale(ptr noalias %0, ptr noalias %1, i32 %2, i32 %3)") == 1);
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(statistics.loop_vectorization_loops_vectorized == 2);
+  assert(statistics.loop_vectorization_alias_checks == 2);
+  assert(count_occurrences(optimized, "load <4 x i32>") == 3);
+  assert(count_occurrences(optimized, "store <4 x i32>") == 2);
+  assert(count_occurrences(optimized, "add <4 x i32>") == 1);
+  assert(count_occurrences(optimized, "mul <4 x i32>") == 1);
+  assert(count_occurrences(optimized, "shufflevector") == 1);
+  assert(count_occurrences(optimized, "icmp ule ptr") == 4);
+
+  // the original loops are still there for the last few elements
+  assert(count_occurrences(optimized, "load i32, ptr") == 8);
+  assert(count_occurrences(optimized, "mul i32") == 1);
+
+  // the vector loop's loads and stores are tagged like the scalar loop's
+  assert(count_occurrences(optimized, " = load ") + count_occurrences(optimized, "store ") == count_occurrences(optimized, ", !tbaa !"));
+
+  printf("test 11 passed\n\n");
+}
+
+void test12()
+{
+  printf("Running codegen test 12: qualifiers and function specifiers...\n");
+
+  // the volatile local keeps every load and store even at -O1, where the
+  // plain one is forwarded away. Nothing runs after a call to fail, and
+  // clamp is small enough to inline only because it's declared inline
+  char const* source = "_Noreturn void fail(int code);\n"
+                       "static inline int clamp(int x, int lo, int hi)\n"
+                       "{\n"
+                       "  if (x < lo)\n"
+                       "    return lo;\n"
+                       "  if (x > hi)\n"
+                       "    return hi;\n"
+                       "  int y = x;\n"
+                       "  y = y + lo;\n"
+                       "  y = y - lo;\n"
+                       "  y = y * 1;\n"
+                       "  return y;\n"
+                       "}\n"
+                       "int poll(volatile int *status, int limit)\n"
+                       "{\n"
+                       "  volatile int spins = 0;\n"
+                       "  int plain = 0;\n"
+                       "  while (status[0] < 1) {\n"
+                       "    spins++;\n"
+                       "    plain++;\n"
+                       "    if (spins > limit)\n"
+                       "      fail(spins + plain);\n"
+                       "  }\n"
+                       "  return clamp(spins, 0, 100) + clamp(plain, 0, 100);\n"
+                       "}\n";
+
+  OptimizationStatistics unoptimized_statistics = new_optimization_statistics();
+  std::string unoptimized = module_to_string(compile(source, 0, &unoptimized_statistics));
+  assert(count_occurrences(unoptimized, "declare void @fail(i32) noreturn") == 1);
+  assert(count_occurrences(unoptimized, "define internal i32 @clamp(i32 %0, i32 %1, i32 %2) inlinehint{") == 1);
+  assert(count_occurrences(unoptimized, "call void @fail") == 1);
+  assert(count_occurrences(unoptimized, "unreachable") == 1);
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string optimized = module_to_string(compile(source, 1, &statistics));
+
+  assert(count_occurrences(optimized, "load volatile i32, ptr %0") == 0);
+  assert(count_occurrences(optimized, "store volatile i32") == 2);
+  assert(count_occurrences(optimized, "load volatile i32") == 5);
+  assert(count_occurrences(optimized, "call i32 @clamp") == 0);
+  assert(statistics.inliner_call_sites_inlined == 2);
+
+  printf("test 12 passed\n\n");
+}
+
+void test13()
+{
+  printf("Running codegen test 13: type based alias analysis metadata...\n");
+
+  // signed and unsigned share a node, char is the parent of everything, and
+  // pointers hang off any pointer by what they point to
+  char const* source = "int f(int *a, unsigned int *b, short *s, char *c, int **p, void **v)\n"
+                       "{\n"
+                       "  a[0] = b[0];\n"
+                       "  s[0] = 1;\n"
+                       "  c[0] = 2;\n"
+                       "  p[0] = a;\n"
+                       "  v[0] = a;\n"
+                       "  return a[0];\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string module = module_to_string(compile(source, 0, &statistics));
+
+  assert(count_occurrences(module, "!0 = !{!\"Simple C/C++ TBAA\"}") == 1);
+  assert(count_occurrences(module, "!1 = !{!\"omnipotent char\", !0, i64 0}") == 1);
+  assert(count_occurrences(module, "!{!\"int\", !1, i64 0}") == 1);
+  assert(count_occurrences(module, "!{!\"short\", !1, i64 0}") == 1);
+  assert(count_occurrences(module, "!{!1, !1, i64 0}") == 1);
+  assert(count_occurrences(module, "!{!\"p1 int\", !") == 1);
+  assert(count_occurrences(module, "!{!\"any pointer\", !1, i64 0}") == 1);
+  assert(count_occurrences(module, "!{!\"unsigned") == 0);
+
+  // every load and store is tagged
+  assert(count_occurrences(module, " = load ") == count_occurrences(module, ", !tbaa !") - count_occurrences(module, "store "));
+  assert(count_occurrences(module, "store ") == 11);
+
+  printf("test 13 passed\n\n");
+}
+
+void test14()
+{
+  printf("Running codegen test 14: switch statements...\n");
+
+  // stacked labels share a block, case values are constant expressions, a
+  // case can fall through into the default, and the default needn't be last
+  char const* source = "int classify(int c)\n"
+                       "{\n"
+                       "  int kind = 0;\n"
+                       "  switch (c) {\n"
+                       "  case 97:\n"
+                       "  case 101:\n"
+                       "    kind = 1;\n"
+                       "    break;\n"
+                       "  case 10 * 10:\n"
+                       "    kind = 2;\n"
+                       "  default:\n"
+                       "    kind = kind + 3;\n"
+                       "    break;\n"
+                       "  case 7:\n"
+                       "    return 4;\n"
+                       "  }\n"
+                       "  return kind;\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string module = module_to_string(compile(source, 0, &statistics));
+
+  assert(count_occurrences(module, "switch i32 %3, label %switch.default6 [\n"
+                                   "    i32 97, label %switch.case3\n"
+                                   "    i32 101, label %switch.case3\n"
+                                   "    i32 100, label %switch.case5\n"
+                                   "    i32 7, label %switch.case8\n"
+                                   "  ]\n")
+      == 1);
+  assert(count_occurrences(module, "switch.case5:\n  store i32 2, ptr %2, !tbaa !3\n  br label %switch.default6\n") == 1);
+  assert(count_occurrences(module, "br label %switch.end2") == 2);
+
+  // a long long condition keeps its width, and case values are converted to it
+  source = "int f(long long x)\n"
+           "{\n"
+           "  switch (x) {\n"
+           "  case 0 - 1:\n"
+           "    return 1;\n"
+           "  }\n"
+           "  return 0;\n"
+           "}\n";
+  module = module_to_string(compile(source, 1, &statistics));
+  assert(count_occurrences(module, "switch i64 %0, label %switch.end2 [\n    i64 -1, label %switch.case3\n  ]") == 1);
+
+  printf("test 14 passed\n\n");
+}
+
+void test15()
+{
+  printf("Running codegen test 15: logical operators and conditionals...\n");
+
+  // conditions branch on each comparison directly, cheap ?: arms are
+  // selected between, and p[0] isn't read unless n > 0
+  char const* source = "int both(int a, int b, int c)\n"
+                       "{\n"
+                       "  if (a < b && !(b < c))\n"
+                       "    return 1;\n"
+                       "  return 0;\n"
+                       "}\n"
+                       "int pick(int a, int b) { return a < b ? a : b; }\n"
+                       "int guarded(int *p, int n) { return n > 0 && p[0] > 3; }\n"
+                       "int inverted(int a, int b) { return !(a < b); }\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string module = module_to_string(compile(source, 0, &statistics));
+
+  assert(count_occurrences(module, "%8 = icmp slt i32 %6, %7\n  br i1 %8, label %land.rhs3, label %if.end2\n") == 1);
+  assert(count_occurrences(module, "%11 = icmp slt i32 %9, %10\n  br i1 %11, label %if.end2, label %if.then1\n") == 1);
+  assert(count_occurrences(module, "%9 = select i1 %6, i32 %7, i32 %8\n") == 1);
+  assert(count_occurrences(module, "br i1 %6, label %land.rhs3, label %land.end2\n") == 1);
+  assert(count_occurrences(module, "%6 = icmp sge i32 %4, %5\n  %7 = zext i1 %6 to i32\n") == 1);
+  assert(count_occurrences(module, "icmp ne") == 0);
+
+  // a && b with a cheap b is a select, and ?: is right associative
+  source = "int f(int a, int b, int c) { return a < b && b < c; }\n"
+           "int g(int a, int b, int c) { return a ? b : c ? a : 3; }\n";
+  module = module_to_string(compile(source, 1, &statistics));
+  assert(count_occurrences(module, "select i1 %3, i1 %4, i1 false") == 1);
+  assert(count_occurrences(module, "select i1") == 3);
+  assert(count_occurrences(module, "br i1") == 0);
+
+  printf("test 15 passed\n\n");
+}
+
+void test16()
+{
+  printf("Running codegen test 16: tail calls...\n");
+
+  // a matching prototype makes it musttail, a different one tail, and a
+  // result that's converted before it's returned isn't a tail call at all
+  char const* source = "int odd(int n);\n"
+                       "int even(int n)\n"
+                       "{\n"
+                       "  if (!n)\n"
+                       "    return 1;\n"
+                       "  return odd(n - 1);\n"
+                       "}\n"
+                       "int odd(int n)\n"
+                       "{\n"
+                       "  if (!n)\n"
+                       "    return 0;\n"
+                       "  return even(n - 1);\n"
+                       "}\n"
+                       "int twice(int a, int b) { return even(a + b); }\n"
+                       "long long wide(int n) { return odd(n); }\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string module = module_to_string(compile(source, 0, &statistics));
+  assert(count_occurrences(module, "%6 = musttail call i32 @odd(i32 %5)\n  ret i32 %6\n") == 1);
+  assert(count_occurrences(module, "%6 = musttail call i32 @even(i32 %5)\n  ret i32 %6\n") == 1);
+  assert(count_occurrences(module, "%7 = tail call i32 @even(i32 %6)\n  ret i32 %7\n") == 1);
+  assert(count_occurrences(module, "%3 = call i32 @odd(i32 %2)\n  %4 = sext i32 %3 to i64\n") == 1);
+
+  // self recursion becomes a loop
+  source = "int sum(int n, int total)\n"
+           "{\n"
+           "  if (!n)\n"
+           "    return total;\n"
+           "  return sum(n - 1, total + n);\n"
+           "}\n";
+  module = module_to_string(compile(source, 1, &statistics));
+  assert(statistics.tail_calls_eliminated == 1);
+  assert(count_occurrences(module, "call") == 0);
+  assert(count_occurrences(module, "br label %tailrecurse") == 2);
+  assert(count_occurrences(module, " = load ") + count_occurrences(module, "store ") == count_occurrences(module, ", !tbaa !"));
+
+  printf("test 16 passed\n\n");
+}
+
+void test17()
+{
+  printf("Running codegen test 17: profile guided optimization...\n");
+
+  char const* source = "int f(int n)\n"
+                       "{\n"
+                       "  if (n < 3)\n"
+                       "    return 1;\n"
+                       "  return 2;\n"
+                       "}\n";
+
+  // a counter for the entry and one for each way out of the if, each bumped
+  // in a block of its own
+  IRModule* instrumented = lower_translation_unit(parse_translation_unit(source));
+  instrument_ir_module(instrumented);
+  std::string module = module_to_string(instrumented);
+  assert(count_occurrences(module, "@__miniclang_profile_counters_f = private global [3 x i64] zeroinitializer\n") == 1);
+  assert(count_occurrences(module, "@__miniclang_profile_name_f = private constant [2 x i8] c\"f\\00\"\n") == 1);
+  assert(count_occurrences(module, "section \"miniclang_profile\"") == 1);
+  assert(count_occurrences(module, "@__miniclang_profile_runtime = external global i32\n") == 1);
+  assert(count_occurrences(module, "@llvm.used = appending global [2 x ptr]") == 1);
+  assert(count_occurrences(module, "label %prof.edge") == 2);
+  assert(count_occurrences(module, "add i64") == 3);
+  assert(count_occurrences(module, "!{!\"miniclang profile counter\", !1, i64 0}") == 1);
+  assert(count_occurrences(module, " = load ") + count_occurrences(module, "store ") == count_occurrences(module, ", !tbaa !"));
+
+  // the hash the runtime would have written
+  size_t hash_start = module.find("i64 ", module.find("ptr @__miniclang_profile_counters_f, ")) + 4;
+  std::string hash = module.substr(hash_start, module.find(',', hash_start) - hash_start);
+
+  Profile profile;
+  std::string text = "miniclang profile\nf " + hash + " 3\n100 90 10\n";
+  FILE* file = fmemopen((void*)text.data(), text.size(), "r");
+  assert(read_profile(file, &profile));
+  fclose(file);
+
+  IRModule* optimized = lower_translation_unit(parse_translation_unit(source));
+  apply_profile(optimized, &profile);
+  module = module_to_string(optimized);
+  assert(count_occurrences(module, "define i32 @f(i32 %0) !prof !4{\n") == 1);
+  assert(count_occurrences(module, ", !prof !5\n") == 1);
+  assert(count_occurrences(module, "!4 = !{!\"function_entry_count\", i64 100}\n") == 1);
+  assert(count_occurrences(module, "!5 = !{!\"branch_weights\", i32 90, i32 10}\n") == 1);
+
+  // counts for code that has changed since are ignored
+  profile["f"].counts.push_back(0);
+  optimized = lower_translation_unit(parse_translation_unit(source));
+  apply_profile(optimized, &profile);
+  assert(count_occurrences(module_to_string(optimized), "!prof") == 0);
+
+  printf("test 17 passed\n\n");
+}
+
+void test18()
+{
+  printf("Running codegen test 18: hot/cold splitting...\n");
+
+  // the error path moves out into a function of its own, and a function that
+  // always ends up in a _Noreturn one is cold as a whole
+  char const* source = "_Noreturn void fail(int code);\n"
+                       "int check(int *p, int n)\n"
+                       "{\n"
+                       "  int total = 0;\n"
+                       "  for (int i = 0; i < n; i++) {\n"
+                       "    if (p[i] > 1000) {\n"
+                       "      int a = p[i] * 3;\n"
+                       "      int b = a + n;\n"
+                       "      fail(a + b * 7);\n"
+                       "    }\n"
+                       "    total = total + p[i];\n"
+                       "  }\n"
+                       "  return total;\n"
+                       "}\n"
+                       "void die(int code) { fail(code + 1); }\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string module = module_to_string(compile(source, 1, &statistics));
+  assert(statistics.hot_cold_regions_outlined == 1);
+  assert(statistics.hot_cold_cold_functions == 1);
+  assert(count_occurrences(module, "codeRepl8:\n  call void @check.cold.1(ptr %7, i32 %1)\n  unreachable\n") == 1);
+  assert(count_occurrences(module, "define internal void @check.cold.1(ptr %0, i32 %1) noreturn cold section \".text.unlikely\"{\n") == 1);
+  assert(count_occurrences(module, "define void @die(i32 %0) cold section \".text.unlikely\"{\n") == 1);
+  assert(count_occurrences(module, "define i32 @check(ptr %0, i32 %1){\n") == 1);
+
+  // a branch the profile never saw taken is cold even if it returns, and the
+  // function that runs the most is hot
+  source = "int compute(int n)\n"
+           "{\n"
+           "  if (n > 100) {\n"
+           "    int a = n * 3;\n"
+           "    int b = a * a;\n"
+           "    return a + b * 7;\n"
+           "  }\n"
+           "  return n + 1;\n"
+           "}\n"
+           "int never(int n) { return n * 2; }\n";
+
+  Profile profile;
+  profile["compute"].counts = { 1000, 0, 1000 };
+  profile["never"].counts = { 0 };
+
+  // the hashes come from the instrumented IR's data records
+  IRModule* instrumented = lower_translation_unit(parse_translation_unit(source));
+  instrument_ir_module(instrumented);
+  module = module_to_string(instrumented);
+  for (auto& [name, function_profile] : profile) {
+    size_t hash_start = module.find("i64 ", module.find("ptr @__miniclang_profile_counters_" + name + ", ")) + 4;
+    function_profile.hash = strtoull(module.substr(hash_start).c_str(), nullptr, 10);
+  }
+
+  IRModule* profiled = lower_translation_unit(parse_translation_unit(source));
+  apply_profile(profiled, &profile);
+  statistics = new_optimization_statistics();
+  optimize_ir_module(profiled, 1, &statistics);
+  module = module_to_string(profiled);
+  assert(statistics.hot_cold_regions_outlined == 1);
+  assert(count_occurrences(module, "define i32 @compute(i32 %0) hot section \".text.hot\"") == 1);
+  assert(count_occurrences(module, "define i32 @never(i32 %0) cold section \".text.unlikely\"") == 1);
+  assert(count_occurrences(module, "define internal i32 @compute.cold.1(i32 %0) cold section \".text.unlikely\"{\n") == 1);
+  assert(count_occurrences(module, "  %2 = call i32 @compute.cold.1(i32 %0)\n  ret i32 %2\n") == 1);
+
+  printf("test 18 passed\n\n");
+}
+
+void test19()
+{
+  printf("Running codegen test 19: static branch prediction...\n");
+
+  char const* source = "_Noreturn void fail(int code);\n"
+                       "int f(int *p, int n)\n"
+                       "{\n"
+                       "  if (!p)\n"
+                       "    return 0;\n"
+                       "  int total = 0;\n"
+                       "  while (n > 0) {\n"
+                       "    if (n < 0)\n"
+                       "      fail(n);\n"
+                       "    total = total + p[0];\n"
+                       "    n = n - 1;\n"
+                       "  }\n"
+                       "  if (!total)\n"
+                       "    return 7;\n"
+                       "  return total;\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  IRModule* module = compile(source, 0, &statistics);
+  estimate_branch_weights(module);
+  std::string text = module_to_string(module);
+
+  // p is likely not null, the loop likely goes round again, fail likely
+  // isn't called and total likely isn't 0
+  assert(count_occurrences(text, "%6 = icmp ne ptr %5, null\n  br i1 %6, label %if.end2, label %if.then1, !prof !7\n") == 1);
+  assert(count_occurrences(text, "br i1 %8, label %while.body4, label %while.end5, !prof !8\n") == 1);
+  assert(count_occurrences(text, "br i1 %10, label %if.then6, label %if.end7, !prof !9\n") == 1);
+  assert(count_occurrences(text, "br i1 %20, label %if.end10, label %if.then9, !prof !10\n") == 1);
+  assert(count_occurrences(text, "!7 = !{!\"branch_weights\", i32 60, i32 40}\n") == 1);
+  assert(count_occurrences(text, "!8 = !{!\"branch_weights\", i32 88, i32 12}\n") == 1);
+  assert(count_occurrences(text, "!9 = !{!\"branch_weights\", i32 1, i32 1048575}\n") == 1);
+  assert(count_occurrences(text, "!10 = !{!\"branch_weights\", i32 84, i32 16}\n") == 1);
+
+  // a switch's case that calls fail is as good as never taken. Nothing tells
+  // the targets of the second one apart
+  source = "_Noreturn void fail(int code);\n"
+           "int h(int c)\n"
+           "{\n"
+           "  switch (c) {\n"
+           "  case 1:\n"
+           "    fail(c);\n"
+           "  case 2:\n"
+           "    c = 5;\n"
+           "  }\n"
+           "  switch (c) {\n"
+           "  case 4:\n"
+           "    c = 6;\n"
+           "    break;\n"
+           "  case 5:\n"
+           "    c = 7;\n"
+           "  }\n"
+           "  if (c)\n"
+           "    return 1;\n"
+           "  return 2;\n"
+           "}\n";
+  module = compile(source, 0, &statistics);
+  estimate_branch_weights(module);
+  text = module_to_string(module);
+  assert(count_occurrences(text, "    i32 2, label %switch.case5\n  ], !prof !4\n") == 1);
+  assert(count_occurrences(text, "    i32 5, label %switch.case10\n  ], !prof !5\n") == 1);
+  assert(count_occurrences(text, "!4 = !{!\"branch_weights\", i32 1048575, i32 1, i32 1048575}\n") == 1);
+  assert(count_occurrences(text, "!5 = !{!\"branch_weights\", i32 1, i32 1, i32 1}\n") == 1);
+
+  // weights from a profile stay
+  source = "int g(int n)\n"
+           "{\n"
+           "  if (n < 3)\n"
+           "    return 1;\n"
+           "  return 2;\n"
+           "}\n";
+  module = compile(source, 0, &statistics);
+  IRInstruction* branch = ir_block_terminator(module->first_function->first_block);
+  branch->branch_weights = (unsigned long long*)malloc(2 * sizeof(unsigned long long));
+  branch->branch_weights[0] = 5;
+  branch->branch_weights[1] = 6;
+  estimate_branch_weights(module);
+  assert(count_occurrences(module_to_string(module), "!{!\"branch_weights\", i32 5, i32 6}") == 1);
+
+  printf("test 19 passed\n\n");
+}
+
+void test20()
+{
+  printf("Running codegen test 20: peephole rules...\n");
+
+  char const* source = "unsigned f(unsigned x) { return x * 8 + x / 4 + x % 16 + 2 * x + x % 1; }\n"
+                       "int g(int x) { return x / 4 + x * 1 - 0; }\n"
+                       "int h(int a, int b) { int t = a < b; return !t; }\n"
+                       "long long w(int x) { long long y = x; int z = y; return z; }\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  std::string module = module_to_string(compile(source, 1, &statistics));
+  assert(statistics.peephole_rewrites > 0);
+
+  // strength reduction, with the constant on the left moved to the right first
+  assert(count_occurrences(module, "shl i32 %0, 3\n") == 1);
+  assert(count_occurrences(module, "lshr i32 %0, 2\n") == 1);
+  assert(count_occurrences(module, "and i32 %0, 15\n") == 1);
+  assert(count_occurrences(module, "shl i32 %0, 1\n") == 1);
+  assert(count_occurrences(module, "mul") == 0);
+  assert(count_occurrences(module, "urem") == 0);
+
+  // signed division by a power of two isn't a shift, and the identities go
+  assert(count_occurrences(module, "%1 = sdiv i32 %0, 4\n  %2 = add i32 %1, %0\n  ret i32 %2\n") == 1);
+
+  // !t on a comparison stored in t is the inverse comparison
+  assert(count_occurrences(module, "%2 = icmp sge i32 %0, %1\n  %3 = zext i1 %2 to i32\n  ret i32 %3\n") == 1);
+
+  // the truncation undoes the extension, leaving one sext
+  assert(count_occurrences(module, "%1 = sext i32 %0 to i64\n  ret i64 %1\n") == 1);
+  assert(count_occurrences(module, "trunc") == 0);
+
+  printf("test 20 passed\n\n");
+}
+
+void test21()
+{
+  printf("Running codegen test 21: precompiled headers...\n");
+
+  char const* header = "#define SCALE 3\n"
+                       "int unused(int x);\n"
+                       "int twice(int x);\n"
+                       "static int scaled(int x) { return twice(x) * SCALE; }\n"
+                       "static int unused_static(int x) { return unused(x); }\n"
+                       "int helper(int x) { return x + 1; }\n";
+  char const* source = "int main() { return scaled(2) + SCALE; }\n";
+
+  char path[] = "/tmp/miniclang_codegen_test_XXXXXX";
+  int descriptor = mkstemp(path);
+  FILE* file = fdopen(descriptor, "wb");
+  TranslationUnit header_unit = parse_whole_translation_unit(header, nullptr, nullptr);
+  write_precompiled_header(&header_unit, file);
+  fclose(file);
+
+  PrecompiledHeader* precompiled_header = read_precompiled_header(path);
+  assert(precompiled_header);
+  TranslationUnit translation_unit = parse_whole_translation_unit(source, nullptr, precompiled_header);
+  std::string module = module_to_string(lower_translation_unit(translation_unit.external_declarations));
+#ifdef TEST_VERBOSE
+  printf("%s", module.c_str());
+#endif
+
+  // what main uses, and helper, which every file including the header defines
+  assert(count_occurrences(module, "@scaled(") == 2);
+  assert(count_occurrences(module, "declare i32 @twice(") == 1);
+  assert(count_occurrences(module, "mul i32") == 1);
+  assert(count_occurrences(module, "define i32 @helper(") == 1);
+  assert(count_occurrences(module, "unused") == 0);
+
+  remove(path);
+  assert(!read_precompiled_header(path));
+  printf("test 21 passed\n\n");
+}
+
+void test22()
+{
+  printf("Running codegen test 22: compilation cache...\n");
+
+  char directory_template[] = "/tmp/miniclang_codegen_test_XXXXXX";
+  std::string directory = mkdtemp(directory_template);
+  std::string header_path = directory + "/value.h";
+  std::string source_path = directory + "/main.c";
+  std::string cache_directory = directory + "/cache";
+  auto write_header = [&](char const* text) {
+    FILE* file = fopen(header_path.c_str(), "w");
+    fputs(text, file);
+    fclose(file);
+  };
+  write_header("int value() { return 1; }\n");
+  std::string source = "#include \"value.h\"\nint main() { return value(); }\n";
+
+  CompilerOptions options = default_compiler_options();
+  options.cache_directory = cache_directory.c_str();
+  CompilationCacheStatistics before = compilation_cache_statistics();
+
+  std::string key = compilation_cache_key(source.c_str(), source_path.c_str(), "-O1 ");
+  std::string output;
+  assert(!lookup_compilation_cache(&options, key, &output));
+  TranslationUnit translation_unit = parse_whole_translation_unit(source.c_str(), source_path.c_str(), nullptr);
+  store_compilation_cache(&options, key, translation_unit.preprocessor, "compiled");
+  assert(lookup_compilation_cache(&options, key, &output) && output == "compiled");
+
+  // other flags are another entry, and a changed header misses
+  assert(compilation_cache_key(source.c_str(), source_path.c_str(), "-O2 ") != key);
+  write_header("int value() { return 2; }\n");
+  assert(!lookup_compilation_cache(&options, key, &output));
+
+  CompilationCacheStatistics after = compilation_cache_statistics();
+  assert(after.hits - before.hits == 1);
+  assert(after.misses - before.misses == 2);
+
+  // with no room, storing evicts everything, the new entry included
+  options.cache_max_size = 0;
+  store_compilation_cache(&options, key, translation_unit.preprocessor, "compiled");
+  assert(!lookup_compilation_cache(&options, key, &output));
+  assert(compilation_cache_statistics().entries_evicted - after.entries_evicted == 1);
+
+  remove(header_path.c_str());
+  remove(cache_directory.c_str());
+  remove(directory.c_str());
+  printf("test 22 passed\n\n");
+}
+
+void test23()
+{
+  printf("Running codegen test 23: incremental compiles...\n");
+
+  char directory_template[] = "/tmp/miniclang_codegen_test_XXXXXX";
+  std::string directory = mkdtemp(directory_template);
+  std::string cache_directory = directory + "/cache";
+  CompilerOptions options = default_compiler_options();
+  options.optimization_level = 2;
+  options.cache_directory = cache_directory.c_str();
+  OptimizationStatistics statistics = new_optimization_statistics();
+
+  auto compile = [&](std::string const& source, bool incremental) {
+    char* buffer = nullptr;
+    size_t size = 0;
+    FILE* stream = open_memstream(&buffer, &size);
+    TranslationUnit translation_unit = parse_whole_translation_unit(source.c_str(), nullptr, nullptr);
+    if (incremental)
+      emit_llvm_incrementally(&translation_unit, "-O2 ", stream, &options, &statistics);
+    else
+      emit_llvm_from_translation_unit(translation_unit.external_declarations, stream, &options, &statistics);
+    fclose(stream);
+    std::string text(buffer, size);
+    free(buffer);
+    return text;
+  };
+
+  // square is inlined into sum and deleted. Each function has its own tbaa
+  // types and branch weights, which have to be numbered as if the file was
+  // compiled whole
+  std::string source = "static int square(int x) { return x * x; }\n"
+                       "int sum(int* a, int n) { int s = 0; for (int i = 0; i < n; i++) s = s + square(a[i]); return s; }\n"
+                       "long clamp(long* p, int n) { long t = 0; for (int i = 0; i < n; i++) {\n"
+                       "  if (p[i] > 3) t = t + p[i]; else t = t - 1; } return t; }\n"
+                       "int first(short* q) { return q[0] + q[1]; }\n";
+
+  IncrementalStatistics before = incremental_statistics();
+  std::string first_output = compile(source, true);
+  assert(first_output == compile(source, false));
+  IncrementalStatistics after = incremental_statistics();
+  assert(after.functions_compiled - before.functions_compiled == 4);
+  assert(after.functions_reused == before.functions_reused);
+
+  // only clamp changed
+  source.replace(source.find("t - 1"), strlen("t - 1"), "t - 2");
+  before = after;
+  std::string incremental = compile(source, true);
+  assert(incremental != first_output && incremental == compile(source, false));
+  after = incremental_statistics();
+  assert(after.functions_compiled - before.functions_compiled == 1);
+  assert(after.functions_reused - before.functions_reused == 3);
+
+  // first calls sum now, which decides whether square is called only once.
+  // square itself is kept, and compiled again for sum to inline it
+  char const* first = "int first(short* q) { return q[0] + q[1]; }";
+  source.replace(source.find(first), strlen(first), "int first(short* q, int* a) { return q[0] + sum(a, 2); }");
+  before = after;
+  assert(compile(source, true) == compile(source, false));
+  after = incremental_statistics();
+  assert(after.functions_compiled - before.functions_compiled == 3);
+  assert(after.functions_reused - before.functions_reused == 2);
+
+  // main depends on every helper it calls, but they don't depend on main or
+  // on each other
+  source = "static int twice(int x) { return x + x; }\n"
+           "static int thrice(int x) { return x * 3; }\n"
+           "int negate(int x) { return 0 - x; }\n"
+           "int main(int argc, char** argv) { return twice(argc) + thrice(argc) + negate(argc); }\n";
+  assert(compile(source, true) == compile(source, false));
+
+  source.replace(source.find("x * 3"), strlen("x * 3"), "x - 3");
+  before = incremental_statistics();
+  assert(compile(source, true) == compile(source, false));
+  after = incremental_statistics();
+  assert(after.functions_compiled - before.functions_compiled == 4);
+  assert(after.functions_reused - before.functions_reused == 2);
+
+  source.replace(source.find("+ negate"), strlen("+ negate"), "- negate");
+  before = after;
+  assert(compile(source, true) == compile(source, false));
+  after = incremental_statistics();
+  assert(after.functions_reused - before.functions_reused == 3);
+
+  system(("rm -rf " + directory).c_str());
+  printf("test 23 passed\n\n");
+}
+
+// prints its arguments a line each, and returns how many there were
+static int echo_command_line(int argc, char** argv)
+{
+  if (argc == 2 && strcmp(argv[1], "--exit") == 0)
+    exit(3);
+
+  if (argc == 2 && strcmp(argv[1], "--pid") == 0) {
+    fprintf(stderr, "%d\n", (int)getpid());
+    return 0;
+  }
+
+  // where compiling each file would write to
+  if (argc >= 2 && strcmp(argv[1], "--output-paths") == 0) {
+    CompilerOptions options = default_compiler_options();
+    for (int i = 2; i < argc; i++)
+      fprintf(stderr, "%s\n", output_path(argv[i], &options).c_str());
+    return 0;
+  }
+
+  // includes the header twice, and prints how many includes the --stats
+  // count as skipped by its guard
+  if (argc == 3 && strcmp(argv[1], "--guarded") == 0) {
+    std::string source = std::string("#include \"") + argv[2] + "\"\n#include \"" + argv[2] + "\"\n;";
+    Lexer lexer = new_lexer(source.c_str());
+    while (get_next_token(&lexer)->type != TokenType::Eof) { }
+    fprintf(stderr, "%u\n", preprocessor_statistics().includes_skipped_by_guard);
+    return 0;
+  }
+
+  for (int i = 1; i < argc; i++)
+    fprintf(stderr, "%s\n", argv[i]);
+  return argc - 1;
+}
+
+void test24()
+{
+  printf("Running codegen test 24: compile server...\n");
+
+  char directory_template[] = "/tmp/miniclang_codegen_test_XXXXXX";
+  std::string directory = mkdtemp(directory_template);
+  std::string socket_path = directory + "/server.sock";
+  char program[] = "miniclang";
+
+  // what the server has the compile print is copied to the client's stderr
+  auto compile = [&](std::vector<char const*> arguments, int* status) {
+    arguments.insert(arguments.begin(), program);
+    fflush(stderr);
+    FILE* output = tmpfile();
+    int saved_stderr = dup(STDERR_FILENO);
+    dup2(fileno(output), STDERR_FILENO);
+    bool is_served = compile_on_server(socket_path.c_str(), (int)arguments.size(), (char**)arguments.data(), status);
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+
+    std::string text;
+    rewind(output);
+    char buffer[4096];
+    for (size_t read; (read = fread(buffer, 1, sizeof(buffer), output)) > 0;)
+      text.append(buffer, read);
+    fclose(output);
+    return is_served ? text : "no server";
+  };
+
+  int status;
+  assert(compile({ "a.c" }, &status) == "no server");
+
+  // so the workers don't print it again
+  fflush(stdout);
+  pid_t server = fork();
+  if (server == 0)
+    _exit(run_compile_server(socket_path.c_str(), 2, echo_command_line));
+  while (access(socket_path.c_str(), F_OK) != 0)
+    usleep(1000);
+
+  // paths are made absolute, since workers outlive the client's directory
+  char working_directory[4096];
+  assert(getcwd(working_directory, sizeof(working_directory)));
+  std::string cwd = working_directory;
+  assert(compile({ "-O2", "a.c", "-Iinclude", "/b.c" }, &status) == "-O2\n" + cwd + "/a.c\n-I" + cwd + "/include\n/b.c\n");
+  assert(status == 4);
+
+  // a compile that exits still gets its status back, and the worker is replaced
+  for (int i = 0; i < 3; i++) {
+    assert(compile({ "--exit" }, &status).empty());
+    assert(status == 3);
+  }
+  assert(compile({ "/c.c" }, &status) == "/c.c\n" && status == 1);
+
+  // a worker's --stats only count what the command line compiled, however
+  // many it compiled before. Two workers, so one serves more than one
+  std::string header_path = directory + "/guarded.h";
+  FILE* header = fopen(header_path.c_str(), "w");
+  fputs("#ifndef GUARDED_H\n#define GUARDED_H\nint x;\n#endif\n", header);
+  fclose(header);
+  for (int i = 0; i < 3; i++) {
+    assert(compile({ "--guarded", header_path.c_str() }, &status) == "1\n");
+    assert(status == 0);
+  }
+  remove(header_path.c_str());
+
+  // the paths are absolute, so a dot in a directory isn't the extension
+  std::string dotted = directory + "/sources.d";
+  mkdir(dotted.c_str(), 0700);
+  assert(chdir(dotted.c_str()) == 0);
+  assert(compile({ "--output-paths", "a.c", "b.tar.c" }, &status) == dotted + "/a.ll\n" + dotted + "/b.ll\n");
+  assert(chdir(working_directory) == 0);
+  rmdir(dotted.c_str());
+
+  // workers are retired after so many compiles, and new ones take over
+  std::set<std::string> workers;
+  for (unsigned i = 0; i < 2 * compiles_per_worker + 1; i++) {
+    workers.insert(compile({ "--pid" }, &status));
+    assert(status == 0);
+  }
+  assert(workers.size() > 2);
+
+  kill(server, SIGTERM);
+  waitpid(server, nullptr, 0);
+  assert(access(socket_path.c_str(), F_OK) != 0);
+  remove(directory.c_str());
+  printf("test 24 passed\n\n");
+}
+
+void test25()
+{
+  printf("Running codegen test 25: symbol index...\n");
+
+  char directory_template[] = "/tmp/miniclang_codegen_test_XXXXXX";
+  std::string directory = mkdtemp(directory_template);
+  std::string header_path = directory + "/shapes.h";
+  std::string source_path = directory + "/shapes.c";
+  std::string index_path = directory + "/shapes.idx";
+  FILE* header = fopen(header_path.c_str(), "w");
+  fputs("int area(int* sides, int count);\nextern double scale;\n", header);
+  fclose(header);
+
+  // the body that doesn't parse is never parsed
+  std::string source = "#include \"shapes.h\"\n"
+                       "static int helper(char c) { return 1 + ; }\n"
+                       "int area(int* sides, int count) { return sides[0] * count; }\n"
+                       "long a, *b;\n";
+  TranslationUnit translation_unit = parse_whole_translation_unit(source.c_str(), source_path.c_str(), nullptr, true);
+  FILE* file = fopen(index_path.c_str(), "wb");
+  write_symbol_index(&translation_unit, file);
+  fclose(file);
+
+  std::vector<IndexedSymbol> symbols;
+  assert(read_symbol_index(index_path.c_str(), &symbols));
+#ifdef TEST_VERBOSE
+  for (IndexedSymbol const& symbol : symbols)
+    printf("%s %d %s %s:%u:%u\n", symbol.name.c_str(), (int)symbol.kind, symbol.signature.c_str(), symbol.path.c_str(), symbol.line,
+        symbol.column);
+#endif
+  assert(symbols.size() == 6);
+
+  assert(symbols[0].name == "area" && symbols[0].kind == SymbolKind::FunctionDeclaration);
+  assert(symbols[0].signature == "int (int*, int)");
+  assert(symbols[0].path == header_path && symbols[0].line == 0 && symbols[0].column == 4);
+  assert(symbols[1].name == "scale" && symbols[1].kind == SymbolKind::Variable && symbols[1].is_extern);
+  assert(symbols[1].signature == "double" && symbols[1].path == header_path && symbols[1].line == 1);
+
+  assert(symbols[2].name == "helper" && symbols[2].kind == SymbolKind::FunctionDefinition);
+  assert(symbols[2].is_static && !symbols[2].is_extern && symbols[2].signature == "int (char)");
+  assert(symbols[2].path == source_path && symbols[2].line == 1);
+  assert(symbols[3].name == "area" && symbols[3].kind == SymbolKind::FunctionDefinition && !symbols[3].is_static);
+  assert(symbols[3].path == source_path && symbols[3].line == 2);
+
+  assert(symbols[4].name == "a" && symbols[4].signature == "long" && symbols[4].kind == SymbolKind::Variable);
+  assert(symbols[5].name == "b" && symbols[5].signature == "long*" && symbols[5].line == 3);
+
+  // nothing else reads as one
+  assert(!read_symbol_index(header_path.c_str(), &symbols));
+
+  remove(index_path.c_str());
+  remove(header_path.c_str());
+  remove(directory.c_str());
+  printf("test 25 passed\n\n");
+}
+
+void test26()
+{
+  printf("Running codegen test 26: pipelined parse and lowering...\n");
+
+  // first calls second before it's declared, and enough functions to go
+  // round the queue a few times
+  std::string source = "int later(int x);\n"
+                       "int first(int x) { return second(x) + later(x); }\n"
+                       "int second(int x) { if (x > 3) return x * 2; return x - 1; }\n";
+  for (int i = 0; i < 200; i++)
+    source += "int f" + std::to_string(i) + "(int x) { int y = x; for (int i = 0; i < x; i++) y = y + i; return y + later(x); }\n";
+  source += "int later(int x) { return x + 1; }\n";
+
+  CompilerOptions options = default_compiler_options();
+  options.optimization_level = 2;
+  auto emit = [&](bool is_pipelined, TranslationUnit* translation_unit) {
+    char* buffer = nullptr;
+    size_t size = 0;
+    FILE* stream = open_memstream(&buffer, &size);
+    OptimizationStatistics statistics = new_optimization_statistics();
+    if (is_pipelined) {
+      *translation_unit = emit_pipelined(source.c_str(), nullptr, stream, &options, &statistics);
+    } else {
+      *translation_unit = parse_whole_translation_unit(source.c_str(), nullptr, nullptr);
+      emit_llvm_from_translation_unit(translation_unit->external_declarations, stream, &options, &statistics);
+    }
+    fclose(stream);
+    std::string output(buffer, size);
+    free(buffer);
+    return output;
+  };
+
+  TranslationUnit whole;
+  TranslationUnit pipelined;
+  std::string expected = emit(false, &whole);
+  assert(emit(true, &pipelined) == expected);
+  assert(count_occurrences(expected, "define i32 @") == 203);
+
+  // the bodies are freed as they're lowered, the declarations are all there
+  unsigned definitions = 0;
+  for (ExternalDeclaration const* declaration = pipelined.external_declarations; declaration; declaration = declaration->next)
+    if (declaration->type == ExternalDeclarationType::FunctionDefinition) {
+      assert(!declaration->root_ast_node->object->function_body);
+      definitions++;
+    }
+  assert(definitions == 203);
+
+  assert(can_compile_pipelined(&options));
+  options.incremental = true;
+  assert(!can_compile_pipelined(&options));
+  printf("test 26 passed\n\n");
+}
+
+int main()
+{
+  test1();
+  test2();
+  test3();
+  test4();
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+  test13();
+  test14();
+  test15();
+  test16();
+  test17();
+  test18();
+  test19();
+  test20();
+  test21();
+  test22();
+  test23();
+  test24();
+  test25();
+  test26();
+}
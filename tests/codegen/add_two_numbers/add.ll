@@ -1,5 +1,18 @@
 define i32 @add(i32 %0, i32 %1){
 entry:
   %2 = alloca i32
-  ret i32 %0
+  %3 = alloca i32
+  %4 = alloca i32
+  store i32 %0, ptr %2, !tbaa !3
+  store i32 %1, ptr %3, !tbaa !3
+  %5 = load i32, ptr %2, !tbaa !3
+  %6 = load i32, ptr %3, !tbaa !3
+  %7 = add i32 %5, %6
+  store i32 %7, ptr %4, !tbaa !3
+  %8 = load i32, ptr %4, !tbaa !3
+  ret i32 %8
 }
+!0 = !{!"Simple C/C++ TBAA"}
+!1 = !{!"omnipotent char", !0, i64 0}
+!2 = !{!"int", !1, i64 0}
+!3 = !{!2, !2, i64 0}
@@ -1,6 +1,11 @@
 #include "lexer.h"
+#include "preprocessor.h"
 
 #include <cassert>
+#include <fcntl.h>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
 
 void assert_and_print_error(Lexer *lexer, const Token *left,
                             const Token *right) {
@@ -122,6 +127,222 @@ void test6() {
   printf("Lexer test 5 passed\n\n");
 }
 
+void expect_tokens(Lexer *lexer, const Token *expected, unsigned count) {
+  for (unsigned i = 0; i < count; i++)
+    assert_and_print_error(lexer, get_next_token(lexer), &expected[i]);
+  assert_and_print_error(lexer, get_next_token(lexer), &eof_token);
+}
+
+Token number_token(const char *number) {
+  return make_token(TokenType::Number, 0, 0, number);
+}
+
+Token identifier_token(const char *identifier) {
+  return make_token(TokenType::Identifier, 0, 0, identifier);
+}
+
+Token punctuation_token(TokenType type) { return make_token(type, 0, 0); }
+
+void test7() {
+  printf("running lexer test 7...\n");
+  const char *test = "#define N 5\n"
+                     "#define EMPTY\n"
+                     "# \n"
+                     "int x = N EMPTY;\n"
+                     "#undef N\n"
+                     "N";
+  Lexer lexer = new_lexer(test);
+
+  const Token expected[] = {int_token,       x_token, equal_token, five_token,
+                            semicolon_token, identifier_token("N")};
+  expect_tokens(&lexer, expected, sizeof(expected) / sizeof(expected[0]));
+  printf("Lexer test 7 passed\n\n");
+}
+
+void test8() {
+  printf("running lexer test 8...\n");
+  // x is hidden inside its own expansion, f isn't hidden in its argument, and
+  // g without parentheses isn't a call
+  const char *test = "#define x x * 2\n"
+                     "#define f(a) a + 1\n"
+                     "#define g(a) f (a)\n"
+                     "#define h (5)\n"
+                     "f(f(x)) g(20) g; h";
+  Lexer lexer = new_lexer(test);
+
+  const Token plus = punctuation_token(TokenType::Plus);
+  const Token expected[] = {
+      identifier_token("x"), asterisk_token, number_token("2"), plus, number_token("1"),
+      plus, number_token("1"), twenty_token, plus, number_token("1"), identifier_token("g"),
+      semicolon_token, punctuation_token(TokenType::LParen), five_token,
+      punctuation_token(TokenType::RParen)};
+  expect_tokens(&lexer, expected, sizeof(expected) / sizeof(expected[0]));
+  printf("Lexer test 8 passed\n\n");
+}
+
+void test9() {
+  printf("running lexer test 9...\n");
+  // pasting, including an empty argument, and variadic macros
+  const char *test = "#define cat(a, b) a ## b\n"
+                     "#define first(x, ...) x\n"
+                     "#define rest(x, ...) __VA_ARGS__\n"
+                     "#define call(f, ...) f(__VA_ARGS__)\n"
+                     "cat(va, r) cat(2, 0) cat(, 5) first(x) rest(1, (2, 3), 5)\n"
+                     "call(cat, x, 5)\n"
+                     "#undef cat\n"
+                     "cat";
+  Lexer lexer = new_lexer(test);
+
+  const Token expected[] = {
+      identifier_token("var"), twenty_token, five_token, x_token,
+      punctuation_token(TokenType::LParen), number_token("2"),
+      punctuation_token(TokenType::Comma), number_token("3"),
+      punctuation_token(TokenType::RParen), punctuation_token(TokenType::Comma),
+      five_token, identifier_token("x5"), identifier_token("cat")};
+  expect_tokens(&lexer, expected, sizeof(expected) / sizeof(expected[0]));
+  printf("Lexer test 9 passed\n\n");
+}
+
+void test10() {
+  printf("running lexer test 10...\n");
+  // skipped groups don't have to lex, and names left in an #if are 0
+  const char *test = "#define N 4\n"
+                     "#if defined(N) && N * 5 == 20 && !defined M && !UNDEFINED\n"
+                     "20\n"
+                     "#elif 1\n"
+                     "'\n"
+                     "#endif\n"
+                     "#ifdef N\n"
+                     "#  if N - 1 > 3 ? 0 : 1\n"
+                     "5\n"
+                     "#  else\n"
+                     "#    if 1\n"
+                     "'\n"
+                     "#    endif\n"
+                     "#  endif\n"
+                     "#elif N\n"
+                     "'\n"
+                     "#else\n"
+                     "'\n"
+                     "#endif\n"
+                     "#ifndef N\n"
+                     "'\n"
+                     "#else\n"
+                     "x\n"
+                     "#endif";
+  Lexer lexer = new_lexer(test);
+
+  const Token expected[] = {twenty_token, five_token, x_token};
+  expect_tokens(&lexer, expected, sizeof(expected) / sizeof(expected[0]));
+  printf("Lexer test 10 passed\n\n");
+}
+
+void write_test_file(std::string const &path, const char *contents) {
+  FILE *file = fopen(path.c_str(), "w");
+  assert(file);
+  fputs(contents, file);
+  fclose(file);
+}
+
+void test11() {
+  printf("running lexer test 11...\n");
+  char directory_template[] = "/tmp/miniclang_lexer_test_XXXXXX";
+  std::string directory = mkdtemp(directory_template);
+
+  write_test_file(directory + "/guarded.h", "// a guard\n"
+                                            "#ifndef GUARDED_H\n"
+                                            "#define GUARDED_H\n"
+                                            "x\n"
+                                            "#endif\n");
+  write_test_file(directory + "/once.h", "#pragma once\n"
+                                         "5\n");
+  // not guarded, the 20 is outside the #ifndef
+  write_test_file(directory + "/unguarded.h", "#ifndef UNGUARDED_H\n"
+                                              "#define UNGUARDED_H\n"
+                                              "#endif\n"
+                                              "20\n");
+  write_test_file(directory + "/nested.h", "#include \"guarded.h\"\n"
+                                           "#include \"once.h\"\n");
+
+  std::string test = "#include \"" + directory + "/guarded.h\"\n" +
+                     "#include \"" + directory + "/guarded.h\"\n" +
+                     "#include \"" + directory + "/once.h\"\n" +
+                     "#include \"" + directory + "/unguarded.h\"\n" +
+                     "#include \"" + directory + "/unguarded.h\"\n" +
+                     "#include \"" + directory + "/nested.h\"\n" + ";";
+
+  PreprocessorStatistics before = preprocessor_statistics();
+  Lexer lexer = new_lexer(test.c_str());
+  const Token expected[] = {x_token, five_token, twenty_token, twenty_token,
+                            semicolon_token};
+  expect_tokens(&lexer, expected, sizeof(expected) / sizeof(expected[0]));
+
+  // each file is read once, guarded.h is skipped twice and once.h once
+  PreprocessorStatistics after = preprocessor_statistics();
+  assert(after.files_read - before.files_read == 4);
+  assert(after.includes_skipped_by_guard - before.includes_skipped_by_guard == 2);
+  assert(after.includes_skipped_by_pragma_once -
+             before.includes_skipped_by_pragma_once ==
+         1);
+
+  for (const char *name : {"guarded.h", "once.h", "unguarded.h", "nested.h"})
+    remove((directory + "/" + name).c_str());
+  remove(directory.c_str());
+  printf("Lexer test 11 passed\n\n");
+}
+
+void test12() {
+  printf("running lexer test 12...\n");
+  char directory_template[] = "/tmp/miniclang_lexer_test_XXXXXX";
+  std::string directory = mkdtemp(directory_template);
+
+  write_test_file(directory + "/outer.h", "#define SEMICOLON ;\n"
+                                          "#include \"inner.h\"\n"
+                                          "#if defined(INNER_H)\n"
+                                          "x SEMICOLON\n"
+                                          "#endif\n");
+  write_test_file(directory + "/inner.h", "#ifndef INNER_H\n"
+                                          "#define INNER_H\n"
+                                          "5\n"
+                                          "#endif\n");
+  // doesn't lex as a whole, so it's lexed as it's read every time
+  write_test_file(directory + "/unlexable.h", "#if 0\n"
+                                              "@\n"
+                                              "#endif\n"
+                                              "20\n");
+
+  std::string test = "#include \"" + directory + "/outer.h\"\n" +
+                     "#include \"" + directory + "/unlexable.h\"\n";
+  const Token expected[] = {five_token, x_token, semicolon_token,
+                            twenty_token};
+
+  // the second translation unit gets outer.h and inner.h from the first
+  PreprocessorStatistics before = preprocessor_statistics();
+  for (int i = 0; i < 2; i++) {
+    Lexer lexer = new_lexer(test.c_str());
+    expect_tokens(&lexer, expected, sizeof(expected) / sizeof(expected[0]));
+  }
+  PreprocessorStatistics after = preprocessor_statistics();
+  assert(after.files_read - before.files_read == 3);
+  assert(after.includes_from_token_cache -
+             before.includes_from_token_cache ==
+         2);
+
+  // a file that changed is read and lexed again
+  write_test_file(directory + "/inner.h", "20\n");
+  timespec times[2] = {{1, 0}, {1, 0}};
+  utimensat(AT_FDCWD, (directory + "/inner.h").c_str(), times, 0);
+  Lexer lexer = new_lexer(test.c_str());
+  const Token changed[] = {twenty_token, twenty_token};
+  expect_tokens(&lexer, changed, sizeof(changed) / sizeof(changed[0]));
+  assert(preprocessor_statistics().files_read - after.files_read == 1);
+
+  for (const char *name : {"outer.h", "inner.h", "unlexable.h"})
+    remove((directory + "/" + name).c_str());
+  remove(directory.c_str());
+  printf("Lexer test 12 passed\n\n");
+}
+
 int main() {
   printf("running lexer tests...\n");
 
@@ -131,4 +352,10 @@ int main() {
   test4();
   test5();
   test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
 }
@@ -282,6 +282,70 @@ void test11()
   printf("test 11 passed\n\n");
 }
 
+void test12()
+{
+  printf("Running parser test 12: Deferred function bodies...\n");
+
+  // the body that doesn't parse is never asked for. A macro defined after a
+  // body doesn't change it, its tokens were expanded where they were
+  char const* source = "#define Y 4\n"
+                       "void function(int x){ double y = Y;\nreturn y; }\n"
+                       "#undef Y\n"
+                       "#define Y 5\n"
+                       "int broken() { return 1 + ; }\n"
+                       "int plain(int a) {\n  // { not a brace\n  if (a) { return a * 2; } /* } */\n  return 31; }\n"
+                       "float z = 3; ";
+  TranslationUnit translation_unit = parse_whole_translation_unit(source, nullptr, nullptr, true);
+  ExternalDeclaration* declaration = translation_unit.external_declarations;
+
+  assert(declaration && declaration->type == ExternalDeclarationType::FunctionDefinition);
+  Object const* function = declaration->root_ast_node->object;
+  assert(!function->function_body && function->deferred_body);
+  assert(function->deferred_body->tokens.front().type == TokenType::LBrace);
+  assert(function->deferred_body->tokens.back().type == TokenType::RBrace);
+
+  ExternalDeclaration* broken = declaration->next;
+  assert(broken && broken->type == ExternalDeclarationType::FunctionDefinition);
+  assert(broken->root_ast_node->object->deferred_body);
+
+  // with no macros or directives in it, the body's text is only scanned for
+  // braces, and lexed when it's asked for
+  ExternalDeclaration* plain = broken->next;
+  assert(plain && plain->root_ast_node->object->deferred_body->text);
+  assert(plain->root_ast_node->object->deferred_body->tokens.empty());
+
+  assert(plain->next && plain->next->root_ast_node->object->identifier == "z");
+  assert(plain->next->root_ast_node->object->type->fundamental_type == FundamentalType::Float);
+  assert(!plain->next->next);
+
+  ASTNode const* plain_body = function_body(plain->root_ast_node->object);
+  assert(plain_body && plain_body->type == ASTNodeType::If);
+  assert(plain_body->next && plain_body->next->type == ASTNodeType::Return);
+  assert(plain_body->next->rhs->data_as.int_data == 31);
+
+  ASTNode const* body = function_body(function);
+  assert(body && body == function_body(function));
+  assert(!function->deferred_body);
+  assert(body->type == ASTNodeType::Declaration);
+  assert(body->object->identifier == "y");
+  assert(body->object->type == get_fundamental_type_pointer(FundamentalType::Double));
+  assert(body->rhs && body->rhs->type == ASTNodeType::NumericConstant && body->rhs->data_as.int_data == 4);
+  assert(body->next && body->next->type == ASTNodeType::Return);
+
+  // a body parsed late still only sees what was declared before it
+  source = "int before(int a) { return a; }\n"
+           "int user(int b) { return before(b) + after(b); }\n"
+           "int after(int c) { return c; }\n";
+  translation_unit = parse_whole_translation_unit(source, nullptr, nullptr, true);
+  Object const* user = translation_unit.external_declarations->next->root_ast_node->object;
+  Scope* user_scope = function_body(user)->scope;
+  assert(variable_in_scope("before", user_scope) && variable_in_scope("user", user_scope));
+  assert(!variable_in_scope("after", user_scope));
+  assert(variable_in_scope("after", translation_unit.global_scope));
+
+  printf("test 12 passed\n\n");
+}
+
 int main()
 {
   test1();
@@ -295,4 +359,5 @@ int main()
   test9();
   // test10();
   test11();
+  test12();
 }
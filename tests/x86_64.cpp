@@ -0,0 +1,702 @@
+#include "codegen.h"
+#include "ir.h"
+#include "optimize.h"
+#include "parser.h"
+#include "x86_64.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/wait.h>
+
+static ObjectFile compile(char const* source, unsigned optimization_level, OptimizationStatistics* statistics)
+{
+  ExternalDeclaration* declarations = parse_translation_unit(source);
+  IRModule* module = lower_translation_unit(declarations);
+  optimize_ir_module(module, optimization_level, statistics);
+
+#ifdef TEST_VERBOSE
+  for (IRFunction const* function = module->first_function; function; function = function->next) {
+    if (ir_function_is_declaration(function))
+      continue;
+    MachineFunction* machine_function = select_x86_64_instructions(function);
+    OptimizationStatistics scratch = new_optimization_statistics();
+    allocate_registers(machine_function, &scratch);
+    print_machine_function(machine_function, stdout);
+  }
+#endif
+
+  return generate_x86_64_object(module, statistics);
+}
+
+static bool contains_bytes(std::vector<unsigned char> const& text, std::vector<unsigned char> const& bytes)
+{
+  for (size_t i = 0; i + bytes.size() <= text.size(); i++)
+    if (memcmp(text.data() + i, bytes.data(), bytes.size()) == 0)
+      return true;
+  return false;
+}
+
+static bool have_c_compiler() { return system("cc --version > /dev/null 2>&1") == 0; }
+
+// writes the object out, links it with the given C file if there is one, and
+// returns the exit code of running the result
+static int run_native(char const* source, unsigned optimization_level, char const* driver, OptimizationStatistics* statistics)
+{
+  ObjectFile object = compile(source, optimization_level, statistics);
+
+  FILE* object_file = fopen("/tmp/miniclang_x86_64_test.o", "wb");
+  assert(object_file);
+  write_elf_object(&object, object_file);
+  fclose(object_file);
+
+  std::string link = "cc -o /tmp/miniclang_x86_64_test /tmp/miniclang_x86_64_test.o";
+  if (driver) {
+    FILE* driver_file = fopen("/tmp/miniclang_x86_64_driver.c", "w");
+    assert(driver_file);
+    fputs(driver, driver_file);
+    fclose(driver_file);
+    link += " /tmp/miniclang_x86_64_driver.c";
+  }
+
+  int status = system(link.c_str());
+  assert(status == 0);
+
+  status = system("/tmp/miniclang_x86_64_test");
+  assert(WIFEXITED(status));
+  return WEXITSTATUS(status);
+}
+
+void test1()
+{
+  printf("Running x86-64 test 1: returning a constant...\n");
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  ObjectFile object = compile("int main() { return 42; }", 1, &statistics);
+
+  // push rbp; mov rbp, rsp
+  assert(contains_bytes(object.text, { 0x55, 0x48, 0x89, 0xe5 }));
+  // mov eax, 42
+  assert(contains_bytes(object.text, { 0xb8, 0x2a, 0x00, 0x00, 0x00 }));
+  // pop rbp; ret
+  assert(contains_bytes(object.text, { 0x5d, 0xc3 }));
+
+  assert(object.symbols.size() == 1);
+  assert(object.symbols[0].name == "main");
+  assert(object.symbols[0].is_global);
+  assert(object.symbols[0].size == object.text.size());
+
+  printf("test 1 passed\n\n");
+}
+
+void test2()
+{
+  printf("Running x86-64 test 2: compare and branch folding...\n");
+
+  // the condition should be a cmp straight into a jcc, with no setcc
+  char const* source = "int main()\n"
+                       "{\n"
+                       "  int x = 3;\n"
+                       "  if (x < 5)\n"
+                       "    return 1;\n"
+                       "  return 2;\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  ObjectFile object = compile(source, 0, &statistics);
+
+  // cmp dword [rbp - n], 5, then jl or its inverse
+  bool has_jl = contains_bytes(object.text, { 0x0f, 0x8c }) || contains_bytes(object.text, { 0x0f, 0x8d });
+  assert(has_jl);
+  assert(!contains_bytes(object.text, { 0x0f, 0x9c }));
+
+  printf("test 2 passed\n\n");
+}
+
+void test3()
+{
+  printf("Running x86-64 test 3: running loops and arithmetic...\n");
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping\n\n");
+    return;
+  }
+
+  char const* source = "int main()\n"
+                       "{\n"
+                       "  int total = 0;\n"
+                       "  for (int i = 0; i < 10; i++) {\n"
+                       "    int j = 0;\n"
+                       "    while (j < i) {\n"
+                       "      total += i * j - j / 3 + i % 4;\n"
+                       "      j++;\n"
+                       "    }\n"
+                       "  }\n"
+                       "  do {\n"
+                       "    total -= 7;\n"
+                       "  } while (total > 200);\n"
+                       "  return total;\n"
+                       "}\n";
+
+  // computed by hand with the same loops in C
+  int expected = 0;
+  for (int i = 0; i < 10; i++)
+    for (int j = 0; j < i; j++)
+      expected += i * j - j / 3 + (i % 4);
+  do {
+    expected -= 7;
+  } while (expected > 200);
+
+  for (unsigned level = 0; level <= 1; level++) {
+    OptimizationStatistics statistics = new_optimization_statistics();
+    assert(run_native(source, level, nullptr, &statistics) == (expected & 0xff));
+  }
+
+  printf("test 3 passed\n\n");
+}
+
+void test4()
+{
+  printf("Running x86-64 test 4: arguments from C...\n");
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping\n\n");
+    return;
+  }
+
+  char const* source = "int select(int a, int b, int c, int d, int e, int f, int g, int h)\n"
+                       "{\n"
+                       "  if (a > b)\n"
+                       "    return g - h;\n"
+                       "  int shifted = c << d;\n"
+                       "  int halved = e >> 1;\n"
+                       "  return shifted + halved - f;\n"
+                       "}\n";
+
+  char const* driver = "int select(int, int, int, int, int, int, int, int);\n"
+                       "int main(void)\n"
+                       "{\n"
+                       "  if (select(2, 1, 0, 0, 0, 0, 9, 4) != 5)\n"
+                       "    return 1;\n"
+                       "  if (select(1, 2, 3, 2, -9, 100, 0, 0) != -93)\n"
+                       "    return 2;\n"
+                       "  return 0;\n"
+                       "}\n";
+
+  for (unsigned level = 0; level <= 1; level++) {
+    OptimizationStatistics statistics = new_optimization_statistics();
+    assert(run_native(source, level, driver, &statistics) == 0);
+  }
+
+  printf("test 4 passed\n\n");
+}
+
+void test5()
+{
+  printf("Running x86-64 test 5: more live values than registers...\n");
+
+  // at -O1 the arguments and all six products are live at once, which is
+  // more than the five registers linear scan has to hand out
+  char const* source = "int pressure(int a, int b, int c, int d, int e, int g)\n"
+                       "{\n"
+                       "  int x1 = a * b;\n"
+                       "  int x2 = b * c;\n"
+                       "  int x3 = c * d;\n"
+                       "  int x4 = d * e;\n"
+                       "  int x5 = e * g;\n"
+                       "  int x6 = g * a;\n"
+                       "  return x1 + x2 + x3 + x4 + x5 + x6 + a + b + c + d + e + g;\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  compile(source, 1, &statistics);
+  assert(statistics.intervals_split + statistics.intervals_spilled > 0);
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping running it\n\n");
+    return;
+  }
+
+  char const* driver = "int pressure(int, int, int, int, int, int);\n"
+                       "int main(void)\n"
+                       "{\n"
+                       "  int a = 2, b = 3, c = 5, d = 7, e = 11, g = 13;\n"
+                       "  int expected = a * b + b * c + c * d + d * e + e * g + g * a + a + b + c + d + e + g;\n"
+                       "  return pressure(a, b, c, d, e, g) != expected;\n"
+                       "}\n";
+
+  statistics = new_optimization_statistics();
+  assert(run_native(source, 1, driver, &statistics) == 0);
+
+  printf("test 5 passed\n\n");
+}
+
+void test6()
+{
+  printf("Running x86-64 test 6: calls...\n");
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping\n\n");
+    return;
+  }
+
+  // weigh is defined in C and takes two arguments on the stack, fib calls
+  // itself, and main makes calls while values are live in registers
+  char const* source = "int weigh(int a, int b, int c, int d, int e, int f, int g, int h);\n"
+                       "int fib(int n)\n"
+                       "{\n"
+                       "  if (n < 2)\n"
+                       "    return n;\n"
+                       "  return fib(n - 1) + fib(n - 2);\n"
+                       "}\n"
+                       "int main()\n"
+                       "{\n"
+                       "  int x = fib(10);\n"
+                       "  int y = weigh(x, 2, 3, 4, 5, 6, 7, x + 1);\n"
+                       "  return x + y - fib(5);\n"
+                       "}\n";
+
+  char const* driver = "int weigh(int a, int b, int c, int d, int e, int f, int g, int h)\n"
+                       "{\n"
+                       "  return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g - h;\n"
+                       "}\n";
+
+  int x = 55;
+  int expected = x + (x + 2 * 2 + 3 * 3 + 4 * 4 + 5 * 5 + 6 * 6 + 7 * 7 - (x + 1)) - 5;
+
+  for (unsigned level = 0; level <= 1; level++) {
+    OptimizationStatistics statistics = new_optimization_statistics();
+    assert(run_native(source, level, driver, &statistics) == (expected & 0xff));
+  }
+
+  printf("test 6 passed\n\n");
+}
+
+void test7()
+{
+  printf("Running x86-64 test 7: vectorized loops...\n");
+
+  char const* source = "void add(int *a, int *b, int *c, int n)\n"
+                       "{\n"
+                       "  for (int i = 0; i < n; i++)\n"
+                       "    a[i] = b[i] + c[i];\n"
+                       "}\n"
+                       "void scale(long long *restrict a, long long *restrict b, long long k, int n)\n"
+                       "{\n"
+                       "  for (int i = 0; i <= n; i++)\n"
+                       "    a[i] = b[i] - k ^ 123456789;\n"
+                       "}\n"
+                       "void copy(char *a, char *b, unsigned n)\n"
+                       "{\n"
+                       "  for (unsigned i = 0; i < n; i++)\n"
+                       "    a[i] = b[i];\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  ObjectFile object = compile(source, 1, &statistics);
+  assert(statistics.loop_vectorization_loops_vectorized == 3);
+
+  // movdqu xmm0, [rbp - n] and paddd xmm0, xmm1
+  assert(contains_bytes(object.text, { 0xf3, 0x0f, 0x6f, 0x45 }));
+  assert(contains_bytes(object.text, { 0x66, 0x0f, 0xfe, 0xc1 }));
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping running it\n\n");
+    return;
+  }
+
+  // every length up to a few vectors, with the arrays add and copy write
+  // overlapping what they read at every offset a vector could get wrong
+  char const* driver = "void add(int *a, int *b, int *c, int n);\n"
+                       "void scale(long long *restrict a, long long *restrict b, long long k, int n);\n"
+                       "void copy(char *a, char *b, unsigned n);\n"
+                       "int main(void)\n"
+                       "{\n"
+                       "  for (int n = 0; n < 40; n++)\n"
+                       "    for (int offset = -5; offset <= 5; offset++) {\n"
+                       "      int x[100], y[100];\n"
+                       "      char c[100], d[100];\n"
+                       "      for (int i = 0; i < 100; i++)\n"
+                       "        x[i] = y[i] = c[i] = d[i] = i * 7 + 3;\n"
+                       "      add(x + 20 + offset, x + 20, x + 21, n);\n"
+                       "      copy(c + 20 + offset, c + 20, n);\n"
+                       "      for (int i = 0; i < n; i++) {\n"
+                       "        y[20 + offset + i] = y[20 + i] + y[21 + i];\n"
+                       "        d[20 + offset + i] = d[20 + i];\n"
+                       "      }\n"
+                       "      for (int i = 0; i < 100; i++)\n"
+                       "        if (x[i] != y[i] || c[i] != d[i])\n"
+                       "          return 1;\n"
+                       "    }\n"
+                       "  long long a[30], b[30];\n"
+                       "  for (int i = 0; i < 30; i++)\n"
+                       "    a[i] = b[i] = i * 1000000007ll;\n"
+                       "  scale(a, b, 99, 28);\n"
+                       "  for (int i = 0; i < 30; i++)\n"
+                       "    if (a[i] != (i <= 28 ? (b[i] - 99) ^ 123456789 : b[i]))\n"
+                       "      return 2;\n"
+                       "  return 0;\n"
+                       "}\n";
+
+  for (unsigned level = 0; level <= 1; level++) {
+    statistics = new_optimization_statistics();
+    assert(run_native(source, level, driver, &statistics) == 0);
+  }
+
+  printf("test 7 passed\n\n");
+}
+
+void test8()
+{
+  printf("Running x86-64 test 8: switch lowering...\n");
+
+  // dense cases with fallthrough for a jump table, few targets in a small
+  // span for bit tests, and far apart values for a tree of compares
+  char const* source = "int dense(int x)\n"
+                       "{\n"
+                       "  int r = 0;\n"
+                       "  switch (x) {\n"
+                       "  case 0: r = 10; break;\n"
+                       "  case 1: r = 11;\n"
+                       "  case 2: r = r + 12; break;\n"
+                       "  case 3: return 13;\n"
+                       "  case 5: r = 15; break;\n"
+                       "  case 6: case 7: r = 17; break;\n"
+                       "  case 9: r = 19; break;\n"
+                       "  default: r = 99;\n"
+                       "  }\n"
+                       "  return r;\n"
+                       "}\n"
+                       "int separator(int c)\n"
+                       "{\n"
+                       "  switch (c) {\n"
+                       "  case 32: case 9: case 10: case 13: return 1;\n"
+                       "  case 40: case 41: case 44: return 2;\n"
+                       "  case 59: return 3;\n"
+                       "  }\n"
+                       "  return 0;\n"
+                       "}\n"
+                       "int sparse(long long x)\n"
+                       "{\n"
+                       "  switch (x) {\n"
+                       "  case 0 - 2147483647 - 1: return 1;\n"
+                       "  case 100: return 2;\n"
+                       "  case 1000: return 3;\n"
+                       "  case 100000: return 4;\n"
+                       "  case 5000: return 5;\n"
+                       "  case 2147483647: return 6;\n"
+                       "  case 0 - 77: return 7;\n"
+                       "  default: return 8;\n"
+                       "  }\n"
+                       "}\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  ObjectFile object = compile(source, 1, &statistics);
+
+  // lea r11, [rip + table] and bt
+  assert(contains_bytes(object.text, { 0x4c, 0x8d, 0x1d }));
+  assert(contains_bytes(object.text, { 0x0f, 0xa3 }));
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping running it\n\n");
+    return;
+  }
+
+  // against the same functions compiled by cc, for every value near a case
+  std::string driver = "#define dense reference_dense\n"
+                       "#define separator reference_separator\n"
+                       "#define sparse reference_sparse\n";
+  driver += source;
+  driver += "#undef dense\n"
+            "#undef separator\n"
+            "#undef sparse\n"
+            "int dense(int x);\n"
+            "int separator(int c);\n"
+            "int sparse(long long x);\n"
+            "int main(void)\n"
+            "{\n"
+            "  for (long long x = -300; x < 300; x++)\n"
+            "    if (dense(x) != reference_dense(x) || separator(x) != reference_separator(x) || sparse(x) != reference_sparse(x))\n"
+            "      return 1;\n"
+            "  long long values[] = { -2147483648ll, -2147483647ll, 999, 1000, 1001, 4999, 5000, 100000, 2147483646ll, 2147483647ll };\n"
+            "  for (int i = 0; i < 10; i++)\n"
+            "    if (sparse(values[i]) != reference_sparse(values[i]))\n"
+            "      return 2;\n"
+            "  return 0;\n"
+            "}\n";
+
+  for (unsigned level = 0; level <= 1; level++) {
+    statistics = new_optimization_statistics();
+    assert(run_native(source, level, driver.c_str(), &statistics) == 0);
+  }
+
+  printf("test 8 passed\n\n");
+}
+
+void test9()
+{
+  printf("Running x86-64 test 9: logical operators and conditionals...\n");
+
+  // bump counts the calls, which only happen when C says they do
+  char const* source = "int bump(int *calls, int v)\n"
+                       "{\n"
+                       "  calls[0] = calls[0] * 3 + v;\n"
+                       "  return v;\n"
+                       "}\n"
+                       "int both(int a, int b, int c) { return a < b && b < c; }\n"
+                       "int either(int a, int b, int *calls) { return a || bump(calls, b); }\n"
+                       "int branchy(int a, int b, int *calls)\n"
+                       "{\n"
+                       "  if (a > 0 && (b > 0 || bump(calls, a)) && !(a > b))\n"
+                       "    return 1;\n"
+                       "  return 2;\n"
+                       "}\n"
+                       "int smaller(int a, int b) { return a < b ? a : b; }\n"
+                       "long long widened(int a, long long b, unsigned c) { return a ? b : c; }\n"
+                       "int nested(int a) { return a > 5 ? a > 10 ? 3 : 2 : a < 0 ? 0 : 1; }\n"
+                       "int called(int a, int b, int *calls) { return a > b ? bump(calls, a) : bump(calls, b); }\n"
+                       "int bits(int a, int b, int c) { return !a + !!b + !(a < c) * 4 + (a && b || c) * 8 + (!(a || b) && c) * 16; }\n";
+
+  OptimizationStatistics statistics = new_optimization_statistics();
+  ObjectFile object = compile(source, 1, &statistics);
+
+  // cmovl
+  assert(contains_bytes(object.text, { 0x0f, 0x4c }));
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping running it\n\n");
+    return;
+  }
+
+  std::string driver = "#define bump reference_bump\n"
+                       "#define both reference_both\n"
+                       "#define either reference_either\n"
+                       "#define branchy reference_branchy\n"
+                       "#define smaller reference_smaller\n"
+                       "#define widened reference_widened\n"
+                       "#define nested reference_nested\n"
+                       "#define called reference_called\n"
+                       "#define bits reference_bits\n";
+  driver += source;
+  driver += "#undef both\n"
+            "#undef either\n"
+            "#undef branchy\n"
+            "#undef smaller\n"
+            "#undef widened\n"
+            "#undef nested\n"
+            "#undef called\n"
+            "#undef bits\n"
+            "int both(int a, int b, int c);\n"
+            "int either(int a, int b, int *calls);\n"
+            "int branchy(int a, int b, int *calls);\n"
+            "int smaller(int a, int b);\n"
+            "long long widened(int a, long long b, unsigned c);\n"
+            "int nested(int a);\n"
+            "int called(int a, int b, int *calls);\n"
+            "int bits(int a, int b, int c);\n"
+            "int main(void)\n"
+            "{\n"
+            "  int values[] = { -3, -1, 0, 1, 2, 5, 7, 11, 30 };\n"
+            "  for (int i = 0; i < 9; i++)\n"
+            "    for (int j = 0; j < 9; j++)\n"
+            "      for (int k = 0; k < 9; k++) {\n"
+            "        int a = values[i], b = values[j], c = values[k];\n"
+            "        int calls = 1, reference_calls = 1;\n"
+            "        if (both(a, b, c) != reference_both(a, b, c) || smaller(a, b) != reference_smaller(a, b)\n"
+            "            || widened(a, b * 1000000007ll, c) != reference_widened(a, b * 1000000007ll, c) || nested(a) != reference_nested(a)\n"
+            "            || bits(a, b, c) != reference_bits(a, b, c))\n"
+            "          return 1;\n"
+            "        if (either(a, b, &calls) != reference_either(a, b, &reference_calls) || calls != reference_calls)\n"
+            "          return 2;\n"
+            "        if (branchy(a, b, &calls) != reference_branchy(a, b, &reference_calls) || calls != reference_calls)\n"
+            "          return 3;\n"
+            "        if (called(a, b, &calls) != reference_called(a, b, &reference_calls) || calls != reference_calls)\n"
+            "          return 4;\n"
+            "      }\n"
+            "  return 0;\n"
+            "}\n";
+
+  for (unsigned level = 0; level <= 1; level++) {
+    statistics = new_optimization_statistics();
+    assert(run_native(source, level, driver.c_str(), &statistics) == 0);
+  }
+
+  printf("test 9 passed\n\n");
+}
+
+void test10()
+{
+  printf("Running x86-64 test 10: tail calls...\n");
+
+  // deep enough to run out of stack with a frame per call. rotate has
+  // arguments on the stack, which its tail call passes in place of its own
+  char const* source = "int odd(int n);\n"
+                       "int even(int n)\n"
+                       "{\n"
+                       "  if (!n)\n"
+                       "    return 1;\n"
+                       "  return odd(n - 1);\n"
+                       "}\n"
+                       "int odd(int n)\n"
+                       "{\n"
+                       "  if (!n)\n"
+                       "    return 0;\n"
+                       "  return even(n - 1);\n"
+                       "}\n"
+                       "int rotate(int n, int a, int b, int c, int d, int e, int f, int g)\n"
+                       "{\n"
+                       "  if (!n)\n"
+                       "    return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + g * 7;\n"
+                       "  return rotate(n - 1, g, a, b, c, d, e, f + 1);\n"
+                       "}\n";
+
+  // every call is a jmp
+  OptimizationStatistics statistics = new_optimization_statistics();
+  ObjectFile object = compile(source, 0, &statistics);
+  assert(object.relocations.size() == 3);
+  for (ObjectRelocation const& relocation : object.relocations)
+    assert(object.text[relocation.offset - 1] == 0xe9);
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping running it\n\n");
+    return;
+  }
+
+  char const* driver = "int even(int n);\n"
+                       "int rotate(int n, int a, int b, int c, int d, int e, int f, int g);\n"
+                       "int main(void)\n"
+                       "{\n"
+                       "  if (even(10000000) != 1 || even(10000001) != 0)\n"
+                       "    return 1;\n"
+                       "  if (rotate(7, 1, 2, 3, 4, 5, 6, 7) != 168 || rotate(10000003, 1, 2, 3, 4, 5, 6, 7) != 40000129)\n"
+                       "    return 2;\n"
+                       "  return 0;\n"
+                       "}\n";
+
+  for (unsigned level = 0; level <= 1; level++) {
+    statistics = new_optimization_statistics();
+    assert(run_native(source, level, driver, &statistics) == 0);
+  }
+
+  printf("test 10 passed\n\n");
+}
+
+void test11()
+{
+  printf("Running x86-64 test 11: hot/cold splitting...\n");
+
+  char const* source = "_Noreturn void fail(int code);\n"
+                       "void die(int code) { fail(code + 1); }\n"
+                       "int check(int *p, int n)\n"
+                       "{\n"
+                       "  int total = 0;\n"
+                       "  for (int i = 0; i < n; i++) {\n"
+                       "    if (p[i] > 1000) {\n"
+                       "      int a = p[i] * 3;\n"
+                       "      int b = a + n;\n"
+                       "      fail(a + b * 7);\n"
+                       "    }\n"
+                       "    total = total + p[i];\n"
+                       "  }\n"
+                       "  return total;\n"
+                       "}\n";
+
+  // cold code goes after the rest, even though die comes first
+  OptimizationStatistics statistics = new_optimization_statistics();
+  ObjectFile object = compile(source, 1, &statistics);
+  unsigned long long offsets[3] = {};
+  for (ObjectSymbol const& symbol : object.symbols) {
+    if (symbol.name == "check")
+      offsets[0] = symbol.offset;
+    if (symbol.name == "die")
+      offsets[1] = symbol.offset;
+    if (symbol.name == "check.cold.1") {
+      offsets[2] = symbol.offset;
+      assert(!symbol.is_global);
+    }
+  }
+  assert(offsets[0] < offsets[1] && offsets[0] < offsets[2]);
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping running it\n\n");
+    return;
+  }
+
+  char const* driver = "#include <stdlib.h>\n"
+                       "int check(int *p, int n);\n"
+                       "void fail(int code) { exit(code % 200); }\n"
+                       "int main(void)\n"
+                       "{\n"
+                       "  int values[4] = { 1, 2, 3, 4 };\n"
+                       "  if (check(values, 4) != 10)\n"
+                       "    return 1;\n"
+                       "  values[2] = 2000;\n"
+                       "  check(values, 4);\n"
+                       "  return 2;\n"
+                       "}\n";
+
+  // 2000 * 3 + (6000 + 4) * 7 = 48028
+  statistics = new_optimization_statistics();
+  assert(run_native(source, 1, driver, &statistics) == 48028 % 200);
+
+  printf("test 11 passed\n\n");
+}
+
+void test12()
+{
+  printf("Running x86-64 test 12: a division in a divisor...\n");
+
+  if (!have_c_compiler()) {
+    printf("no cc to link with, skipping\n\n");
+    return;
+  }
+
+  // the remainder is folded into the divisor, and computed while the outer
+  // division's dividend is already in eax
+  char const* source = "int divide(int a, int b)\n"
+                       "{\n"
+                       "  int c = a % 7 + 2;\n"
+                       "  return b / c;\n"
+                       "}\n"
+                       "unsigned modulo(unsigned a, unsigned b, unsigned c)\n"
+                       "{\n"
+                       "  return a % (b / c + 1);\n"
+                       "}\n";
+
+  char const* driver = "int divide(int, int);\n"
+                       "unsigned modulo(unsigned, unsigned, unsigned);\n"
+                       "int main(void)\n"
+                       "{\n"
+                       "  if (divide(10, 110) != 22)\n"
+                       "    return 1;\n"
+                       "  if (divide(-3, 9) != -9)\n"
+                       "    return 2;\n"
+                       "  if (modulo(100, 30, 4) != 4)\n"
+                       "    return 3;\n"
+                       "  return 0;\n"
+                       "}\n";
+
+  for (unsigned level = 0; level <= 1; level++) {
+    OptimizationStatistics statistics = new_optimization_statistics();
+    assert(run_native(source, level, driver, &statistics) == 0);
+  }
+
+  printf("test 12 passed\n\n");
+}
+
+int main()
+{
+  test1();
+  test2();
+  test3();
+  test4();
+  test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+}